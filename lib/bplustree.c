@@ -2,15 +2,25 @@
  * Copyright (C) 2017, Leo Ma <begeekmyfriend@gmail.com>
  */
 
+/* open file description locks and writer preferring rwlocks */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <errno.h>
 
 #include "bplustree.h"
 
@@ -18,9 +28,62 @@ enum {
         INVALID_OFFSET = 0xdeadbeef,
 };
 
+/* header of compact nodes on disk, links are 32-bit block numbers and self
+ * is implied by the location */
+struct bplus_block {
+        uint32_t parent;
+        uint32_t prev;
+        uint32_t next;
+        int type;
+        int children;
+};
+
+#define INVALID_BLOCK 0xffffffffU
+
+/* Header of compressed leaves on disk, followed by the bit-packed distances
+ * of keys and data from their bases in key order. Data wider than 32 bits
+ * are stored as they are */
+struct leaf_pack {
+        key_t key_base;
+        unsigned char key_bits;
+        unsigned char data_bits;
+        long data_base;
+};
+
+/* Pending change to a key below a buffered non-leaf node. Buffers are kept
+ * sorted with one message per key, those of upper nodes are the later ones */
+struct bplus_message {
+        key_t key;
+        int type;
+        long data;
+};
+
+/* a cell of class c holds (8 << c) - 1 values */
+struct posting_cell {
+        long count;
+        long value[];
+};
+
+struct message_buffer {
+        long count;
+        struct bplus_message msg[];
+};
+
+enum {
+        /* add the key unless it exists, which is what a put does */
+        MESSAGE_INSERT,
+        MESSAGE_DELETE,
+        /* add the key or overwrite its data */
+        MESSAGE_UPSERT,
+};
+
 enum {
         BPLUS_TREE_LEAF,
         BPLUS_TREE_NON_LEAF = 1,
+        /* values of a multi-valued key */
+        BPLUS_TREE_POSTING = 2,
+        /* cells of the values of multi-valued keys with a few */
+        BPLUS_TREE_POSTING_CELLS = 3,
 };
 
 enum {
@@ -33,10 +96,66 @@ enum {
 #define key(node) ((key_t *)offset_ptr(node))
 #define data(node) ((long *)(offset_ptr(node) + _max_entries * sizeof(key_t)))
 #define sub(node) ((off_t *)(offset_ptr(node) + (_max_order - 1) * sizeof(key_t)))
+#define cnt(node) ((long *)(offset_ptr(node) + (_max_order - 1) * sizeof(key_t) + _max_order * sizeof(off_t)))
+#define slot(node) ((unsigned short *)(offset_ptr(node) + _max_entries * (sizeof(key_t) + sizeof(long))))
+#define fence(node) ((key_t *)(offset_ptr(node) + (_max_order - 1) * sizeof(key_t) + \
+                             _max_order * (sizeof(off_t) + (augmented() ? sizeof(long) : 0))))
+#define augmented() (_format_flags & BPLUS_TREE_AUGMENTED)
+#define slotted() (_format_flags & BPLUS_TREE_SLOTTED_LEAVES)
+#define blocked() (_format_flags & BPLUS_TREE_BLOCKED_NODES)
+#define compact() (_format_flags & BPLUS_TREE_COMPACT_NODES)
+#define compressed() (_format_flags & BPLUS_TREE_COMPRESSED_LEAVES)
+#define buffered() (_format_flags & BPLUS_TREE_BUFFERED_NODES)
+#define multi_valued() (_format_flags & BPLUS_TREE_MULTI_VALUES)
+#define buffer(node) ((struct message_buffer *) ((char *) (node) + _buffer_offset))
+
+/* options which change the on-disk format and are kept in boot file */
+#define FORMAT_FLAGS (BPLUS_TREE_AUGMENTED | BPLUS_TREE_SLOTTED_LEAVES | BPLUS_TREE_BLOCKED_NODES | \
+                      BPLUS_TREE_COMPACT_NODES | BPLUS_TREE_COMPRESSED_LEAVES | BPLUS_TREE_BUFFERED_NODES | \
+                      BPLUS_TREE_MULTI_VALUES)
+#define MAX_SLOTTED_ENTRIES 65535
+
+/* keys per cache line, the fan-out of fence levels in blocked non-leaf nodes */
+#define FENCE_FANOUT (64 / (int) sizeof(key_t))
+#define FENCE_MAX_LEVELS 8
+
+/* interpolation search tuning */
+#define INTERPOLATION_MAX_PROBES 3
+#define INTERPOLATION_LINEAR_SPAN 8
+#define INTERPOLATION_MIN_KEYS 32
+#define INTERPOLATION_SKEW_RATIO 16
+
+/* dirty blocks written by one pass of the write-back flusher at a time */
+#define WRITEBACK_CHUNK_BLOCKS 256
+/* dirty blocks a writer flushes itself when the dirty table is full */
+#define WRITEBACK_INLINE_BLOCKS 32
+
+/* lookups interleaved at most by bplus_tree_get_batch() */
+#define BATCH_GROUP_MAX 64
+
+/* sub-nodes a buffered non-leaf node may gain from one flush after it has
+ * reached the fan-out it gets split at */
+#define BUFFER_SPLIT_SLACK 4
 
 static int _block_size;
+/* size of a node in memory, larger than a block for compact nodes */
+static int _node_size;
 static int _max_entries;
 static int _max_order;
+static int _key_search_mode;
+static int _format_flags;
+/* trees open in this process, all of the format above */
+static int _open_trees;
+static pthread_mutex_t _format_lock = PTHREAD_MUTEX_INITIALIZER;
+/* where the message buffer of a non-leaf node starts and its capacity */
+static int _buffer_offset;
+static int _max_messages;
+/* values a posting block holds, cells of each class a block of them holds
+ * and the bytes of its map of cells in use */
+static int _max_postings;
+static int _max_cells[MAX_CELL_CLASSES];
+static int _cell_map_size[MAX_CELL_CLASSES];
+static int _cell_classes;
 
 static inline int is_leaf(struct bplus_node *node)
 {
@@ -66,9 +185,246 @@ static int key_binary_search(struct bplus_node *node, key_t target)
         }
 }
 
+/* entries of a slotted leaf are unordered, slot[i] locates the i-th smallest */
+static inline int leaf_slot(struct bplus_node *node, int i)
+{
+        return slotted() ? slot(node)[i] : i;
+}
+
+static int key_slot_search(struct bplus_node *node, key_t target)
+{
+        key_t *arr = key(node);
+        unsigned short *slots = slot(node);
+        int low = -1;
+        int high = node->children;
+
+        while (low + 1 < high) {
+                int mid = low + (high - low) / 2;
+                if (target > arr[slots[mid]]) {
+                        low = mid;
+                } else {
+                        high = mid;
+                }
+        }
+
+        if (high >= node->children || arr[slots[high]] != target) {
+                return -high - 1;
+        } else {
+                return high;
+        }
+}
+
+static int key_interpolation_search(struct bplus_node *node, key_t target)
+{
+        key_t *arr = key(node);
+        int len = is_leaf(node) ? node->children : node->children - 1;
+        int low = 0;
+        int high = len;
+        int probes = 0;
+
+        /* keys in [0, low) are less and keys in [high, len) are greater than target */
+        while (low < high) {
+                if (target < arr[low]) {
+                        return -low - 1;
+                } else if (target > arr[high - 1]) {
+                        return -high - 1;
+                }
+
+                int mid;
+                if (high - low <= INTERPOLATION_LINEAR_SPAN) {
+                        /* scan the last few keys sequentially */
+                        for (mid = low; arr[mid] < target; mid++) {
+                                continue;
+                        }
+                        return arr[mid] == target ? mid : -mid - 1;
+                } else if (probes++ < INTERPOLATION_MAX_PROBES) {
+                        /* estimate the position assuming keys are evenly distributed */
+                        long span = (long) arr[high - 1] - arr[low];
+                        mid = low + (span == 0 ? 0 : ((long) target - arr[low]) * (high - 1 - low) / span);
+                } else {
+                        /* skewed keys, fall back to bisection */
+                        mid = low + (high - low) / 2;
+                }
+
+                if (arr[mid] == target) {
+                        return mid;
+                } else if (arr[mid] < target) {
+                        low = mid + 1;
+                } else {
+                        high = mid;
+                }
+        }
+
+        return -low - 1;
+}
+
+static inline int key_distribution_uniform(struct bplus_node *node)
+{
+        key_t *arr = key(node);
+        int len = is_leaf(node) ? node->children : node->children - 1;
+        if (len < INTERPOLATION_MIN_KEYS) {
+                return 0;
+        }
+
+        /* compare quartile keys against their linear estimates */
+        long first = arr[0];
+        long span = (long) arr[len - 1] - first;
+        long slack = span / INTERPOLATION_SKEW_RATIO;
+        int q;
+        for (q = 1; q <= 3; q++) {
+                long expect = first + span * q / 4;
+                long actual = arr[(len - 1) * q / 4];
+                if (actual - expect > slack || expect - actual > slack) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+static int key_search(struct bplus_node *node, key_t target)
+{
+        if (slotted() && is_leaf(node)) {
+                return key_slot_search(node, target);
+        }
+
+        switch (_key_search_mode) {
+        case BPLUS_TREE_INTERPOLATION_SEARCH:
+                return key_interpolation_search(node, target);
+        case BPLUS_TREE_ADAPTIVE_SEARCH:
+                if (key_distribution_uniform(node)) {
+                        return key_interpolation_search(node, target);
+                }
+                return key_binary_search(node, target);
+        default:
+                return key_binary_search(node, target);
+        }
+}
+
+/* entry count of the subtree rooted at node */
+static long node_count(struct bplus_node *node)
+{
+        if (is_leaf(node)) {
+                return node->children;
+        }
+
+        int i;
+        long count = 0;
+        for (i = 0; i < node->children; i++) {
+                count += cnt(node)[i];
+        }
+        return count;
+}
+
+static inline void sub_count_update(struct bplus_node *parent, int index, struct bplus_node *sub_node)
+{
+        if (augmented()) {
+                cnt(parent)[index] = node_count(sub_node);
+        }
+}
+
+/* move sub-nodes together with their subtree counts */
+static inline void sub_move(struct bplus_node *dst, int d, struct bplus_node *src, int s, int n)
+{
+        memmove(&sub(dst)[d], &sub(src)[s], n * sizeof(off_t));
+        if (augmented()) {
+                memmove(&cnt(dst)[d], &cnt(src)[s], n * sizeof(long));
+        }
+}
+
+static inline int child_index(struct bplus_node *node, key_t key)
+{
+        int i = key_search(node, key);
+        return i >= 0 ? i + 1 : -i - 1;
+}
+
+/* Fence levels of a blocked non-leaf node, level 1 keeps the last key of
+ * every cache line of keys, level 2 the last of every line of level 1 and so
+ * on until one line covers the whole level. Returns the number of levels */
+static int fence_levels(int keys, int *sizes)
+{
+        int levels = 0;
+        while (keys > FENCE_FANOUT) {
+                keys = (keys + FENCE_FANOUT - 1) / FENCE_FANOUT;
+                if (sizes != NULL) {
+                        sizes[levels] = keys;
+                }
+                levels++;
+        }
+        return levels;
+}
+
+static int fence_size(int keys)
+{
+        int i, size = 0;
+        int sizes[FENCE_MAX_LEVELS];
+        int levels = fence_levels(keys, sizes);
+        for (i = 0; i < levels; i++) {
+                size += sizes[i];
+        }
+        return size;
+}
+
+static void fence_build(struct bplus_node *node)
+{
+        int i;
+        int n = node->children - 1;
+        key_t *arr = key(node);
+        key_t *fence = fence(node);
+
+        while (n > FENCE_FANOUT) {
+                int c = (n + FENCE_FANOUT - 1) / FENCE_FANOUT;
+                for (i = 0; i < c; i++) {
+                        int last = (i + 1) * FENCE_FANOUT;
+                        fence[i] = arr[(last < n ? last : n) - 1];
+                }
+                arr = fence;
+                fence += c;
+                n = c;
+        }
+}
+
+/* sub-node index to descend for target, one cache line is scanned per level */
+static int fence_descend(struct bplus_node *node, key_t target)
+{
+        int sizes[FENCE_MAX_LEVELS];
+        key_t *levels[FENCE_MAX_LEVELS];
+        int l, block = 0;
+        int keys = node->children - 1;
+        int nr = fence_levels(keys, sizes);
+        key_t *fence = fence(node);
+
+        for (l = 0; l < nr; l++) {
+                levels[l] = fence;
+                fence += sizes[l];
+        }
+
+        for (l = nr - 1; l >= -1; l--) {
+                key_t *arr = l >= 0 ? levels[l] : key(node);
+                int size = l >= 0 ? sizes[l] : keys;
+                int i, low = block * FENCE_FANOUT;
+                int high = low + FENCE_FANOUT < size ? low + FENCE_FANOUT : size;
+                /* count of entries not greater than target, branch free */
+                block = low;
+                for (i = low; i < high; i++) {
+                        block += arr[i] <= target;
+                }
+                if (block == size) {
+                        /* target goes after all keys */
+                        return keys;
+                }
+        }
+
+        return block;
+}
+
+static inline int key_descend(struct bplus_node *node, key_t key)
+{
+        return blocked() ? fence_descend(node, key) : child_index(node, key);
+}
+
 static inline int parent_key_index(struct bplus_node *parent, key_t key)
 {
-        int index = key_binary_search(parent, key);
+        int index = key_search(parent, key);
         return index >= 0 ? index : -index - 2;
 }
 
@@ -78,7 +434,7 @@ static inline struct bplus_node *cache_refer(struct bplus_tree *tree)
         for (i = 0; i < MIN_CACHE_NUM; i++) {
                 if (!tree->used[i]) {
                         tree->used[i] = 1;
-                        char *buf = tree->caches + _block_size * i;
+                        char *buf = tree->caches + _node_size * i;
                         return (struct bplus_node *) buf;
                 }
         }
@@ -89,7 +445,7 @@ static inline void cache_defer(struct bplus_tree *tree, struct bplus_node *node)
 {
         /* return the node cache borrowed from */
         char *buf = (char *) node;
-        int i = (buf - tree->caches) / _block_size;
+        int i = (buf - tree->caches) / _node_size;
         tree->used[i] = 0;
 }
 
@@ -108,6 +464,9 @@ static inline struct bplus_node *non_leaf_new(struct bplus_tree *tree)
 {
         struct bplus_node *node = node_new(tree);
         node->type = BPLUS_TREE_NON_LEAF;
+        if (buffered()) {
+                buffer(node)->count = 0;
+        }
         return node;
 }
 
@@ -118,941 +477,7448 @@ static inline struct bplus_node *leaf_new(struct bplus_tree *tree)
         return node;
 }
 
-static struct bplus_node *node_fetch(struct bplus_tree *tree, off_t offset)
+/* Put the entries of a slotted leaf in key order so that it can be handled
+ * like a plain one, the cycles of the slot permutation are followed in place */
+static void leaf_sort(struct bplus_node *leaf)
 {
-        if (offset == INVALID_OFFSET) {
-                return NULL;
+        int i, j, k;
+        key_t *keys = key(leaf);
+        long *data = data(leaf);
+        unsigned short *slots = slot(leaf);
+
+        if (!slotted() || !is_leaf(leaf)) {
+                return;
         }
 
-        struct bplus_node *node = cache_refer(tree);
-        int len = pread(tree->fd, node, _block_size, offset);
-        assert(len == _block_size);
-        return node;
+        for (i = 0; i < leaf->children; i++) {
+                if (slots[i] == i) {
+                        continue;
+                }
+                key_t key = keys[i];
+                long value = data[i];
+                for (j = i; slots[j] != i; j = k) {
+                        k = slots[j];
+                        keys[j] = keys[k];
+                        data[j] = data[k];
+                        slots[j] = j;
+                }
+                keys[j] = key;
+                data[j] = value;
+                slots[j] = j;
+        }
 }
 
-static struct bplus_node *node_seek(struct bplus_tree *tree, off_t offset)
+/* bits holding distances up to range */
+static inline int pack_bits(unsigned long range)
 {
-        if (offset == INVALID_OFFSET) {
-                return NULL;
-        }
+        return range == 0 ? 0 : 64 - __builtin_clzl(range);
+}
 
-        int i;
-        for (i = 0; i < MIN_CACHE_NUM; i++) {
-                if (!tree->used[i]) {
-                        char *buf = tree->caches + _block_size * i;
-                        int len = pread(tree->fd, buf, _block_size, offset);
-                        assert(len == _block_size);
-                        return (struct bplus_node *) buf;
-                }
-        }
-        assert(0);
+/* bytes of a compressed leaf payload, a word of slack lets every packed
+ * field be accessed with one unaligned 64-bit load */
+static long leaf_pack_size(long entries, int key_bits, int data_bits)
+{
+        long size = sizeof(struct leaf_pack) + sizeof(uint64_t) + (entries * key_bits + 7) / 8;
+        return size + (data_bits > 32 ? entries * (long) sizeof(long) : (entries * data_bits + 7) / 8);
 }
 
-static inline void node_flush(struct bplus_tree *tree, struct bplus_node *node)
+/* bounds of the keys and data going into one compressed leaf */
+struct pack_span {
+        long entries;
+        key_t key_min;
+        key_t key_max;
+        long data_min;
+        long data_max;
+};
+
+static inline void pack_span_init(struct pack_span *span)
 {
-        if (node != NULL) {
-                int len = pwrite(tree->fd, node, _block_size, node->self);
-                assert(len == _block_size);
-                cache_defer(tree, node);
-        }
+        span->entries = 0;
+        span->key_min = INT_MAX;
+        span->key_max = INT_MIN;
+        span->data_min = LONG_MAX;
+        span->data_max = LONG_MIN;
 }
 
-static off_t new_node_append(struct bplus_tree *tree, struct bplus_node *node)
+static void pack_span_add(struct pack_span *span, key_t *keys, long *data, int n)
 {
-        /* assign new offset to the new node */
-        if (list_empty(&tree->free_blocks)) {
-                node->self = tree->file_size;
-                tree->file_size += _block_size;
-        } else {
-                struct free_block *block;
-                block = list_first_entry(&tree->free_blocks, struct free_block, link);
-                list_del(&block->link);
-                node->self = block->offset;
-                free(block);
+        int i;
+        key_t key_min = span->key_min, key_max = span->key_max;
+        long data_min = span->data_min, data_max = span->data_max;
+
+        /* separate reductions over each array get vectorized */
+        for (i = 0; i < n; i++) {
+                key_min = keys[i] < key_min ? keys[i] : key_min;
+                key_max = keys[i] > key_max ? keys[i] : key_max;
         }
-        return node->self;
+        for (i = 0; i < n; i++) {
+                data_min = data[i] < data_min ? data[i] : data_min;
+                data_max = data[i] > data_max ? data[i] : data_max;
+        }
+
+        span->key_min = key_min;
+        span->key_max = key_max;
+        span->data_min = data_min;
+        span->data_max = data_max;
+        span->entries += n;
 }
 
-static void node_delete(struct bplus_tree *tree, struct bplus_node *node,
-                        struct bplus_node *left, struct bplus_node *right)
+static inline int pack_span_key_bits(struct pack_span *span)
 {
-        if (left != NULL) {
-                if (right != NULL) {
-                        left->next = right->self;
-                        right->prev = left->self;
-                        node_flush(tree, right);
-                } else {
-                        left->next = INVALID_OFFSET;
-                }
-                node_flush(tree, left);
-        } else {
-                if (right != NULL) {
-                        right->prev = INVALID_OFFSET;
-                        node_flush(tree, right);
-                }
-        }
+        return span->entries > 0 ? pack_bits((long) span->key_max - span->key_min) : 0;
+}
 
-        assert(node->self != INVALID_OFFSET);
-        struct free_block *block = malloc(sizeof(*block));
-        assert(block != NULL);
-        /* deleted blocks can be allocated for other nodes */
-        block->offset = node->self;
-        list_add_tail(&block->link, &tree->free_blocks);
-        /* return the node cache borrowed from */
-        cache_defer(tree, node);
+static inline int pack_span_data_bits(struct pack_span *span)
+{
+        return span->entries > 0 ? pack_bits((unsigned long) span->data_max - span->data_min) : 0;
 }
 
-static inline void sub_node_update(struct bplus_tree *tree, struct bplus_node *parent,
-                                   int index, struct bplus_node *sub_node)
+static int pack_span_fits(struct pack_span *span)
 {
-        assert(sub_node->self != INVALID_OFFSET);
-        sub(parent)[index] = sub_node->self;
-        sub_node->parent = parent->self;
-        node_flush(tree, sub_node);
+        int header = compact() ? sizeof(struct bplus_block) : sizeof(struct bplus_node);
+        long size = leaf_pack_size(span->entries, pack_span_key_bits(span), pack_span_data_bits(span));
+        return header + size <= _block_size;
 }
 
-static inline void sub_node_flush(struct bplus_tree *tree, struct bplus_node *parent, off_t sub_offset)
+/* whether the leaf still fits in a block with one more entry */
+static int leaf_full(struct bplus_node *leaf, key_t key, long data)
 {
-        struct bplus_node *sub_node = node_fetch(tree, sub_offset);
-        assert(sub_node != NULL);
-        sub_node->parent = parent->self;
-        node_flush(tree, sub_node);
+        if (leaf->children == _max_entries) {
+                return 1;
+        } else if (!compressed()) {
+                return 0;
+        }
+
+        struct pack_span span;
+        pack_span_init(&span);
+        pack_span_add(&span, key(leaf), data(leaf), leaf->children);
+        pack_span_add(&span, &key, &data, 1);
+        return !pack_span_fits(&span);
 }
 
-static long bplus_tree_search(struct bplus_tree *tree, key_t key)
+/* whether all entries of both leaves fit in one block, the count is checked
+ * by callers */
+static int leaf_merge_fits(struct bplus_node *left, struct bplus_node *right)
 {
-        int ret = -1;
-        struct bplus_node *node = node_seek(tree, tree->root);
-        while (node != NULL) {
-                int i = key_binary_search(node, key);
-                if (is_leaf(node)) {
-                        ret = i >= 0 ? data(node)[i] : -1;
-                        break;
-                } else {
-                        if (i >= 0) {
-                                node = node_seek(tree, sub(node)[i + 1]);
-                        } else {
-                                i = -i - 1;
-                                node = node_seek(tree, sub(node)[i]);
-                        }
-                }
+        if (!compressed()) {
+                return 1;
         }
 
-        return ret;
+        struct pack_span span;
+        pack_span_init(&span);
+        pack_span_add(&span, key(left), data(left), left->children);
+        pack_span_add(&span, key(right), data(right), right->children);
+        return pack_span_fits(&span);
 }
 
-static void left_node_add(struct bplus_tree *tree, struct bplus_node *node, struct bplus_node *left)
+/* whether the entries of both leaves in order fit in two blocks with the
+ * first split of them in the left one */
+static int leaf_split_fits(struct bplus_node *left, struct bplus_node *right, int split)
 {
-        new_node_append(tree, left);
+        int l = left->children;
+        int r = right->children;
+        struct pack_span lo, hi;
 
-        struct bplus_node *prev = node_fetch(tree, node->prev);
-        if (prev != NULL) {
-                prev->next = left->self;
-                left->prev = prev->self;
-                node_flush(tree, prev);
+        if (!compressed()) {
+                return 1;
+        }
+
+        pack_span_init(&lo);
+        pack_span_init(&hi);
+        if (split <= l) {
+                pack_span_add(&lo, key(left), data(left), split);
+                pack_span_add(&hi, &key(left)[split], &data(left)[split], l - split);
+                pack_span_add(&hi, key(right), data(right), r);
         } else {
-                left->prev = INVALID_OFFSET;
+                pack_span_add(&lo, key(left), data(left), l);
+                pack_span_add(&lo, key(right), data(right), split - l);
+                pack_span_add(&hi, &key(right)[split - l], &data(right)[split - l], l + r - split);
         }
-        left->next = node->self;
-        node->prev = left->self;
+        return pack_span_fits(&lo) && pack_span_fits(&hi);
 }
 
-static void right_node_add(struct bplus_tree *tree, struct bplus_node *node, struct bplus_node *right)
-{
-        new_node_append(tree, right);
+/* packs fields of up to 32 bits into whole words */
+struct bit_writer {
+        char *p;
+        uint64_t word;
+        int bits;
+};
 
-        struct bplus_node *next = node_fetch(tree, node->next);
-        if (next != NULL) {
-                next->prev = right->self;
-                right->next = next->self;
-                node_flush(tree, next);
-        } else {
-                right->next = INVALID_OFFSET;
+static inline void bits_put(struct bit_writer *w, uint64_t value, int bits)
+{
+        w->word |= value << w->bits;
+        w->bits += bits;
+        if (w->bits >= 64) {
+                memcpy(w->p, &w->word, sizeof(w->word));
+                w->p += sizeof(w->word);
+                w->bits -= 64;
+                w->word = w->bits > 0 ? value >> (bits - w->bits) : 0;
         }
-        right->prev = node->self;
-        node->next = right->self;
 }
 
-static key_t non_leaf_insert(struct bplus_tree *tree, struct bplus_node *node,
-                             struct bplus_node *l_ch, struct bplus_node *r_ch, key_t key);
+/* write the bytes of the last partial word, returns where packing ends */
+static inline char *bits_flush(struct bit_writer *w)
+{
+        memcpy(w->p, &w->word, (w->bits + 7) / 8);
+        return w->p + (w->bits + 7) / 8;
+}
 
-static int parent_node_build(struct bplus_tree *tree, struct bplus_node *l_ch,
-                             struct bplus_node *r_ch, key_t key)
+static inline uint64_t bits_get(char *p, long bit, uint64_t mask)
 {
-        if (l_ch->parent == INVALID_OFFSET && r_ch->parent == INVALID_OFFSET) {
-                /* new parent */
-                struct bplus_node *parent = non_leaf_new(tree);
-                key(parent)[0] = key;
-                sub(parent)[0] = l_ch->self;
-                sub(parent)[1] = r_ch->self;
-                parent->children = 2;
-                /* write new parent and update root */
-                tree->root = new_node_append(tree, parent);
-                l_ch->parent = parent->self;
-                r_ch->parent = parent->self;
-                tree->level++;
-                /* flush parent, left and right child */
-                node_flush(tree, l_ch);
-                node_flush(tree, r_ch);
-                node_flush(tree, parent);
-                return 0;
-        } else if (r_ch->parent == INVALID_OFFSET) {
-                return non_leaf_insert(tree, node_fetch(tree, l_ch->parent), l_ch, r_ch, key);
+        uint64_t word;
+        memcpy(&word, p + (bit >> 3), sizeof(word));
+        return (word >> (bit & 7)) & mask;
+}
+
+/* pack entries of a leaf in key order */
+static void leaf_pack(struct bplus_node *leaf, char *buf)
+{
+        int i, j;
+        int n = leaf->children;
+        struct leaf_pack *pack = (struct leaf_pack *) buf;
+        char *p = buf + sizeof(*pack);
+        struct pack_span span;
+
+        pack_span_init(&span);
+        pack_span_add(&span, key(leaf), data(leaf), n);
+        assert(pack_span_fits(&span));
+        pack->key_base = n > 0 ? span.key_min : 0;
+        pack->data_base = n > 0 ? span.data_min : 0;
+        pack->key_bits = pack_span_key_bits(&span);
+        pack->data_bits = pack_span_data_bits(&span);
+
+        struct bit_writer w = { p, 0, 0 };
+        for (i = 0; i < n; i++) {
+                j = leaf_slot(leaf, i);
+                bits_put(&w, (long) key(leaf)[j] - pack->key_base, pack->key_bits);
+        }
+        p = bits_flush(&w);
+
+        if (pack->data_bits > 32) {
+                for (i = 0; i < n; i++) {
+                        memcpy(p + (long) i * sizeof(long), &data(leaf)[leaf_slot(leaf, i)], sizeof(long));
+                }
         } else {
-                return non_leaf_insert(tree, node_fetch(tree, r_ch->parent), l_ch, r_ch, key);
+                struct bit_writer v = { p, 0, 0 };
+                for (i = 0; i < n; i++) {
+                        j = leaf_slot(leaf, i);
+                        bits_put(&v, (unsigned long) data(leaf)[j] - pack->data_base, pack->data_bits);
+                }
+                bits_flush(&v);
         }
 }
 
-static key_t non_leaf_split_left(struct bplus_tree *tree, struct bplus_node *node,
-                                 struct bplus_node *left, struct bplus_node *l_ch,
-                                 struct bplus_node *r_ch, key_t key, int insert, int split)
+/* Expand the packed payload following the header of a leaf just read. It is
+ * moved behind the arrays first, fields are at most 32 bits wide so each one
+ * takes a single load, shift and mask */
+static void leaf_unpack(struct bplus_node *leaf)
 {
         int i;
+        int n = leaf->children;
+        char *buf = (char *) leaf + _node_size - _block_size;
+        struct leaf_pack *pack = (struct leaf_pack *) offset_ptr(leaf);
+        key_t *keys = key(leaf);
+        long *data = data(leaf);
+
+        memcpy(buf, pack, leaf_pack_size(n, pack->key_bits, pack->data_bits));
+        pack = (struct leaf_pack *) buf;
+        char *p = buf + sizeof(*pack);
+
+        uint64_t mask = ((uint64_t) 1 << pack->key_bits) - 1;
+        for (i = 0; i < n; i++) {
+                keys[i] = (long) pack->key_base + (long) bits_get(p, (long) i * pack->key_bits, mask);
+        }
+        p += ((long) n * pack->key_bits + 7) / 8;
 
-        /* split key is key[split - 1] */
-        key_t split_key = key(node)[split - 1];
-
-        /* split as left sibling */
-        left_node_add(tree, node, left);
-
-        /* calculate split nodes' children (sum as (order + 1))*/
-        int pivot = insert;
-        left->children = split + 1;
-        node->children = _max_order - split;
+        if (pack->data_bits > 32) {
+                memcpy(data, p, n * sizeof(long));
+        } else {
+                mask = ((uint64_t) 1 << pack->data_bits) - 1;
+                for (i = 0; i < n; i++) {
+                        data[i] = pack->data_base + bits_get(p, (long) i * pack->data_bits, mask);
+                }
+        }
 
-        /* sum = left->children = pivot + (split - pivot) + 1 */
-        /* replicate from key[0] to key[insert] in original node */
-        memmove(&key(left)[0], &key(node)[0], pivot * sizeof(key_t));
-        memmove(&sub(left)[0], &sub(node)[0], pivot * sizeof(off_t));
+        if (slotted()) {
+                for (i = 0; i < n; i++) {
+                        slot(leaf)[i] = i;
+                }
+        }
+}
 
-        /* replicate from key[insert] to key[split] in original node */
-        memmove(&key(left)[pivot + 1], &key(node)[pivot], (split - pivot) * sizeof(key_t));
-        memmove(&sub(left)[pivot + 1], &sub(node)[pivot], (split - pivot) * sizeof(off_t));
+/* data of key in a leaf still packed, keys are bisected in place and only
+ * the data found is extracted */
+static long leaf_pack_search(struct bplus_node *leaf, key_t key)
+{
+        struct leaf_pack *pack = (struct leaf_pack *) offset_ptr(leaf);
+        char *p = (char *) leaf + sizeof(*leaf) + sizeof(*pack);
+        uint64_t mask = ((uint64_t) 1 << pack->key_bits) - 1;
+        uint64_t target = (long) key - pack->key_base;
+        int low = -1;
+        int high = leaf->children;
+        long data;
 
-        /* flush sub-nodes of the new splitted left node */
-        for (i = 0; i < left->children; i++) {
-                if (i != pivot && i != pivot + 1) {
-                        sub_node_flush(tree, left, sub(left)[i]);
+        if ((long) key < pack->key_base || target > mask) {
+                return -1;
+        }
+        while (low + 1 < high) {
+                int mid = low + (high - low) / 2;
+                if (target > bits_get(p, (long) mid * pack->key_bits, mask)) {
+                        low = mid;
+                } else {
+                        high = mid;
                 }
         }
+        if (high >= leaf->children || bits_get(p, (long) high * pack->key_bits, mask) != target) {
+                return -1;
+        }
 
-        /* insert new key and sub-nodes and locate the split key */
-        key(left)[pivot] = key;
-        sub_node_update(tree, left, pivot, l_ch);
-        sub_node_update(tree, left, pivot + 1, r_ch);
+        p += ((long) leaf->children * pack->key_bits + 7) / 8;
+        if (pack->data_bits > 32) {
+                memcpy(&data, p + (long) high * sizeof(long), sizeof(long));
+        } else {
+                mask = ((uint64_t) 1 << pack->data_bits) - 1;
+                data = pack->data_base + bits_get(p, (long) high * pack->data_bits, mask);
+        }
+        return data;
+}
 
-        /* sum = node->children = 1 + (node->children - 1) */
-        /* right node left shift from key[split] to key[children - 2] */
-        memmove(&key(node)[0], &key(node)[split], (node->children - 1) * sizeof(key_t));
-        memmove(&sub(node)[0], &sub(node)[split], (node->children) * sizeof(off_t));
+static inline off_t block_offset(uint32_t block)
+{
+        return block == INVALID_BLOCK ? INVALID_OFFSET : (off_t) block * _block_size;
+}
 
-        return split_key;
+static inline uint32_t offset_block(off_t offset)
+{
+        return offset == INVALID_OFFSET ? INVALID_BLOCK : offset / _block_size;
 }
 
-static key_t non_leaf_split_middle(struct bplus_tree *tree, struct bplus_node *node,
-                                   struct bplus_node *right, struct bplus_node *l_ch,
-                                   struct bplus_node *r_ch, key_t key, int insert, int split)
+/* bytes following the sub-nodes, subtree counts and fence keys */
+static inline int non_leaf_tail_size(void)
+{
+        return (augmented() ? _max_order * sizeof(long) : 0) +
+               (blocked() ? fence_size(_max_order - 1) * sizeof(key_t) : 0);
+}
+
+/* the block was read right behind the in-memory header, so the payload of
+ * leaves lands in place and only links of non-leaves get widened */
+static void node_decode(struct bplus_node *node, off_t offset)
 {
         int i;
+        struct bplus_block block = *(struct bplus_block *) ((char *) node + sizeof(*node) - sizeof(block));
+
+        node->self = offset;
+        node->parent = block_offset(block.parent);
+        node->prev = block_offset(block.prev);
+        node->next = block_offset(block.next);
+        node->type = block.type;
+        node->children = block.children;
+
+        if (node->type == BPLUS_TREE_NON_LEAF) {
+                uint32_t *subs = (uint32_t *) sub(node);
+                memmove(&sub(node)[_max_order], &subs[_max_order], non_leaf_tail_size());
+                /* backwards so a widened link only covers narrow ones already done */
+                for (i = node->children - 1; i >= 0; i--) {
+                        sub(node)[i] = block_offset(subs[i]);
+                }
+        }
+}
 
-        /* split as right sibling */
-        right_node_add(tree, node, right);
+static void node_encode(struct bplus_node *node, char *buf)
+{
+        int i;
+        struct bplus_block *block = (struct bplus_block *) buf;
+        char *p = buf + sizeof(*block);
+
+        if (!compact()) {
+                /* only compressed leaves get here */
+                memcpy(buf, node, sizeof(*node));
+                leaf_pack(node, buf + sizeof(*node));
+                return;
+        }
 
-        /* split key is key[split - 1] */
-        key_t split_key = key(node)[split - 1];
+        block->parent = offset_block(node->parent);
+        block->prev = offset_block(node->prev);
+        block->next = offset_block(node->next);
+        block->type = node->type;
+        block->children = node->children;
+
+        if (is_leaf(node) && compressed()) {
+                leaf_pack(node, p);
+        } else if (is_leaf(node)) {
+                memcpy(p, offset_ptr(node), _max_entries * (sizeof(key_t) + sizeof(long) +
+                                                            (slotted() ? sizeof(short) : 0)));
+        } else if (node->type == BPLUS_TREE_POSTING || node->type == BPLUS_TREE_POSTING_CELLS) {
+                memcpy(p, offset_ptr(node), _block_size - sizeof(*node));
+        } else {
+                memcpy(p, key(node), (_max_order - 1) * sizeof(key_t));
+                uint32_t *subs = (uint32_t *) (p + (_max_order - 1) * sizeof(key_t));
+                for (i = 0; i < node->children; i++) {
+                        subs[i] = offset_block(sub(node)[i]);
+                }
+                memcpy(&subs[_max_order], &sub(node)[_max_order], non_leaf_tail_size());
+        }
+}
 
-        /* calculate split nodes' children (sum as (order + 1))*/
-        int pivot = 0;
-        node->children = split;
-        right->children = _max_order - split + 1;
+/* block image modified in memory and not written yet */
+struct dirty_block {
+        off_t offset;
+        /* bumped on every modification, tells a flushed image from a newer one */
+        long seq;
+        struct dirty_block *next;
+        char buf[];
+};
 
-        /* insert new key and sub-nodes */
-        key(right)[pivot] = key;
-        sub_node_update(tree, right, pivot, l_ch);
-        sub_node_update(tree, right, pivot + 1, r_ch);
+struct bplus_writeback {
+        /* guards the dirty table */
+        pthread_mutex_t lock;
+        /* one flush pass at a time */
+        pthread_mutex_t flush_lock;
+        pthread_cond_t wakeup;
+        pthread_t flusher;
+        int quit;
+        struct dirty_block **table;
+        /* blocks are taken from a pool as large as the dirty cap */
+        char *pool;
+        struct dirty_block *free_list;
+        long mask;
+        long dirty;
+        long max_dirty;
+        long seq;
+        int flush_ms;
+        int checkpoint_ms;
+        struct timespec checkpoint;
+        char *staging;
+        /* undo file of the last checkpoint, and its blocks saved there */
+        int undo_fd;
+        long undo_blocks;
+        unsigned char *undone;
+        char *undo_buf;
+};
 
-        /* sum = right->children = 2 + (right->children - 2) */
-        /* replicate from key[split] to key[_max_order - 2] */
-        memmove(&key(right)[pivot + 1], &key(node)[split], (right->children - 2) * sizeof(key_t));
-        memmove(&sub(right)[pivot + 2], &sub(node)[split + 1], (right->children - 2) * sizeof(off_t));
+static inline struct dirty_block **dirty_bucket(struct bplus_writeback *wb, off_t offset)
+{
+        unsigned long h = (unsigned long) (offset / _block_size) * 0x9e3779b97f4a7c15UL;
+        return &wb->table[(h >> 32) & wb->mask];
+}
 
-        /* flush sub-nodes of the new splitted right node */
-        for (i = pivot + 2; i < right->children; i++) {
-                sub_node_flush(tree, right, sub(right)[i]);
+static struct dirty_block *dirty_find(struct bplus_writeback *wb, off_t offset)
+{
+        struct dirty_block *e;
+        for (e = *dirty_bucket(wb, offset); e != NULL; e = e->next) {
+                if (e->offset == offset) {
+                        return e;
+                }
         }
-
-        return split_key;
+        return NULL;
 }
 
-static key_t non_leaf_split_right(struct bplus_tree *tree, struct bplus_node *node,
-                                  struct bplus_node *right, struct bplus_node *l_ch,
-                                  struct bplus_node *r_ch, key_t key, int insert, int split)
+static void dirty_remove(struct bplus_writeback *wb, struct dirty_block *block)
 {
-        int i;
+        struct dirty_block **p = dirty_bucket(wb, block->offset);
+        while (*p != block) {
+                p = &(*p)->next;
+        }
+        *p = block->next;
+        block->next = wb->free_list;
+        wb->free_list = block;
+        wb->dirty--;
+}
 
-        /* split as right sibling */
-        right_node_add(tree, node, right);
+static long dirty_flush(struct bplus_tree *tree, long max);
 
-        /* split key is key[split] */
-        key_t split_key = key(node)[split];
+/* keep a block image in memory, writers make room themselves when the
+ * dirty table is full rather than wait for the flusher to be scheduled */
+static void dirty_store(struct bplus_tree *tree, off_t offset, char *image)
+{
+        struct bplus_writeback *wb = tree->wb;
+        struct dirty_block *block;
+
+        pthread_mutex_lock(&wb->lock);
+        while ((block = dirty_find(wb, offset)) == NULL && wb->dirty >= wb->max_dirty) {
+                pthread_mutex_unlock(&wb->lock);
+                dirty_flush(tree, WRITEBACK_INLINE_BLOCKS);
+                pthread_mutex_lock(&wb->lock);
+        }
+        if (block == NULL) {
+                block = wb->free_list;
+                wb->free_list = block->next;
+                block->offset = offset;
+                struct dirty_block **p = dirty_bucket(wb, offset);
+                block->next = *p;
+                *p = block;
+                if (++wb->dirty >= wb->max_dirty / 2) {
+                        pthread_cond_signal(&wb->wakeup);
+                }
+        }
+        memcpy(block->buf, image, _block_size);
+        block->seq = ++wb->seq;
+        pthread_mutex_unlock(&wb->lock);
+}
 
-        /* calculate split nodes' children (sum as (order + 1))*/
-        int pivot = insert - split - 1;
-        node->children = split + 1;
-        right->children = _max_order - split;
+static int dirty_read(struct bplus_tree *tree, off_t offset, char *buf)
+{
+        struct bplus_writeback *wb = tree->wb;
+        if (wb == NULL) {
+                return -1;
+        }
 
-        /* sum = right->children = pivot + 2 + (_max_order - insert - 1) */
-        /* replicate from key[split + 1] to key[insert] */
-        memmove(&key(right)[0], &key(node)[split + 1], pivot * sizeof(key_t));
-        memmove(&sub(right)[0], &sub(node)[split + 1], pivot * sizeof(off_t));
+        pthread_mutex_lock(&wb->lock);
+        struct dirty_block *block = dirty_find(wb, offset);
+        if (block != NULL) {
+                memcpy(buf, block->buf, _block_size);
+        }
+        pthread_mutex_unlock(&wb->lock);
+        return block != NULL ? 0 : -1;
+}
 
-        /* insert new key and sub-node */
-        key(right)[pivot] = key;
-        sub_node_update(tree, right, pivot, l_ch);
-        sub_node_update(tree, right, pivot + 1, r_ch);
+static int shared_load(struct bplus_tree *tree, off_t offset, char *buf);
+static void shared_store(struct bplus_tree *tree, off_t offset, char *buf, int wait);
+static void manifest_mark(struct bplus_tree *tree, struct bplus_node *node, off_t offset);
 
-        /* replicate from key[insert] to key[order - 1] */
-        memmove(&key(right)[pivot + 1], &key(node)[insert], (_max_order - insert - 1) * sizeof(key_t));
-        memmove(&sub(right)[pivot + 2], &sub(node)[insert + 1], (_max_order - insert - 1) * sizeof(off_t));
+/* the image of a block in the file, through the shared pool if any */
+static void block_read(struct bplus_tree *tree, char *buf, off_t offset)
+{
+        if (tree->shared != NULL && shared_load(tree, offset, buf) == 0) {
+                return;
+        }
+        int len = pread(tree->fd, buf, _block_size, offset);
+        assert(len == _block_size);
+        if (tree->shared != NULL) {
+                shared_store(tree, offset, buf, 0);
+        }
+}
 
-        /* flush sub-nodes of the new splitted right node */
-        for (i = 0; i < right->children; i++) {
-                if (i != pivot && i != pivot + 1) {
-                        sub_node_flush(tree, right, sub(right)[i]);
+/* compressed leaves are left packed */
+static void node_read_packed(struct bplus_tree *tree, struct bplus_node *node, off_t offset)
+{
+        if (compact()) {
+                char *buf = (char *) node + sizeof(*node) - sizeof(struct bplus_block);
+                if (dirty_read(tree, offset, buf) != 0) {
+                        block_read(tree, buf, offset);
                 }
+                node_decode(node, offset);
+        } else if (dirty_read(tree, offset, (char *) node) != 0) {
+                block_read(tree, (char *) node, offset);
+        }
+        if (tree->manifest != NULL) {
+                manifest_mark(tree, node, offset);
         }
+}
 
-        return split_key;
+static void node_read(struct bplus_tree *tree, struct bplus_node *node, off_t offset)
+{
+        node_read_packed(tree, node, offset);
+        if (compressed() && is_leaf(node)) {
+                leaf_unpack(node);
+        }
 }
 
-static void non_leaf_simple_insert(struct bplus_tree *tree, struct bplus_node *node,
-                                   struct bplus_node *l_ch, struct bplus_node *r_ch,
-                                   key_t key, int insert)
+static struct bplus_node *node_fetch(struct bplus_tree *tree, off_t offset)
 {
-        memmove(&key(node)[insert + 1], &key(node)[insert], (node->children - 1 - insert) * sizeof(key_t));
-        memmove(&sub(node)[insert + 2], &sub(node)[insert + 1], (node->children - 1 - insert) * sizeof(off_t));
-        /* insert new key and sub-nodes */
-        key(node)[insert] = key;
-        sub_node_update(tree, node, insert, l_ch);
-        sub_node_update(tree, node, insert + 1, r_ch);
-        node->children++;
+        if (offset == INVALID_OFFSET) {
+                return NULL;
+        }
+
+        struct bplus_node *node = cache_refer(tree);
+        node_read(tree, node, offset);
+        leaf_sort(node);
+        return node;
 }
 
-static int non_leaf_insert(struct bplus_tree *tree, struct bplus_node *node,
-                           struct bplus_node *l_ch, struct bplus_node *r_ch, key_t key)
+/* private copy of a node, range deletion and buffer flushing hold more nodes than the caches */
+static struct bplus_node *node_load(struct bplus_tree *tree, off_t offset)
 {
-        /* Search key location */
-        int insert = key_binary_search(node, key);
-        assert(insert < 0);
-        insert = -insert - 1;
+        struct bplus_node *node = malloc(_node_size);
+        assert(node != NULL);
+        node_read(tree, node, offset);
+        leaf_sort(node);
+        return node;
+}
 
-        /* node is full */
-        if (node->children == _max_order) {
-                key_t split_key;
-                /* split = [m/2] */
-                int split = node->children / 2;
-                struct bplus_node *sibling = non_leaf_new(tree);
-                if (insert < split) {
-                        split_key = non_leaf_split_left(tree, node, sibling, l_ch, r_ch, key, insert, split);
-                } else if (insert == split) {
-                        split_key = non_leaf_split_middle(tree, node, sibling, l_ch, r_ch, key, insert, split);
-                } else {
-                        split_key = non_leaf_split_right(tree, node, sibling, l_ch, r_ch, key, insert, split);
-                }
+static struct bplus_node *node_seek_packed(struct bplus_tree *tree, off_t offset)
+{
+        if (offset == INVALID_OFFSET) {
+                return NULL;
+        }
 
-                /* build new parent */
-                if (insert < split) {
-                        return parent_node_build(tree, sibling, node, split_key);
-                } else {
-                        return parent_node_build(tree, node, sibling, split_key);
+        int i;
+        for (i = 0; i < MIN_CACHE_NUM; i++) {
+                if (!tree->used[i]) {
+                        char *buf = tree->caches + _node_size * i;
+                        node_read_packed(tree, (struct bplus_node *) buf, offset);
+                        return (struct bplus_node *) buf;
                 }
-        } else {
-                non_leaf_simple_insert(tree, node, l_ch, r_ch, key, insert);
-                node_flush(tree, node);
         }
-        return 0;
+        assert(0);
 }
 
-static key_t leaf_split_left(struct bplus_tree *tree, struct bplus_node *leaf,
-                             struct bplus_node *left, key_t key, long data, int insert)
+static struct bplus_node *node_seek(struct bplus_tree *tree, off_t offset)
 {
-        /* split = [m/2] */
-        int split = (leaf->children + 1) / 2;
+        struct bplus_node *node = node_seek_packed(tree, offset);
+        if (node != NULL && compressed() && is_leaf(node)) {
+                leaf_unpack(node);
+        }
+        return node;
+}
 
-        /* split as left sibling */
-        left_node_add(tree, leaf, left);
+static inline int bitmap_test(unsigned char *map, long bit)
+{
+        return map[bit >> 3] & (1 << (bit & 7));
+}
 
-        /* calculate split leaves' children (sum as (entries + 1)) */
-        int pivot = insert;
-        left->children = split;
-        leaf->children = _max_entries - split + 1;
+static inline void bitmap_set(unsigned char *map, long bit)
+{
+        map[bit >> 3] |= 1 << (bit & 7);
+}
 
-        /* sum = left->children = pivot + 1 + (split - pivot - 1) */
-        /* replicate from key[0] to key[insert] */
-        memmove(&key(left)[0], &key(leaf)[0], pivot * sizeof(key_t));
-        memmove(&data(left)[0], &data(leaf)[0], pivot * sizeof(long));
+static inline void bitmap_clear(unsigned char *map, long bit)
+{
+        map[bit >> 3] &= ~(1 << (bit & 7));
+}
 
-        /* insert new key and data */
-        key(left)[pivot] = key;
-        data(left)[pivot] = data;
+static void backup_block_ship(struct bplus_tree *tree, off_t offset);
+static void replica_ship(struct bplus_tree *tree, off_t offset, char *buf);
+static void replica_commit(struct bplus_tree *tree);
+static void shared_write_begin(struct bplus_tree *tree);
+static void shared_commit(struct bplus_tree *tree);
+static void shared_read_begin(struct bplus_tree *tree);
+static void shared_read_end(struct bplus_tree *tree);
+static int shared_reader(struct bplus_tree *tree);
+static void shared_hold(struct bplus_tree *tree, int hold);
+static void tree_tick(struct bplus_tree *tree);
+
+static void changed_map_grow(struct bplus_tree *tree, long blocks)
+{
+        long n = tree->changed_blocks > 0 ? tree->changed_blocks : 1024;
+        while (n < blocks) {
+                n *= 2;
+        }
+        if (n > tree->changed_blocks) {
+                tree->changed = realloc(tree->changed, n / 8);
+                assert(tree->changed != NULL);
+                memset(tree->changed + tree->changed_blocks / 8, 0, (n - tree->changed_blocks) / 8);
+                tree->changed_blocks = n;
+        }
+}
 
-        /* replicate from key[insert] to key[split - 1] */
-        memmove(&key(left)[pivot + 1], &key(leaf)[pivot], (split - pivot - 1) * sizeof(key_t));
+static inline void block_changed(struct bplus_tree *tree, off_t offset)
+{
+        /* not tracked until the first backup */
+        if (tree->changed == NULL) {
+                return;
+        }
+
+        long block = offset / _block_size;
+        if (block >= tree->changed_blocks) {
+                changed_map_grow(tree, block + 1);
+        }
+        /* leaves of the bulk loader are written in parallel */
+        __atomic_fetch_or(&tree->changed[block >> 3], 1 << (block & 7), __ATOMIC_RELAXED);
+}
+
+static inline void block_write(struct bplus_tree *tree, struct bplus_node *node)
+{
+        if (tree->backup != NULL) {
+                /* ship the snapshot version before it is overwritten */
+                backup_block_ship(tree, node->self);
+        }
+        block_changed(tree, node->self);
+        if (tree->shared != NULL) {
+                /* readers of other processes wait until the operation ends */
+                shared_write_begin(tree);
+        }
+
+        char *buf = (char *) node;
+        if (compact() || (compressed() && is_leaf(node))) {
+                /* not the shared block buffer, the bulk loader writes in parallel */
+                buf = malloc(_block_size);
+                assert(buf != NULL);
+                memset(buf, 0, _block_size);
+                node_encode(node, buf);
+        }
+
+        if (tree->replica != NULL) {
+                replica_ship(tree, node->self, buf);
+        }
+        if (tree->wb != NULL) {
+                dirty_store(tree, node->self, buf);
+        } else {
+                int len = pwrite(tree->fd, buf, _block_size, node->self);
+                assert(len == _block_size);
+                __atomic_add_fetch(&tree->written_blocks, 1, __ATOMIC_RELAXED);
+        }
+        if (tree->shared != NULL) {
+                shared_store(tree, node->self, buf, 1);
+        }
+
+        if (buf != (char *) node) {
+                free(buf);
+        }
+}
+
+static inline void node_write(struct bplus_tree *tree, struct bplus_node *node)
+{
+        /* leaves handled in key order get an identity slot directory */
+        if (slotted() && is_leaf(node)) {
+                int i;
+                for (i = 0; i < node->children; i++) {
+                        slot(node)[i] = i;
+                }
+        }
+        if (blocked() && !is_leaf(node)) {
+                fence_build(node);
+        }
+        block_write(tree, node);
+}
+
+/* write a slotted leaf as it is */
+static inline void leaf_slot_flush(struct bplus_tree *tree, struct bplus_node *leaf)
+{
+        block_write(tree, leaf);
+        cache_defer(tree, leaf);
+}
+
+static inline void node_flush(struct bplus_tree *tree, struct bplus_node *node)
+{
+        if (node != NULL) {
+                node_write(tree, node);
+                cache_defer(tree, node);
+        }
+}
+
+static off_t new_node_append(struct bplus_tree *tree, struct bplus_node *node)
+{
+        /* assign new offset to the new node */
+        if (list_empty(&tree->free_blocks)) {
+                node->self = tree->file_size;
+                tree->file_size += _block_size;
+                /* block numbers of compact nodes are 32-bit */
+                assert(!compact() || offset_block(node->self) < INVALID_BLOCK);
+        } else {
+                struct free_block *block;
+                block = list_first_entry(&tree->free_blocks, struct free_block, link);
+                list_del(&block->link);
+                node->self = block->offset;
+                free(block);
+        }
+        return node->self;
+}
+
+static void block_free(struct bplus_tree *tree, off_t offset)
+{
+        struct free_block *block = malloc(sizeof(*block));
+        assert(block != NULL);
+        /* deleted blocks can be allocated for other nodes */
+        block->offset = offset;
+        list_add_tail(&block->link, &tree->free_blocks);
+}
+
+static void node_delete(struct bplus_tree *tree, struct bplus_node *node,
+                        struct bplus_node *left, struct bplus_node *right)
+{
+        if (left != NULL) {
+                if (right != NULL) {
+                        left->next = right->self;
+                        right->prev = left->self;
+                        node_flush(tree, right);
+                } else {
+                        left->next = INVALID_OFFSET;
+                }
+                node_flush(tree, left);
+        } else {
+                if (right != NULL) {
+                        right->prev = INVALID_OFFSET;
+                        node_flush(tree, right);
+                }
+        }
+
+        assert(node->self != INVALID_OFFSET);
+        block_free(tree, node->self);
+        /* return the node cache borrowed from */
+        cache_defer(tree, node);
+}
+
+static inline void sub_node_update(struct bplus_tree *tree, struct bplus_node *parent,
+                                   int index, struct bplus_node *sub_node)
+{
+        assert(sub_node->self != INVALID_OFFSET);
+        sub(parent)[index] = sub_node->self;
+        sub_count_update(parent, index, sub_node);
+        sub_node->parent = parent->self;
+        node_flush(tree, sub_node);
+}
+
+static inline void sub_node_flush(struct bplus_tree *tree, struct bplus_node *parent, off_t sub_offset)
+{
+        struct bplus_node *sub_node = node_fetch(tree, sub_offset);
+        assert(sub_node != NULL);
+        sub_node->parent = parent->self;
+        node_flush(tree, sub_node);
+}
+
+/* index of the message of key, or -(insertion point) - 1 */
+static int message_search(struct message_buffer *buf, key_t key)
+{
+        int low = -1;
+        int high = buf->count;
+
+        while (low + 1 < high) {
+                int mid = low + (high - low) / 2;
+                if (key > buf->msg[mid].key) {
+                        low = mid;
+                } else {
+                        high = mid;
+                }
+        }
+
+        if (high >= buf->count || buf->msg[high].key != key) {
+                return -high - 1;
+        } else {
+                return high;
+        }
+}
+
+/* first message not less than key */
+static inline int message_lower_bound(struct message_buffer *buf, key_t key)
+{
+        int i = message_search(buf, key);
+        return i >= 0 ? i : -i - 1;
+}
+
+/* fold a later message of the same key into an earlier one */
+static void message_merge(struct bplus_message *old, struct bplus_message *msg)
+{
+        if (msg->type != MESSAGE_INSERT) {
+                *old = *msg;
+        } else if (old->type == MESSAGE_DELETE) {
+                /* the key is gone by then, so it is added whatever was below */
+                old->type = MESSAGE_UPSERT;
+                old->data = msg->data;
+        }
+}
+
+/* data of key with buffered messages applied, returns -1 if it is absent */
+static int buffer_lookup(struct bplus_tree *tree, key_t key, long *data)
+{
+        int inserted = 0;
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL && !is_leaf(node)) {
+                int i = message_search(buffer(node), key);
+                if (i >= 0) {
+                        struct bplus_message *msg = &buffer(node)->msg[i];
+                        if (msg->type == MESSAGE_DELETE) {
+                                return inserted ? 0 : -1;
+                        }
+                        *data = msg->data;
+                        if (msg->type == MESSAGE_UPSERT) {
+                                return 0;
+                        }
+                        inserted = 1;
+                }
+                node = node_seek(tree, sub(node)[key_descend(node, key)]);
+        }
+
+        int i = node != NULL ? key_search(node, key) : -1;
+        if (i >= 0) {
+                *data = data(node)[leaf_slot(node, i)];
+                return 0;
+        }
+        return inserted ? 0 : -1;
+}
+
+static long bplus_tree_search(struct bplus_tree *tree, key_t key)
+{
+        long ret = -1;
+        struct bplus_node *node = node_seek_packed(tree, tree->root);
+        while (node != NULL) {
+                if (is_leaf(node) && compressed()) {
+                        ret = leaf_pack_search(node, key);
+                        break;
+                } else if (is_leaf(node)) {
+                        int i = key_search(node, key);
+                        ret = i >= 0 ? data(node)[leaf_slot(node, i)] : -1;
+                        break;
+                } else {
+                        int i = buffered() ? message_search(buffer(node), key) : -1;
+                        if (i >= 0) {
+                                struct bplus_message *msg = &buffer(node)->msg[i];
+                                if (msg->type == MESSAGE_INSERT) {
+                                        /* up to whether the key is there below */
+                                        return buffer_lookup(tree, key, &ret) == 0 ? ret : -1;
+                                }
+                                return msg->type == MESSAGE_UPSERT ? msg->data : -1;
+                        }
+                        node = node_seek_packed(tree, sub(node)[key_descend(node, key)]);
+                }
+        }
+
+        return ret;
+}
+
+static void left_node_add(struct bplus_tree *tree, struct bplus_node *node, struct bplus_node *left)
+{
+        new_node_append(tree, left);
+
+        struct bplus_node *prev = node_fetch(tree, node->prev);
+        if (prev != NULL) {
+                prev->next = left->self;
+                left->prev = prev->self;
+                node_flush(tree, prev);
+        } else {
+                left->prev = INVALID_OFFSET;
+        }
+        left->next = node->self;
+        node->prev = left->self;
+}
+
+static void right_node_add(struct bplus_tree *tree, struct bplus_node *node, struct bplus_node *right)
+{
+        new_node_append(tree, right);
+
+        struct bplus_node *next = node_fetch(tree, node->next);
+        if (next != NULL) {
+                next->prev = right->self;
+                right->next = next->self;
+                node_flush(tree, next);
+        } else {
+                right->next = INVALID_OFFSET;
+        }
+        right->prev = node->self;
+        node->next = right->self;
+}
+
+static key_t non_leaf_insert(struct bplus_tree *tree, struct bplus_node *node,
+                             struct bplus_node *l_ch, struct bplus_node *r_ch, key_t key);
+
+static int parent_node_build(struct bplus_tree *tree, struct bplus_node *l_ch,
+                             struct bplus_node *r_ch, key_t key)
+{
+        if (l_ch->parent == INVALID_OFFSET && r_ch->parent == INVALID_OFFSET) {
+                /* new parent */
+                struct bplus_node *parent = non_leaf_new(tree);
+                key(parent)[0] = key;
+                sub(parent)[0] = l_ch->self;
+                sub(parent)[1] = r_ch->self;
+                sub_count_update(parent, 0, l_ch);
+                sub_count_update(parent, 1, r_ch);
+                parent->children = 2;
+                /* write new parent and update root */
+                tree->root = new_node_append(tree, parent);
+                l_ch->parent = parent->self;
+                r_ch->parent = parent->self;
+                tree->level++;
+                /* flush parent, left and right child */
+                node_flush(tree, l_ch);
+                node_flush(tree, r_ch);
+                node_flush(tree, parent);
+                return 0;
+        } else if (r_ch->parent == INVALID_OFFSET) {
+                return non_leaf_insert(tree, node_fetch(tree, l_ch->parent), l_ch, r_ch, key);
+        } else {
+                return non_leaf_insert(tree, node_fetch(tree, r_ch->parent), l_ch, r_ch, key);
+        }
+}
+
+static key_t non_leaf_split_left(struct bplus_tree *tree, struct bplus_node *node,
+                                 struct bplus_node *left, struct bplus_node *l_ch,
+                                 struct bplus_node *r_ch, key_t key, int insert, int split)
+{
+        int i;
+
+        /* split key is key[split - 1] */
+        key_t split_key = key(node)[split - 1];
+
+        /* split as left sibling */
+        left_node_add(tree, node, left);
+
+        /* calculate split nodes' children (sum as (order + 1))*/
+        int pivot = insert;
+        left->children = split + 1;
+        node->children = _max_order - split;
+
+        /* sum = left->children = pivot + (split - pivot) + 1 */
+        /* replicate from key[0] to key[insert] in original node */
+        memmove(&key(left)[0], &key(node)[0], pivot * sizeof(key_t));
+        sub_move(left, 0, node, 0, pivot);
+
+        /* replicate from key[insert] to key[split] in original node */
+        memmove(&key(left)[pivot + 1], &key(node)[pivot], (split - pivot) * sizeof(key_t));
+        sub_move(left, pivot + 1, node, pivot, split - pivot);
+
+        /* flush sub-nodes of the new splitted left node */
+        for (i = 0; i < left->children; i++) {
+                if (i != pivot && i != pivot + 1) {
+                        sub_node_flush(tree, left, sub(left)[i]);
+                }
+        }
+
+        /* insert new key and sub-nodes and locate the split key */
+        key(left)[pivot] = key;
+        sub_node_update(tree, left, pivot, l_ch);
+        sub_node_update(tree, left, pivot + 1, r_ch);
+
+        /* sum = node->children = 1 + (node->children - 1) */
+        /* right node left shift from key[split] to key[children - 2] */
+        memmove(&key(node)[0], &key(node)[split], (node->children - 1) * sizeof(key_t));
+        sub_move(node, 0, node, split, node->children);
+
+        return split_key;
+}
+
+static key_t non_leaf_split_middle(struct bplus_tree *tree, struct bplus_node *node,
+                                   struct bplus_node *right, struct bplus_node *l_ch,
+                                   struct bplus_node *r_ch, key_t key, int insert, int split)
+{
+        int i;
+
+        /* split as right sibling */
+        right_node_add(tree, node, right);
+
+        /* split key is key[split - 1] */
+        key_t split_key = key(node)[split - 1];
+
+        /* calculate split nodes' children (sum as (order + 1))*/
+        int pivot = 0;
+        node->children = split;
+        right->children = _max_order - split + 1;
+
+        /* insert new key and sub-nodes */
+        key(right)[pivot] = key;
+        sub_node_update(tree, right, pivot, l_ch);
+        sub_node_update(tree, right, pivot + 1, r_ch);
+
+        /* sum = right->children = 2 + (right->children - 2) */
+        /* replicate from key[split] to key[_max_order - 2] */
+        memmove(&key(right)[pivot + 1], &key(node)[split], (right->children - 2) * sizeof(key_t));
+        sub_move(right, pivot + 2, node, split + 1, right->children - 2);
+
+        /* flush sub-nodes of the new splitted right node */
+        for (i = pivot + 2; i < right->children; i++) {
+                sub_node_flush(tree, right, sub(right)[i]);
+        }
+
+        return split_key;
+}
+
+static key_t non_leaf_split_right(struct bplus_tree *tree, struct bplus_node *node,
+                                  struct bplus_node *right, struct bplus_node *l_ch,
+                                  struct bplus_node *r_ch, key_t key, int insert, int split)
+{
+        int i;
+
+        /* split as right sibling */
+        right_node_add(tree, node, right);
+
+        /* split key is key[split] */
+        key_t split_key = key(node)[split];
+
+        /* calculate split nodes' children (sum as (order + 1))*/
+        int pivot = insert - split - 1;
+        node->children = split + 1;
+        right->children = _max_order - split;
+
+        /* sum = right->children = pivot + 2 + (_max_order - insert - 1) */
+        /* replicate from key[split + 1] to key[insert] */
+        memmove(&key(right)[0], &key(node)[split + 1], pivot * sizeof(key_t));
+        sub_move(right, 0, node, split + 1, pivot);
+
+        /* insert new key and sub-node */
+        key(right)[pivot] = key;
+        sub_node_update(tree, right, pivot, l_ch);
+        sub_node_update(tree, right, pivot + 1, r_ch);
+
+        /* replicate from key[insert] to key[order - 1] */
+        memmove(&key(right)[pivot + 1], &key(node)[insert], (_max_order - insert - 1) * sizeof(key_t));
+        sub_move(right, pivot + 2, node, insert + 1, _max_order - insert - 1);
+
+        /* flush sub-nodes of the new splitted right node */
+        for (i = 0; i < right->children; i++) {
+                if (i != pivot && i != pivot + 1) {
+                        sub_node_flush(tree, right, sub(right)[i]);
+                }
+        }
+
+        return split_key;
+}
+
+static void non_leaf_simple_insert(struct bplus_tree *tree, struct bplus_node *node,
+                                   struct bplus_node *l_ch, struct bplus_node *r_ch,
+                                   key_t key, int insert)
+{
+        memmove(&key(node)[insert + 1], &key(node)[insert], (node->children - 1 - insert) * sizeof(key_t));
+        sub_move(node, insert + 2, node, insert + 1, node->children - 1 - insert);
+        /* insert new key and sub-nodes */
+        key(node)[insert] = key;
+        sub_node_update(tree, node, insert, l_ch);
+        sub_node_update(tree, node, insert + 1, r_ch);
+        node->children++;
+}
+
+static int non_leaf_insert(struct bplus_tree *tree, struct bplus_node *node,
+                           struct bplus_node *l_ch, struct bplus_node *r_ch, key_t key)
+{
+        /* Search key location */
+        int insert = key_search(node, key);
+        assert(insert < 0);
+        insert = -insert - 1;
+
+        /* node is full */
+        if (node->children == _max_order) {
+                key_t split_key;
+                /* split = [m/2] */
+                int split = node->children / 2;
+                struct bplus_node *sibling = non_leaf_new(tree);
+                if (insert < split) {
+                        split_key = non_leaf_split_left(tree, node, sibling, l_ch, r_ch, key, insert, split);
+                } else if (insert == split) {
+                        split_key = non_leaf_split_middle(tree, node, sibling, l_ch, r_ch, key, insert, split);
+                } else {
+                        split_key = non_leaf_split_right(tree, node, sibling, l_ch, r_ch, key, insert, split);
+                }
+
+                /* build new parent */
+                if (insert < split) {
+                        return parent_node_build(tree, sibling, node, split_key);
+                } else {
+                        return parent_node_build(tree, node, sibling, split_key);
+                }
+        } else {
+                non_leaf_simple_insert(tree, node, l_ch, r_ch, key, insert);
+                node_flush(tree, node);
+        }
+        return 0;
+}
+
+static key_t leaf_split_left(struct bplus_tree *tree, struct bplus_node *leaf,
+                             struct bplus_node *left, key_t key, long data, int insert)
+{
+        /* split = [m/2] */
+        int split = (leaf->children + 1) / 2;
+
+        /* split as left sibling */
+        left_node_add(tree, leaf, left);
+
+        /* calculate split leaves' children (sum as (entries + 1)) */
+        int pivot = insert;
+        left->children = split;
+        leaf->children = leaf->children - split + 1;
+
+        /* sum = left->children = pivot + 1 + (split - pivot - 1) */
+        /* replicate from key[0] to key[insert] */
+        memmove(&key(left)[0], &key(leaf)[0], pivot * sizeof(key_t));
+        memmove(&data(left)[0], &data(leaf)[0], pivot * sizeof(long));
+
+        /* insert new key and data */
+        key(left)[pivot] = key;
+        data(left)[pivot] = data;
+
+        /* replicate from key[insert] to key[split - 1] */
+        memmove(&key(left)[pivot + 1], &key(leaf)[pivot], (split - pivot - 1) * sizeof(key_t));
         memmove(&data(left)[pivot + 1], &data(leaf)[pivot], (split - pivot - 1) * sizeof(long));
 
-        /* original leaf left shift */
-        memmove(&key(leaf)[0], &key(leaf)[split - 1], leaf->children * sizeof(key_t));
-        memmove(&data(leaf)[0], &data(leaf)[split - 1], leaf->children * sizeof(long));
+        /* original leaf left shift */
+        memmove(&key(leaf)[0], &key(leaf)[split - 1], leaf->children * sizeof(key_t));
+        memmove(&data(leaf)[0], &data(leaf)[split - 1], leaf->children * sizeof(long));
+
+        return key(leaf)[0];
+}
+
+static key_t leaf_split_right(struct bplus_tree *tree, struct bplus_node *leaf,
+                              struct bplus_node *right, key_t key, long data, int insert)
+{
+        /* split = [m/2] */
+        int split = (leaf->children + 1) / 2;
+
+        /* split as right sibling */
+        right_node_add(tree, leaf, right);
+
+        /* calculate split leaves' children (sum as (entries + 1)) */
+        int entries = leaf->children;
+        int pivot = insert - split;
+        leaf->children = split;
+        right->children = entries - split + 1;
+
+        /* sum = right->children = pivot + 1 + (entries - pivot - split) */
+        /* replicate from key[split] to key[children - 1] in original leaf */
+        memmove(&key(right)[0], &key(leaf)[split], pivot * sizeof(key_t));
+        memmove(&data(right)[0], &data(leaf)[split], pivot * sizeof(long));
+
+        /* insert new key and data */
+        key(right)[pivot] = key;
+        data(right)[pivot] = data;
+
+        /* replicate from key[insert] to key[children - 1] in original leaf */
+        memmove(&key(right)[pivot + 1], &key(leaf)[insert], (entries - insert) * sizeof(key_t));
+        memmove(&data(right)[pivot + 1], &data(leaf)[insert], (entries - insert) * sizeof(long));
+
+        return key(right)[0];
+}
+
+static void leaf_simple_insert(struct bplus_tree *tree, struct bplus_node *leaf,
+                               key_t key, long data, int insert)
+{
+        memmove(&key(leaf)[insert + 1], &key(leaf)[insert], (leaf->children - insert) * sizeof(key_t));
+        memmove(&data(leaf)[insert + 1], &data(leaf)[insert], (leaf->children - insert) * sizeof(long));
+        key(leaf)[insert] = key;
+        data(leaf)[insert] = data;
+        leaf->children++;
+}
+
+/* entries are kept dense, the new one is appended and only slots move */
+static void leaf_slot_insert(struct bplus_node *leaf, key_t key, long data, int insert)
+{
+        unsigned short *slots = slot(leaf);
+        int entry = leaf->children;
+        key(leaf)[entry] = key;
+        data(leaf)[entry] = data;
+        memmove(&slots[insert + 1], &slots[insert], (leaf->children - insert) * sizeof(*slots));
+        slots[insert] = entry;
+        leaf->children++;
+}
+
+static int leaf_insert(struct bplus_tree *tree, struct bplus_node *leaf, key_t key, long data)
+{
+        /* Search key location */
+        int insert = key_search(leaf, key);
+        if (insert >= 0) {
+                /* Already exists */
+                return -1;
+        }
+        insert = -insert - 1;
+
+        /* fetch from free node caches */
+        int i = ((char *) leaf - tree->caches) / _node_size;
+        tree->used[i] = 1;
+
+        /* leaf is full */
+        if (leaf_full(leaf, key, data)) {
+                key_t split_key;
+                /* split = [m/2] */
+                int split = (leaf->children + 1) / 2;
+                struct bplus_node *sibling = leaf_new(tree);
+                leaf_sort(leaf);
+
+                /* sibling leaf replication due to location of insertion */
+                if (insert < split) {
+                        split_key = leaf_split_left(tree, leaf, sibling, key, data, insert);
+                } else {
+                        split_key = leaf_split_right(tree, leaf, sibling, key, data, insert);
+                }
+
+                /* build new parent */
+                if (insert < split) {
+                        return parent_node_build(tree, sibling, leaf, split_key);
+                } else {
+                        return parent_node_build(tree, leaf, sibling, split_key);
+                }
+        } else if (slotted()) {
+                leaf_slot_insert(leaf, key, data, insert);
+                leaf_slot_flush(tree, leaf);
+        } else {
+                leaf_simple_insert(tree, leaf, key, data, insert);
+                node_flush(tree, leaf);
+        }
+
+        return 0;
+}
+
+static int bplus_tree_insert(struct bplus_tree *tree, key_t key, long data)
+{
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL) {
+                if (is_leaf(node)) {
+                        return leaf_insert(tree, node, key, data);
+                } else {
+                        node = node_seek(tree, sub(node)[key_descend(node, key)]);
+                }
+        }
+
+        /* new root */
+        struct bplus_node *root = leaf_new(tree);
+        key(root)[0] = key;
+        data(root)[0] = data;
+        root->children = 1;
+        tree->root = new_node_append(tree, root);
+        tree->level = 1;
+        node_flush(tree, root);
+        return 0;
+}
+
+static inline int sibling_select(struct bplus_node *l_sib, struct bplus_node *r_sib,
+                                 struct bplus_node *parent, int i)
+{
+        if (i == -1) {
+                /* the frist sub-node, no left sibling, choose the right one */
+                return RIGHT_SIBLING;
+        } else if (i == parent->children - 2) {
+                /* the last sub-node, no right sibling, choose the left one */
+                return LEFT_SIBLING;
+        } else {
+                /* if both left and right sibling found, choose the one with more children */
+                return l_sib->children >= r_sib->children ? LEFT_SIBLING : RIGHT_SIBLING;
+        }
+}
+
+static void non_leaf_shift_from_left(struct bplus_tree *tree, struct bplus_node *node,
+                                     struct bplus_node *left, struct bplus_node *parent,
+                                     int parent_key_index, int remove)
+{
+        /* node's elements right shift */
+        memmove(&key(node)[1], &key(node)[0], remove * sizeof(key_t));
+        sub_move(node, 1, node, 0, remove + 1);
+
+        /* parent key right rotation */
+        key(node)[0] = key(parent)[parent_key_index];
+        key(parent)[parent_key_index] = key(left)[left->children - 2];
+
+        /* borrow the last sub-node from left sibling */
+        sub_move(node, 0, left, left->children - 1, 1);
+        sub_node_flush(tree, node, sub(node)[0]);
+
+        left->children--;
+}
+
+static void non_leaf_merge_into_left(struct bplus_tree *tree, struct bplus_node *node,
+                                     struct bplus_node *left, struct bplus_node *parent,
+                                     int parent_key_index, int remove)
+{
+        /* move parent key down */
+        key(left)[left->children - 1] = key(parent)[parent_key_index];
+
+        /* merge into left sibling */
+        /* key sum = node->children - 2 */
+        memmove(&key(left)[left->children], &key(node)[0], remove * sizeof(key_t));
+        sub_move(left, left->children, node, 0, remove + 1);
+
+        /* sub-node sum = node->children - 1 */
+        memmove(&key(left)[left->children + remove], &key(node)[remove + 1], (node->children - remove - 2) * sizeof(key_t));
+        sub_move(left, left->children + remove + 1, node, remove + 2, node->children - remove - 2);
+
+        /* flush sub-nodes of the new merged left node */
+        int i, j;
+        for (i = left->children, j = 0; j < node->children - 1; i++, j++) {
+                sub_node_flush(tree, left, sub(left)[i]);
+        }
+
+        left->children += node->children - 1;
+}
+
+static void non_leaf_shift_from_right(struct bplus_tree *tree, struct bplus_node *node,
+                                      struct bplus_node *right, struct bplus_node *parent,
+                                      int parent_key_index)
+{
+        /* parent key left rotation */
+        key(node)[node->children - 1] = key(parent)[parent_key_index];
+        key(parent)[parent_key_index] = key(right)[0];
+
+        /* borrow the frist sub-node from right sibling */
+        sub_move(node, node->children, right, 0, 1);
+        sub_node_flush(tree, node, sub(node)[node->children]);
+        node->children++;
+
+        /* right sibling left shift*/
+        memmove(&key(right)[0], &key(right)[1], (right->children - 2) * sizeof(key_t));
+        sub_move(right, 0, right, 1, right->children - 1);
+
+        right->children--;
+}
+
+static void non_leaf_merge_from_right(struct bplus_tree *tree, struct bplus_node *node,
+                                      struct bplus_node *right, struct bplus_node *parent,
+                                      int parent_key_index)
+{
+        /* move parent key down */
+        key(node)[node->children - 1] = key(parent)[parent_key_index];
+        node->children++;
+
+        /* merge from right sibling */
+        memmove(&key(node)[node->children - 1], &key(right)[0], (right->children - 1) * sizeof(key_t));
+        sub_move(node, node->children - 1, right, 0, right->children);
+
+        /* flush sub-nodes of the new merged node */
+        int i, j;
+        for (i = node->children - 1, j = 0; j < right->children; i++, j++) {
+                sub_node_flush(tree, node, sub(node)[i]);
+        }
+
+        node->children += right->children - 1;
+}
+
+static inline void non_leaf_simple_remove(struct bplus_tree *tree, struct bplus_node *node, int remove)
+{
+        assert(node->children >= 2);
+        memmove(&key(node)[remove], &key(node)[remove + 1], (node->children - remove - 2) * sizeof(key_t));
+        sub_move(node, remove + 1, node, remove + 2, node->children - remove - 2);
+        node->children--;
+}
+
+static void non_leaf_remove(struct bplus_tree *tree, struct bplus_node *node, int remove)
+{
+        if (node->parent == INVALID_OFFSET) {
+                /* node is the root */
+                if (node->children == 2) {
+                        /* replace old root with the first sub-node */
+                        struct bplus_node *root = node_fetch(tree, sub(node)[0]);
+                        root->parent = INVALID_OFFSET;
+                        tree->root = root->self;
+                        tree->level--;
+                        node_delete(tree, node, NULL, NULL);
+                        node_flush(tree, root);
+                } else {
+                        non_leaf_simple_remove(tree, node, remove);
+                        node_flush(tree, node);
+                }
+        } else if (node->children <= (_max_order + 1) / 2) {
+                struct bplus_node *l_sib = node_fetch(tree, node->prev);
+                struct bplus_node *r_sib = node_fetch(tree, node->next);
+                struct bplus_node *parent = node_fetch(tree, node->parent);
+
+                int i = parent_key_index(parent, key(node)[0]);
+
+                /* decide which sibling to be borrowed from */
+                if (sibling_select(l_sib, r_sib, parent, i)  == LEFT_SIBLING) {
+                        if (l_sib->children > (_max_order + 1) / 2) {
+                                non_leaf_shift_from_left(tree, node, l_sib, parent, i, remove);
+                                sub_count_update(parent, i, l_sib);
+                                sub_count_update(parent, i + 1, node);
+                                /* flush nodes */
+                                node_flush(tree, node);
+                                node_flush(tree, l_sib);
+                                node_flush(tree, r_sib);
+                                node_flush(tree, parent);
+                        } else {
+                                non_leaf_merge_into_left(tree, node, l_sib, parent, i, remove);
+                                sub_count_update(parent, i, l_sib);
+                                /* delete empty node and flush */
+                                node_delete(tree, node, l_sib, r_sib);
+                                /* trace upwards */
+                                non_leaf_remove(tree, parent, i);
+                        }
+                } else {
+                        /* remove at first in case of overflow during merging with sibling */
+                        non_leaf_simple_remove(tree, node, remove);
+
+                        if (r_sib->children > (_max_order + 1) / 2) {
+                                non_leaf_shift_from_right(tree, node, r_sib, parent, i + 1);
+                                sub_count_update(parent, i + 1, node);
+                                sub_count_update(parent, i + 2, r_sib);
+                                /* flush nodes */
+                                node_flush(tree, node);
+                                node_flush(tree, l_sib);
+                                node_flush(tree, r_sib);
+                                node_flush(tree, parent);
+                        } else {
+                                non_leaf_merge_from_right(tree, node, r_sib, parent, i + 1);
+                                sub_count_update(parent, i + 1, node);
+                                /* delete empty right sibling and flush */
+                                struct bplus_node *rr_sib = node_fetch(tree, r_sib->next);
+                                node_delete(tree, r_sib, node, rr_sib);
+                                node_flush(tree, l_sib);
+                                /* trace upwards */
+                                non_leaf_remove(tree, parent, i + 1);
+                        }
+                }
+        } else {
+                non_leaf_simple_remove(tree, node, remove);
+                node_flush(tree, node);
+        }
+}
+
+static void leaf_shift_from_left(struct bplus_tree *tree, struct bplus_node *leaf,
+                                 struct bplus_node *left, struct bplus_node *parent,
+                                 int parent_key_index, int remove)
+{
+        /* right shift in leaf node */
+        memmove(&key(leaf)[1], &key(leaf)[0], remove * sizeof(key_t));
+        memmove(&data(leaf)[1], &data(leaf)[0], remove * sizeof(off_t));
+
+        /* borrow the last element from left sibling */
+        key(leaf)[0] = key(left)[left->children - 1];
+        data(leaf)[0] = data(left)[left->children - 1];
+        left->children--;
+
+        /* update parent key */
+        key(parent)[parent_key_index] = key(leaf)[0];
+}
+
+static void leaf_merge_into_left(struct bplus_tree *tree, struct bplus_node *leaf,
+                                 struct bplus_node *left, int parent_key_index, int remove)
+{
+        /* merge into left sibling, sum = leaf->children - 1*/
+        memmove(&key(left)[left->children], &key(leaf)[0], remove * sizeof(key_t));
+        memmove(&data(left)[left->children], &data(leaf)[0], remove * sizeof(off_t));
+        memmove(&key(left)[left->children + remove], &key(leaf)[remove + 1], (leaf->children - remove - 1) * sizeof(key_t));
+        memmove(&data(left)[left->children + remove], &data(leaf)[remove + 1], (leaf->children - remove - 1) * sizeof(off_t));
+        left->children += leaf->children - 1;
+}
+
+static void leaf_shift_from_right(struct bplus_tree *tree, struct bplus_node *leaf,
+                                  struct bplus_node *right, struct bplus_node *parent,
+                                  int parent_key_index)
+{
+        /* borrow the first element from right sibling */
+        key(leaf)[leaf->children] = key(right)[0];
+        data(leaf)[leaf->children] = data(right)[0];
+        leaf->children++;
+
+        /* left shift in right sibling */
+        memmove(&key(right)[0], &key(right)[1], (right->children - 1) * sizeof(key_t));
+        memmove(&data(right)[0], &data(right)[1], (right->children - 1) * sizeof(off_t));
+        right->children--;
+
+        /* update parent key */
+        key(parent)[parent_key_index] = key(right)[0];
+}
+
+static inline void leaf_merge_from_right(struct bplus_tree *tree, struct bplus_node *leaf,
+                                         struct bplus_node *right)
+{
+        memmove(&key(leaf)[leaf->children], &key(right)[0], right->children * sizeof(key_t));
+        memmove(&data(leaf)[leaf->children], &data(right)[0], right->children * sizeof(off_t));
+        leaf->children += right->children;
+}
+
+static inline void leaf_simple_remove(struct bplus_tree *tree, struct bplus_node *leaf, int remove)
+{
+        memmove(&key(leaf)[remove], &key(leaf)[remove + 1], (leaf->children - remove - 1) * sizeof(key_t));
+        memmove(&data(leaf)[remove], &data(leaf)[remove + 1], (leaf->children - remove - 1) * sizeof(off_t));
+        leaf->children--;
+}
+
+/* the last entry fills the hole and its slot is redirected */
+static void leaf_slot_remove(struct bplus_node *leaf, int remove)
+{
+        unsigned short *slots = slot(leaf);
+        int entry = slots[remove];
+        int last = leaf->children - 1;
+        memmove(&slots[remove], &slots[remove + 1], (last - remove) * sizeof(*slots));
+        leaf->children--;
+        if (entry != last) {
+                key(leaf)[entry] = key(leaf)[last];
+                data(leaf)[entry] = data(leaf)[last];
+                slots[key_slot_search(leaf, key(leaf)[entry])] = entry;
+        }
+}
+
+static int leaf_remove(struct bplus_tree *tree, struct bplus_node *leaf, key_t key)
+{
+        int remove = key_search(leaf, key);
+        if (remove < 0) {
+                /* Not exist */
+                return -1;
+        }
+
+        /* fetch from free node caches */
+        int i = ((char *) leaf - tree->caches) / _node_size;
+        tree->used[i] = 1;
+
+        if (leaf->parent == INVALID_OFFSET) {
+                /* leaf as the root */
+                if (leaf->children == 1) {
+                        /* delete the only last node */
+                        assert(key == key(leaf)[0]);
+                        tree->root = INVALID_OFFSET;
+                        tree->level = 0;
+                        node_delete(tree, leaf, NULL, NULL);
+                } else if (slotted()) {
+                        leaf_slot_remove(leaf, remove);
+                        leaf_slot_flush(tree, leaf);
+                } else {
+                        leaf_simple_remove(tree, leaf, remove);
+                        node_flush(tree, leaf);
+                }
+        } else if (leaf->children <= (_max_entries + 1) / 2) {
+                leaf_sort(leaf);
+                struct bplus_node *l_sib = node_fetch(tree, leaf->prev);
+                struct bplus_node *r_sib = node_fetch(tree, leaf->next);
+                struct bplus_node *parent = node_fetch(tree, leaf->parent);
+
+                i = parent_key_index(parent, key(leaf)[0]);
+
+                /* decide which sibling to be borrowed from */
+                if (sibling_select(l_sib, r_sib, parent, i) == LEFT_SIBLING) {
+                        /* compressed leaves too wide to merge borrow instead */
+                        if (l_sib->children > (_max_entries + 1) / 2 || !leaf_merge_fits(l_sib, leaf)) {
+                                leaf_shift_from_left(tree, leaf, l_sib, parent, i, remove);
+                                sub_count_update(parent, i, l_sib);
+                                sub_count_update(parent, i + 1, leaf);
+                                /* flush leaves */
+                                node_flush(tree, leaf);
+                                node_flush(tree, l_sib);
+                                node_flush(tree, r_sib);
+                                node_flush(tree, parent);
+                        } else {
+                                leaf_merge_into_left(tree, leaf, l_sib, i, remove);
+                                sub_count_update(parent, i, l_sib);
+                                /* delete empty leaf and flush */
+                                node_delete(tree, leaf, l_sib, r_sib);
+                                /* trace upwards */
+                                non_leaf_remove(tree, parent, i);
+                        }
+                } else {
+                        /* remove at first in case of overflow during merging with sibling */
+                        leaf_simple_remove(tree, leaf, remove);
+
+                        if (r_sib->children > (_max_entries + 1) / 2 || !leaf_merge_fits(leaf, r_sib)) {
+                                leaf_shift_from_right(tree, leaf, r_sib, parent, i + 1);
+                                sub_count_update(parent, i + 1, leaf);
+                                sub_count_update(parent, i + 2, r_sib);
+                                /* flush leaves */
+                                node_flush(tree, leaf);
+                                node_flush(tree, l_sib);
+                                node_flush(tree, r_sib);
+                                node_flush(tree, parent);
+                        } else {
+                                leaf_merge_from_right(tree, leaf, r_sib);
+                                sub_count_update(parent, i + 1, leaf);
+                                /* delete empty right sibling flush */
+                                struct bplus_node *rr_sib = node_fetch(tree, r_sib->next);
+                                node_delete(tree, r_sib, leaf, rr_sib);
+                                node_flush(tree, l_sib);
+                                /* trace upwards */
+                                non_leaf_remove(tree, parent, i + 1);
+                        }
+                }
+        } else if (slotted()) {
+                leaf_slot_remove(leaf, remove);
+                leaf_slot_flush(tree, leaf);
+        } else {
+                leaf_simple_remove(tree, leaf, remove);
+                node_flush(tree, leaf);
+        }
+
+        return 0;
+}
+
+static int bplus_tree_delete(struct bplus_tree *tree, key_t key)
+{
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL) {
+                if (is_leaf(node)) {
+                        return leaf_remove(tree, node, key);
+                } else {
+                        node = node_seek(tree, sub(node)[key_descend(node, key)]);
+                }
+        }
+        return -1;
+}
+
+/* Rebalancing refreshes the counts of the nodes involved, but an insertion or
+ * removal changes the count of every ancestor, so fix them bottom up along
+ * the path of the key */
+static void count_path_repair(struct bplus_tree *tree, key_t key)
+{
+        int depth = 0, max_depth = 0;
+        char *path = NULL;
+        int *index = NULL;
+
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL && !is_leaf(node)) {
+                if (depth == max_depth) {
+                        max_depth = max_depth ? max_depth * 2 : 8;
+                        path = realloc(path, (long) max_depth * _node_size);
+                        index = realloc(index, max_depth * sizeof(int));
+                        assert(path != NULL && index != NULL);
+                }
+                int i = key_search(node, key);
+                i = i >= 0 ? i + 1 : -i - 1;
+                memcpy(path + (long) depth * _node_size, node, _node_size);
+                index[depth++] = i;
+                node = node_seek(tree, sub(node)[i]);
+        }
+
+        long count = node != NULL ? node->children : 0;
+        while (--depth >= 0) {
+                node = (struct bplus_node *) (path + (long) depth * _node_size);
+                if (cnt(node)[index[depth]] != count) {
+                        cnt(node)[index[depth]] = count;
+                        node_write(tree, node);
+                }
+                count = node_count(node);
+        }
+
+        free(index);
+        free(path);
+}
+
+static inline unsigned long bloom_hash(key_t key)
+{
+        /* splitmix64 finalizer */
+        unsigned long h = (unsigned long) key + 0x9e3779b97f4a7c15UL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9UL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebUL;
+        return h ^ (h >> 31);
+}
+
+static void bloom_add(struct bplus_tree *tree, key_t key)
+{
+        int i;
+        unsigned long h = bloom_hash(key);
+        unsigned long delta = (h >> 33) | 1;
+        for (i = 0; i < tree->bloom_hashes; i++) {
+                unsigned long bit = h % tree->bloom_bits;
+                tree->bloom[bit >> 3] |= 1 << (bit & 7);
+                h += delta;
+        }
+}
+
+static int bloom_test(struct bplus_tree *tree, key_t key)
+{
+        int i;
+        unsigned long h = bloom_hash(key);
+        unsigned long delta = (h >> 33) | 1;
+        for (i = 0; i < tree->bloom_hashes; i++) {
+                unsigned long bit = h % tree->bloom_bits;
+                if (!(tree->bloom[bit >> 3] & (1 << (bit & 7)))) {
+                        return 0;
+                }
+                h += delta;
+        }
+        return 1;
+}
+
+static int bloom_walk_add(key_t key, long data, void *arg)
+{
+        (void) data;
+        bloom_add(arg, key);
+        return 0;
+}
+
+long bplus_tree_bloom_rebuild(struct bplus_tree *tree)
+{
+        long keys = 0;
+
+        if (tree->bloom == NULL) {
+                return -1;
+        }
+        memset(tree->bloom, 0, (tree->bloom_bits + 7) / 8);
+
+        /* keys still in buffers are seen by walking */
+        if (buffered()) {
+                return bplus_tree_walk(tree, INT_MIN, INT_MAX, bloom_walk_add, tree);
+        }
+
+        /* walk down to the first leaf and then along the leaf chain */
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL && !is_leaf(node)) {
+                node = node_seek(tree, sub(node)[0]);
+        }
+        while (node != NULL) {
+                int i;
+                for (i = 0; i < node->children; i++) {
+                        bloom_add(tree, key(node)[i]);
+                }
+                keys += node->children;
+                node = node_seek(tree, node->next);
+        }
+
+        return keys;
+}
+
+int bplus_tree_bloom_enable(struct bplus_tree *tree, long keys, int bits_per_key)
+{
+        if (keys <= 0 || bits_per_key <= 0 || shared_reader(tree)) {
+                return -1;
+        }
+
+        free(tree->bloom);
+        tree->bloom_bits = keys * bits_per_key;
+        /* k = ln2 * m / n minimizes false positive rate */
+        tree->bloom_hashes = bits_per_key * 69 / 100;
+        if (tree->bloom_hashes < 1) {
+                tree->bloom_hashes = 1;
+        } else if (tree->bloom_hashes > 16) {
+                tree->bloom_hashes = 16;
+        }
+        tree->bloom = malloc((tree->bloom_bits + 7) / 8);
+        assert(tree->bloom != NULL);
+        bplus_tree_bloom_rebuild(tree);
+        return 0;
+}
+
+/* Entry of the hot-key cache, guarded by a sequence counter which is odd
+ * while the entry is being written. The tree owner is the only writer,
+ * other threads may read it without locks */
+struct hot_entry {
+        unsigned seq;
+        int used;
+        key_t key;
+        long data;
+};
+
+static inline struct hot_entry *hot_entry(struct bplus_tree *tree, key_t key)
+{
+        /* Fibonacci hashing spreads clustered keys over the table */
+        unsigned long h = (unsigned long) (unsigned) key * 0x9e3779b97f4a7c15UL;
+        return &tree->hot[(h >> 32) & tree->hot_mask];
+}
+
+static void hot_set(struct hot_entry *e, int used, key_t key, long data)
+{
+        unsigned seq = e->seq;
+        __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&e->used, used, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->key, key, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->data, data, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* keep a cached key in step with the tree, keys not cached stay out */
+static inline void hot_refresh(struct bplus_tree *tree, key_t key, long data)
+{
+        if (tree->hot != NULL) {
+                struct hot_entry *e = hot_entry(tree, key);
+                if (e->used && e->key == key) {
+                        hot_set(e, 1, key, data);
+                }
+        }
+}
+
+static void hot_invalidate_range(struct bplus_tree *tree, key_t lo, key_t hi)
+{
+        long i;
+        if (tree->hot == NULL) {
+                return;
+        }
+
+        if ((long) hi - lo <= tree->hot_mask) {
+                for (i = lo; i <= hi; i++) {
+                        struct hot_entry *e = hot_entry(tree, i);
+                        if (e->used && e->key == i) {
+                                hot_set(e, 0, 0, 0);
+                        }
+                }
+        } else {
+                for (i = 0; i <= tree->hot_mask; i++) {
+                        struct hot_entry *e = &tree->hot[i];
+                        if (e->used && e->key >= lo && e->key <= hi) {
+                                hot_set(e, 0, 0, 0);
+                        }
+                }
+        }
+}
+
+int bplus_tree_cache_get(struct bplus_tree *tree, key_t key, long *data)
+{
+        if (tree->hot == NULL) {
+                return -1;
+        }
+
+        struct hot_entry *e = hot_entry(tree, key);
+        unsigned seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+                return -1;
+        }
+        int used = __atomic_load_n(&e->used, __ATOMIC_RELAXED);
+        key_t k = __atomic_load_n(&e->key, __ATOMIC_RELAXED);
+        long d = __atomic_load_n(&e->data, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq || !used || k != key) {
+                return -1;
+        }
+
+        *data = d;
+        return 0;
+}
+
+int bplus_tree_cache_enable(struct bplus_tree *tree, long entries)
+{
+        free(tree->hot);
+        tree->hot = NULL;
+        tree->hot_mask = 0;
+        tree->hot_hits = 0;
+        tree->hot_lookups = 0;
+        if (entries <= 0) {
+                return 0;
+        }
+        if (shared_reader(tree)) {
+                fprintf(stderr, "Lookups of a shared reader cannot be cached!\n");
+                return -1;
+        }
+
+        long n = 1;
+        while (n < entries) {
+                n <<= 1;
+        }
+        tree->hot = calloc(n, sizeof(struct hot_entry));
+        if (tree->hot == NULL) {
+                fprintf(stderr, "Failed to allocate hot key cache!\n");
+                return -1;
+        }
+        tree->hot_mask = n - 1;
+        return 0;
+}
+
+/* records are buffered by stdio in chunks of that many bytes */
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+struct bplus_trace {
+        FILE *fp;
+        struct timespec start;
+};
+
+int bplus_tree_trace_begin(struct bplus_tree *tree, char *path)
+{
+        if (tree->trace != NULL) {
+                fprintf(stderr, "Trace is being recorded!\n");
+                return -1;
+        }
+
+        struct bplus_trace *trace = malloc(sizeof(*trace));
+        assert(trace != NULL);
+        trace->fp = fopen(path, "wb");
+        if (trace->fp == NULL) {
+                fprintf(stderr, "Failed to create trace file %s!\n", path);
+                free(trace);
+                return -1;
+        }
+        setvbuf(trace->fp, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+        struct bplus_trace_header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = BPLUS_TRACE_MAGIC;
+        header.version = BPLUS_TRACE_VERSION;
+        if (fwrite(&header, sizeof(header), 1, trace->fp) != 1) {
+                fprintf(stderr, "Failed to write trace file %s!\n", path);
+                fclose(trace->fp);
+                free(trace);
+                return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &trace->start);
+        tree->trace = trace;
+        return 0;
+}
+
+int bplus_tree_trace_end(struct bplus_tree *tree)
+{
+        struct bplus_trace *trace = tree->trace;
+        if (trace == NULL) {
+                return -1;
+        }
+
+        /* records failed to write are reported at last */
+        int ret = ferror(trace->fp) ? -1 : 0;
+        if (fclose(trace->fp) != 0) {
+                ret = -1;
+        }
+        free(trace);
+        tree->trace = NULL;
+        return ret;
+}
+
+static void trace_record(struct bplus_tree *tree, int op, key_t key, long arg, long ret)
+{
+        struct timespec now;
+        struct bplus_trace_record rec;
+        struct bplus_trace *trace = tree->trace;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        rec.time = (now.tv_sec - trace->start.tv_sec) * 1000000000L + now.tv_nsec - trace->start.tv_nsec;
+        rec.arg = arg;
+        rec.ret = ret;
+        rec.op = op;
+        rec.key = key;
+        fwrite(&rec, sizeof(rec), 1, trace->fp);
+}
+
+static int memtable_get(struct bplus_tree *tree, key_t key, long *data);
+static long posting_first(struct bplus_tree *tree, long data);
+
+long bplus_tree_get(struct bplus_tree *tree, key_t key)
+{
+        long data;
+        int hit = 0;
+
+        shared_read_begin(tree);
+        if (tree->hot != NULL) {
+                tree->hot_lookups++;
+                hit = bplus_tree_cache_get(tree, key, &data) == 0;
+                tree->hot_hits += hit;
+        }
+
+        if (!hit && memtable_get(tree, key, &data) != 0) {
+                if (tree->bloom != NULL && !bloom_test(tree, key)) {
+                        data = -1;
+                } else {
+                        data = posting_first(tree, bplus_tree_search(tree, key));
+                }
+                /* absent keys are cached too */
+                if (tree->hot != NULL) {
+                        hot_set(hot_entry(tree, key), 1, key, data);
+                }
+        }
+        shared_read_end(tree);
+
+        if (tree->trace != NULL) {
+                trace_record(tree, BPLUS_TRACE_GET, key, 0, data);
+        }
+        return data;
+}
+
+/* map the whole index read-only for lookups which chase nodes in place */
+static int tree_map(struct bplus_tree *tree)
+{
+        if (tree->map_size >= tree->file_size) {
+                return 0;
+        }
+
+        if (tree->map != NULL) {
+                munmap(tree->map, tree->map_size);
+                tree->map = NULL;
+                tree->map_size = 0;
+        }
+
+        void *map = mmap(NULL, tree->file_size, PROT_READ, MAP_SHARED, tree->fd, 0);
+        if (map == MAP_FAILED) {
+                fprintf(stderr, "Failed to map index file!\n");
+                return -1;
+        }
+        tree->map = map;
+        tree->map_size = tree->file_size;
+        return 0;
+}
+
+/* stages of an interleaved lookup, each one ends by prefetching what the
+ * next needs and yielding to the other lookups of the group */
+enum {
+        BATCH_NODE,
+        BATCH_KEYS,
+        BATCH_DATA,
+        BATCH_DONE,
+};
+
+struct batch_lookup {
+        int stage;
+        int slot;
+        long index;
+        struct bplus_node *node;
+};
+
+static inline void batch_start(struct bplus_tree *tree, struct batch_lookup *l, long index)
+{
+        l->stage = BATCH_NODE;
+        l->index = index;
+        l->node = (struct bplus_node *) (tree->map + tree->root);
+        __builtin_prefetch(l->node);
+}
+
+/* touch the lines a search of node is going to probe first */
+static inline void batch_keys_prefetch(struct bplus_node *node)
+{
+        if (blocked() && !is_leaf(node)) {
+                int sizes[FENCE_MAX_LEVELS];
+                int levels = fence_levels(node->children - 1, sizes);
+                if (levels > 0) {
+                        /* the top fence level is a single line */
+                        __builtin_prefetch(fence(node) + fence_size(node->children - 1) - sizes[levels - 1]);
+                        return;
+                }
+                __builtin_prefetch(key(node));
+                return;
+        }
+
+        int len = is_leaf(node) ? node->children : node->children - 1;
+        if (slotted() && is_leaf(node)) {
+                __builtin_prefetch(&slot(node)[len / 2]);
+        } else {
+                __builtin_prefetch(&key(node)[len / 4]);
+                __builtin_prefetch(&key(node)[len / 2]);
+                __builtin_prefetch(&key(node)[len * 3 / 4]);
+        }
+}
+
+/* Look up count keys and store their data or -1 into data, up to group
+ * lookups proceed together so that the cache misses of one are overlapped
+ * with work on the others. The index is mapped and read in place, which
+ * pays off when it is resident in memory. Returns the number of keys found */
+long bplus_tree_get_batch(struct bplus_tree *tree, key_t *keys, long *data, long count, int group)
+{
+        long i, next = 0, found = 0;
+
+        if (group < 1) {
+                group = 1;
+        } else if (group > BATCH_GROUP_MAX) {
+                group = BATCH_GROUP_MAX;
+        }
+
+        /* compact nodes and compressed leaves have to be decoded, buffers,
+         * the memtable and posting blocks consulted and dirty blocks are
+         * not in the file yet, look them up one by one */
+        shared_read_begin(tree);
+        if (compact() || compressed() || buffered() || multi_valued() || tree->wb != NULL || tree->memtable != NULL ||
+            tree->root == INVALID_OFFSET || tree_map(tree) != 0) {
+                for (i = 0; i < count; i++) {
+                        data[i] = bplus_tree_get(tree, keys[i]);
+                        found += data[i] != -1;
+                }
+                shared_read_end(tree);
+                return found;
+        }
+
+        struct batch_lookup lookups[BATCH_GROUP_MAX];
+        int active = 0;
+        while (active < group && next < count) {
+                if (tree->bloom != NULL && !bloom_test(tree, keys[next])) {
+                        data[next++] = -1;
+                        continue;
+                }
+                batch_start(tree, &lookups[active++], next++);
+        }
+
+        while (active > 0) {
+                int j;
+                for (j = 0; j < active; j++) {
+                        struct batch_lookup *l = &lookups[j];
+                        struct bplus_node *node = l->node;
+                        key_t key = keys[l->index];
+
+                        switch (l->stage) {
+                        case BATCH_NODE:
+                                batch_keys_prefetch(node);
+                                l->stage = BATCH_KEYS;
+                                break;
+                        case BATCH_KEYS:
+                                if (is_leaf(node)) {
+                                        int k = key_search(node, key);
+                                        if (k >= 0) {
+                                                l->slot = leaf_slot(node, k);
+                                                __builtin_prefetch(&data(node)[l->slot]);
+                                                l->stage = BATCH_DATA;
+                                        } else {
+                                                data[l->index] = -1;
+                                                l->stage = BATCH_DONE;
+                                        }
+                                } else {
+                                        l->node = (struct bplus_node *) (tree->map + sub(node)[key_descend(node, key)]);
+                                        __builtin_prefetch(l->node);
+                                        l->stage = BATCH_NODE;
+                                }
+                                break;
+                        case BATCH_DATA:
+                                data[l->index] = data(node)[l->slot];
+                                found++;
+                                l->stage = BATCH_DONE;
+                                break;
+                        }
+
+                        if (l->stage == BATCH_DONE) {
+                                /* refill the finished lookup with the next key */
+                                while (next < count && tree->bloom != NULL && !bloom_test(tree, keys[next])) {
+                                        data[next++] = -1;
+                                }
+                                if (next < count) {
+                                        batch_start(tree, l, next++);
+                                } else {
+                                        lookups[j--] = lookups[--active];
+                                }
+                        }
+                }
+        }
+
+        shared_read_end(tree);
+        return found;
+}
+
+/* add a message to a buffer which has room for it */
+static void buffer_add(struct message_buffer *buf, struct bplus_message *msg)
+{
+        int i = message_search(buf, msg->key);
+        if (i >= 0) {
+                message_merge(&buf->msg[i], msg);
+                return;
+        }
+
+        i = -i - 1;
+        memmove(&buf->msg[i + 1], &buf->msg[i], (buf->count - i) * sizeof(*msg));
+        buf->msg[i] = *msg;
+        buf->count++;
+}
+
+/* merge n sorted messages later than the buffered ones into a buffer */
+static void buffer_merge(struct message_buffer *buf, struct bplus_message *msgs, int n)
+{
+        int i = 0, j = 0, k = 0;
+        struct bplus_message *merged = malloc((buf->count + n) * sizeof(*merged));
+        assert(merged != NULL);
+
+        while (i < buf->count || j < n) {
+                if (j == n || (i < buf->count && buf->msg[i].key < msgs[j].key)) {
+                        merged[k++] = buf->msg[i++];
+                } else if (i == buf->count || msgs[j].key < buf->msg[i].key) {
+                        merged[k++] = msgs[j++];
+                } else {
+                        merged[k] = buf->msg[i++];
+                        message_merge(&merged[k++], &msgs[j++]);
+                }
+        }
+
+        memcpy(buf->msg, merged, k * sizeof(*merged));
+        buf->count = k;
+        free(merged);
+}
+
+/* the sub-node becomes the index-th one, key separates it from the one before */
+static void non_leaf_sub_insert(struct bplus_node *node, int index, key_t key, off_t sub)
+{
+        memmove(&key(node)[index], &key(node)[index - 1], (node->children - index) * sizeof(key_t));
+        sub_move(node, index + 1, node, index, node->children - index);
+        key(node)[index - 1] = key;
+        sub(node)[index] = sub;
+        node->children++;
+}
+
+static void non_leaf_sub_remove(struct bplus_node *node, int index)
+{
+        int k = index > 0 ? index - 1 : 0;
+        memmove(&key(node)[k], &key(node)[k + 1], (node->children - 2 - k) * sizeof(key_t));
+        sub_move(node, index, node, index + 1, node->children - 1 - index);
+        node->children--;
+}
+
+/* unlink an emptied leaf which is the index-th sub-node of parent */
+static void leaf_drop(struct bplus_tree *tree, struct bplus_node *parent, int index,
+                      struct bplus_node *leaf)
+{
+        struct bplus_node *prev = node_fetch(tree, leaf->prev);
+        struct bplus_node *next = node_fetch(tree, leaf->next);
+        if (prev != NULL) {
+                prev->next = leaf->next;
+                node_flush(tree, prev);
+        }
+        if (next != NULL) {
+                next->prev = leaf->prev;
+                node_flush(tree, next);
+        }
+        block_free(tree, leaf->self);
+        non_leaf_sub_remove(parent, index);
+}
+
+/* entries of a compressed leaf which fit in a block from the start of n */
+static int leaf_pack_fit(key_t *keys, long *data, int n)
+{
+        int low = 0, high = n;
+        struct pack_span span;
+
+        while (low < high) {
+                int mid = low + (high - low + 1) / 2;
+                pack_span_init(&span);
+                pack_span_add(&span, keys, data, mid);
+                if (pack_span_fits(&span)) {
+                        low = mid;
+                } else {
+                        high = mid - 1;
+                }
+        }
+        return low;
+}
+
+/* Apply sorted messages to the index-th sub-node of parent. The entries
+ * left are spread over as few leaves as hold them, the new ones are linked
+ * behind the leaf in parent, which loses the leaf if nothing is left */
+static void leaf_messages_apply(struct bplus_tree *tree, struct bplus_node *parent, int index,
+                                struct bplus_node *leaf, struct bplus_message *msgs, int n)
+{
+        int i = 0, j = 0, m = 0, start = 0;
+        key_t *keys = malloc((leaf->children + n) * sizeof(key_t));
+        long *data = malloc((leaf->children + n) * sizeof(long));
+        assert(keys != NULL && data != NULL);
+
+        while (i < leaf->children || j < n) {
+                if (j == n || (i < leaf->children && key(leaf)[i] < msgs[j].key)) {
+                        keys[m] = key(leaf)[i];
+                        data[m++] = data(leaf)[i++];
+                        continue;
+                }
+
+                struct bplus_message *msg = &msgs[j++];
+                int found = i < leaf->children && key(leaf)[i] == msg->key;
+                long old = found ? data(leaf)[i++] : 0;
+                if (msg->type != MESSAGE_DELETE) {
+                        keys[m] = msg->key;
+                        data[m++] = found && msg->type == MESSAGE_INSERT ? old : msg->data;
+                }
+        }
+
+        if (m == 0 && parent->children > 1) {
+                leaf_drop(tree, parent, index, leaf);
+                free(keys);
+                free(data);
+                return;
+        }
+
+        struct bplus_node *node = leaf;
+        for (; ;) {
+                /* as many entries as the leaves left to fill share evenly */
+                int rest = m - start;
+                int leaves = (rest + _max_entries - 1) / _max_entries;
+                int len = leaves > 1 ? (rest + leaves - 1) / leaves : rest;
+                if (compressed()) {
+                        len = leaf_pack_fit(&keys[start], &data[start], len);
+                }
+                memcpy(key(node), &keys[start], len * sizeof(key_t));
+                memcpy(data(node), &data[start], len * sizeof(long));
+                node->children = len;
+                start += len;
+                if (start == m) {
+                        break;
+                }
+
+                struct bplus_node *right = malloc(_node_size);
+                assert(right != NULL);
+                right->type = BPLUS_TREE_LEAF;
+                right->parent = parent->self;
+                right_node_add(tree, node, right);
+                non_leaf_sub_insert(parent, ++index, keys[start], right->self);
+                node_write(tree, node);
+                if (node != leaf) {
+                        free(node);
+                }
+                node = right;
+        }
+
+        node_write(tree, node);
+        if (node != leaf) {
+                free(node);
+        }
+        free(keys);
+        free(data);
+}
+
+static inline int buffer_overfull(struct bplus_node *node)
+{
+        return node->children > _max_order - BUFFER_SPLIT_SLACK;
+}
+
+/* Split a buffered non-leaf node, the index-th sub-node of parent, in two
+ * halves and its messages with them. The caller writes node */
+static void buffer_node_split(struct bplus_tree *tree, struct bplus_node *parent, int index,
+                              struct bplus_node *node)
+{
+        int i;
+        int split = node->children / 2;
+        key_t split_key = key(node)[split - 1];
+        struct message_buffer *buf = buffer(node);
+
+        struct bplus_node *right = malloc(_node_size);
+        assert(right != NULL);
+        right->type = BPLUS_TREE_NON_LEAF;
+        right->parent = parent->self;
+        right->children = node->children - split;
+        right_node_add(tree, node, right);
+
+        memmove(&key(right)[0], &key(node)[split], (right->children - 1) * sizeof(key_t));
+        sub_move(right, 0, node, split, right->children);
+        node->children = split;
+
+        int m = message_lower_bound(buf, split_key);
+        buffer(right)->count = buf->count - m;
+        memcpy(buffer(right)->msg, &buf->msg[m], (buf->count - m) * sizeof(struct bplus_message));
+        buf->count = m;
+
+        for (i = 0; i < right->children; i++) {
+                sub_node_flush(tree, right, sub(right)[i]);
+        }
+        non_leaf_sub_insert(parent, index + 1, split_key, right->self);
+        node_write(tree, right);
+        free(right);
+}
+
+static void buffer_root_split(struct bplus_tree *tree, struct bplus_node *root)
+{
+        struct bplus_node *parent = malloc(_node_size);
+        assert(parent != NULL);
+        parent->type = BPLUS_TREE_NON_LEAF;
+        parent->parent = INVALID_OFFSET;
+        parent->prev = INVALID_OFFSET;
+        parent->next = INVALID_OFFSET;
+        parent->children = 1;
+        sub(parent)[0] = root->self;
+        buffer(parent)->count = 0;
+        tree->root = new_node_append(tree, parent);
+        tree->level++;
+
+        root->parent = parent->self;
+        buffer_node_split(tree, parent, 0, root);
+        node_write(tree, parent);
+        free(parent);
+}
+
+static void buffer_flush(struct bplus_tree *tree, struct bplus_node *node);
+
+/* Push the messages of the sub-node most of them go to one level down. A
+ * non-leaf sub-node is flushed itself first if they do not fit, and split
+ * if it has grown too wide */
+static void buffer_flush_step(struct bplus_tree *tree, struct bplus_node *node)
+{
+        int i, index = 0, lo = 0, hi = 0, start = 0;
+        struct message_buffer *buf = buffer(node);
+
+        for (i = 0; i < node->children; i++) {
+                int end = i == node->children - 1 ? buf->count : message_lower_bound(buf, key(node)[i]);
+                if (end - start > hi - lo) {
+                        index = i;
+                        lo = start;
+                        hi = end;
+                }
+                start = end;
+        }
+
+        struct bplus_node *sub_node = node_load(tree, sub(node)[index]);
+        if (is_leaf(sub_node)) {
+                leaf_messages_apply(tree, node, index, sub_node, &buf->msg[lo], hi - lo);
+        } else {
+                struct message_buffer *sub_buf = buffer(sub_node);
+                if (sub_buf->count + hi - lo > _max_messages) {
+                        buffer_flush(tree, sub_node);
+                }
+                /* the rest waits for another step */
+                if (hi - lo > _max_messages - sub_buf->count) {
+                        hi = lo + _max_messages - sub_buf->count;
+                }
+                buffer_merge(sub_buf, &buf->msg[lo], hi - lo);
+                if (buffer_overfull(sub_node)) {
+                        buffer_node_split(tree, node, index, sub_node);
+                }
+                node_write(tree, sub_node);
+        }
+        free(sub_node);
+
+        memmove(&buf->msg[lo], &buf->msg[hi], (buf->count - hi) * sizeof(struct bplus_message));
+        buf->count -= hi - lo;
+}
+
+/* flush until half of the buffer is free or node has to be split */
+static void buffer_flush(struct bplus_tree *tree, struct bplus_node *node)
+{
+        while (buffer(node)->count > _max_messages / 2 && !buffer_overfull(node)) {
+                buffer_flush_step(tree, node);
+        }
+}
+
+/* whether changes are buffered, which starts once the root is a non-leaf */
+static int buffer_active(struct bplus_tree *tree)
+{
+        if (!buffered() || tree->root == INVALID_OFFSET) {
+                return 0;
+        }
+        return !is_leaf(node_seek_packed(tree, tree->root));
+}
+
+/* Queue a message in the root, which is flushed when its buffer is full.
+ * Returns -1 if the root is a leaf and the change has to be made in place */
+static int buffer_put(struct bplus_tree *tree, key_t key, int type, long data)
+{
+        if (!buffered() || tree->root == INVALID_OFFSET) {
+                return -1;
+        }
+
+        struct bplus_node *root = node_load(tree, tree->root);
+        if (is_leaf(root)) {
+                free(root);
+                return -1;
+        }
+
+        struct bplus_message msg;
+        msg.key = key;
+        msg.type = type;
+        msg.data = data;
+        buffer_add(buffer(root), &msg);
+        if (buffer(root)->count == _max_messages) {
+                buffer_flush(tree, root);
+                if (buffer_overfull(root)) {
+                        buffer_root_split(tree, root);
+                }
+        }
+        node_write(tree, root);
+        free(root);
+        return 0;
+}
+
+/* message and the level of the buffer it was found in */
+struct overlay_message {
+        struct bplus_message msg;
+        int depth;
+};
+
+struct message_overlay {
+        struct overlay_message *msgs;
+        long count;
+        long size;
+};
+
+/* gather messages in [min, max] from the buffers of non-leaf nodes under
+ * offset, height levels above the leaves */
+static void overlay_collect(struct bplus_tree *tree, struct message_overlay *ov, off_t offset,
+                            int height, int depth, key_t min, key_t max)
+{
+        int i;
+
+        if (height == 0) {
+                return;
+        }
+
+        struct bplus_node *node = node_load(tree, offset);
+        struct message_buffer *buf = buffer(node);
+        for (i = message_lower_bound(buf, min); i < buf->count && buf->msg[i].key <= max; i++) {
+                if (ov->count == ov->size) {
+                        ov->size = ov->size ? ov->size * 2 : 256;
+                        ov->msgs = realloc(ov->msgs, ov->size * sizeof(*ov->msgs));
+                        assert(ov->msgs != NULL);
+                }
+                ov->msgs[ov->count].msg = buf->msg[i];
+                ov->msgs[ov->count++].depth = depth;
+        }
+
+        int last = key_descend(node, max);
+        for (i = key_descend(node, min); i <= last; i++) {
+                overlay_collect(tree, ov, sub(node)[i], height - 1, depth + 1, min, max);
+        }
+        free(node);
+}
+
+static int overlay_cmp(const void *a, const void *b)
+{
+        const struct overlay_message *x = a;
+        const struct overlay_message *y = b;
+        if (x->msg.key != y->msg.key) {
+                return x->msg.key < y->msg.key ? -1 : 1;
+        }
+        /* deeper ones are earlier */
+        return y->depth - x->depth;
+}
+
+/* Walk keys in [min, max] as they are once all buffered messages have gone
+ * down to the leaves, which are read as they are */
+static long buffer_walk(struct bplus_tree *tree, key_t min, key_t max,
+                        bplus_tree_walk_fn fn, void *arg)
+{
+        long i, j, n = 0, count = 0;
+        int height = 0;
+        struct message_overlay ov;
+
+        struct bplus_node *node = node_seek_packed(tree, tree->root);
+        while (!is_leaf(node)) {
+                height++;
+                node = node_seek_packed(tree, sub(node)[0]);
+        }
+
+        ov.msgs = NULL;
+        ov.count = 0;
+        ov.size = 0;
+        overlay_collect(tree, &ov, tree->root, height, 0, min, max);
+        if (ov.count > 0) {
+                qsort(ov.msgs, ov.count, sizeof(*ov.msgs), overlay_cmp);
+        }
+        for (j = 0; j < ov.count; j++) {
+                if (n > 0 && ov.msgs[n - 1].msg.key == ov.msgs[j].msg.key) {
+                        message_merge(&ov.msgs[n - 1].msg, &ov.msgs[j].msg);
+                } else {
+                        ov.msgs[n++] = ov.msgs[j];
+                }
+        }
+
+        node = node_seek(tree, tree->root);
+        while (!is_leaf(node)) {
+                node = node_seek(tree, sub(node)[key_descend(node, min)]);
+        }
+        i = key_search(node, min);
+        i = i >= 0 ? i : -i - 1;
+
+        for (j = 0; ; ) {
+                while (node != NULL && i >= node->children) {
+                        node = node_seek(tree, node->next);
+                        i = 0;
+                }
+
+                key_t key;
+                long data;
+                int leaf_key = node != NULL && key(node)[leaf_slot(node, i)] <= max;
+                if (leaf_key && (j == n || key(node)[leaf_slot(node, i)] < ov.msgs[j].msg.key)) {
+                        key = key(node)[leaf_slot(node, i)];
+                        data = data(node)[leaf_slot(node, i++)];
+                } else if (j < n) {
+                        struct bplus_message *msg = &ov.msgs[j++].msg;
+                        int found = leaf_key && key(node)[leaf_slot(node, i)] == msg->key;
+                        long old = found ? data(node)[leaf_slot(node, i++)] : 0;
+                        if (msg->type == MESSAGE_DELETE) {
+                                continue;
+                        }
+                        key = msg->key;
+                        data = found && msg->type == MESSAGE_INSERT ? old : msg->data;
+                } else {
+                        break;
+                }
+
+                count++;
+                if (fn(key, data, arg) != 0) {
+                        break;
+                }
+        }
+
+        free(ov.msgs);
+        return count;
+}
+
+static int buffer_walk_last(key_t key, long data, void *arg)
+{
+        (void) key;
+        *(long *) arg = data;
+        return 0;
+}
+
+struct key_list {
+        key_t *keys;
+        long count;
+        long size;
+};
+
+static int buffer_walk_collect(key_t key, long data, void *arg)
+{
+        struct key_list *list = arg;
+        (void) data;
+        if (list->count == list->size) {
+                list->size = list->size ? list->size * 2 : 256;
+                list->keys = realloc(list->keys, list->size * sizeof(key_t));
+                assert(list->keys != NULL);
+        }
+        list->keys[list->count++] = key;
+        return 0;
+}
+
+static int bplus_tree_store(struct bplus_tree *tree, key_t key, long data)
+{
+        if (buffer_put(tree, key, data ? MESSAGE_INSERT : MESSAGE_DELETE, data) == 0) {
+                if (data && tree->bloom != NULL) {
+                        bloom_add(tree, key);
+                }
+                /* whether the insertion takes effect is not known yet */
+                if (data) {
+                        hot_invalidate_range(tree, key, key);
+                } else {
+                        hot_refresh(tree, key, -1);
+                }
+                return 0;
+        }
+
+        if (data) {
+                int ret = bplus_tree_insert(tree, key, data);
+                if (ret == 0 && tree->bloom != NULL) {
+                        bloom_add(tree, key);
+                }
+                if (ret == 0 && augmented()) {
+                        count_path_repair(tree, key);
+                }
+                if (ret == 0) {
+                        hot_refresh(tree, key, data);
+                }
+                return ret;
+        } else {
+                /* stale bits of deleted keys only cost false positives */
+                int ret = bplus_tree_delete(tree, key);
+                if (ret == 0 && augmented()) {
+                        count_path_repair(tree, key);
+                }
+                if (ret == 0) {
+                        hot_refresh(tree, key, -1);
+                }
+                return ret;
+        }
+}
+
+/* Overwrite the data of the i-th entry in memory, fails if a compressed
+ * leaf would not fit in its block with it */
+static int leaf_data_set(struct bplus_node *leaf, int i, long data)
+{
+        i = leaf_slot(leaf, i);
+        if (compressed()) {
+                struct pack_span span;
+                pack_span_init(&span);
+                pack_span_add(&span, key(leaf), data(leaf), leaf->children);
+                pack_span_add(&span, &key(leaf)[i], &data, 1);
+                /* the old data is replaced */
+                span.entries--;
+                if (!pack_span_fits(&span)) {
+                        return -1;
+                }
+        }
+
+        data(leaf)[i] = data;
+        return 0;
+}
+
+/* overwrite the data of the i-th entry in place */
+static int leaf_data_store(struct bplus_tree *tree, struct bplus_node *leaf, int i, long data)
+{
+        if (leaf_data_set(leaf, i, data) != 0) {
+                return -1;
+        }
+        block_write(tree, leaf);
+        return 0;
+}
+
+/* the leaf where key is or should be, in an unclaimed cache */
+static struct bplus_node *leaf_locate(struct bplus_tree *tree, key_t key)
+{
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL && !is_leaf(node)) {
+                node = node_seek(tree, sub(node)[key_descend(node, key)]);
+        }
+        return node;
+}
+
+/* levels of memtable towers, enough for 4^20 entries */
+#define MEMTABLE_MAX_LEVEL 20
+
+/* A memtable entry holds the data a key is going to have in the tree, zero
+ * for a deleted key */
+struct memtable_entry {
+        key_t key;
+        long data;
+        struct memtable_entry *next[];
+};
+
+/* skip list of the changes not merged into the tree yet */
+struct bplus_memtable {
+        struct memtable_entry *head;
+        int level;
+        long count;
+        long limit;
+        unsigned long seed;
+};
+
+/* the first entry not less than key, preceding entries of each level are
+ * stored in prev if given */
+static struct memtable_entry *memtable_seek(struct bplus_memtable *mt, key_t key,
+                                            struct memtable_entry **prev)
+{
+        int l;
+        struct memtable_entry *e = mt->head;
+        for (l = mt->level - 1; l >= 0; l--) {
+                while (e->next[l] != NULL && e->next[l]->key < key) {
+                        e = e->next[l];
+                }
+                if (prev != NULL) {
+                        prev[l] = e;
+                }
+        }
+        return e->next[0];
+}
+
+static struct memtable_entry *memtable_find(struct bplus_tree *tree, key_t key)
+{
+        if (tree->memtable == NULL || tree->memtable->count == 0) {
+                return NULL;
+        }
+
+        struct memtable_entry *e = memtable_seek(tree->memtable, key, NULL);
+        return e != NULL && e->key == key ? e : NULL;
+}
+
+/* data of key in the memtable or -1 if deleted there, fails if the memtable
+ * does not know the key */
+static int memtable_get(struct bplus_tree *tree, key_t key, long *data)
+{
+        struct memtable_entry *e = memtable_find(tree, key);
+        if (e == NULL) {
+                return -1;
+        }
+        *data = e->data ? e->data : -1;
+        return 0;
+}
+
+/* data of key in the memtable or else the tree, fails if it is absent */
+static int memtable_lookup(struct bplus_tree *tree, key_t key, long *data)
+{
+        struct memtable_entry *e = memtable_find(tree, key);
+        if (e != NULL) {
+                *data = e->data;
+                return e->data ? 0 : -1;
+        }
+        if (tree->bloom != NULL && !bloom_test(tree, key)) {
+                return -1;
+        }
+
+        struct bplus_node *leaf = leaf_locate(tree, key);
+        int i = leaf != NULL ? key_search(leaf, key) : -1;
+        if (i < 0) {
+                return -1;
+        }
+        *data = data(leaf)[leaf_slot(leaf, i)];
+        return 0;
+}
+
+/* Apply n sorted changes, data 0 for a deletion, to the leaf of the first
+ * one as long as they fall in it and fit without rebalancing, so that the
+ * leaf is written once. The change breaking the run goes through the usual
+ * path. Returns the changes applied */
+static long leaf_run_apply(struct bplus_tree *tree, key_t *keys, long *data, long n)
+{
+        int i = -1, changed = 0, resized = 0, bounded = 0;
+        long k = 0;
+        key_t hi = 0;
+
+        struct bplus_node *leaf = node_seek(tree, tree->root);
+        while (leaf != NULL && !is_leaf(leaf)) {
+                int j = key_descend(leaf, keys[0]);
+                if (j < leaf->children - 1) {
+                        /* keys of the child are less than its right separator */
+                        hi = key(leaf)[j];
+                        bounded = 1;
+                }
+                leaf = node_seek(tree, sub(leaf)[j]);
+        }
+
+        for (; leaf != NULL && k < n && (!bounded || keys[k] < hi); k++) {
+                i = key_search(leaf, keys[k]);
+                if (data[k] == 0) {
+                        if (i < 0) {
+                                continue;
+                        }
+                        /* leaves must not underflow nor the root get empty */
+                        if (leaf->children <= (leaf->parent == INVALID_OFFSET ? 1 : (_max_entries + 1) / 2)) {
+                                break;
+                        }
+                        if (slotted()) {
+                                leaf_slot_remove(leaf, i);
+                        } else {
+                                leaf_simple_remove(tree, leaf, i);
+                        }
+                        resized = 1;
+                } else if (i >= 0) {
+                        if (data(leaf)[leaf_slot(leaf, i)] == data[k]) {
+                                continue;
+                        }
+                        if (leaf_data_set(leaf, i, data[k]) != 0) {
+                                break;
+                        }
+                } else {
+                        if (leaf_full(leaf, keys[k], data[k])) {
+                                break;
+                        }
+                        if (slotted()) {
+                                leaf_slot_insert(leaf, keys[k], data[k], -i - 1);
+                        } else {
+                                leaf_simple_insert(tree, leaf, keys[k], data[k], -i - 1);
+                        }
+                        resized = 1;
+                }
+                changed = 1;
+        }
+
+        if (changed) {
+                key_t key = key(leaf)[leaf_slot(leaf, 0)];
+                block_write(tree, leaf);
+                if (resized && augmented()) {
+                        count_path_repair(tree, key);
+                }
+        }
+
+        if (k < n && (leaf == NULL || !bounded || keys[k] < hi)) {
+                /* a split, a merge or a new root */
+                if (leaf != NULL && data[k] != 0 && i >= 0) {
+                        bplus_tree_store(tree, keys[k], 0);
+                }
+                bplus_tree_store(tree, keys[k], data[k]);
+                k++;
+        }
+        return k;
+}
+
+static void memtable_clear(struct bplus_memtable *mt)
+{
+        int l;
+        struct memtable_entry *e = mt->head->next[0];
+        while (e != NULL) {
+                struct memtable_entry *next = e->next[0];
+                free(e);
+                e = next;
+        }
+        for (l = 0; l < MEMTABLE_MAX_LEVEL; l++) {
+                mt->head->next[l] = NULL;
+        }
+        mt->level = 1;
+        mt->count = 0;
+}
+
+/* merge the memtable into the tree in key order, returns entries merged */
+long bplus_tree_memtable_flush(struct bplus_tree *tree)
+{
+        struct bplus_memtable *mt = tree->memtable;
+        if (mt == NULL) {
+                return 0;
+        }
+
+        long i, count = 0;
+        key_t *keys = malloc(mt->count * sizeof(key_t) + 1);
+        long *data = malloc(mt->count * sizeof(long) + 1);
+        assert(keys != NULL && data != NULL);
+        struct memtable_entry *e;
+        for (e = mt->head->next[0]; e != NULL; e = e->next[0]) {
+                keys[count] = e->key;
+                data[count++] = e->data;
+        }
+        for (i = 0; i < count; ) {
+                i += leaf_run_apply(tree, &keys[i], &data[i], count - i);
+        }
+        free(keys);
+        free(data);
+        memtable_clear(mt);
+        replica_commit(tree);
+        shared_commit(tree);
+        return count;
+}
+
+/* keep data of key in the memtable, merged when it is full */
+static void memtable_set(struct bplus_tree *tree, key_t key, long data)
+{
+        int l, level = 1;
+        struct bplus_memtable *mt = tree->memtable;
+        struct memtable_entry *prev[MEMTABLE_MAX_LEVEL];
+
+        struct memtable_entry *e = memtable_seek(mt, key, prev);
+        if (e != NULL && e->key == key) {
+                e->data = data;
+                return;
+        }
+
+        /* xorshift, a level up for every two zero bits */
+        mt->seed ^= mt->seed << 13;
+        mt->seed ^= mt->seed >> 7;
+        mt->seed ^= mt->seed << 17;
+        unsigned long bits = mt->seed;
+        while (level < MEMTABLE_MAX_LEVEL && (bits & 3) == 0) {
+                level++;
+                bits >>= 2;
+        }
+        for (l = mt->level; l < level; l++) {
+                prev[l] = mt->head;
+        }
+        if (level > mt->level) {
+                mt->level = level;
+        }
+
+        e = malloc(sizeof(*e) + level * sizeof(e->next[0]));
+        assert(e != NULL);
+        e->key = key;
+        e->data = data;
+        for (l = 0; l < level; l++) {
+                e->next[l] = prev[l]->next[l];
+                prev[l]->next[l] = e;
+        }
+
+        if (++mt->count >= mt->limit) {
+                bplus_tree_memtable_flush(tree);
+        }
+}
+
+static int memtable_store(struct bplus_tree *tree, key_t key, long data)
+{
+        /* a put does not replace, nor delete an absent key */
+        long old;
+        if ((memtable_lookup(tree, key, &old) == 0) == (data != 0)) {
+                return -1;
+        }
+
+        memtable_set(tree, key, data);
+        if (data && tree->bloom != NULL) {
+                bloom_add(tree, key);
+        }
+        hot_refresh(tree, key, data ? data : -1);
+        return 0;
+}
+
+/* Keep up to entries changes in memory, where they are read from, and merge
+ * them into the tree in key order once there are that many. 0 merges and
+ * drops the memtable */
+int bplus_tree_memtable_enable(struct bplus_tree *tree, long entries)
+{
+        if (buffered()) {
+                fprintf(stderr, "Buffered nodes batch changes already!\n");
+                return -1;
+        }
+        if (multi_valued()) {
+                fprintf(stderr, "Values of multi-valued keys are kept in leaves only!\n");
+                return -1;
+        }
+
+        if (tree->memtable != NULL) {
+                bplus_tree_memtable_flush(tree);
+                if (entries > 0) {
+                        tree->memtable->limit = entries;
+                        return 0;
+                }
+                free(tree->memtable->head);
+                free(tree->memtable);
+                tree->memtable = NULL;
+        }
+        if (entries <= 0) {
+                return 0;
+        }
+
+        struct bplus_memtable *mt = calloc(1, sizeof(*mt));
+        assert(mt != NULL);
+        mt->head = calloc(1, sizeof(*mt->head) + MEMTABLE_MAX_LEVEL * sizeof(mt->head->next[0]));
+        assert(mt->head != NULL);
+        mt->level = 1;
+        mt->limit = entries;
+        mt->seed = 0x9e3779b97f4a7c15UL;
+        tree->memtable = mt;
+        return 0;
+}
+
+/* Values of a multi-valued key are positive. A key with one value keeps it
+ * in the leaf. More share a block with those of other keys in a cell of the
+ * least class they fit, the values a cell holds double from class to class.
+ * More than the largest cell holds go in sorted order to a chain of posting
+ * blocks. The leaf refers to a cell or the first block by a negative number,
+ * the lowest bit of its magnitude tells which */
+#define values(node) ((long *) offset_ptr(node))
+#define cell_class(node) (*(long *) offset_ptr(node))
+#define cell_map(node) ((unsigned char *) offset_ptr(node) + sizeof(long))
+#define cell_capacity(class) ((8 << (class)) - 1)
+#define chain_ref(offset) (-2 - 2 * (long) ((offset) / _block_size))
+#define cell_ref(offset, i) (-3 - 2 * ((long) ((offset) / _block_size) * _max_cells[0] + (i)))
+#define chain_offset(data) ((off_t) ((-(data) - 2) / 2) * _block_size)
+#define cell_offset(data) ((off_t) ((-(data) - 3) / 2 / _max_cells[0]) * _block_size)
+#define cell_index(data) ((int) ((-(data) - 3) / 2 % _max_cells[0]))
+
+static inline int is_posting(long data)
+{
+        return multi_valued() && data < -1;
+}
+
+static inline int is_cell(long data)
+{
+        return is_posting(data) && (-data - 2) % 2 == 1;
+}
+
+static inline struct posting_cell *posting_cell(struct bplus_node *node, int i)
+{
+        int class = cell_class(node);
+        return (struct posting_cell *) (cell_map(node) + _cell_map_size[class] +
+                                        (long) i * (cell_capacity(class) + 1) * sizeof(long));
+}
+
+/* the least class of cells holding n values */
+static inline int cell_class_fit(int n)
+{
+        int class = 0;
+        while (cell_capacity(class) < n) {
+                class++;
+        }
+        assert(class < _cell_classes);
+        return class;
+}
+
+/* the least value of a key for the data in its leaf entry */
+static long posting_first(struct bplus_tree *tree, long data)
+{
+        if (!is_posting(data)) {
+                return data;
+        }
+
+        if (is_cell(data)) {
+                struct bplus_node *node = node_load(tree, cell_offset(data));
+                data = posting_cell(node, cell_index(data))->value[0];
+                free(node);
+        } else {
+                struct bplus_node *node = node_load(tree, chain_offset(data));
+                data = values(node)[0];
+                free(node);
+        }
+        return data;
+}
+
+static struct bplus_node *posting_new(struct bplus_tree *tree, int type)
+{
+        struct bplus_node *node = malloc(_node_size);
+        assert(node != NULL);
+        memset(node, 0, _node_size);
+        node->parent = INVALID_OFFSET;
+        node->prev = INVALID_OFFSET;
+        node->next = INVALID_OFFSET;
+        node->type = type;
+        new_node_append(tree, node);
+        return node;
+}
+
+/* a free cell of the class from the block last seen with one, or from a new
+ * block */
+static int cell_alloc(struct bplus_tree *tree, int class, struct bplus_node **block)
+{
+        int i;
+        struct bplus_node *node;
+
+        if (tree->posting_cells[class] != INVALID_OFFSET) {
+                node = node_load(tree, tree->posting_cells[class]);
+        } else {
+                node = posting_new(tree, BPLUS_TREE_POSTING_CELLS);
+                cell_class(node) = class;
+        }
+        for (i = 0; bitmap_test(cell_map(node), i); i++) {
+                assert(i < _max_cells[class]);
+        }
+        bitmap_set(cell_map(node), i);
+        node->children++;
+        tree->posting_cells[class] = node->children < _max_cells[class] ? node->self : INVALID_OFFSET;
+        *block = node;
+        return i;
+}
+
+/* free the cell the data of a leaf entry refers to */
+static void cell_free(struct bplus_tree *tree, long data)
+{
+        struct bplus_node *node = node_load(tree, cell_offset(data));
+        int class = cell_class(node);
+        bitmap_clear(cell_map(node), cell_index(data));
+        node->children--;
+        if (node->children == 0) {
+                block_free(tree, node->self);
+                if (tree->posting_cells[class] == node->self) {
+                        tree->posting_cells[class] = INVALID_OFFSET;
+                }
+        } else {
+                block_write(tree, node);
+                tree->posting_cells[class] = node->self;
+        }
+        free(node);
+}
+
+/* values to a new cell of the least class they fit, the data referring to
+ * it is returned */
+static long cell_store(struct bplus_tree *tree, long *values, int count)
+{
+        struct bplus_node *node;
+        int i = cell_alloc(tree, cell_class_fit(count), &node);
+        struct posting_cell *cell = posting_cell(node, i);
+        memcpy(cell->value, values, count * sizeof(long));
+        cell->count = count;
+        block_write(tree, node);
+        long data = cell_ref(node->self, i);
+        free(node);
+        return data;
+}
+
+/* free what the data of a leaf entry refers to */
+static void posting_release(struct bplus_tree *tree, long data)
+{
+        if (!is_posting(data)) {
+                return;
+        }
+
+        if (is_cell(data)) {
+                cell_free(tree, data);
+                return;
+        }
+
+        off_t offset = chain_offset(data);
+        while (offset != INVALID_OFFSET) {
+                struct bplus_node *node = node_load(tree, offset);
+                block_free(tree, offset);
+                offset = node->next;
+                free(node);
+        }
+}
+
+static void posting_drop(struct bplus_tree *tree, key_t key)
+{
+        struct bplus_node *leaf = leaf_locate(tree, key);
+        int i = leaf != NULL ? key_search(leaf, key) : -1;
+        if (i >= 0) {
+                posting_release(tree, data(leaf)[leaf_slot(leaf, i)]);
+        }
+}
+
+static int posting_walk_release(key_t key, long data, void *arg)
+{
+        (void) key;
+        posting_release(arg, data);
+        return 0;
+}
+
+/* index of value among n sorted ones, or -(insertion point) - 1 */
+static int value_search(long *values, int n, long value)
+{
+        int low = 0, high = n - 1;
+        while (low <= high) {
+                int mid = low + (high - low) / 2;
+                if (values[mid] < value) {
+                        low = mid + 1;
+                } else if (values[mid] > value) {
+                        high = mid - 1;
+                } else {
+                        return mid;
+                }
+        }
+        return -low - 1;
+}
+
+/* the block of the chain from head where value is or belongs */
+static struct bplus_node *posting_locate(struct bplus_tree *tree, off_t head, long value)
+{
+        struct bplus_node *node = node_load(tree, head);
+        while (node->next != INVALID_OFFSET && value > values(node)[node->children - 1]) {
+                struct bplus_node *next = node_load(tree, node->next);
+                free(node);
+                node = next;
+        }
+        return node;
+}
+
+static int posting_insert(struct bplus_tree *tree, off_t head, long value)
+{
+        struct bplus_node *node = posting_locate(tree, head, value);
+        int i = value_search(values(node), node->children, value);
+        if (i >= 0) {
+                free(node);
+                return -1;
+        }
+        i = -i - 1;
+
+        if (node->children == _max_postings) {
+                /* split = [m/2], the upper half goes to a new block behind */
+                int split = node->children / 2;
+                struct bplus_node *right = posting_new(tree, BPLUS_TREE_POSTING);
+                memcpy(values(right), &values(node)[split], (node->children - split) * sizeof(long));
+                right->children = node->children - split;
+                node->children = split;
+                right->prev = node->self;
+                right->next = node->next;
+                node->next = right->self;
+                if (right->next != INVALID_OFFSET) {
+                        struct bplus_node *next = node_load(tree, right->next);
+                        next->prev = right->self;
+                        block_write(tree, next);
+                        free(next);
+                }
+                if (i > split) {
+                        block_write(tree, node);
+                        free(node);
+                        node = right;
+                        i -= split;
+                } else {
+                        block_write(tree, right);
+                        free(right);
+                }
+        }
+
+        memmove(&values(node)[i + 1], &values(node)[i], (node->children - i) * sizeof(long));
+        values(node)[i] = value;
+        node->children++;
+        block_write(tree, node);
+        free(node);
+        return 0;
+}
+
+/* Add value to a cell, a full one moves to a cell of the next class or to a
+ * chain beyond the largest. Returns the data referring to the values or 0 if
+ * value is there already */
+static long cell_insert(struct bplus_tree *tree, long data, long value)
+{
+        struct bplus_node *node = node_load(tree, cell_offset(data));
+        struct posting_cell *cell = posting_cell(node, cell_index(data));
+        int i = value_search(cell->value, cell->count, value);
+        if (i >= 0) {
+                free(node);
+                return 0;
+        }
+        i = -i - 1;
+
+        if (cell->count < cell_capacity(cell_class(node))) {
+                memmove(&cell->value[i + 1], &cell->value[i], (cell->count - i) * sizeof(long));
+                cell->value[i] = value;
+                cell->count++;
+                block_write(tree, node);
+                free(node);
+                return data;
+        }
+
+        int count = cell->count + 1;
+        long *merged = malloc(count * sizeof(long));
+        assert(merged != NULL);
+        memcpy(merged, cell->value, i * sizeof(long));
+        merged[i] = value;
+        memcpy(&merged[i + 1], &cell->value[i], (cell->count - i) * sizeof(long));
+        free(node);
+        cell_free(tree, data);
+        if (count <= cell_capacity(_cell_classes - 1)) {
+                data = cell_store(tree, merged, count);
+        } else {
+                struct bplus_node *head = posting_new(tree, BPLUS_TREE_POSTING);
+                memcpy(values(head), merged, count * sizeof(long));
+                head->children = count;
+                block_write(tree, head);
+                data = chain_ref(head->self);
+                free(head);
+        }
+        free(merged);
+        return data;
+}
+
+/* the leaf entry of key gets data, in place unless a compressed leaf grows
+ * out of its block */
+static void entry_data_store(struct bplus_tree *tree, key_t key, long data)
+{
+        struct bplus_node *leaf = leaf_locate(tree, key);
+        int i = key_search(leaf, key);
+        assert(i >= 0);
+        if (leaf_data_store(tree, leaf, i, data) != 0) {
+                bplus_tree_store(tree, key, 0);
+                bplus_tree_store(tree, key, data);
+        }
+}
+
+/* Add value to the values of key, fails if it is there already */
+int bplus_tree_append(struct bplus_tree *tree, key_t key, long value)
+{
+        if (!multi_valued() || value <= 0) {
+                return -1;
+        }
+
+        struct bplus_node *leaf = leaf_locate(tree, key);
+        int i = leaf != NULL ? key_search(leaf, key) : -1;
+        if (i < 0) {
+                int ret = bplus_tree_store(tree, key, value);
+                tree_tick(tree);
+                return ret;
+        }
+
+        long data = data(leaf)[leaf_slot(leaf, i)];
+        long ref = data;
+        if (data == value) {
+                return -1;
+        } else if (!is_posting(data)) {
+                /* the second value moves both out of the leaf */
+                long values[2];
+                values[0] = data < value ? data : value;
+                values[1] = data < value ? value : data;
+                ref = cell_store(tree, values, 2);
+        } else if (is_cell(data)) {
+                ref = cell_insert(tree, data, value);
+        } else if (posting_insert(tree, chain_offset(data), value) != 0) {
+                ref = 0;
+        }
+
+        if (ref == 0) {
+                return -1;
+        }
+        if (ref != data) {
+                entry_data_store(tree, key, ref);
+        }
+        hot_refresh(tree, key, posting_first(tree, ref));
+        tree_tick(tree);
+        return 0;
+}
+
+/* Remove value from a cell, returns the data referring to the values left
+ * or 0 if value is not there */
+static long cell_remove(struct bplus_tree *tree, long data, long value)
+{
+        struct bplus_node *node = node_load(tree, cell_offset(data));
+        struct posting_cell *cell = posting_cell(node, cell_index(data));
+        int i = value_search(cell->value, cell->count, value);
+        if (i < 0) {
+                free(node);
+                return 0;
+        }
+
+        memmove(&cell->value[i], &cell->value[i + 1], (cell->count - i - 1) * sizeof(long));
+        cell->count--;
+        if (cell->count == 1) {
+                /* the last value goes back to the leaf */
+                long last = cell->value[0];
+                free(node);
+                cell_free(tree, data);
+                return last;
+        }
+        if (cell_class(node) > 0 && cell->count <= cell_capacity(cell_class(node) - 1) / 2) {
+                /* down to a smaller class once that is half full */
+                long ref = cell_store(tree, cell->value, cell->count);
+                free(node);
+                cell_free(tree, data);
+                return ref;
+        }
+        block_write(tree, node);
+        free(node);
+        return data;
+}
+
+/* Remove value from a chain, returns the data referring to the values left
+ * or 0 if value is not there */
+static long chain_remove(struct bplus_tree *tree, long data, long value)
+{
+        off_t head = chain_offset(data);
+        struct bplus_node *node = posting_locate(tree, head, value);
+        int i = value_search(values(node), node->children, value);
+        if (i < 0) {
+                free(node);
+                return 0;
+        }
+
+        memmove(&values(node)[i], &values(node)[i + 1], (node->children - i - 1) * sizeof(long));
+        node->children--;
+        if (node->children > 0) {
+                block_write(tree, node);
+        } else {
+                /* unlink the empty block, never the only one */
+                struct bplus_node *prev = node_load(tree, node->prev == INVALID_OFFSET ? node->next : node->prev);
+                if (node->prev == INVALID_OFFSET) {
+                        head = node->next;
+                        prev->prev = INVALID_OFFSET;
+                } else {
+                        prev->next = node->next;
+                        if (node->next != INVALID_OFFSET) {
+                                struct bplus_node *next = node_load(tree, node->next);
+                                next->prev = prev->self;
+                                block_write(tree, next);
+                                free(next);
+                        }
+                }
+                block_write(tree, prev);
+                free(prev);
+                block_free(tree, node->self);
+        }
+        free(node);
+
+        /* back to a cell once the largest is half full */
+        node = node_load(tree, head);
+        if (node->next == INVALID_OFFSET && node->children <= cell_capacity(_cell_classes - 1) / 2) {
+                data = node->children == 1 ? values(node)[0] : cell_store(tree, values(node), node->children);
+                block_free(tree, head);
+        } else {
+                data = chain_ref(head);
+        }
+        free(node);
+        return data;
+}
+
+/* Remove value from the values of key, the key goes with its last value */
+int bplus_tree_remove(struct bplus_tree *tree, key_t key, long value)
+{
+        if (!multi_valued()) {
+                return -1;
+        }
+
+        struct bplus_node *leaf = leaf_locate(tree, key);
+        int i = leaf != NULL ? key_search(leaf, key) : -1;
+        if (i < 0) {
+                return -1;
+        }
+
+        long data = data(leaf)[leaf_slot(leaf, i)];
+        long ref;
+        if (!is_posting(data)) {
+                if (data != value) {
+                        return -1;
+                }
+                int ret = bplus_tree_store(tree, key, 0);
+                tree_tick(tree);
+                return ret;
+        } else if (is_cell(data)) {
+                ref = cell_remove(tree, data, value);
+        } else {
+                ref = chain_remove(tree, data, value);
+        }
+
+        if (ref == 0) {
+                return -1;
+        }
+        if (ref != data) {
+                entry_data_store(tree, key, ref);
+        }
+        hot_refresh(tree, key, posting_first(tree, ref));
+        tree_tick(tree);
+        return 0;
+}
+
+struct posting_walker {
+        struct bplus_tree *tree;
+        bplus_tree_walk_fn fn;
+        void *arg;
+        long count;
+};
+
+static int posting_walk_values(struct posting_walker *w, key_t key, long *values, int n)
+{
+        int i;
+        for (i = 0; i < n; i++) {
+                w->count++;
+                if (w->fn(key, values[i], w->arg) != 0) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/* every value of a multi-valued key is walked as an entry of its own */
+static int posting_walk_step(key_t key, long data, void *arg)
+{
+        struct posting_walker *w = arg;
+        if (!is_posting(data)) {
+                return posting_walk_values(w, key, &data, 1);
+        }
+
+        if (is_cell(data)) {
+                struct bplus_node *node = node_load(w->tree, cell_offset(data));
+                struct posting_cell *cell = posting_cell(node, cell_index(data));
+                int stop = posting_walk_values(w, key, cell->value, cell->count);
+                free(node);
+                return stop;
+        }
+
+        off_t offset = chain_offset(data);
+        while (offset != INVALID_OFFSET) {
+                struct bplus_node *node = node_load(w->tree, offset);
+                int stop = posting_walk_values(w, key, values(node), node->children);
+                offset = node->next;
+                free(node);
+                if (stop) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+int bplus_tree_put(struct bplus_tree *tree, key_t key, long data)
+{
+        int ret;
+        if (multi_valued() && data < 0) {
+                ret = -1;
+        } else {
+                if (multi_valued() && data == 0) {
+                        /* the values go with the key */
+                        posting_drop(tree, key);
+                }
+                ret = tree->memtable != NULL ? memtable_store(tree, key, data) : bplus_tree_store(tree, key, data);
+        }
+        if (tree->trace != NULL) {
+                trace_record(tree, BPLUS_TRACE_PUT, key, data, ret);
+        }
+        tree_tick(tree);
+        return ret;
+}
+
+int bplus_tree_update(struct bplus_tree *tree, key_t key, long data)
+{
+        if (data == 0 || (multi_valued() && data < 0) || (tree->bloom != NULL && !bloom_test(tree, key))) {
+                return -1;
+        }
+
+        long old;
+        if (tree->memtable != NULL) {
+                if (memtable_lookup(tree, key, &old) != 0) {
+                        return -1;
+                }
+                memtable_set(tree, key, data);
+                hot_refresh(tree, key, data);
+                tree_tick(tree);
+                return 0;
+        }
+
+        if (buffer_active(tree)) {
+                if (buffer_lookup(tree, key, &old) != 0) {
+                        return -1;
+                }
+                buffer_put(tree, key, MESSAGE_UPSERT, data);
+                hot_refresh(tree, key, data);
+                tree_tick(tree);
+                return 0;
+        }
+
+        struct bplus_node *leaf = leaf_locate(tree, key);
+        int i = leaf != NULL ? key_search(leaf, key) : -1;
+        if (i < 0) {
+                return -1;
+        }
+
+        /* overwrite in place, the only block written unless the leaf has to
+         * split, the data replaces all values */
+        posting_release(tree, data(leaf)[leaf_slot(leaf, i)]);
+        if (leaf_data_store(tree, leaf, i, data) != 0) {
+                bplus_tree_store(tree, key, 0);
+                bplus_tree_store(tree, key, data);
+        }
+        hot_refresh(tree, key, data);
+        tree_tick(tree);
+        return 0;
+}
+
+int bplus_tree_upsert(struct bplus_tree *tree, key_t key, long data)
+{
+        if (data == 0 || (multi_valued() && data < 0)) {
+                return -1;
+        }
+
+        /* no need to know whether the key exists */
+        if (tree->memtable != NULL) {
+                memtable_set(tree, key, data);
+        }
+        if (tree->memtable != NULL || buffer_put(tree, key, MESSAGE_UPSERT, data) == 0) {
+                if (tree->bloom != NULL) {
+                        bloom_add(tree, key);
+                }
+                hot_refresh(tree, key, data);
+                tree_tick(tree);
+                return 0;
+        }
+
+        struct bplus_node *leaf = leaf_locate(tree, key);
+        int i = leaf != NULL ? key_search(leaf, key) : -1;
+        if (i >= 0) {
+                posting_release(tree, data(leaf)[leaf_slot(leaf, i)]);
+                if (leaf_data_store(tree, leaf, i, data) != 0) {
+                        bplus_tree_store(tree, key, 0);
+                        bplus_tree_store(tree, key, data);
+                }
+                hot_refresh(tree, key, data);
+                tree_tick(tree);
+                return 0;
+        }
+
+        return bplus_tree_put(tree, key, data);
+}
+
+long bplus_tree_add(struct bplus_tree *tree, key_t key, long delta)
+{
+        /* values of multi-valued keys are no counters */
+        if (multi_valued()) {
+                return -1;
+        }
+
+        if (tree->memtable != NULL) {
+                long old;
+                long data = (memtable_lookup(tree, key, &old) == 0 ? old : 0) + delta;
+                if (delta != 0) {
+                        memtable_set(tree, key, data);
+                        if (data && tree->bloom != NULL) {
+                                bloom_add(tree, key);
+                        }
+                        hot_refresh(tree, key, data ? data : -1);
+                        tree_tick(tree);
+                }
+                return data;
+        }
+
+        if (buffer_active(tree)) {
+                long old;
+                long data = (buffer_lookup(tree, key, &old) == 0 ? old : 0) + delta;
+                if (delta != 0) {
+                        buffer_put(tree, key, data ? MESSAGE_UPSERT : MESSAGE_DELETE, data);
+                        if (data && tree->bloom != NULL) {
+                                bloom_add(tree, key);
+                        }
+                        hot_refresh(tree, key, data ? data : -1);
+                        tree_tick(tree);
+                }
+                return data;
+        }
+
+        struct bplus_node *leaf = leaf_locate(tree, key);
+        int i = leaf != NULL ? key_search(leaf, key) : -1;
+        if (i < 0) {
+                /* a missing counter starts from zero */
+                if (delta != 0) {
+                        bplus_tree_put(tree, key, delta);
+                }
+                return delta;
+        }
+
+        long data = data(leaf)[leaf_slot(leaf, i)] + delta;
+        if (data == 0) {
+                /* zero is not stored, the counter goes away */
+                bplus_tree_put(tree, key, 0);
+        } else if (delta != 0) {
+                if (leaf_data_store(tree, leaf, i, data) != 0) {
+                        bplus_tree_store(tree, key, 0);
+                        bplus_tree_store(tree, key, data);
+                }
+                hot_refresh(tree, key, data);
+                tree_tick(tree);
+        }
+        return data;
+}
+
+/* count of keys less than the given one, found is set if the key exists */
+static long bplus_tree_rank_search(struct bplus_tree *tree, key_t key, int *found)
+{
+        long rank = 0;
+        *found = 0;
+
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL) {
+                int i = key_search(node, key);
+                if (is_leaf(node)) {
+                        if (i >= 0) {
+                                *found = 1;
+                                rank += i;
+                        } else {
+                                rank += -i - 1;
+                        }
+                        break;
+                } else {
+                        int j;
+                        i = i >= 0 ? i + 1 : -i - 1;
+                        for (j = 0; j < i; j++) {
+                                rank += cnt(node)[j];
+                        }
+                        node = node_seek(tree, sub(node)[i]);
+                }
+        }
+
+        return rank;
+}
+
+long bplus_tree_rank(struct bplus_tree *tree, key_t key)
+{
+        int found;
+
+        if (!augmented()) {
+                return -1;
+        }
+        /* counts are kept by the tree only */
+        bplus_tree_memtable_flush(tree);
+        shared_read_begin(tree);
+        long rank = bplus_tree_rank_search(tree, key, &found);
+        shared_read_end(tree);
+        return rank;
+}
+
+long bplus_tree_count(struct bplus_tree *tree, key_t key1, key_t key2)
+{
+        int found;
+        key_t min = key1 <= key2 ? key1 : key2;
+        key_t max = min == key1 ? key2 : key1;
+
+        if (!augmented()) {
+                return -1;
+        }
+        bplus_tree_memtable_flush(tree);
+        shared_read_begin(tree);
+        long upper = bplus_tree_rank_search(tree, max, &found);
+        upper += found;
+        long lower = bplus_tree_rank_search(tree, min, &found);
+        shared_read_end(tree);
+        return upper - lower;
+}
+
+static int bplus_tree_rank_select(struct bplus_tree *tree, long rank, key_t *key, long *data)
+{
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL) {
+                int i;
+                if (is_leaf(node)) {
+                        if (rank >= node->children) {
+                                break;
+                        }
+                        *key = key(node)[leaf_slot(node, rank)];
+                        *data = posting_first(tree, data(node)[leaf_slot(node, rank)]);
+                        return 0;
+                }
+                for (i = 0; i < node->children - 1 && rank >= cnt(node)[i]; i++) {
+                        rank -= cnt(node)[i];
+                }
+                node = node_seek(tree, sub(node)[i]);
+        }
+
+        return -1;
+}
+
+int bplus_tree_select(struct bplus_tree *tree, long rank, key_t *key, long *data)
+{
+        if (!augmented() || rank < 0) {
+                return -1;
+        }
+        bplus_tree_memtable_flush(tree);
+        shared_read_begin(tree);
+        int ret = bplus_tree_rank_select(tree, rank, key, data);
+        shared_read_end(tree);
+        return ret;
+}
+
+/* entries of the leaves from min to max */
+static long tree_walk(struct bplus_tree *tree, key_t min, key_t max,
+                      bplus_tree_walk_fn fn, void *arg)
+{
+        long count = 0;
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL && !is_leaf(node)) {
+                int i = key_search(node, min);
+                if (i >= 0) {
+                        node = node_seek(tree, sub(node)[i + 1]);
+                } else {
+                        i = -i - 1;
+                        node = node_seek(tree, sub(node)[i]);
+                }
+        }
+
+        if (node != NULL) {
+                int i = key_search(node, min);
+                if (i < 0) {
+                        i = -i - 1;
+                }
+                for (; ;) {
+                        if (i >= node->children) {
+                                node = node_seek(tree, node->next);
+                                i = 0;
+                                if (node == NULL) {
+                                        break;
+                                }
+                        }
+                        int j = leaf_slot(node, i);
+                        if (key(node)[j] > max) {
+                                break;
+                        }
+                        count++;
+                        if (fn(key(node)[j], data(node)[j], arg) != 0) {
+                                break;
+                        }
+                        i++;
+                }
+        }
+
+        return count;
+}
+
+struct memtable_walker {
+        struct memtable_entry *e;
+        bplus_tree_walk_fn fn;
+        void *arg;
+        long count;
+        int stop;
+};
+
+static int memtable_walk_emit(struct memtable_walker *w, key_t key, long data)
+{
+        w->count++;
+        w->stop = w->fn(key, data, w->arg) != 0;
+        return w->stop;
+}
+
+/* entries of the memtable before key go first, then key from either side */
+static int memtable_walk_step(key_t key, long data, void *arg)
+{
+        struct memtable_walker *w = arg;
+        for (; w->e != NULL && w->e->key < key; w->e = w->e->next[0]) {
+                if (w->e->data && memtable_walk_emit(w, w->e->key, w->e->data)) {
+                        return 1;
+                }
+        }
+        if (w->e != NULL && w->e->key == key) {
+                data = w->e->data;
+                w->e = w->e->next[0];
+                if (data == 0) {
+                        return 0;
+                }
+        }
+        return memtable_walk_emit(w, key, data);
+}
+
+/* walk the leaves and the memtable together */
+static long memtable_walk(struct bplus_tree *tree, key_t min, key_t max,
+                          bplus_tree_walk_fn fn, void *arg)
+{
+        struct memtable_walker w;
+        w.e = memtable_seek(tree->memtable, min, NULL);
+        w.fn = fn;
+        w.arg = arg;
+        w.count = 0;
+        w.stop = 0;
+
+        tree_walk(tree, min, max, memtable_walk_step, &w);
+        for (; !w.stop && w.e != NULL && w.e->key <= max; w.e = w.e->next[0]) {
+                if (w.e->data) {
+                        memtable_walk_emit(&w, w.e->key, w.e->data);
+                }
+        }
+        return w.count;
+}
+
+/* walk the leaves with the values of multi-valued keys */
+static long posting_walk(struct bplus_tree *tree, key_t min, key_t max,
+                         bplus_tree_walk_fn fn, void *arg)
+{
+        struct posting_walker w;
+        w.tree = tree;
+        w.fn = fn;
+        w.arg = arg;
+        w.count = 0;
+        tree_walk(tree, min, max, posting_walk_step, &w);
+        return w.count;
+}
+
+static void subtree_free(struct bplus_tree *tree, off_t offset, int height)
+{
+        /* leaves are released without being read */
+        if (height > 0) {
+                int i;
+                struct bplus_node *node = node_load(tree, offset);
+                for (i = 0; i < node->children; i++) {
+                        subtree_free(tree, sub(node)[i], height - 1);
+                }
+                free(node);
+        }
+        block_free(tree, offset);
+}
+
+/* the leftmost and rightmost node visited at one level */
+struct range_edge {
+        off_t first;
+        off_t first_prev;
+        int first_kept;
+        off_t last;
+        off_t last_next;
+        int last_kept;
+};
+
+struct range_cutter {
+        key_t lo;
+        key_t hi;
+        int height;
+        int removed;
+        struct range_edge *edges;
+};
+
+/* Remove keys in [lo, hi] under the node, subtrees in between are freed as a
+ * whole and only the two boundary paths are visited. Returns the children left,
+ * 0 if the node has been freed, and sets count for the parent's entry */
+static int range_cut(struct bplus_tree *tree, struct range_cutter *rc, off_t offset,
+                     int depth, long *count)
+{
+        struct bplus_node *node = node_load(tree, offset);
+        struct range_edge *edge = &rc->edges[depth];
+        int dirty = 0;
+
+        /* the lo side is always visited first */
+        if (edge->first == INVALID_OFFSET) {
+                edge->first = offset;
+                edge->first_prev = node->prev;
+        }
+        edge->last = offset;
+        edge->last_next = node->next;
+
+        if (is_leaf(node)) {
+                int start = key_search(node, rc->lo);
+                int end = key_search(node, rc->hi);
+                start = start >= 0 ? start : -start - 1;
+                end = end >= 0 ? end + 1 : -end - 1;
+                if (end > start) {
+                        memmove(&key(node)[start], &key(node)[end], (node->children - end) * sizeof(key_t));
+                        memmove(&data(node)[start], &data(node)[end], (node->children - end) * sizeof(long));
+                        node->children -= end - start;
+                        rc->removed = 1;
+                        dirty = 1;
+                }
+        } else {
+                int i, kept = 0;
+                int a = child_index(node, rc->lo);
+                int b = child_index(node, rc->hi);
+                long ca = 0, cb = 0;
+
+                for (i = a + 1; i < b; i++) {
+                        subtree_free(tree, sub(node)[i], rc->height - depth - 1);
+                        rc->removed = 1;
+                }
+                int keep_a = range_cut(tree, rc, sub(node)[a], depth + 1, &ca);
+                int keep_b = b == a ? keep_a : range_cut(tree, rc, sub(node)[b], depth + 1, &cb);
+
+                /* compact the kept sub-nodes, key[i - 1] still bounds sub[i] below */
+                for (i = 0; i < node->children; i++) {
+                        if ((i == a && !keep_a) || (i > a && i < b) || (i == b && !keep_b)) {
+                                continue;
+                        }
+                        if (kept > 0) {
+                                key(node)[kept - 1] = key(node)[i - 1];
+                        }
+                        sub(node)[kept] = sub(node)[i];
+                        if (augmented()) {
+                                cnt(node)[kept] = i == a ? ca : i == b ? cb : cnt(node)[i];
+                        }
+                        kept++;
+                }
+                node->children = kept;
+                dirty = 1;
+        }
+
+        int children = node->children;
+        if (children == 0) {
+                block_free(tree, offset);
+        } else if (dirty) {
+                node_write(tree, node);
+        }
+        if (edge->first == offset) {
+                edge->first_kept = children > 0;
+        }
+        if (edge->last == offset) {
+                edge->last_kept = children > 0;
+        }
+        *count = children > 0 && augmented() ? node_count(node) : 0;
+
+        free(node);
+        return children;
+}
+
+static inline int node_underflow(struct bplus_node *node)
+{
+        if (is_leaf(node)) {
+                return node->children < (_max_entries + 1) / 2;
+        } else {
+                return node->children < (_max_order + 1) / 2;
+        }
+}
+
+/* merge sub[j + 1] into sub[j] if they fit in one node, or share their
+ * elements evenly, returns 1 if the right one has been merged and -1 if
+ * compressed leaves too wide to merge are left as they are */
+static int sibling_rebalance(struct bplus_tree *tree, struct bplus_node *parent, int j,
+                             struct bplus_node *left, struct bplus_node *right)
+{
+        int i;
+        int l = left->children;
+        int r = right->children;
+        int merge, split;
+
+        if (is_leaf(left)) {
+                merge = l + r <= _max_entries && leaf_merge_fits(left, right);
+                split = merge ? l + r : (l + r) / 2;
+                if (!merge && (split == l || !leaf_split_fits(left, right, split))) {
+                        return -1;
+                }
+                if (split > l) {
+                        memmove(&key(left)[l], &key(right)[0], (split - l) * sizeof(key_t));
+                        memmove(&data(left)[l], &data(right)[0], (split - l) * sizeof(long));
+                        memmove(&key(right)[0], &key(right)[split - l], (l + r - split) * sizeof(key_t));
+                        memmove(&data(right)[0], &data(right)[split - l], (l + r - split) * sizeof(long));
+                } else if (split < l) {
+                        memmove(&key(right)[l - split], &key(right)[0], r * sizeof(key_t));
+                        memmove(&data(right)[l - split], &data(right)[0], r * sizeof(long));
+                        memmove(&key(right)[0], &key(left)[split], (l - split) * sizeof(key_t));
+                        memmove(&data(right)[0], &data(left)[split], (l - split) * sizeof(long));
+                }
+                if (!merge) {
+                        key(parent)[j] = key(right)[0];
+                }
+        } else {
+                merge = l + r <= _max_order;
+                split = merge ? l + r : (l + r) / 2;
+                if (split > l) {
+                        /* parent key moves down and key[split - l - 1] of right moves up */
+                        key(left)[l - 1] = key(parent)[j];
+                        memmove(&key(left)[l], &key(right)[0], (split - l - 1) * sizeof(key_t));
+                        if (!merge) {
+                                key(parent)[j] = key(right)[split - l - 1];
+                                memmove(&key(right)[0], &key(right)[split - l], (l + r - split - 1) * sizeof(key_t));
+                        }
+                        sub_move(left, l, right, 0, split - l);
+                        sub_move(right, 0, right, split - l, l + r - split);
+                        for (i = l; i < split; i++) {
+                                sub_node_flush(tree, left, sub(left)[i]);
+                        }
+                } else if (split < l) {
+                        memmove(&key(right)[l - split], &key(right)[0], (r - 1) * sizeof(key_t));
+                        key(right)[l - split - 1] = key(parent)[j];
+                        memmove(&key(right)[0], &key(left)[split], (l - split - 1) * sizeof(key_t));
+                        key(parent)[j] = key(left)[split - 1];
+                        sub_move(right, l - split, right, 0, r);
+                        sub_move(right, 0, left, split, l - split);
+                        for (i = 0; i < l - split; i++) {
+                                sub_node_flush(tree, right, sub(right)[i]);
+                        }
+                }
+        }
+        left->children = split;
+        right->children = l + r - split;
+
+        if (merge) {
+                /* unlink the right node and remove it from parent */
+                struct bplus_node *next = node_fetch(tree, right->next);
+                left->next = right->next;
+                if (next != NULL) {
+                        next->prev = left->self;
+                        node_flush(tree, next);
+                }
+                block_free(tree, right->self);
+                memmove(&key(parent)[j], &key(parent)[j + 1], (parent->children - j - 2) * sizeof(key_t));
+                sub_move(parent, j + 1, parent, j + 2, parent->children - j - 2);
+                parent->children--;
+        } else {
+                sub_count_update(parent, j + 1, right);
+                node_write(tree, right);
+        }
+        sub_count_update(parent, j, left);
+        node_write(tree, left);
+        return merge;
+}
+
+/* One pass fixing underflowed nodes on the path of key from bottom up,
+ * returns non-zero if anything changed and another pass is needed */
+static int range_edge_fix(struct bplus_tree *tree, key_t key)
+{
+        int changed = 0;
+
+        /* collapse the root with a single sub-node */
+        struct bplus_node *root = node_seek(tree, tree->root);
+        while (root != NULL && !is_leaf(root) && root->children == 1) {
+                block_free(tree, root->self);
+                tree->root = sub(root)[0];
+                tree->level--;
+                root = node_fetch(tree, tree->root);
+                root->parent = INVALID_OFFSET;
+                node_flush(tree, root);
+                root = node_seek(tree, tree->root);
+                changed = 1;
+        }
+        if (root == NULL) {
+                return changed;
+        }
+
+        int depth = 0, max_depth = 0;
+        struct bplus_node **path = NULL;
+        int *index = NULL, *dirty = NULL;
+        off_t offset = tree->root;
+        for (; ;) {
+                if (depth == max_depth) {
+                        max_depth = max_depth ? max_depth * 2 : 8;
+                        path = realloc(path, max_depth * sizeof(*path));
+                        index = realloc(index, max_depth * sizeof(int));
+                        dirty = realloc(dirty, max_depth * sizeof(int));
+                        assert(path != NULL && index != NULL && dirty != NULL);
+                }
+                struct bplus_node *node = node_load(tree, offset);
+                path[depth] = node;
+                dirty[depth] = 0;
+                if (is_leaf(node)) {
+                        depth++;
+                        break;
+                }
+                index[depth] = child_index(node, key);
+                offset = sub(node)[index[depth++]];
+        }
+
+        int d;
+        for (d = depth - 1; d > 0; d--) {
+                struct bplus_node *node = path[d];
+                struct bplus_node *parent = path[d - 1];
+                int i = index[d - 1];
+                if (!node_underflow(node) || parent->children < 2) {
+                        /* written before its sub-nodes might get reparented above */
+                        if (dirty[d]) {
+                                node_write(tree, node);
+                        }
+                        continue;
+                }
+
+                /* borrow from or merge with the left sibling, the right one for the first */
+                int j = i > 0 ? i - 1 : i;
+                struct bplus_node *sibling = node_load(tree, sub(parent)[i > 0 ? j : j + 1]);
+                int ret;
+                if (i > 0) {
+                        ret = sibling_rebalance(tree, parent, j, sibling, node);
+                } else {
+                        ret = sibling_rebalance(tree, parent, j, node, sibling);
+                }
+                free(sibling);
+                if (ret < 0) {
+                        /* the leaf stays underflowed */
+                        if (dirty[d]) {
+                                node_write(tree, node);
+                        }
+                        continue;
+                }
+                dirty[d - 1] = 1;
+                changed = 1;
+        }
+
+        if (dirty[0]) {
+                node_write(tree, path[0]);
+        }
+        for (d = 0; d < depth; d++) {
+                free(path[d]);
+        }
+        free(dirty);
+        free(index);
+        free(path);
+        return changed;
+}
+
+int bplus_tree_delete_range(struct bplus_tree *tree, key_t key1, key_t key2)
+{
+        int d;
+        long count;
+        struct range_cutter rc;
+
+        rc.lo = key1 <= key2 ? key1 : key2;
+        rc.hi = rc.lo == key1 ? key2 : key1;
+        rc.removed = 0;
+        hot_invalidate_range(tree, rc.lo, rc.hi);
+        /* the range is cut out of the tree with the changes in it */
+        bplus_tree_memtable_flush(tree);
+        if (multi_valued()) {
+                tree_walk(tree, rc.lo, rc.hi, posting_walk_release, tree);
+        }
+
+        if (buffer_active(tree)) {
+                /* keys found are deleted by messages like any others */
+                long i;
+                struct key_list list;
+                list.keys = NULL;
+                list.count = 0;
+                list.size = 0;
+                buffer_walk(tree, rc.lo, rc.hi, buffer_walk_collect, &list);
+                for (i = 0; i < list.count; i++) {
+                        buffer_put(tree, list.keys[i], MESSAGE_DELETE, 0);
+                }
+                free(list.keys);
+                tree_tick(tree);
+                return list.count > 0 ? 0 : -1;
+        }
+
+        /* tree height decides which sub-nodes are leaves */
+        rc.height = 0;
+        struct bplus_node *node = node_seek(tree, tree->root);
+        if (node == NULL) {
+                return -1;
+        }
+        while (!is_leaf(node)) {
+                rc.height++;
+                node = node_seek(tree, sub(node)[0]);
+        }
+
+        rc.edges = malloc((rc.height + 1) * sizeof(struct range_edge));
+        assert(rc.edges != NULL);
+        for (d = 0; d <= rc.height; d++) {
+                rc.edges[d].first = INVALID_OFFSET;
+        }
+
+        if (range_cut(tree, &rc, tree->root, 0, &count) == 0) {
+                tree->root = INVALID_OFFSET;
+                tree->level = 0;
+        }
+
+        /* link the nodes left at both sides of every level */
+        for (d = 1; d <= rc.height; d++) {
+                struct range_edge *edge = &rc.edges[d];
+                if (edge->first == edge->last && edge->first_kept) {
+                        continue;
+                }
+                off_t left = edge->first_kept ? edge->first : edge->first_prev;
+                off_t right = edge->last_kept ? edge->last : edge->last_next;
+                node = node_fetch(tree, left);
+                if (node != NULL) {
+                        node->next = right;
+                        node_flush(tree, node);
+                }
+                node = node_fetch(tree, right);
+                if (node != NULL) {
+                        node->prev = left;
+                        node_flush(tree, node);
+                }
+        }
+        free(rc.edges);
+
+        /* rebalance along both edges of the removed range */
+        while (range_edge_fix(tree, rc.lo)) {
+                continue;
+        }
+        while (range_edge_fix(tree, rc.hi)) {
+                continue;
+        }
+
+        tree_tick(tree);
+        return rc.removed ? 0 : -1;
+}
+
+static long bplus_tree_range_search(struct bplus_tree *tree, key_t key1, key_t key2)
+{
+        long start = -1;
+        key_t min = key1 <= key2 ? key1 : key2;
+        key_t max = min == key1 ? key2 : key1;
+
+        if (tree->memtable != NULL && tree->memtable->count > 0) {
+                memtable_walk(tree, min, max, buffer_walk_last, &start);
+                return start;
+        }
+        if (multi_valued()) {
+                posting_walk(tree, min, max, buffer_walk_last, &start);
+                return start;
+        }
+        if (buffer_active(tree)) {
+                buffer_walk(tree, min, max, buffer_walk_last, &start);
+                return start;
+        }
+
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL) {
+                int i = key_search(node, min);
+                if (is_leaf(node)) {
+                        if (i < 0) {
+                                i = -i - 1;
+                                if (i >= node->children) {
+                                        node = node_seek(tree, node->next);
+                                        i = 0;
+                                }
+                        }
+                        while (node != NULL && key(node)[leaf_slot(node, i)] <= max) {
+                                start = data(node)[leaf_slot(node, i)];
+                                if (++i >= node->children) {
+                                        node = node_seek(tree, node->next);
+                                        i = 0;
+                                }
+                        }
+                        break;
+                } else {
+                        if (i >= 0) {
+                                node = node_seek(tree, sub(node)[i + 1]);
+                        } else  {
+                                i = -i - 1;
+                                node = node_seek(tree, sub(node)[i]);
+                        }
+                }
+        }
+
+        return start;
+}
+
+long bplus_tree_get_range(struct bplus_tree *tree, key_t key1, key_t key2)
+{
+        shared_read_begin(tree);
+        long ret = bplus_tree_range_search(tree, key1, key2);
+        shared_read_end(tree);
+        if (tree->trace != NULL) {
+                trace_record(tree, BPLUS_TRACE_GET_RANGE, key1, key2, ret);
+        }
+        return ret;
+}
+
+long bplus_tree_walk(struct bplus_tree *tree, key_t key1, key_t key2,
+                     bplus_tree_walk_fn fn, void *arg)
+{
+        key_t min = key1 <= key2 ? key1 : key2;
+        key_t max = min == key1 ? key2 : key1;
+
+        long count;
+
+        shared_read_begin(tree);
+        if (tree->memtable != NULL && tree->memtable->count > 0) {
+                count = memtable_walk(tree, min, max, fn, arg);
+        } else if (buffer_active(tree)) {
+                count = buffer_walk(tree, min, max, fn, arg);
+        } else if (multi_valued()) {
+                count = posting_walk(tree, min, max, fn, arg);
+        } else {
+                count = tree_walk(tree, min, max, fn, arg);
+        }
+        shared_read_end(tree);
+        return count;
+}
+
+static void index_file_name(struct bplus_tree *tree, char *buf, const char *suffix)
+{
+        /* tree->filename is the boot file name, i.e. index file name + ".boot" */
+        int len = strlen(tree->filename) - strlen(".boot");
+        memcpy(buf, tree->filename, len);
+        strcpy(buf + len, suffix);
+}
+
+/* bulk loading input beyond this many entries is sorted in runs spilled to
+ * temp files, a run takes 16 bytes an entry twice in memory */
+#define BULK_SPILL_ENTRIES (1L << 24)
+
+/* entry of bulk loading, pos keeps the input order among equal keys */
+struct bulk_entry {
+        key_t key;
+        int pos;
+        long data;
+};
+
+struct bulk_run {
+        struct bulk_entry *entries;
+        long count;
+};
+
+struct bulk_loader {
+        struct bplus_tree *tree;
+        int nr_threads;
+        key_t *keys;
+        long *data;
+        long total;
+        /* sorted runs of input chunks */
+        struct bulk_run *runs;
+        /* key range partitions merged from all runs */
+        key_t *splitters;
+        struct bulk_run *parts;
+        long *part_start;
+        long entries;
+        /* tree layout */
+        long leaves;
+        off_t base;
+        /* first entry of every leaf if compressed ones are filled by size,
+         * NULL if entries are spread evenly */
+        long *leaf_start;
+};
+
+struct bulk_task {
+        struct bulk_loader *bl;
+        int id;
+};
+
+static int bulk_entry_cmp(const void *a, const void *b)
+{
+        const struct bulk_entry *x = a;
+        const struct bulk_entry *y = b;
+        if (x->key != y->key) {
+                return x->key < y->key ? -1 : 1;
+        }
+        return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+static void *bulk_sort_run(void *arg)
+{
+        struct bulk_task *task = arg;
+        struct bulk_loader *bl = task->bl;
+        long begin = bl->total * task->id / bl->nr_threads;
+        long end = bl->total * (task->id + 1) / bl->nr_threads;
+        struct bulk_run *run = &bl->runs[task->id];
+        long i, n = 0;
+
+        run->entries = malloc((end - begin + 1) * sizeof(struct bulk_entry));
+        assert(run->entries != NULL);
+        for (i = begin; i < end; i++) {
+                run->entries[i - begin].key = bl->keys[i];
+                run->entries[i - begin].pos = i - begin;
+                run->entries[i - begin].data = bl->data[i];
+        }
+        qsort(run->entries, end - begin, sizeof(struct bulk_entry), bulk_entry_cmp);
+
+        /* the first put of a key wins like inserting one by one */
+        for (i = 0; i < end - begin; i++) {
+                if (n == 0 || run->entries[i].key != run->entries[n - 1].key) {
+                        run->entries[n++] = run->entries[i];
+                }
+        }
+        run->count = n;
+        return NULL;
+}
+
+static long bulk_lower_bound(struct bulk_run *run, key_t key)
+{
+        long low = 0, high = run->count;
+        while (low < high) {
+                long mid = low + (high - low) / 2;
+                if (run->entries[mid].key < key) {
+                        low = mid + 1;
+                } else {
+                        high = mid;
+                }
+        }
+        return low;
+}
+
+static void *bulk_merge_part(void *arg)
+{
+        struct bulk_task *task = arg;
+        struct bulk_loader *bl = task->bl;
+        int j, nr = bl->nr_threads;
+        long *cur = malloc(nr * sizeof(long));
+        long *end = malloc(nr * sizeof(long));
+        long n = 0, size = 0;
+        assert(cur != NULL && end != NULL);
+
+        /* slice every run by key range [splitters[id - 1], splitters[id]) */
+        for (j = 0; j < nr; j++) {
+                struct bulk_run *run = &bl->runs[j];
+                cur[j] = task->id == 0 ? 0 : bulk_lower_bound(run, bl->splitters[task->id - 1]);
+                end[j] = task->id == nr - 1 ? run->count : bulk_lower_bound(run, bl->splitters[task->id]);
+                size += end[j] - cur[j];
+        }
+
+        /* k-way merge, earlier runs win on equal keys */
+        struct bulk_run *part = &bl->parts[task->id];
+        part->entries = malloc((size + 1) * sizeof(struct bulk_entry));
+        assert(part->entries != NULL);
+        for (; ;) {
+                int min = -1;
+                for (j = 0; j < nr; j++) {
+                        if (cur[j] < end[j] && (min < 0 || bl->runs[j].entries[cur[j]].key < bl->runs[min].entries[cur[min]].key)) {
+                                min = j;
+                        }
+                }
+                if (min < 0) {
+                        break;
+                }
+                struct bulk_entry *e = &bl->runs[min].entries[cur[min]++];
+                if (n == 0 || part->entries[n - 1].key != e->key) {
+                        part->entries[n++] = *e;
+                }
+        }
+        part->count = n;
+
+        free(cur);
+        free(end);
+        return NULL;
+}
+
+static struct bulk_entry *bulk_entry_at(struct bulk_loader *bl, long index)
+{
+        /* locate the partition holding the global index */
+        int low = 0, high = bl->nr_threads - 1;
+        while (low < high) {
+                int mid = low + (high - low + 1) / 2;
+                if (bl->part_start[mid] <= index) {
+                        low = mid;
+                } else {
+                        high = mid - 1;
+                }
+        }
+        return &bl->parts[low].entries[index - bl->part_start[low]];
+}
+
+static inline long bulk_first_child(long node, long nodes, long children)
+{
+        /* children are spread evenly among the nodes of upper level */
+        return node * children / nodes;
+}
+
+static inline long bulk_parent(long child, long nodes, long children)
+{
+        return ((child + 1) * nodes - 1) / children;
+}
+
+static inline long bulk_leaf_first(struct bulk_loader *bl, long leaf)
+{
+        if (bl->leaf_start != NULL) {
+                return bl->leaf_start[leaf];
+        }
+        return bulk_first_child(leaf, bl->leaves, bl->entries);
+}
+
+/* compressed leaves take entries in order as long as they fit in a block */
+static void bulk_leaves_pack(struct bulk_loader *bl)
+{
+        long i, max = 1024;
+        struct pack_span span, next;
+
+        bl->leaves = 0;
+        bl->leaf_start = malloc(max * sizeof(long));
+        assert(bl->leaf_start != NULL);
+        pack_span_init(&span);
+        for (i = 0; i < bl->entries; i++) {
+                struct bulk_entry *e = bulk_entry_at(bl, i);
+                next = span;
+                pack_span_add(&next, &e->key, &e->data, 1);
+                if (span.entries == _max_entries || !pack_span_fits(&next)) {
+                        pack_span_init(&next);
+                        pack_span_add(&next, &e->key, &e->data, 1);
+                }
+                if (next.entries == 1) {
+                        if (bl->leaves + 1 == max) {
+                                max *= 2;
+                                bl->leaf_start = realloc(bl->leaf_start, max * sizeof(long));
+                                assert(bl->leaf_start != NULL);
+                        }
+                        bl->leaf_start[bl->leaves++] = i;
+                }
+                span = next;
+        }
+        bl->leaf_start[bl->leaves] = bl->entries;
+}
+
+static void *bulk_build_leaves(void *arg)
+{
+        struct bulk_task *task = arg;
+        struct bulk_loader *bl = task->bl;
+        long leaves = bl->leaves;
+        long parents = (leaves + _max_order - 1) / _max_order;
+        long begin = leaves * task->id / bl->nr_threads;
+        long end = leaves * (task->id + 1) / bl->nr_threads;
+        struct bplus_node *leaf = malloc(_node_size);
+        long i;
+        assert(leaf != NULL);
+
+        for (i = begin; i < end; i++) {
+                long first = bulk_leaf_first(bl, i);
+                long last = bulk_leaf_first(bl, i + 1);
+                long j;
+
+                memset(leaf, 0, _node_size);
+                leaf->type = BPLUS_TREE_LEAF;
+                leaf->self = bl->base + i * _block_size;
+                leaf->prev = i == 0 ? INVALID_OFFSET : leaf->self - _block_size;
+                leaf->next = i == leaves - 1 ? INVALID_OFFSET : leaf->self + _block_size;
+                /* the parents of leaves are laid out right after the leaves */
+                leaf->parent = leaves == 1 ? INVALID_OFFSET :
+                               bl->base + (leaves + bulk_parent(i, parents, leaves)) * _block_size;
+                leaf->children = last - first;
+                for (j = first; j < last; j++) {
+                        struct bulk_entry *e = bulk_entry_at(bl, j);
+                        key(leaf)[j - first] = e->key;
+                        data(leaf)[j - first] = e->data;
+                }
+                node_write(bl->tree, leaf);
+        }
+
+        free(leaf);
+        return NULL;
+}
+
+/* Build the levels above the leaves laid out from base, given the first key
+ * and the entry count of every leaf, which are overwritten level by level */
+static void bulk_build_non_leaves(struct bplus_tree *tree, off_t base, long leaves,
+                                  key_t *first_keys, long *counts)
+{
+        struct bplus_node *node = malloc(_node_size);
+        long children = leaves;
+        off_t child_base = base;
+        long i, j;
+        assert(node != NULL);
+
+        tree->level = 1;
+        while (children > 1) {
+                long nodes = (children + _max_order - 1) / _max_order;
+                long parents = (nodes + _max_order - 1) / _max_order;
+                off_t base = child_base + children * _block_size;
+
+                for (i = 0; i < nodes; i++) {
+                        long first = bulk_first_child(i, nodes, children);
+                        long last = bulk_first_child(i + 1, nodes, children);
+                        long count = 0;
+
+                        memset(node, 0, _node_size);
+                        node->type = BPLUS_TREE_NON_LEAF;
+                        node->self = base + i * _block_size;
+                        node->prev = i == 0 ? INVALID_OFFSET : node->self - _block_size;
+                        node->next = i == nodes - 1 ? INVALID_OFFSET : node->self + _block_size;
+                        node->parent = nodes == 1 ? INVALID_OFFSET :
+                                       base + (nodes + bulk_parent(i, parents, nodes)) * _block_size;
+                        node->children = last - first;
+                        for (j = first; j < last; j++) {
+                                if (j > first) {
+                                        key(node)[j - first - 1] = first_keys[j];
+                                }
+                                sub(node)[j - first] = child_base + j * _block_size;
+                                if (augmented()) {
+                                        cnt(node)[j - first] = counts[j];
+                                }
+                                count += counts[j];
+                        }
+                        node_write(tree, node);
+                        first_keys[i] = first_keys[first];
+                        counts[i] = count;
+                }
+
+                tree->level++;
+                children = nodes;
+                child_base = base;
+        }
+
+        tree->root = child_base;
+        tree->file_size = child_base + _block_size;
+        free(node);
+}
+
+static void bulk_run_threads(struct bulk_loader *bl, void *(*fn)(void *))
+{
+        int i;
+        pthread_t *threads = malloc(bl->nr_threads * sizeof(pthread_t));
+        struct bulk_task *tasks = malloc(bl->nr_threads * sizeof(struct bulk_task));
+        assert(threads != NULL && tasks != NULL);
+
+        for (i = 0; i < bl->nr_threads; i++) {
+                tasks[i].bl = bl;
+                tasks[i].id = i;
+                pthread_create(&threads[i], NULL, fn, &tasks[i]);
+        }
+        for (i = 0; i < bl->nr_threads; i++) {
+                pthread_join(threads[i], NULL);
+        }
+
+        free(tasks);
+        free(threads);
+}
+
+static void bulk_splitters_select(struct bulk_loader *bl)
+{
+        int i, j, nr = bl->nr_threads;
+        long n = 0;
+
+        /* sample every run evenly and take quantiles of the samples */
+        key_t *samples = malloc(nr * nr * sizeof(key_t) + 1);
+        assert(samples != NULL);
+        for (i = 0; i < nr; i++) {
+                struct bulk_run *run = &bl->runs[i];
+                for (j = 0; j < nr && run->count > 0; j++) {
+                        samples[n++] = run->entries[run->count * j / nr].key;
+                }
+        }
+
+        /* insertion sort is enough for nr * nr samples */
+        for (i = 1; i < n; i++) {
+                key_t k = samples[i];
+                for (j = i - 1; j >= 0 && samples[j] > k; j--) {
+                        samples[j + 1] = samples[j];
+                }
+                samples[j + 1] = k;
+        }
+
+        for (i = 1; i < nr; i++) {
+                bl->splitters[i - 1] = n > 0 ? samples[n * i / nr] : 0;
+        }
+        free(samples);
+}
+
+/* a tree of the sorted entries in the partitions */
+static void bulk_tree_build(struct bulk_loader *bl)
+{
+        /* before the leaves are written in parallel */
+        if (bl->tree->shared != NULL) {
+                shared_write_begin(bl->tree);
+        }
+
+        /* write leaves in parallel to a contiguous area at the end of file */
+        if (compressed()) {
+                bulk_leaves_pack(bl);
+        } else {
+                bl->leaves = (bl->entries + _max_entries - 1) / _max_entries;
+        }
+        bl->base = bl->tree->file_size;
+        if (bl->tree->changed != NULL) {
+                /* the change map must not be reallocated under the threads */
+                changed_map_grow(bl->tree, bl->base / _block_size + bl->leaves);
+        }
+        bulk_run_threads(bl, bulk_build_leaves);
+
+        /* non-leaf levels are much smaller, build them at last */
+        long i;
+        key_t *first_keys = malloc(bl->leaves * sizeof(key_t));
+        long *counts = malloc(bl->leaves * sizeof(long));
+        assert(first_keys != NULL && counts != NULL);
+        for (i = 0; i < bl->leaves; i++) {
+                long first = bulk_leaf_first(bl, i);
+                first_keys[i] = bulk_entry_at(bl, first)->key;
+                counts[i] = bulk_leaf_first(bl, i + 1) - first;
+        }
+        bulk_build_non_leaves(bl->tree, bl->base, bl->leaves, first_keys, counts);
+        free(counts);
+        free(first_keys);
+}
+
+/* Entries streamed in key order are written leaf after leaf at the end of
+ * the file, spread over the leaves as bulk_tree_build() does. That takes
+ * the numbers of entries and leaves of a dry run over the same stream
+ * beforehand, and only the first key and count of every leaf in memory */
+struct bulk_stream {
+        struct bplus_tree *tree;
+        /* entries and leaves are only counted */
+        int dry;
+        long entries;
+        long leaves;
+        /* found by the dry run */
+        long nr_entries;
+        long nr_leaves;
+        off_t base;
+        struct pack_span span;
+        struct bplus_node *leaf;
+        key_t *first_keys;
+        long *counts;
+};
+
+static void bulk_stream_begin(struct bulk_stream *bs, struct bplus_tree *tree, struct bulk_stream *dry)
+{
+        memset(bs, 0, sizeof(*bs));
+        bs->tree = tree;
+        bs->dry = dry == NULL;
+        pack_span_init(&bs->span);
+        if (dry != NULL) {
+                bs->nr_entries = dry->entries;
+                bs->nr_leaves = dry->leaves;
+                bs->base = tree->file_size;
+                bs->leaf = malloc(_node_size);
+                bs->first_keys = malloc((bs->nr_leaves + 1) * sizeof(key_t));
+                bs->counts = malloc((bs->nr_leaves + 1) * sizeof(long));
+                assert(bs->leaf != NULL && bs->first_keys != NULL && bs->counts != NULL);
+        }
+}
+
+static void bulk_stream_leaf_write(struct bulk_stream *bs)
+{
+        struct bplus_node *leaf = bs->leaf;
+        long i = bs->leaves - 1, leaves = bs->nr_leaves;
+        long parents = (leaves + _max_order - 1) / _max_order;
+
+        leaf->type = BPLUS_TREE_LEAF;
+        leaf->self = bs->base + i * _block_size;
+        leaf->prev = i == 0 ? INVALID_OFFSET : leaf->self - _block_size;
+        leaf->next = i == leaves - 1 ? INVALID_OFFSET : leaf->self + _block_size;
+        leaf->parent = leaves == 1 ? INVALID_OFFSET :
+                       bs->base + (leaves + bulk_parent(i, parents, leaves)) * _block_size;
+        node_write(bs->tree, leaf);
+}
+
+static void bulk_stream_add(struct bulk_stream *bs, key_t key, long data)
+{
+        int start;
+
+        /* where a new leaf starts is decided the same way in both runs */
+        if (compressed()) {
+                struct pack_span next = bs->span;
+                pack_span_add(&next, &key, &data, 1);
+                if (bs->span.entries == _max_entries || !pack_span_fits(&next)) {
+                        pack_span_init(&next);
+                        pack_span_add(&next, &key, &data, 1);
+                }
+                start = next.entries == 1;
+                bs->span = next;
+        } else if (bs->dry) {
+                start = bs->entries % _max_entries == 0;
+        } else {
+                start = bs->leaves < bs->nr_leaves &&
+                        bs->entries == bulk_first_child(bs->leaves, bs->nr_leaves, bs->nr_entries);
+        }
+
+        if (start) {
+                if (!bs->dry) {
+                        assert(bs->leaves < bs->nr_leaves);
+                        if (bs->leaves > 0) {
+                                bulk_stream_leaf_write(bs);
+                        }
+                        memset(bs->leaf, 0, _node_size);
+                        bs->first_keys[bs->leaves] = key;
+                        bs->counts[bs->leaves] = 0;
+                }
+                bs->leaves++;
+        }
+        if (!bs->dry) {
+                struct bplus_node *leaf = bs->leaf;
+                key(leaf)[leaf->children] = key;
+                data(leaf)[leaf->children++] = data;
+                bs->counts[bs->leaves - 1]++;
+        }
+        bs->entries++;
+}
+
+/* the tree written replaces the root, the old one is left to the caller */
+static void bulk_stream_end(struct bulk_stream *bs)
+{
+        if (bs->dry) {
+                return;
+        }
+        assert(bs->entries == bs->nr_entries && bs->leaves == bs->nr_leaves);
+        if (bs->leaves > 0) {
+                bulk_stream_leaf_write(bs);
+                bulk_build_non_leaves(bs->tree, bs->base, bs->leaves, bs->first_keys, bs->counts);
+        }
+        free(bs->leaf);
+        free(bs->first_keys);
+        free(bs->counts);
+}
+
+/* entries walked a chunk at a time, resuming after the last key */
+#define CURSOR_CHUNK 4096
+
+struct walk_cursor {
+        struct bplus_tree *tree;
+        key_t next;
+        key_t max;
+        int done;
+        int count;
+        int pos;
+        key_t *keys;
+        long *data;
+};
+
+static void cursor_init(struct walk_cursor *c, struct bplus_tree *tree, key_t min, key_t max)
+{
+        c->tree = tree;
+        c->next = min;
+        c->max = max;
+        c->done = min > max;
+        c->count = 0;
+        c->pos = 0;
+        c->keys = malloc(CURSOR_CHUNK * sizeof(key_t));
+        c->data = malloc(CURSOR_CHUNK * sizeof(long));
+        assert(c->keys != NULL && c->data != NULL);
+}
+
+static void cursor_free(struct walk_cursor *c)
+{
+        free(c->keys);
+        free(c->data);
+}
+
+static int cursor_chunk_add(key_t key, long data, void *arg)
+{
+        struct walk_cursor *c = arg;
+        c->keys[c->count] = key;
+        c->data[c->count++] = data;
+        return c->count == CURSOR_CHUNK;
+}
+
+/* the next chunk of entries, 0 at the end */
+static int cursor_fill(struct walk_cursor *c)
+{
+        c->count = 0;
+        c->pos = 0;
+        if (!c->done) {
+                bplus_tree_walk(c->tree, c->next, c->max, cursor_chunk_add, c);
+                if (c->count < CURSOR_CHUNK || c->keys[c->count - 1] == c->max) {
+                        c->done = 1;
+                } else {
+                        c->next = c->keys[c->count - 1] + 1;
+                }
+        }
+        return c->count;
+}
+
+static int cursor_next(struct walk_cursor *c, key_t *key, long *data)
+{
+        if (c->pos == c->count && cursor_fill(c) == 0) {
+                return -1;
+        }
+        *key = c->keys[c->pos];
+        *data = c->data[c->pos++];
+        return 0;
+}
+
+/* sort and merge input in memory into partitions of disjoint key ranges */
+static void bulk_sort(struct bulk_loader *bl, key_t *keys, long *data, long count)
+{
+        int i, nr_threads = bl->nr_threads;
+
+        bl->keys = keys;
+        bl->data = data;
+        bl->total = count;
+        bl->entries = 0;
+        bl->runs = calloc(nr_threads, sizeof(struct bulk_run));
+        bl->parts = calloc(nr_threads, sizeof(struct bulk_run));
+        bl->splitters = calloc(nr_threads, sizeof(key_t));
+        bl->part_start = calloc(nr_threads, sizeof(long));
+        assert(bl->runs != NULL && bl->parts != NULL && bl->splitters != NULL && bl->part_start != NULL);
+
+        /* sort input chunks in parallel */
+        bulk_run_threads(bl, bulk_sort_run);
+
+        /* merge runs into disjoint key ranges in parallel */
+        bulk_splitters_select(bl);
+        bulk_run_threads(bl, bulk_merge_part);
+        for (i = 0; i < nr_threads; i++) {
+                free(bl->runs[i].entries);
+                bl->part_start[i] = bl->entries;
+                bl->entries += bl->parts[i].count;
+        }
+}
+
+static void bulk_sort_free(struct bulk_loader *bl)
+{
+        int i;
+        for (i = 0; i < bl->nr_threads; i++) {
+                free(bl->parts[i].entries);
+        }
+        free(bl->runs);
+        free(bl->parts);
+        free(bl->splitters);
+        free(bl->part_start);
+        free(bl->leaf_start);
+        bl->leaf_start = NULL;
+}
+
+/* sorted run of input spilled to a temp file and its entry read last */
+struct bulk_spill {
+        FILE *fp;
+        struct bulk_entry e;
+        int has;
+};
+
+static int bulk_spill_write(struct bplus_tree *tree, struct bulk_spill *spill, struct bulk_loader *bl)
+{
+        int i;
+        char name[1024 + 16];
+
+        /* next to the index rather than in a small tmpfs */
+        index_file_name(tree, name, ".bulkXXXXXX");
+        int fd = mkstemp(name);
+        if (fd < 0) {
+                fprintf(stderr, "Failed to create a temp file for bulk loading!\n");
+                return -1;
+        }
+        unlink(name);
+        spill->fp = fdopen(fd, "w+b");
+        assert(spill->fp != NULL);
+
+        for (i = 0; i < bl->nr_threads; i++) {
+                struct bulk_run *part = &bl->parts[i];
+                if (fwrite(part->entries, sizeof(struct bulk_entry), part->count, spill->fp) != (size_t) part->count) {
+                        fprintf(stderr, "Failed to spill bulk loading input!\n");
+                        return -1;
+                }
+        }
+        return fflush(spill->fp);
+}
+
+static void bulk_spill_read(struct bulk_spill *spill)
+{
+        spill->has = fread(&spill->e, sizeof(spill->e), 1, spill->fp) == 1;
+}
+
+/* k-way merge of the runs, earlier runs win on equal keys */
+static void bulk_spill_merge(struct bulk_stream *bs, struct bulk_spill *spills, int nr)
+{
+        int j;
+
+        for (j = 0; j < nr; j++) {
+                rewind(spills[j].fp);
+                bulk_spill_read(&spills[j]);
+        }
+        for (; ;) {
+                int min = -1;
+                for (j = 0; j < nr; j++) {
+                        if (spills[j].has && (min < 0 || spills[j].e.key < spills[min].e.key)) {
+                                min = j;
+                        }
+                }
+                if (min < 0) {
+                        break;
+                }
+                key_t key = spills[min].e.key;
+                bulk_stream_add(bs, key, spills[min].e.data);
+                for (j = min; j < nr; j++) {
+                        while (spills[j].has && spills[j].e.key == key) {
+                                bulk_spill_read(&spills[j]);
+                        }
+                }
+        }
+}
+
+/* Input beyond the spill threshold is sorted in runs of that many entries,
+ * each spilled to a temp file, and the runs are merged into leaves written
+ * one after another */
+static int bulk_load_spilled(struct bulk_loader *bl, key_t *keys, long *data, long count)
+{
+        long i, limit = bl->tree->bulk_spill;
+        int j, nr = (count + limit - 1) / limit, ret = 0;
+        struct bulk_stream dry, bs;
+
+        struct bulk_spill *spills = calloc(nr, sizeof(*spills));
+        assert(spills != NULL);
+        for (j = 0, i = 0; j < nr && ret == 0; j++, i += limit) {
+                bulk_sort(bl, keys + i, data + i, count - i < limit ? count - i : limit);
+                ret = bulk_spill_write(bl->tree, &spills[j], bl);
+                bulk_sort_free(bl);
+        }
+
+        if (ret == 0) {
+                bulk_stream_begin(&dry, bl->tree, NULL);
+                bulk_spill_merge(&dry, spills, nr);
+                bulk_stream_end(&dry);
+                bulk_stream_begin(&bs, bl->tree, &dry);
+                bulk_spill_merge(&bs, spills, nr);
+                bulk_stream_end(&bs);
+        }
+
+        for (j = 0; j < nr; j++) {
+                if (spills[j].fp != NULL) {
+                        fclose(spills[j].fp);
+                }
+        }
+        free(spills);
+        return ret == 0 ? 0 : -1;
+}
+
+/* Load count entries in any order into an empty tree, the first put of a key
+ * wins. Input is sorted by nr_threads in parallel, in memory up to the spill
+ * threshold of bplus_tree_bulk_spill_enable() and in runs spilled to temp
+ * files beyond it */
+int bplus_tree_bulk_load(struct bplus_tree *tree, key_t *keys, long *data, long count, int nr_threads)
+{
+        struct bulk_loader bl;
+
+        bplus_tree_memtable_flush(tree);
+        if (tree->root != INVALID_OFFSET) {
+                fprintf(stderr, "Bulk loading requires an empty tree!\n");
+                return -1;
+        }
+
+        if (count <= 0) {
+                return 0;
+        }
+
+        if (multi_valued()) {
+                long j;
+                for (j = 0; j < count; j++) {
+                        if (data[j] <= 0) {
+                                fprintf(stderr, "Values of multi-valued keys must be positive!\n");
+                                return -1;
+                        }
+                }
+        }
+
+        /* absent keys may have been cached */
+        hot_invalidate_range(tree, INT_MIN, INT_MAX);
+
+        if (nr_threads <= 0) {
+                nr_threads = 1;
+        }
+        /* every chunk of input should be larger than the position in it */
+        while (count / nr_threads > 0x7fffffff) {
+                nr_threads++;
+        }
+
+        memset(&bl, 0, sizeof(bl));
+        bl.tree = tree;
+        bl.nr_threads = nr_threads;
+        if (tree->bulk_spill > 0 && count > tree->bulk_spill) {
+                if (bulk_load_spilled(&bl, keys, data, count) != 0) {
+                        return -1;
+                }
+        } else {
+                bulk_sort(&bl, keys, data, count);
+                bulk_tree_build(&bl);
+                bulk_sort_free(&bl);
+        }
+
+        if (tree->bloom != NULL) {
+                bplus_tree_bloom_rebuild(tree);
+        }
+
+        replica_commit(tree);
+        shared_commit(tree);
+        return 0;
+}
+
+/* Sort at most entries of bulk loading input in memory at a time, 0 for any
+ * input however large */
+int bplus_tree_bulk_spill_enable(struct bplus_tree *tree, long entries)
+{
+        tree->bulk_spill = entries > 0 ? entries : 0;
+        return 0;
+}
+
+/* a merge applies changes leaf by leaf unless there are this many for every
+ * block of dst, when most leaves would be written anyway and dst is rebuilt
+ * with full ones */
+#define MERGE_REBUILD_CHANGES 8
+
+/* blocks of the file neither free nor out of use */
+static long tree_blocks(struct bplus_tree *tree)
+{
+        long blocks = tree->file_size / _block_size;
+        struct list_head *pos;
+        list_for_each(pos, &tree->free_blocks) {
+                blocks--;
+        }
+        return blocks;
+}
+
+/* both trees in key order, src takes over keys in both, returns the
+ * entries of src */
+static long merge_stream(struct bulk_stream *bs, struct bplus_tree *dst, struct bplus_tree *src)
+{
+        key_t k1 = 0, k2 = 0;
+        long d1 = 0, d2 = 0, count = 0;
+        struct walk_cursor old, new;
+
+        cursor_init(&old, dst, INT_MIN, INT_MAX);
+        cursor_init(&new, src, INT_MIN, INT_MAX);
+        int has_old = cursor_next(&old, &k1, &d1) == 0;
+        int has_new = cursor_next(&new, &k2, &d2) == 0;
+        while (has_old || has_new) {
+                if (!has_new || (has_old && k1 < k2)) {
+                        bulk_stream_add(bs, k1, d1);
+                        has_old = cursor_next(&old, &k1, &d1) == 0;
+                } else {
+                        if (has_old && k1 == k2) {
+                                has_old = cursor_next(&old, &k1, &d1) == 0;
+                        }
+                        bulk_stream_add(bs, k2, d2);
+                        has_new = cursor_next(&new, &k2, &d2) == 0;
+                        count++;
+                }
+        }
+        cursor_free(&old);
+        cursor_free(&new);
+        return count;
+}
+
+/* Both trees stream in key order into a new one written at the end of the
+ * file, blocks of the old tree are freed afterwards */
+static long merge_rebuild(struct bplus_tree *dst, struct bplus_tree *src)
+{
+        long count = 0;
+        struct bulk_stream dry, bs;
+
+        bulk_stream_begin(&dry, dst, NULL);
+        merge_stream(&dry, dst, src);
+        bulk_stream_end(&dry);
+
+        /* tree height decides which sub-nodes are leaves */
+        int height = 0;
+        off_t root = dst->root;
+        struct bplus_node *node = node_seek(dst, root);
+        while (node != NULL && !is_leaf(node)) {
+                height++;
+                node = node_seek(dst, sub(node)[0]);
+        }
+
+        if (dry.entries > 0) {
+                /* the old tree is read until the new one takes over */
+                bulk_stream_begin(&bs, dst, &dry);
+                count = merge_stream(&bs, dst, src);
+                bulk_stream_end(&bs);
+        } else {
+                dst->root = INVALID_OFFSET;
+                dst->level = 0;
+        }
+        if (node != NULL) {
+                subtree_free(dst, root, height);
+        }
+        return count;
+}
+
+static int merge_count(key_t key, long data, void *arg)
+{
+        long *left = arg;
+        (void) key;
+        (void) data;
+        return --*left <= 0;
+}
+
+static int merge_append(key_t key, long data, void *arg)
+{
+        bplus_tree_append(arg, key, data);
+        return 0;
+}
+
+/* Merge the entries of src into dst, where src takes over keys in both, and
+ * returns the entries merged. Values of multi-valued keys are added to those
+ * of dst. Both trees must have the same format and block size. Neither tree
+ * is held in memory, src is walked a chunk at a time */
+long bplus_tree_merge(struct bplus_tree *dst, struct bplus_tree *src)
+{
+        long i, count = 0;
+        struct walk_cursor c;
+
+        if (dst == src || (src->flags & FORMAT_FLAGS) != (dst->flags & FORMAT_FLAGS) ||
+            src->block_size != dst->block_size) {
+                fprintf(stderr, "Trees to merge must differ and share a format and block size!\n");
+                return -1;
+        }
+
+        bplus_tree_memtable_flush(dst);
+        /* src is walked more than once, as of one operation of its writer
+         * if it is shared */
+        shared_read_begin(src);
+        /* as many changes as to rebuild dst are counted at most */
+        long changes = MERGE_REBUILD_CHANGES * tree_blocks(dst);
+        if (changes > 0 && !multi_valued()) {
+                long left = changes;
+                changes -= bplus_tree_walk(src, INT_MIN, INT_MAX, merge_count, &left);
+        }
+
+        /* readers of other processes see the calls below as one */
+        shared_hold(dst, 1);
+        if (multi_valued()) {
+                count = bplus_tree_walk(src, INT_MIN, INT_MAX, merge_append, dst);
+        } else if (changes <= 0) {
+                count = merge_rebuild(dst, src);
+                hot_invalidate_range(dst, INT_MIN, INT_MAX);
+                if (dst->bloom != NULL) {
+                        bplus_tree_bloom_rebuild(dst);
+                }
+        } else {
+                cursor_init(&c, src, INT_MIN, INT_MAX);
+                while (cursor_fill(&c) > 0) {
+                        if (buffered()) {
+                                /* changes are batched by the buffers anyway */
+                                for (i = 0; i < c.count; i++) {
+                                        bplus_tree_upsert(dst, c.keys[i], c.data[i]);
+                                }
+                        } else {
+                                for (i = 0; i < c.count; ) {
+                                        i += leaf_run_apply(dst, &c.keys[i], &c.data[i], c.count - i);
+                                }
+                                for (i = 0; i < c.count; i++) {
+                                        if (dst->bloom != NULL) {
+                                                bloom_add(dst, c.keys[i]);
+                                        }
+                                        hot_refresh(dst, c.keys[i], c.data[i]);
+                                }
+                        }
+                        count += c.count;
+                }
+                cursor_free(&c);
+        }
+
+        shared_hold(dst, 0);
+        shared_read_end(src);
+        tree_tick(dst);
+        return count;
+}
+
+int bplus_open(char *filename)
+{
+        return open(filename, O_CREAT | O_RDWR, 0644);
+}
+
+void bplus_close(int fd)
+{
+        fsync(fd);
+        close(fd);
+}
+
+static off_t str_to_hex(char *c, int len)
+{
+        off_t offset = 0;
+        while (len-- > 0) {
+                if (isdigit(*c)) {
+                        offset = offset * 16 + *c - '0';
+                } else if (isxdigit(*c)) {
+                        if (islower(*c)) {
+                                offset = offset * 16 + *c - 'a' + 10;
+                        } else {
+                                offset = offset * 16 + *c - 'A' + 10;
+                        }
+                }
+                c++;
+        }
+        return offset;
+}
+
+static inline void hex_to_str(off_t offset, char *buf, int len)
+{
+        const static char *hex = "0123456789ABCDEF";
+        while (len-- > 0) {
+                buf[len] = hex[offset & 0xf];
+                offset >>= 4;
+        }
+}
+
+static inline off_t offset_load(int fd)
+{
+        char buf[ADDR_STR_WIDTH];
+        ssize_t len = read(fd, buf, sizeof(buf));
+        return len > 0 ? str_to_hex(buf, sizeof(buf)) : INVALID_OFFSET;
+}
+
+static inline ssize_t offset_store(int fd, off_t offset)
+{
+        char buf[ADDR_STR_WIDTH];
+        hex_to_str(offset, buf, sizeof(buf));
+        return write(fd, buf, sizeof(buf));
+}
+
+static inline void offset_write(int fd, off_t offset)
+{
+        ssize_t len = offset_store(fd, offset);
+        assert(len == ADDR_STR_WIDTH);
+}
+
+/* format flags are kept in the upper half of the block size field */
+static inline off_t boot_config(void)
+{
+        return (off_t) _format_flags << 32 | _block_size;
+}
+
+static void boot_write(struct bplus_tree *tree, int fd)
+{
+        offset_write(fd, tree->root);
+        offset_write(fd, boot_config());
+        offset_write(fd, tree->file_size);
+
+        /* store free blocks in files for future reuse */
+        struct list_head *pos;
+        list_for_each(pos, &tree->free_blocks) {
+                struct free_block *block = list_entry(pos, struct free_block, link);
+                offset_write(fd, block->offset);
+        }
+}
+
+/* replace the boot file at once so that it never holds half a state */
+static void boot_save(struct bplus_tree *tree, char *boot)
+{
+        char tmp[1024 + 16];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", boot);
+
+        int fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        assert(fd >= 0);
+        boot_write(tree, fd);
+        fsync(fd);
+        close(fd);
+        int ret = rename(tmp, boot);
+        assert(ret == 0);
+}
+
+static void boot_store(struct bplus_tree *tree)
+{
+        boot_save(tree, tree->filename);
+}
+
+/* In write-back mode blocks are written in place after a checkpoint too,
+ * so the image a block has at the checkpoint is saved to the undo file
+ * before it is first overwritten. The undo file begins with the count of
+ * offsets of the boot file of the checkpoint and the boot file itself, and
+ * is replaced at once by the next checkpoint, which is taken thereby. After
+ * a crash the index is rolled back to it when opened */
+static void undo_reset(struct bplus_tree *tree)
+{
+        char name[1024 + 16], tmp[1024 + 32];
+        struct bplus_writeback *wb = tree->wb;
+        struct list_head *pos;
+        long count = 3;
+
+        index_file_name(tree, name, ".undo");
+        snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+        int fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        assert(fd >= 0);
+        list_for_each(pos, &tree->free_blocks) {
+                count++;
+        }
+        offset_write(fd, count);
+        boot_write(tree, fd);
+        fsync(fd);
+        int ret = rename(tmp, name);
+        assert(ret == 0);
+
+        if (wb->undo_fd >= 0) {
+                close(wb->undo_fd);
+        }
+        wb->undo_fd = fd;
+        /* blocks beyond the checkpoint are cut off instead */
+        wb->undo_blocks = tree->file_size / _block_size;
+        free(wb->undone);
+        wb->undone = calloc(wb->undo_blocks / 8 + 1, 1);
+        assert(wb->undone != NULL);
+}
+
+/* save the images on disk of the blocks of a chunk about to be written
+ * which are overwritten first since the checkpoint, before they are */
+static void undo_save(struct bplus_tree *tree, off_t *offsets, long *seqs, long m)
+{
+        long j, saved = 0;
+        struct bplus_writeback *wb = tree->wb;
+
+        for (j = 0; j < m; j++) {
+                long b = offsets[j] / _block_size;
+                if (seqs[j] < 0 || b >= wb->undo_blocks || (wb->undone[b / 8] & (1 << b % 8))) {
+                        continue;
+                }
+                hex_to_str(offsets[j], wb->undo_buf, ADDR_STR_WIDTH);
+                long len = pread(tree->fd, wb->undo_buf + ADDR_STR_WIDTH, _block_size, offsets[j]);
+                assert(len == _block_size);
+                len = write(wb->undo_fd, wb->undo_buf, ADDR_STR_WIDTH + _block_size);
+                assert(len == ADDR_STR_WIDTH + _block_size);
+                wb->undone[b / 8] |= 1 << b % 8;
+                saved++;
+        }
+        if (saved > 0) {
+                fdatasync(wb->undo_fd);
+        }
+}
+
+/* Roll the index back to the checkpoint of an undo file left behind and
+ * put the boot file of it in place. A record cut short at the end was
+ * never followed by its block being written */
+static int undo_recover(char *filename)
+{
+        char name[1024 + 16], tmp[1024 + 32];
+        long i;
+
+        snprintf(name, sizeof(name), "%s.undo", filename);
+        int fd = open(name, O_RDONLY);
+        if (fd < 0) {
+                return 0;
+        }
+
+        off_t count = offset_load(fd);
+        off_t *boot = count >= 3 && count < (1L << 32) ? malloc(count * sizeof(off_t)) : NULL;
+        for (i = 0; boot != NULL && i < count; i++) {
+                boot[i] = offset_load(fd);
+        }
+        int block_size = boot != NULL ? boot[1] & 0xffffffff : 0;
+        int data_fd = open(filename, O_RDWR);
+        if (boot == NULL || block_size <= 0 || (block_size & (block_size - 1)) != 0 || data_fd < 0) {
+                fprintf(stderr, "Undo file %s of the index unreadable!\n", name);
+                if (data_fd >= 0) {
+                        close(data_fd);
+                }
+                free(boot);
+                close(fd);
+                return -1;
+        }
+
+        int ret = 0;
+        char *buf = malloc(ADDR_STR_WIDTH + block_size);
+        assert(buf != NULL);
+        while (read(fd, buf, ADDR_STR_WIDTH + block_size) == ADDR_STR_WIDTH + block_size) {
+                off_t offset = str_to_hex(buf, ADDR_STR_WIDTH);
+                if (pwrite(data_fd, buf + ADDR_STR_WIDTH, block_size, offset) != block_size) {
+                        ret = -1;
+                        break;
+                }
+        }
+        if (ret != 0 || ftruncate(data_fd, boot[2]) != 0 || fsync(data_fd) != 0) {
+                ret = -1;
+        }
+        free(buf);
+        close(data_fd);
+        close(fd);
+
+        /* the undo file goes once the boot file of the checkpoint is back */
+        char boot_name[1024 + 16];
+        snprintf(boot_name, sizeof(boot_name), "%s.boot", filename);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", boot_name);
+        int boot_fd = ret == 0 ? open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644) : -1;
+        if (boot_fd >= 0) {
+                for (i = 0; i < count; i++) {
+                        offset_write(boot_fd, boot[i]);
+                }
+                if (fsync(boot_fd) != 0) {
+                        ret = -1;
+                }
+                close(boot_fd);
+                if (ret != 0 || rename(tmp, boot_name) != 0) {
+                        unlink(tmp);
+                        ret = -1;
+                }
+        } else {
+                ret = -1;
+        }
+        if (ret == 0) {
+                unlink(name);
+        } else {
+                fprintf(stderr, "Failed to roll the index back with undo file %s!\n", name);
+        }
+        free(boot);
+        return ret;
+}
+
+static int offset_cmp(const void *a, const void *b)
+{
+        off_t x = *(off_t *) a, y = *(off_t *) b;
+        return x < y ? -1 : x > y;
+}
+
+/* Write up to max of the blocks dirty at the beginning of the pass in
+ * offset order, runs of adjacent blocks at once. Chunks are written one at
+ * a time, their images copied out under the lock and only dropped if not
+ * modified meanwhile. Returns blocks still dirty */
+static long dirty_flush(struct bplus_tree *tree, long max)
+{
+        long i, j, k, n = 0;
+        long seqs[WRITEBACK_CHUNK_BLOCKS];
+        struct bplus_writeback *wb = tree->wb;
+
+        pthread_mutex_lock(&wb->lock);
+        off_t *offsets = malloc((wb->dirty + 1) * sizeof(*offsets));
+        assert(offsets != NULL);
+        for (i = 0; i <= wb->mask; i++) {
+                struct dirty_block *block;
+                for (block = wb->table[i]; block != NULL; block = block->next) {
+                        offsets[n++] = block->offset;
+                }
+        }
+        pthread_mutex_unlock(&wb->lock);
+
+        qsort(offsets, n, sizeof(*offsets), offset_cmp);
+        if (n > max) {
+                n = max;
+        }
+        for (i = 0; i < n; i += WRITEBACK_CHUNK_BLOCKS) {
+                long m = n - i < WRITEBACK_CHUNK_BLOCKS ? n - i : WRITEBACK_CHUNK_BLOCKS;
+                off_t *chunk = offsets + i;
+
+                /* an older image must not be written over a newer one */
+                pthread_mutex_lock(&wb->flush_lock);
+                for (j = 0; j < m; j++) {
+                        /* locked per block not to stall readers of the table */
+                        pthread_mutex_lock(&wb->lock);
+                        /* blocks may have been flushed by another pass */
+                        struct dirty_block *block = dirty_find(wb, chunk[j]);
+                        if (block != NULL) {
+                                memcpy(wb->staging + j * _block_size, block->buf, _block_size);
+                                seqs[j] = block->seq;
+                        } else {
+                                seqs[j] = -1;
+                        }
+                        pthread_mutex_unlock(&wb->lock);
+                }
+                undo_save(tree, chunk, seqs, m);
+
+                for (j = 0; j < m; j = k) {
+                        if (seqs[j] < 0) {
+                                k = j + 1;
+                                continue;
+                        }
+                        for (k = j + 1; k < m && seqs[k] >= 0 && chunk[k] == chunk[k - 1] + _block_size; k++) {
+                                continue;
+                        }
+                        long len = pwrite(tree->fd, wb->staging + j * _block_size, (k - j) * _block_size, chunk[j]);
+                        assert(len == (k - j) * _block_size);
+                        __atomic_add_fetch(&tree->written_blocks, k - j, __ATOMIC_RELAXED);
+                }
+
+                pthread_mutex_lock(&wb->lock);
+                for (j = 0; j < m; j++) {
+                        struct dirty_block *block = dirty_find(wb, chunk[j]);
+                        if (block != NULL && block->seq == seqs[j]) {
+                                dirty_remove(wb, block);
+                        }
+                }
+                pthread_mutex_unlock(&wb->lock);
+                pthread_mutex_unlock(&wb->flush_lock);
+        }
+        free(offsets);
+
+        pthread_mutex_lock(&wb->lock);
+        n = wb->dirty;
+        pthread_mutex_unlock(&wb->lock);
+        return n;
+}
+
+/* write every dirty block, no other thread may modify the tree */
+static void writeback_drain(struct bplus_tree *tree)
+{
+        if (tree->wb != NULL) {
+                while (dirty_flush(tree, LONG_MAX) > 0) {
+                        continue;
+                }
+        }
+}
+
+/* The table is flushed down to a quarter once it is half full, and as a
+ * whole after the flush interval, whichever comes first */
+static void *writeback_flusher(void *arg)
+{
+        struct bplus_tree *tree = arg;
+        struct bplus_writeback *wb = tree->wb;
+
+        pthread_mutex_lock(&wb->lock);
+        while (!wb->quit) {
+                long max = LONG_MAX;
+                if (wb->dirty >= wb->max_dirty / 2) {
+                        max = wb->dirty - wb->max_dirty / 4;
+                } else {
+                        struct timespec due;
+                        clock_gettime(CLOCK_REALTIME, &due);
+                        due.tv_sec += wb->flush_ms / 1000;
+                        due.tv_nsec += (wb->flush_ms % 1000) * 1000000L;
+                        if (due.tv_nsec >= 1000000000L) {
+                                due.tv_sec++;
+                                due.tv_nsec -= 1000000000L;
+                        }
+                        pthread_cond_timedwait(&wb->wakeup, &wb->lock, &due);
+                }
+                if (!wb->quit && wb->dirty > 0) {
+                        pthread_mutex_unlock(&wb->lock);
+                        dirty_flush(tree, max);
+                        pthread_mutex_lock(&wb->lock);
+                }
+        }
+        pthread_mutex_unlock(&wb->lock);
+        return NULL;
+}
+
+int bplus_tree_checkpoint(struct bplus_tree *tree)
+{
+        bplus_tree_memtable_flush(tree);
+        writeback_drain(tree);
+        fsync(tree->fd);
+        if (tree->wb != NULL) {
+                /* not while a flush pass saves blocks of the last one */
+                pthread_mutex_lock(&tree->wb->flush_lock);
+                undo_reset(tree);
+                pthread_mutex_unlock(&tree->wb->flush_lock);
+                clock_gettime(CLOCK_MONOTONIC, &tree->wb->checkpoint);
+        }
+        boot_store(tree);
+        return 0;
+}
+
+/* called between operations, when the tree is consistent to be committed
+ * to a follower and checkpointed once it is due */
+static void tree_tick(struct bplus_tree *tree)
+{
+        struct timespec now;
+        struct bplus_writeback *wb = tree->wb;
+
+        replica_commit(tree);
+        shared_commit(tree);
+
+        if (wb == NULL || wb->checkpoint_ms <= 0) {
+                return;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (now.tv_sec - wb->checkpoint.tv_sec) * 1000 + (now.tv_nsec - wb->checkpoint.tv_nsec) / 1000000;
+        if (ms >= wb->checkpoint_ms) {
+                bplus_tree_checkpoint(tree);
+        }
+}
+
+static void writeback_disable(struct bplus_tree *tree)
+{
+        struct bplus_writeback *wb = tree->wb;
+
+        pthread_mutex_lock(&wb->lock);
+        wb->quit = 1;
+        pthread_cond_signal(&wb->wakeup);
+        pthread_mutex_unlock(&wb->lock);
+        pthread_join(wb->flusher, NULL);
+
+        /* blocks are written in place from now on, the undo file is of
+         * no use past the checkpoint taken here */
+        bplus_tree_checkpoint(tree);
+        char name[1024 + 16];
+        index_file_name(tree, name, ".undo");
+        close(wb->undo_fd);
+        unlink(name);
+        tree->wb = NULL;
+        pthread_mutex_destroy(&wb->lock);
+        pthread_mutex_destroy(&wb->flush_lock);
+        pthread_cond_destroy(&wb->wakeup);
+        free(wb->table);
+        free(wb->pool);
+        free(wb->staging);
+        free(wb->undone);
+        free(wb->undo_buf);
+        free(wb);
+}
+
+int bplus_tree_writeback_enable(struct bplus_tree *tree, long dirty_bytes, int flush_ms, int checkpoint_ms)
+{
+        if (tree->wb != NULL) {
+                writeback_disable(tree);
+        }
+        if (dirty_bytes <= 0) {
+                return 0;
+        }
+        if (tree->shared != NULL) {
+                fprintf(stderr, "Blocks written back in background cannot be shared!\n");
+                return -1;
+        }
+
+        struct bplus_writeback *wb = calloc(1, sizeof(*wb));
+        assert(wb != NULL);
+        wb->max_dirty = dirty_bytes / _block_size;
+        if (wb->max_dirty < MIN_CACHE_NUM) {
+                /* a split dirties a handful of blocks at once */
+                wb->max_dirty = MIN_CACHE_NUM;
+        }
+        long n = 1;
+        while (n < wb->max_dirty) {
+                n <<= 1;
+        }
+        wb->mask = n - 1;
+        wb->table = calloc(n, sizeof(*wb->table));
+        wb->pool = malloc(wb->max_dirty * (sizeof(struct dirty_block) + _block_size));
+        wb->staging = malloc((long) WRITEBACK_CHUNK_BLOCKS * _block_size);
+        wb->undo_buf = malloc(ADDR_STR_WIDTH + _block_size);
+        if (wb->table == NULL || wb->pool == NULL || wb->staging == NULL || wb->undo_buf == NULL) {
+                fprintf(stderr, "Failed to allocate dirty block table!\n");
+                free(wb->table);
+                free(wb->pool);
+                free(wb->staging);
+                free(wb->undo_buf);
+                free(wb);
+                return -1;
+        }
+        for (n = 0; n < wb->max_dirty; n++) {
+                struct dirty_block *block = (struct dirty_block *)
+                        (wb->pool + n * (sizeof(struct dirty_block) + _block_size));
+                block->next = wb->free_list;
+                wb->free_list = block;
+        }
+        wb->flush_ms = flush_ms > 0 ? flush_ms : 1;
+        wb->checkpoint_ms = checkpoint_ms;
+        clock_gettime(CLOCK_MONOTONIC, &wb->checkpoint);
+        pthread_mutex_init(&wb->lock, NULL);
+        pthread_mutex_init(&wb->flush_lock, NULL);
+        pthread_cond_init(&wb->wakeup, NULL);
+
+        tree->wb = wb;
+        /* what is on disk already is the first checkpoint */
+        wb->undo_fd = -1;
+        bplus_tree_checkpoint(tree);
+        pthread_create(&wb->flusher, NULL, writeback_flusher, tree);
+        return 0;
+}
+
+static void bloom_load(struct bplus_tree *tree)
+{
+        char name[1024 + 16];
+        index_file_name(tree, name, ".bloom");
+        int fd = open(name, O_RDONLY);
+        if (fd < 0) {
+                return;
+        }
+
+        off_t bits = offset_load(fd);
+        off_t hashes = offset_load(fd);
+        if (bits != INVALID_OFFSET && hashes != INVALID_OFFSET) {
+                long len = (bits + 7) / 8;
+                tree->bloom_bits = bits;
+                tree->bloom_hashes = hashes;
+                tree->bloom = malloc(len);
+                assert(tree->bloom != NULL);
+                if (read(fd, tree->bloom, len) != len) {
+                        free(tree->bloom);
+                        tree->bloom = NULL;
+                }
+        }
+        close(fd);
+}
+
+static void bloom_store(struct bplus_tree *tree)
+{
+        char name[1024 + 16];
+        index_file_name(tree, name, ".bloom");
+        if (tree->bloom == NULL) {
+                unlink(name);
+                return;
+        }
+
+        long len = (tree->bloom_bits + 7) / 8;
+        int fd = open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        assert(fd >= 0);
+        offset_write(fd, tree->bloom_bits);
+        offset_write(fd, tree->bloom_hashes);
+        ssize_t size = write(fd, tree->bloom, len);
+        assert(size == len);
+        fsync(fd);
+        close(fd);
+}
+
+/* how a block was looked up, a byte for each in the manifest map */
+enum {
+        /* since the manifest was saved last */
+        MANIFEST_READ = 1,
+        /* before that */
+        MANIFEST_RECENT = 2,
+        /* as a non-leaf node */
+        MANIFEST_UPPER = 4,
+};
+
+/* blocks read at once and threads reading them while warming up */
+#define WARMUP_RUN_BLOCKS 64
+#define WARMUP_THREADS 4
+
+struct bplus_manifest {
+        /* guards the map against growing and aging while saved */
+        pthread_mutex_t lock;
+        pthread_cond_t wakeup;
+        pthread_t saver;
+        int save_ms;
+        int quit;
+        unsigned char *map;
+        long blocks;
+};
+
+struct bplus_warmup {
+        pthread_t thread;
+        int fd;
+        /* upper levels and then the rest, each in offset order */
+        off_t *offsets;
+        long upper;
+        long count;
+        /* runs of adjacent blocks of the batch being read */
+        long *runs;
+        long nr_runs;
+        long next_run;
+        long blocks;
+};
+
+static void manifest_mark(struct bplus_tree *tree, struct bplus_node *node, off_t offset)
+{
+        struct bplus_manifest *m = tree->manifest;
+        long block = offset / _block_size;
+        unsigned char bits = MANIFEST_READ | (node->type == BPLUS_TREE_NON_LEAF ? MANIFEST_UPPER : 0);
+
+        /* mostly marked already in this period, the saver ages the map
+         * under the lock otherwise */
+        if (block < m->blocks &&
+            (__atomic_load_n(&m->map[block], __ATOMIC_RELAXED) & (MANIFEST_READ | MANIFEST_UPPER)) == bits) {
+                return;
+        }
+
+        pthread_mutex_lock(&m->lock);
+        if (block >= m->blocks) {
+                long n = m->blocks > 0 ? m->blocks : 1024;
+                while (n <= block) {
+                        n *= 2;
+                }
+                m->map = realloc(m->map, n);
+                assert(m->map != NULL);
+                memset(m->map + m->blocks, 0, n - m->blocks);
+                m->blocks = n;
+        }
+        /* a block freed and reused is of the type last read */
+        __atomic_store_n(&m->map[block], (m->map[block] & MANIFEST_RECENT) | bits, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&m->lock);
+}
+
+/* Save blocks read in the last two periods to <index>.manifest, as the
+ * numbers of upper and other blocks followed by their offsets. A period
+ * ends at every save unless the tree is going away */
+static void manifest_save(struct bplus_tree *tree, int age)
+{
+        long i, upper = 0, count = 0;
+        char name[1024 + 16], tmp[1024 + 32];
+        struct bplus_manifest *m = tree->manifest;
+
+        pthread_mutex_lock(&m->lock);
+        for (i = 0; i < m->blocks; i++) {
+                if (m->map[i] & (MANIFEST_READ | MANIFEST_RECENT)) {
+                        upper += (m->map[i] & MANIFEST_UPPER) != 0;
+                        count++;
+                }
+        }
+        off_t *offsets = malloc(count * sizeof(off_t) + 1);
+        assert(offsets != NULL);
+        long u = 0, l = upper;
+        for (i = 0; i < m->blocks; i++) {
+                unsigned char bits = m->map[i];
+                if (bits & (MANIFEST_READ | MANIFEST_RECENT)) {
+                        offsets[bits & MANIFEST_UPPER ? u++ : l++] = (off_t) i * _block_size;
+                }
+                if (age) {
+                        __atomic_store_n(&m->map[i], bits & MANIFEST_READ ?
+                                         MANIFEST_RECENT | (bits & MANIFEST_UPPER) : 0, __ATOMIC_RELAXED);
+                }
+        }
+        pthread_mutex_unlock(&m->lock);
+
+        index_file_name(tree, name, ".manifest");
+        snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+        int fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        assert(fd >= 0);
+        offset_write(fd, upper);
+        offset_write(fd, count);
+        ssize_t len = write(fd, offsets, count * sizeof(off_t));
+        close(fd);
+        /* only a hint for warm-up, the previous one is kept on failure */
+        if (len != (ssize_t) (count * sizeof(off_t)) || rename(tmp, name) != 0) {
+                unlink(tmp);
+        }
+        free(offsets);
+}
+
+static void *manifest_saver(void *arg)
+{
+        struct bplus_tree *tree = arg;
+        struct bplus_manifest *m = tree->manifest;
+
+        pthread_mutex_lock(&m->lock);
+        while (!m->quit) {
+                struct timespec due;
+                clock_gettime(CLOCK_REALTIME, &due);
+                due.tv_sec += m->save_ms / 1000;
+                due.tv_nsec += (m->save_ms % 1000) * 1000000L;
+                if (due.tv_nsec >= 1000000000L) {
+                        due.tv_sec++;
+                        due.tv_nsec -= 1000000000L;
+                }
+                if (pthread_cond_timedwait(&m->wakeup, &m->lock, &due) != 0 && !m->quit) {
+                        pthread_mutex_unlock(&m->lock);
+                        manifest_save(tree, 1);
+                        pthread_mutex_lock(&m->lock);
+                }
+        }
+        pthread_mutex_unlock(&m->lock);
+        return NULL;
+}
+
+static void manifest_disable(struct bplus_tree *tree)
+{
+        struct bplus_manifest *m = tree->manifest;
+
+        if (m->save_ms > 0) {
+                pthread_mutex_lock(&m->lock);
+                m->quit = 1;
+                pthread_cond_signal(&m->wakeup);
+                pthread_mutex_unlock(&m->lock);
+                pthread_join(m->saver, NULL);
+        }
+        manifest_save(tree, 0);
+
+        tree->manifest = NULL;
+        pthread_mutex_destroy(&m->lock);
+        pthread_cond_destroy(&m->wakeup);
+        free(m->map);
+        free(m);
+}
+
+/* Keep track of the blocks looked up and save them for bplus_tree_init()
+ * to warm the next start up with, every save_ms in background if positive
+ * and when the tree goes away. Negative save_ms stops tracking */
+int bplus_tree_manifest_enable(struct bplus_tree *tree, int save_ms)
+{
+        if (tree->manifest != NULL) {
+                manifest_disable(tree);
+        }
+        if (save_ms < 0) {
+                return 0;
+        }
+
+        struct bplus_manifest *m = calloc(1, sizeof(*m));
+        assert(m != NULL);
+        m->save_ms = save_ms;
+        pthread_mutex_init(&m->lock, NULL);
+        pthread_cond_init(&m->wakeup, NULL);
+        tree->manifest = m;
+        if (save_ms > 0) {
+                pthread_create(&m->saver, NULL, manifest_saver, tree);
+        }
+        return 0;
+}
+
+static void *warmup_reader(void *arg)
+{
+        struct bplus_warmup *w = arg;
+        char *buf = malloc((long) WARMUP_RUN_BLOCKS * _block_size);
+        assert(buf != NULL);
+
+        long run;
+        while ((run = __atomic_fetch_add(&w->next_run, 1, __ATOMIC_RELAXED)) < w->nr_runs) {
+                long first = w->runs[run], last = w->runs[run + 1];
+                long len = (last - first) * _block_size;
+                /* only to have the blocks in the page cache */
+                if (pread(w->fd, buf, len, w->offsets[first]) == len) {
+                        __atomic_add_fetch(&w->blocks, last - first, __ATOMIC_RELAXED);
+                }
+        }
+        free(buf);
+        return NULL;
+}
+
+/* read offsets [from, to) in parallel runs of adjacent blocks */
+static void warmup_batch(struct bplus_warmup *w, long from, long to)
+{
+        int i;
+        long j;
+        pthread_t threads[WARMUP_THREADS];
+
+        w->nr_runs = 0;
+        w->next_run = 0;
+        for (j = from; j < to; j++) {
+                long start = w->nr_runs > 0 ? w->runs[w->nr_runs - 1] : -1;
+                if (start < 0 || j - start == WARMUP_RUN_BLOCKS ||
+                    w->offsets[j] != w->offsets[j - 1] + _block_size) {
+                        w->runs[w->nr_runs++] = j;
+                }
+        }
+        w->runs[w->nr_runs] = to;
+
+        for (i = 0; i < WARMUP_THREADS; i++) {
+                pthread_create(&threads[i], NULL, warmup_reader, w);
+        }
+        for (i = 0; i < WARMUP_THREADS; i++) {
+                pthread_join(threads[i], NULL);
+        }
+}
+
+static void *warmup_run(void *arg)
+{
+        struct bplus_warmup *w = arg;
+        /* the upper levels are on the path of every lookup */
+        warmup_batch(w, 0, w->upper);
+        warmup_batch(w, w->upper, w->count);
+        return NULL;
+}
+
+/* prefetch the blocks of the manifest left by the last run in background */
+static void warmup_start(struct bplus_tree *tree)
+{
+        long i, n = 0;
+        char name[1024 + 16];
+
+        index_file_name(tree, name, ".manifest");
+        int fd = open(name, O_RDONLY);
+        if (fd < 0) {
+                return;
+        }
+
+        off_t upper = offset_load(fd);
+        off_t count = offset_load(fd);
+        off_t *offsets = NULL;
+        if (upper != INVALID_OFFSET && count != INVALID_OFFSET && upper <= count && count > 0) {
+                offsets = malloc(count * sizeof(off_t));
+                assert(offsets != NULL);
+                if (read(fd, offsets, count * sizeof(off_t)) != (ssize_t) (count * sizeof(off_t))) {
+                        count = 0;
+                }
+        }
+        close(fd);
+
+        /* the index may have shrunk or been replaced since */
+        for (i = 0; offsets != NULL && i < count; i++) {
+                if (offsets[i] % _block_size == 0 && offsets[i] + _block_size <= tree->file_size) {
+                        offsets[n++] = offsets[i];
+                }
+                if (i + 1 == upper) {
+                        upper = n;
+                }
+        }
+        if (n == 0) {
+                free(offsets);
+                return;
+        }
+
+        struct bplus_warmup *w = calloc(1, sizeof(*w));
+        assert(w != NULL);
+        w->fd = tree->fd;
+        w->offsets = offsets;
+        w->upper = upper;
+        w->count = n;
+        w->runs = malloc((n + 1) * sizeof(long));
+        assert(w->runs != NULL);
+        tree->warmup = w;
+        pthread_create(&w->thread, NULL, warmup_run, w);
+}
+
+/* wait for the blocks of the manifest to be read, returns how many were */
+long bplus_tree_warmup_wait(struct bplus_tree *tree)
+{
+        struct bplus_warmup *w = tree->warmup;
+        if (w == NULL) {
+                return 0;
+        }
+
+        pthread_join(w->thread, NULL);
+        long blocks = w->blocks;
+        free(w->offsets);
+        free(w->runs);
+        free(w);
+        tree->warmup = NULL;
+        return blocks;
+}
+
+#define BACKUP_MAGIC "BPTREEBK"
+
+struct bplus_backup {
+        int fd;
+        /* file size of the snapshot */
+        off_t size;
+        /* next block to ship in offset order */
+        off_t cursor;
+        /* blocks of the snapshot not shipped yet */
+        unsigned char *pending;
+        long remain;
+        char *buf;
+        int buf_blocks;
+};
 
-        return key(leaf)[0];
+static void backup_record_write(struct bplus_backup *backup, off_t offset, char *buf, int blocks)
+{
+        int i;
+        for (i = 0; i < blocks; i++) {
+                offset_write(backup->fd, offset + (off_t) i * _block_size);
+                ssize_t len = write(backup->fd, buf + (long) i * _block_size, _block_size);
+                assert(len == _block_size);
+        }
 }
 
-static key_t leaf_split_right(struct bplus_tree *tree, struct bplus_node *leaf,
-                              struct bplus_node *right, key_t key, long data, int insert)
+static void backup_block_ship(struct bplus_tree *tree, off_t offset)
 {
-        /* split = [m/2] */
-        int split = (leaf->children + 1) / 2;
+        struct bplus_backup *backup = tree->backup;
+        long block = offset / _block_size;
 
-        /* split as right sibling */
-        right_node_add(tree, leaf, right);
+        if (offset >= backup->size || !bitmap_test(backup->pending, block)) {
+                return;
+        }
 
-        /* calculate split leaves' children (sum as (entries + 1)) */
-        int pivot = insert - split;
-        leaf->children = split;
-        right->children = _max_entries - split + 1;
+        int len = pread(tree->fd, backup->buf, _block_size, offset);
+        assert(len == _block_size);
+        backup_record_write(backup, offset, backup->buf, 1);
+        bitmap_clear(backup->pending, block);
+        backup->remain--;
+}
 
-        /* sum = right->children = pivot + 1 + (_max_entries - pivot - split) */
-        /* replicate from key[split] to key[children - 1] in original leaf */
-        memmove(&key(right)[0], &key(leaf)[split], pivot * sizeof(key_t));
-        memmove(&data(right)[0], &data(leaf)[split], pivot * sizeof(long));
+int bplus_tree_backup_begin(struct bplus_tree *tree, char *path, int incremental)
+{
+        long i, blocks = tree->file_size / _block_size;
+        struct list_head *pos;
 
-        /* insert new key and data */
-        key(right)[pivot] = key;
-        data(right)[pivot] = data;
+        if (tree->backup != NULL) {
+                fprintf(stderr, "Backup is in progress!\n");
+                return -1;
+        }
 
-        /* replicate from key[insert] to key[children - 1] in original leaf */
-        memmove(&key(right)[pivot + 1], &key(leaf)[insert], (_max_entries - insert) * sizeof(key_t));
-        memmove(&data(right)[pivot + 1], &data(leaf)[insert], (_max_entries - insert) * sizeof(long));
+        /* blocks are shipped from the file */
+        bplus_tree_memtable_flush(tree);
+        writeback_drain(tree);
 
-        return key(right)[0];
+        struct bplus_backup *backup = calloc(1, sizeof(*backup));
+        assert(backup != NULL);
+        backup->fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (backup->fd < 0) {
+                free(backup);
+                return -1;
+        }
+
+        /* without a previous backup every block has to be shipped */
+        if (tree->changed == NULL) {
+                incremental = 0;
+        }
+
+        backup->size = tree->file_size;
+        backup->pending = calloc(blocks / 8 + 1, 1);
+        backup->buf_blocks = 1;
+        backup->buf = malloc(_block_size);
+        assert(backup->pending != NULL && backup->buf != NULL);
+        for (i = 0; i < blocks; i++) {
+                if (!incremental || (i < tree->changed_blocks && bitmap_test(tree->changed, i))) {
+                        bitmap_set(backup->pending, i);
+                        backup->remain++;
+                }
+        }
+
+        /* snapshot of the boot information, free blocks need no shipping */
+        int count = 0;
+        list_for_each(pos, &tree->free_blocks) {
+                count++;
+        }
+        ssize_t len = write(backup->fd, BACKUP_MAGIC, 8);
+        assert(len == 8);
+        offset_write(backup->fd, boot_config());
+        offset_write(backup->fd, tree->root);
+        offset_write(backup->fd, tree->file_size);
+        offset_write(backup->fd, incremental);
+        offset_write(backup->fd, count);
+        list_for_each(pos, &tree->free_blocks) {
+                struct free_block *block = list_entry(pos, struct free_block, link);
+                offset_write(backup->fd, block->offset);
+                if (bitmap_test(backup->pending, block->offset / _block_size)) {
+                        bitmap_clear(backup->pending, block->offset / _block_size);
+                        backup->remain--;
+                }
+        }
+
+        /* blocks written from now on are the base of next incremental backup */
+        changed_map_grow(tree, blocks);
+        memset(tree->changed, 0, tree->changed_blocks / 8);
+
+        tree->backup = backup;
+        return 0;
 }
 
-static void leaf_simple_insert(struct bplus_tree *tree, struct bplus_node *leaf,
-                               key_t key, long data, int insert)
+long bplus_tree_backup_step(struct bplus_tree *tree, int max_blocks)
 {
-        memmove(&key(leaf)[insert + 1], &key(leaf)[insert], (leaf->children - insert) * sizeof(key_t));
-        memmove(&data(leaf)[insert + 1], &data(leaf)[insert], (leaf->children - insert) * sizeof(long));
-        key(leaf)[insert] = key;
-        data(leaf)[insert] = data;
-        leaf->children++;
+        struct bplus_backup *backup = tree->backup;
+        if (backup == NULL) {
+                return -1;
+        }
+
+        if (max_blocks > backup->buf_blocks) {
+                free(backup->buf);
+                backup->buf = malloc((long) max_blocks * _block_size);
+                assert(backup->buf != NULL);
+                backup->buf_blocks = max_blocks;
+        }
+
+        /* ship at most max_blocks pending blocks with sequential reads */
+        while (max_blocks > 0 && backup->cursor < backup->size) {
+                long block = backup->cursor / _block_size;
+                if (!bitmap_test(backup->pending, block)) {
+                        backup->cursor += _block_size;
+                        continue;
+                }
+
+                int n = 1;
+                while (n < max_blocks && backup->cursor + (off_t) n * _block_size < backup->size &&
+                       bitmap_test(backup->pending, block + n)) {
+                        n++;
+                }
+                long len = pread(tree->fd, backup->buf, (long) n * _block_size, backup->cursor);
+                assert(len == (long) n * _block_size);
+                backup_record_write(backup, backup->cursor, backup->buf, n);
+
+                for (len = 0; len < n; len++) {
+                        bitmap_clear(backup->pending, block + len);
+                }
+                backup->remain -= n;
+                backup->cursor += (off_t) n * _block_size;
+                max_blocks -= n;
+        }
+
+        return backup->remain;
 }
 
-static int leaf_insert(struct bplus_tree *tree, struct bplus_node *leaf, key_t key, long data)
+int bplus_tree_backup_end(struct bplus_tree *tree)
 {
-        /* Search key location */
-        int insert = key_binary_search(leaf, key);
-        if (insert >= 0) {
-                /* Already exists */
+        struct bplus_backup *backup = tree->backup;
+        if (backup == NULL) {
                 return -1;
         }
-        insert = -insert - 1;
 
-        /* fetch from free node caches */
-        int i = ((char *) leaf - tree->caches) / _block_size;
-        tree->used[i] = 1;
+        while (bplus_tree_backup_step(tree, 64) > 0) {
+                continue;
+        }
 
-        /* leaf is full */
-        if (leaf->children == _max_entries) {
-                key_t split_key;
-                /* split = [m/2] */
-                int split = (_max_entries + 1) / 2;
-                struct bplus_node *sibling = leaf_new(tree);
+        offset_write(backup->fd, INVALID_OFFSET);
+        fsync(backup->fd);
+        close(backup->fd);
+        free(backup->pending);
+        free(backup->buf);
+        free(backup);
+        tree->backup = NULL;
+        return 0;
+}
 
-                /* sibling leaf replication due to location of insertion */
-                if (insert < split) {
-                        split_key = leaf_split_left(tree, leaf, sibling, key, data, insert);
-                } else {
-                        split_key = leaf_split_right(tree, leaf, sibling, key, data, insert);
+int bplus_tree_restore(char *backup, char *filename)
+{
+        char magic[8];
+        off_t i, offset;
+
+        if (strlen(filename) >= 1024) {
+                fprintf(stderr, "Index file name too long!\n");
+                return -1;
+        }
+
+        int fd = open(backup, O_RDONLY);
+        if (fd < 0) {
+                return -1;
+        }
+        if (read(fd, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, BACKUP_MAGIC, 8) != 0) {
+                fprintf(stderr, "Not a backup of index!\n");
+                close(fd);
+                return -1;
+        }
+
+        off_t config = offset_load(fd);
+        off_t block_size = config & 0xffffffff;
+        off_t root = offset_load(fd);
+        off_t file_size = offset_load(fd);
+        off_t incremental = offset_load(fd);
+        off_t count = offset_load(fd);
+
+        /* free blocks go to the boot file once the blocks are in place */
+        off_t *free_blocks = count != INVALID_OFFSET ? malloc((count + 1) * sizeof(off_t)) : NULL;
+        for (i = 0; free_blocks != NULL && i < count; i++) {
+                free_blocks[i] = offset_load(fd);
+        }
+        if (free_blocks == NULL || (count > 0 && free_blocks[count - 1] == INVALID_OFFSET)) {
+                fprintf(stderr, "Backup truncated!\n");
+                free(free_blocks);
+                close(fd);
+                return -1;
+        }
+
+        /* an incremental backup applies upon the restored previous one */
+        int data_fd = open(filename, O_CREAT | O_RDWR | (incremental ? 0 : O_TRUNC), 0644);
+        if (data_fd < 0) {
+                fprintf(stderr, "Index not writable!\n");
+                free(free_blocks);
+                close(fd);
+                return -1;
+        }
+
+        /* a bloom filter, a manifest or an undo file of the index replaced
+         * would be loaded along with the restored one */
+        char name[1024 + 16];
+        snprintf(name, sizeof(name), "%s.bloom", filename);
+        unlink(name);
+        snprintf(name, sizeof(name), "%s.manifest", filename);
+        unlink(name);
+        snprintf(name, sizeof(name), "%s.undo", filename);
+        unlink(name);
+
+        int ret = 0;
+        char *buf = malloc(block_size);
+        assert(buf != NULL);
+        while ((offset = offset_load(fd)) != INVALID_OFFSET) {
+                ssize_t len = read(fd, buf, block_size);
+                if (len == block_size) {
+                        len = pwrite(data_fd, buf, block_size, offset);
                 }
+                if (len != block_size) {
+                        fprintf(stderr, "Backup truncated or index not writable!\n");
+                        ret = -1;
+                        break;
+                }
+        }
+        if (ret == 0 && ftruncate(data_fd, file_size) != 0) {
+                ret = -1;
+        }
+        free(buf);
+        bplus_close(data_fd);
+        close(fd);
 
-                /* build new parent */
-                if (insert < split) {
-                        return parent_node_build(tree, sibling, leaf, split_key);
-                } else {
-                        return parent_node_build(tree, leaf, sibling, split_key);
+        /* the boot file is replaced only by a backup applied in full */
+        char boot[1024 + 16], tmp[1024 + 32];
+        snprintf(boot, sizeof(boot), "%s.boot", filename);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", boot);
+        int boot_fd = ret == 0 ? open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644) : -1;
+        if (boot_fd >= 0) {
+                offset_write(boot_fd, root);
+                offset_write(boot_fd, config);
+                offset_write(boot_fd, file_size);
+                for (i = 0; i < count; i++) {
+                        offset_write(boot_fd, free_blocks[i]);
+                }
+                if (fsync(boot_fd) != 0) {
+                        ret = -1;
+                }
+                close(boot_fd);
+                if (ret != 0 || rename(tmp, boot) != 0) {
+                        unlink(tmp);
+                        ret = -1;
                 }
         } else {
-                leaf_simple_insert(tree, leaf, key, data, insert);
-                node_flush(tree, leaf);
+                ret = -1;
         }
 
-        return 0;
+        free(free_blocks);
+        return ret;
 }
 
-static int bplus_tree_insert(struct bplus_tree *tree, key_t key, long data)
+/* records are buffered by stdio in chunks of that many bytes and sent at
+ * every commit at least */
+#define REPLICA_BUFFER_SIZE (1 << 20)
+
+struct bplus_replica {
+        FILE *fp;
+        long seq;
+        /* blocks sent since last commit */
+        long blocks;
+        int failed;
+};
+
+static long wall_clock(void)
 {
-        struct bplus_node *node = node_seek(tree, tree->root);
-        while (node != NULL) {
-                if (is_leaf(node)) {
-                        return leaf_insert(tree, node, key, data);
-                } else {
-                        int i = key_binary_search(node, key);
-                        if (i >= 0) {
-                                node = node_seek(tree, sub(node)[i + 1]);
-                        } else {
-                                i = -i - 1;
-                                node = node_seek(tree, sub(node)[i]);
-                        }
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void replica_send(struct bplus_tree *tree, struct bplus_replica_record *rec, char *buf)
+{
+        struct bplus_replica *replica = tree->replica;
+
+        /* blocks of the bulk loader are sent in parallel */
+        flockfile(replica->fp);
+        if (!replica->failed && (fwrite(rec, sizeof(*rec), 1, replica->fp) != 1 ||
+                                 (buf != NULL && fwrite(buf, _block_size, 1, replica->fp) != 1) ||
+                                 (buf == NULL && fflush(replica->fp) != 0))) {
+                fprintf(stderr, "Follower is gone, replication stopped!\n");
+                replica->failed = 1;
+        }
+        funlockfile(replica->fp);
+}
+
+static void replica_ship(struct bplus_tree *tree, off_t offset, char *buf)
+{
+        struct bplus_replica_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.type = BPLUS_REPLICA_BLOCK;
+        rec.offset = offset;
+        rec.seq = tree->replica->seq;
+        replica_send(tree, &rec, buf);
+        __atomic_add_fetch(&tree->replica->blocks, 1, __ATOMIC_RELAXED);
+}
+
+/* make the blocks sent so far visible at the follower */
+static void replica_commit(struct bplus_tree *tree)
+{
+        struct bplus_replica_record rec;
+        struct bplus_replica *replica = tree->replica;
+        if (replica == NULL || replica->blocks == 0) {
+                return;
+        }
+
+        memset(&rec, 0, sizeof(rec));
+        rec.type = BPLUS_REPLICA_COMMIT;
+        rec.offset = tree->root;
+        rec.file_size = tree->file_size;
+        rec.level = tree->level;
+        rec.time = wall_clock();
+        rec.seq = replica->seq++;
+        replica->blocks = 0;
+        replica_send(tree, &rec, NULL);
+}
+
+/* Stream the blocks of the tree and then every block written to fd, a pipe
+ * or a socket read by bplus_follower_start(). Changes still in the memtable
+ * are sent once merged. The stream is sent by the calling thread, which
+ * blocks on a slow follower and had better ignore SIGPIPE */
+int bplus_tree_replicate_begin(struct bplus_tree *tree, int fd)
+{
+        off_t offset;
+
+        if (tree->replica != NULL) {
+                fprintf(stderr, "Tree is being replicated!\n");
+                return -1;
+        }
+
+        struct bplus_replica *replica = calloc(1, sizeof(*replica));
+        assert(replica != NULL);
+        int dup_fd = dup(fd);
+        replica->fp = dup_fd >= 0 ? fdopen(dup_fd, "wb") : NULL;
+        if (replica->fp == NULL) {
+                fprintf(stderr, "Failed to open replication stream!\n");
+                if (dup_fd >= 0) {
+                        close(dup_fd);
                 }
+                free(replica);
+                return -1;
+        }
+        setvbuf(replica->fp, NULL, _IOFBF, REPLICA_BUFFER_SIZE);
+
+        struct bplus_replica_header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = BPLUS_REPLICA_MAGIC;
+        header.version = BPLUS_REPLICA_VERSION;
+        header.config = boot_config();
+        if (fwrite(&header, sizeof(header), 1, replica->fp) != 1) {
+                fclose(replica->fp);
+                free(replica);
+                return -1;
         }
 
-        /* new root */
-        struct bplus_node *root = leaf_new(tree);
-        key(root)[0] = key;
-        data(root)[0] = data;
-        root->children = 1;
-        tree->root = new_node_append(tree, root);
-        tree->level = 1;
-        node_flush(tree, root);
+        /* the file on disk holds every block once checkpointed */
+        bplus_tree_checkpoint(tree);
+        tree->replica = replica;
+        char *buf = malloc(_block_size);
+        assert(buf != NULL);
+        for (offset = 0; offset < tree->file_size; offset += _block_size) {
+                ssize_t len = pread(tree->fd, buf, _block_size, offset);
+                assert(len == _block_size);
+                replica_ship(tree, offset, buf);
+        }
+        free(buf);
+        replica_commit(tree);
+        return replica->failed ? -1 : 0;
+}
+
+int bplus_tree_replicate_end(struct bplus_tree *tree)
+{
+        struct bplus_replica *replica = tree->replica;
+        if (replica == NULL) {
+                return -1;
+        }
+
+        replica_commit(tree);
+        int ret = fclose(replica->fp) == 0 && !replica->failed ? 0 : -1;
+        free(replica);
+        tree->replica = NULL;
+        return ret;
+}
+
+/* staging of a commit larger than that many blocks is freed after it */
+#define FOLLOWER_STAGING_BLOCKS 1024
+
+struct bplus_follower {
+        struct bplus_tree *tree;
+        int fd;
+        /* written to by bplus_follower_stop() to wake the reader up */
+        int stop_pipe[2];
+        /* bytes of the stream read ahead */
+        char *rbuf;
+        long rpos;
+        long rlen;
+        pthread_t thread;
+        /* held by readers and while a commit is applied */
+        pthread_mutex_t lock;
+        /* blocks received since last commit */
+        char *blocks;
+        off_t *offsets;
+        long count;
+        long size;
+        struct bplus_follower_stats stats;
+};
+
+/* read len bytes of the stream, fails at its end and once stopped */
+static int follower_read(struct bplus_follower *f, void *buf, long len)
+{
+        char *p = buf;
+
+        while (len > 0) {
+                if (f->rpos == f->rlen) {
+                        struct pollfd fds[2];
+                        fds[0].fd = f->fd;
+                        fds[0].events = POLLIN;
+                        fds[1].fd = f->stop_pipe[0];
+                        fds[1].events = POLLIN;
+                        if (poll(fds, 2, -1) < 0) {
+                                if (errno == EINTR) {
+                                        continue;
+                                }
+                                return -1;
+                        }
+                        if (fds[1].revents != 0) {
+                                return -1;
+                        }
+                        ssize_t n = read(f->fd, f->rbuf, REPLICA_BUFFER_SIZE);
+                        if (n < 0 && errno == EINTR) {
+                                continue;
+                        }
+                        if (n <= 0) {
+                                return -1;
+                        }
+                        f->rpos = 0;
+                        f->rlen = n;
+                }
+                long n = f->rlen - f->rpos < len ? f->rlen - f->rpos : len;
+                memcpy(p, f->rbuf + f->rpos, n);
+                f->rpos += n;
+                p += n;
+                len -= n;
+        }
         return 0;
 }
 
-static inline int sibling_select(struct bplus_node *l_sib, struct bplus_node *r_sib,
-                                 struct bplus_node *parent, int i)
+static int follower_apply(struct bplus_follower *f, struct bplus_replica_record *rec)
 {
-        if (i == -1) {
-                /* the frist sub-node, no left sibling, choose the right one */
-                return RIGHT_SIBLING;
-        } else if (i == parent->children - 2) {
-                /* the last sub-node, no right sibling, choose the left one */
-                return LEFT_SIBLING;
-        } else {
-                /* if both left and right sibling found, choose the one with more children */
-                return l_sib->children >= r_sib->children ? LEFT_SIBLING : RIGHT_SIBLING;
+        long i;
+        struct bplus_tree *tree = f->tree;
+
+        if (rec->type == BPLUS_REPLICA_BLOCK && f->stats.commits == 0) {
+                /* no root is visible before the first commit, so the blocks
+                 * of the initial copy go to the file as they come */
+                if (f->size == 0) {
+                        f->size = 1;
+                        f->blocks = malloc(_block_size);
+                        f->offsets = malloc(sizeof(off_t));
+                        assert(f->blocks != NULL && f->offsets != NULL);
+                }
+                if (follower_read(f, f->blocks, _block_size) != 0 ||
+                    pwrite(tree->fd, f->blocks, _block_size, rec->offset) != _block_size) {
+                        return -1;
+                }
+                pthread_mutex_lock(&f->lock);
+                f->stats.blocks++;
+                f->stats.bytes += sizeof(*rec) + _block_size;
+                pthread_mutex_unlock(&f->lock);
+                return 0;
+        }
+
+        if (rec->type == BPLUS_REPLICA_BLOCK) {
+                if (f->count == f->size) {
+                        f->size = f->size ? f->size * 2 : 64;
+                        f->blocks = realloc(f->blocks, f->size * _block_size);
+                        f->offsets = realloc(f->offsets, f->size * sizeof(off_t));
+                        assert(f->blocks != NULL && f->offsets != NULL);
+                }
+                if (follower_read(f, f->blocks + f->count * _block_size, _block_size) != 0) {
+                        return -1;
+                }
+                f->offsets[f->count++] = rec->offset;
+                return 0;
+        }
+
+        if (rec->type != BPLUS_REPLICA_COMMIT) {
+                fprintf(stderr, "Unknown record in replication stream!\n");
+                return -1;
+        }
+
+        int ret = 0;
+        pthread_mutex_lock(&f->lock);
+        for (i = 0; i < f->count; i++) {
+                if (pwrite(tree->fd, f->blocks + i * _block_size, _block_size, f->offsets[i]) != _block_size) {
+                        fprintf(stderr, "Replica not writable!\n");
+                        ret = -1;
+                        break;
+                }
+        }
+        if (ret == 0) {
+                tree->root = rec->offset;
+                tree->file_size = rec->file_size;
+                tree->level = rec->level;
+                f->stats.commits++;
+                f->stats.blocks += f->count;
+                f->stats.bytes += f->count * (sizeof(*rec) + _block_size) + sizeof(*rec);
+                f->stats.lag = wall_clock() - rec->time;
+                if (f->stats.lag > f->stats.max_lag) {
+                        f->stats.max_lag = f->stats.lag;
+                }
+        }
+        pthread_mutex_unlock(&f->lock);
+
+        /* keep the staging area for the next commits unless a large one
+         * has grown it */
+        f->count = 0;
+        if (f->size > FOLLOWER_STAGING_BLOCKS) {
+                free(f->blocks);
+                free(f->offsets);
+                f->blocks = NULL;
+                f->offsets = NULL;
+                f->size = 0;
         }
+        return ret;
 }
 
-static void non_leaf_shift_from_left(struct bplus_tree *tree, struct bplus_node *node,
-                                     struct bplus_node *left, struct bplus_node *parent,
-                                     int parent_key_index, int remove)
+static void *follower_run(void *arg)
 {
-        /* node's elements right shift */
-        memmove(&key(node)[1], &key(node)[0], remove * sizeof(key_t));
-        memmove(&sub(node)[1], &sub(node)[0], (remove + 1) * sizeof(off_t));
+        struct bplus_replica_record rec;
+        struct bplus_follower *f = arg;
 
-        /* parent key right rotation */
-        key(node)[0] = key(parent)[parent_key_index];
-        key(parent)[parent_key_index] = key(left)[left->children - 2];
+        while (follower_read(f, &rec, sizeof(rec)) == 0) {
+                if (follower_apply(f, &rec) != 0) {
+                        break;
+                }
+        }
 
-        /* borrow the last sub-node from left sibling */
-        sub(node)[0] = sub(left)[left->children - 1];
-        sub_node_flush(tree, node, sub(node)[0]);
+        pthread_mutex_lock(&f->lock);
+        f->stats.done = 1;
+        pthread_mutex_unlock(&f->lock);
+        return NULL;
+}
 
-        left->children--;
+static void follower_free(struct bplus_follower *f)
+{
+        close(f->fd);
+        close(f->stop_pipe[0]);
+        close(f->stop_pipe[1]);
+        free(f->rbuf);
+        free(f->blocks);
+        free(f->offsets);
+        free(f);
 }
 
-static void non_leaf_merge_into_left(struct bplus_tree *tree, struct bplus_node *node,
-                                     struct bplus_node *left, struct bplus_node *parent,
-                                     int parent_key_index, int remove)
+/* Keep filename a replica of the tree streamed from fd by a leader, which is
+ * applied in background a commit at a time. Any index at filename is
+ * replaced. Blocks the leader holds free are not known here, so the replica
+ * is for reading only */
+struct bplus_follower *bplus_follower_start(char *filename, int fd)
 {
-        /* move parent key down */
-        key(left)[left->children - 1] = key(parent)[parent_key_index];
+        char name[1024 + 16];
+        struct bplus_replica_header header;
 
-        /* merge into left sibling */
-        /* key sum = node->children - 2 */
-        memmove(&key(left)[left->children], &key(node)[0], remove * sizeof(key_t));
-        memmove(&sub(left)[left->children], &sub(node)[0], (remove + 1) * sizeof(off_t));
+        if (strlen(filename) >= 1024) {
+                fprintf(stderr, "Index file name too long!\n");
+                return NULL;
+        }
 
-        /* sub-node sum = node->children - 1 */
-        memmove(&key(left)[left->children + remove], &key(node)[remove + 1], (node->children - remove - 2) * sizeof(key_t));
-        memmove(&sub(left)[left->children + remove + 1], &sub(node)[remove + 2], (node->children - remove - 2) * sizeof(off_t));
+        struct bplus_follower *f = calloc(1, sizeof(*f));
+        assert(f != NULL);
+        f->fd = dup(fd);
+        if (f->fd < 0 || pipe(f->stop_pipe) != 0) {
+                fprintf(stderr, "Failed to open replication stream!\n");
+                if (f->fd >= 0) {
+                        close(f->fd);
+                }
+                free(f);
+                return NULL;
+        }
+        f->rbuf = malloc(REPLICA_BUFFER_SIZE);
+        assert(f->rbuf != NULL);
+
+        /* waits for the leader to begin */
+        if (follower_read(f, &header, sizeof(header)) != 0 ||
+            header.magic != BPLUS_REPLICA_MAGIC || header.version != BPLUS_REPLICA_VERSION) {
+                fprintf(stderr, "Not a replication stream!\n");
+                follower_free(f);
+                return NULL;
+        }
 
-        /* flush sub-nodes of the new merged left node */
-        int i, j;
-        for (i = left->children, j = 0; j < node->children - 1; i++, j++) {
-                sub_node_flush(tree, left, sub(left)[i]);
+        /* nothing of a previous index may be loaded, a stale bloom filter
+         * would hide keys shipped since */
+        unlink(filename);
+        snprintf(name, sizeof(name), "%s.boot", filename);
+        unlink(name);
+        snprintf(name, sizeof(name), "%s.bloom", filename);
+        unlink(name);
+        snprintf(name, sizeof(name), "%s.manifest", filename);
+        unlink(name);
+        snprintf(name, sizeof(name), "%s.undo", filename);
+        unlink(name);
+        f->tree = bplus_tree_init_flags(filename, header.config & 0xffffffff, header.config >> 32);
+        if (f->tree == NULL) {
+                follower_free(f);
+                return NULL;
         }
 
-        left->children += node->children - 1;
+        pthread_mutex_init(&f->lock, NULL);
+        pthread_create(&f->thread, NULL, follower_run, f);
+        return f;
 }
 
-static void non_leaf_shift_from_right(struct bplus_tree *tree, struct bplus_node *node,
-                                      struct bplus_node *right, struct bplus_node *parent,
-                                      int parent_key_index)
+long bplus_follower_get(struct bplus_follower *follower, key_t key)
 {
-        /* parent key left rotation */
-        key(node)[node->children - 1] = key(parent)[parent_key_index];
-        key(parent)[parent_key_index] = key(right)[0];
-
-        /* borrow the frist sub-node from right sibling */
-        sub(node)[node->children] = sub(right)[0];
-        sub_node_flush(tree, node, sub(node)[node->children]);
-        node->children++;
+        pthread_mutex_lock(&follower->lock);
+        long data = bplus_tree_get(follower->tree, key);
+        pthread_mutex_unlock(&follower->lock);
+        return data;
+}
 
-        /* right sibling left shift*/
-        memmove(&key(right)[0], &key(right)[1], (right->children - 2) * sizeof(key_t));
-        memmove(&sub(right)[0], &sub(right)[1], (right->children - 1) * sizeof(off_t));
+/* the tree must not be modified inside fn, which holds up commits */
+long bplus_follower_walk(struct bplus_follower *follower, key_t key1, key_t key2,
+                         bplus_tree_walk_fn fn, void *arg)
+{
+        pthread_mutex_lock(&follower->lock);
+        long count = bplus_tree_walk(follower->tree, key1, key2, fn, arg);
+        pthread_mutex_unlock(&follower->lock);
+        return count;
+}
 
-        right->children--;
+void bplus_follower_stats(struct bplus_follower *follower, struct bplus_follower_stats *stats)
+{
+        pthread_mutex_lock(&follower->lock);
+        *stats = follower->stats;
+        pthread_mutex_unlock(&follower->lock);
 }
 
-static void non_leaf_merge_from_right(struct bplus_tree *tree, struct bplus_node *node,
-                                      struct bplus_node *right, struct bplus_node *parent,
-                                      int parent_key_index)
+/* Stop following, whether the leader has ended the stream or not. The
+ * replica is left as of the last commit applied */
+void bplus_follower_stop(struct bplus_follower *follower)
 {
-        /* move parent key down */
-        key(node)[node->children - 1] = key(parent)[parent_key_index];
-        node->children++;
+        ssize_t len = write(follower->stop_pipe[1], "", 1);
+        (void) len;
+        pthread_join(follower->thread, NULL);
+        pthread_mutex_destroy(&follower->lock);
+        bplus_tree_deinit(follower->tree);
+        follower_free(follower);
+}
 
-        /* merge from right sibling */
-        memmove(&key(node)[node->children - 1], &key(right)[0], (right->children - 1) * sizeof(key_t));
-        memmove(&sub(node)[node->children - 1], &sub(right)[0], right->children * sizeof(off_t));
+/* blocks of the shared pool are looked up in sets of that many frames */
+#define SHARED_POOL_WAYS 8
+#define SHARED_POOL_SLOTS 256
+#define SHARED_POOL_MAGIC 0x4c4f4f50  /* "POOL" */
 
-        /* flush sub-nodes of the new merged node */
-        int i, j;
-        for (i = node->children - 1, j = 0; j < right->children; i++, j++) {
-                sub_node_flush(tree, node, sub(node)[i]);
-        }
+/* bytes of the lock file next to the index, locked while attaching to the
+ * pool, by the writer, shared by every process attached and one for the
+ * reader slot of every process, all released by the kernel on exit */
+enum {
+        SHARED_LOCK_ATTACH,
+        SHARED_LOCK_WRITER,
+        SHARED_LOCK_USERS,
+        SHARED_LOCK_SLOTS,
+};
 
-        node->children += right->children - 1;
-}
+/* Frame of the shared pool, guarded by a sequence counter which is odd
+ * while the block is being replaced, so that lookups take no lock */
+struct shared_frame {
+        unsigned long seq;
+        off_t offset;
+        /* looked up since the clock passed by */
+        int ref;
+};
 
-static inline void non_leaf_simple_remove(struct bplus_tree *tree, struct bplus_node *node, int remove)
+/* Held by a process through every call as a reader, the writer takes the
+ * slot of every process in turn to wait for their calls to end */
+struct shared_slot {
+        pthread_mutex_t lock;
+        char pad[64 - sizeof(pthread_mutex_t) % 64];
+};
+
+/* head of the shared memory segment, followed by the lock of every set for
+ * the processes replacing frames, the reader slots, the frames and their
+ * blocks. Locks are robust ones, a process dying with one held leaves it
+ * to the next taking it rather than hanging every other */
+struct shared_pool {
+        int magic;
+        off_t config;
+        long sets;
+        /* held by the writer from its first block written until the
+         * operation ends, readers wait on it while writer_active is set */
+        pthread_mutex_t lock;
+        int writer_active;
+        /* reader slots ever taken */
+        int slots;
+        /* tree as of the last operation of the writer */
+        off_t root;
+        off_t file_size;
+        int level;
+};
+
+struct bplus_shared {
+        struct shared_pool *pool;
+        size_t size;
+        pthread_mutex_t *set_locks;
+        struct shared_slot *slots;
+        struct shared_frame *frames;
+        char *blocks;
+        char name[64];
+        int lock_fd;
+        int writer;
+        int slot;
+        /* the writer holds the pool lock */
+        int locked;
+        /* calls nested in one holding the pool lock */
+        int depth;
+        long hits;
+        long misses;
+};
+
+static size_t shared_layout(struct bplus_shared *shared, char *base, long sets)
 {
-        assert(node->children >= 2);
-        memmove(&key(node)[remove], &key(node)[remove + 1], (node->children - remove - 2) * sizeof(key_t));
-        memmove(&sub(node)[remove + 1], &sub(node)[remove + 2], (node->children - remove - 2) * sizeof(off_t));
-        node->children--;
+        size_t size = (sizeof(struct shared_pool) + 63) / 64 * 64;
+        shared->set_locks = (pthread_mutex_t *) (base + size);
+        size += (sets * sizeof(pthread_mutex_t) + 63) / 64 * 64;
+        shared->slots = (struct shared_slot *) (base + size);
+        size += SHARED_POOL_SLOTS * sizeof(struct shared_slot);
+        shared->frames = (struct shared_frame *) (base + size);
+        size += sets * SHARED_POOL_WAYS * sizeof(struct shared_frame);
+        /* blocks aligned for direct copies from the page cache */
+        size = (size + _block_size - 1) / _block_size * _block_size;
+        shared->blocks = base + size;
+        return size + (size_t) sets * SHARED_POOL_WAYS * _block_size;
 }
 
-static void non_leaf_remove(struct bplus_tree *tree, struct bplus_node *node, int remove)
+static inline long shared_set(struct bplus_shared *shared, off_t offset)
 {
-        if (node->parent == INVALID_OFFSET) {
-                /* node is the root */
-                if (node->children == 2) {
-                        /* replace old root with the first sub-node */
-                        struct bplus_node *root = node_fetch(tree, sub(node)[0]);
-                        root->parent = INVALID_OFFSET;
-                        tree->root = root->self;
-                        tree->level--;
-                        node_delete(tree, node, NULL, NULL);
-                        node_flush(tree, root);
-                } else {
-                        non_leaf_simple_remove(tree, node, remove);
-                        node_flush(tree, node);
-                }
-        } else if (node->children <= (_max_order + 1) / 2) {
-                struct bplus_node *l_sib = node_fetch(tree, node->prev);
-                struct bplus_node *r_sib = node_fetch(tree, node->next);
-                struct bplus_node *parent = node_fetch(tree, node->parent);
+        unsigned long block = offset / _block_size;
+        return (block * 0x9e3779b97f4a7c15UL >> 32) & (shared->pool->sets - 1);
+}
 
-                int i = parent_key_index(parent, key(node)[0]);
+/* returns 1 if the last owner died holding the lock, -1 if it is busy */
+static int shared_lock(pthread_mutex_t *lock, int wait)
+{
+        int ret = wait ? pthread_mutex_lock(lock) : pthread_mutex_trylock(lock);
+        if (ret == EOWNERDEAD) {
+                pthread_mutex_consistent(lock);
+                return 1;
+        }
+        return ret == 0 ? 0 : -1;
+}
 
-                /* decide which sibling to be borrowed from */
-                if (sibling_select(l_sib, r_sib, parent, i)  == LEFT_SIBLING) {
-                        if (l_sib->children > (_max_order + 1) / 2) {
-                                non_leaf_shift_from_left(tree, node, l_sib, parent, i, remove);
-                                /* flush nodes */
-                                node_flush(tree, node);
-                                node_flush(tree, l_sib);
-                                node_flush(tree, r_sib);
-                                node_flush(tree, parent);
-                        } else {
-                                non_leaf_merge_into_left(tree, node, l_sib, parent, i, remove);
-                                /* delete empty node and flush */
-                                node_delete(tree, node, l_sib, r_sib);
-                                /* trace upwards */
-                                non_leaf_remove(tree, parent, i);
-                        }
-                } else {
-                        /* remove at first in case of overflow during merging with sibling */
-                        non_leaf_simple_remove(tree, node, remove);
+static void shared_lock_init(pthread_mutex_t *lock)
+{
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+}
 
-                        if (r_sib->children > (_max_order + 1) / 2) {
-                                non_leaf_shift_from_right(tree, node, r_sib, parent, i + 1);
-                                /* flush nodes */
-                                node_flush(tree, node);
-                                node_flush(tree, l_sib);
-                                node_flush(tree, r_sib);
-                                node_flush(tree, parent);
-                        } else {
-                                non_leaf_merge_from_right(tree, node, r_sib, parent, i + 1);
-                                /* delete empty right sibling and flush */
-                                struct bplus_node *rr_sib = node_fetch(tree, r_sib->next);
-                                node_delete(tree, r_sib, node, rr_sib);
-                                node_flush(tree, l_sib);
-                                /* trace upwards */
-                                non_leaf_remove(tree, parent, i + 1);
+static int shared_load(struct bplus_tree *tree, off_t offset, char *buf)
+{
+        int i;
+        struct bplus_shared *shared = tree->shared;
+        long frame = shared_set(shared, offset) * SHARED_POOL_WAYS;
+
+        for (i = 0; i < SHARED_POOL_WAYS; i++, frame++) {
+                struct shared_frame *f = &shared->frames[frame];
+                unsigned long seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+                if ((seq & 1) || __atomic_load_n(&f->offset, __ATOMIC_RELAXED) != offset) {
+                        continue;
+                }
+                memcpy(buf, shared->blocks + frame * _block_size, _block_size);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&f->seq, __ATOMIC_RELAXED) == seq) {
+                        /* not to bounce the line of a hot frame between cores */
+                        if (!__atomic_load_n(&f->ref, __ATOMIC_RELAXED)) {
+                                __atomic_store_n(&f->ref, 1, __ATOMIC_RELAXED);
                         }
+                        shared->hits++;
+                        return 0;
                 }
-        } else {
-                non_leaf_simple_remove(tree, node, remove);
-                node_flush(tree, node);
         }
+        shared->misses++;
+        return -1;
 }
 
-static void leaf_shift_from_left(struct bplus_tree *tree, struct bplus_node *leaf,
-                                 struct bplus_node *left, struct bplus_node *parent,
-                                 int parent_key_index, int remove)
+/* Put the image of a block into the pool. Readers give up when another
+ * process is replacing a frame of the set, the writer must not leave an
+ * old image behind */
+static void shared_store(struct bplus_tree *tree, off_t offset, char *buf, int wait)
 {
-        /* right shift in leaf node */
-        memmove(&key(leaf)[1], &key(leaf)[0], remove * sizeof(key_t));
-        memmove(&data(leaf)[1], &data(leaf)[0], remove * sizeof(off_t));
+        int i;
+        struct bplus_shared *shared = tree->shared;
+        long set = shared_set(shared, offset);
+        long base = set * SHARED_POOL_WAYS, victim = -1;
+        int dead = shared_lock(&shared->set_locks[set], wait);
 
-        /* borrow the last element from left sibling */
-        key(leaf)[0] = key(left)[left->children - 1];
-        data(leaf)[0] = data(left)[left->children - 1];
-        left->children--;
+        if (dead < 0) {
+                return;
+        }
+        /* a frame left half replaced is dropped */
+        for (i = 0; dead && i < SHARED_POOL_WAYS; i++) {
+                struct shared_frame *f = &shared->frames[base + i];
+                if (f->seq & 1) {
+                        __atomic_store_n(&f->offset, INVALID_OFFSET, __ATOMIC_RELAXED);
+                        __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELEASE);
+                }
+        }
 
-        /* update parent key */
-        key(parent)[parent_key_index] = key(leaf)[0];
+        for (i = 0; i < SHARED_POOL_WAYS; i++) {
+                if (shared->frames[base + i].offset == offset) {
+                        victim = base + i;
+                        break;
+                }
+        }
+        /* clock over the frames of the set */
+        for (i = 0; victim < 0; i = (i + 1) % SHARED_POOL_WAYS) {
+                struct shared_frame *f = &shared->frames[base + i];
+                if (!__atomic_load_n(&f->ref, __ATOMIC_RELAXED)) {
+                        victim = base + i;
+                } else {
+                        __atomic_store_n(&f->ref, 0, __ATOMIC_RELAXED);
+                }
+        }
+
+        struct shared_frame *f = &shared->frames[victim];
+        unsigned long seq = f->seq;
+        __atomic_store_n(&f->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&f->offset, offset, __ATOMIC_RELAXED);
+        memcpy(shared->blocks + victim * _block_size, buf, _block_size);
+        __atomic_store_n(&f->seq, seq + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&f->ref, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_unlock(&shared->set_locks[set]);
 }
 
-static void leaf_merge_into_left(struct bplus_tree *tree, struct bplus_node *leaf,
-                                 struct bplus_node *left, int parent_key_index, int remove)
+static int shared_reader(struct bplus_tree *tree)
 {
-        /* merge into left sibling, sum = leaf->children - 1*/
-        memmove(&key(left)[left->children], &key(leaf)[0], remove * sizeof(key_t));
-        memmove(&data(left)[left->children], &data(leaf)[0], remove * sizeof(off_t));
-        memmove(&key(left)[left->children + remove], &key(leaf)[remove + 1], (leaf->children - remove - 1) * sizeof(key_t));
-        memmove(&data(left)[left->children + remove], &data(leaf)[remove + 1], (leaf->children - remove - 1) * sizeof(off_t));
-        left->children += leaf->children - 1;
+        return tree->shared != NULL && !tree->shared->writer;
 }
 
-static void leaf_shift_from_right(struct bplus_tree *tree, struct bplus_node *leaf,
-                                  struct bplus_node *right, struct bplus_node *parent,
-                                  int parent_key_index)
+/* keep what nested calls write from readers until the outer one ends */
+static void shared_hold(struct bplus_tree *tree, int hold)
 {
-        /* borrow the first element from right sibling */
-        key(leaf)[leaf->children] = key(right)[0];
-        data(leaf)[leaf->children] = data(right)[0];
-        leaf->children++;
-
-        /* left shift in right sibling */
-        memmove(&key(right)[0], &key(right)[1], (right->children - 1) * sizeof(key_t));
-        memmove(&data(right)[0], &data(right)[1], (right->children - 1) * sizeof(off_t));
-        right->children--;
-
-        /* update parent key */
-        key(parent)[parent_key_index] = key(right)[0];
+        if (tree->shared != NULL) {
+                tree->shared->depth += hold ? 1 : -1;
+        }
 }
 
-static inline void leaf_merge_from_right(struct bplus_tree *tree, struct bplus_node *leaf,
-                                         struct bplus_node *right)
+static void shared_write_begin(struct bplus_tree *tree)
 {
-        memmove(&key(leaf)[leaf->children], &key(right)[0], right->children * sizeof(key_t));
-        memmove(&data(leaf)[leaf->children], &data(right)[0], right->children * sizeof(off_t));
-        leaf->children += right->children;
+        int i;
+        struct bplus_shared *shared = tree->shared;
+        struct shared_pool *pool = shared->pool;
+
+        assert(shared->writer);
+        if (shared->locked) {
+                return;
+        }
+        shared_lock(&pool->lock, 1);
+        shared->locked = 1;
+
+        /* no new call of readers begins, wait for those in progress */
+        __atomic_store_n(&pool->writer_active, 1, __ATOMIC_SEQ_CST);
+        int slots = __atomic_load_n(&pool->slots, __ATOMIC_SEQ_CST);
+        for (i = 0; i < slots; i++) {
+                if (i != shared->slot && shared_lock(&shared->slots[i].lock, 1) >= 0) {
+                        pthread_mutex_unlock(&shared->slots[i].lock);
+                }
+        }
 }
 
-static inline void leaf_simple_remove(struct bplus_tree *tree, struct bplus_node *leaf, int remove)
+/* let readers see what the operation has written */
+static void shared_commit(struct bplus_tree *tree)
 {
-        memmove(&key(leaf)[remove], &key(leaf)[remove + 1], (leaf->children - remove - 1) * sizeof(key_t));
-        memmove(&data(leaf)[remove], &data(leaf)[remove + 1], (leaf->children - remove - 1) * sizeof(off_t));
-        leaf->children--;
+        struct bplus_shared *shared = tree->shared;
+        if (shared == NULL || !shared->locked || shared->depth > 0) {
+                return;
+        }
+
+        shared->pool->root = tree->root;
+        shared->pool->file_size = tree->file_size;
+        shared->pool->level = tree->level;
+        shared->locked = 0;
+        __atomic_store_n(&shared->pool->writer_active, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&shared->pool->lock);
 }
 
-static int leaf_remove(struct bplus_tree *tree, struct bplus_node *leaf, key_t key)
+/* calls of a reader see the tree as of the last operation of the writer */
+static void shared_read_begin(struct bplus_tree *tree)
 {
-        int remove = key_binary_search(leaf, key);
-        if (remove < 0) {
-                /* Not exist */
-                return -1;
+        struct bplus_shared *shared = tree->shared;
+        if (shared == NULL || shared->writer || shared->depth++ > 0) {
+                return;
         }
 
-        /* fetch from free node caches */
-        int i = ((char *) leaf - tree->caches) / _block_size;
-        tree->used[i] = 1;
-
-        if (leaf->parent == INVALID_OFFSET) {
-                /* leaf as the root */
-                if (leaf->children == 1) {
-                        /* delete the only last node */
-                        assert(key == key(leaf)[0]);
-                        tree->root = INVALID_OFFSET;
-                        tree->level = 0;
-                        node_delete(tree, leaf, NULL, NULL);
-                } else {
-                        leaf_simple_remove(tree, leaf, remove);
-                        node_flush(tree, leaf);
+        struct shared_pool *pool = shared->pool;
+        pthread_mutex_t *slot = &shared->slots[shared->slot].lock;
+        for (; ;) {
+                shared_lock(slot, 1);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (!__atomic_load_n(&pool->writer_active, __ATOMIC_SEQ_CST)) {
+                        break;
                 }
-        } else if (leaf->children <= (_max_entries + 1) / 2) {
-                struct bplus_node *l_sib = node_fetch(tree, leaf->prev);
-                struct bplus_node *r_sib = node_fetch(tree, leaf->next);
-                struct bplus_node *parent = node_fetch(tree, leaf->parent);
+                /* until the operation of the writer ends, or it has died */
+                pthread_mutex_unlock(slot);
+                if (shared_lock(&pool->lock, 1) > 0) {
+                        __atomic_store_n(&pool->writer_active, 0, __ATOMIC_SEQ_CST);
+                }
+                pthread_mutex_unlock(&pool->lock);
+        }
+        tree->root = shared->pool->root;
+        tree->file_size = shared->pool->file_size;
+        tree->level = shared->pool->level;
+}
 
-                i = parent_key_index(parent, key(leaf)[0]);
+static void shared_read_end(struct bplus_tree *tree)
+{
+        struct bplus_shared *shared = tree->shared;
+        if (shared == NULL || shared->writer || --shared->depth > 0) {
+                return;
+        }
+        pthread_mutex_unlock(&shared->slots[shared->slot].lock);
+}
 
-                /* decide which sibling to be borrowed from */
-                if (sibling_select(l_sib, r_sib, parent, i) == LEFT_SIBLING) {
-                        if (l_sib->children > (_max_entries + 1) / 2) {
-                                leaf_shift_from_left(tree, leaf, l_sib, parent, i, remove);
-                                /* flush leaves */
-                                node_flush(tree, leaf);
-                                node_flush(tree, l_sib);
-                                node_flush(tree, r_sib);
-                                node_flush(tree, parent);
-                        } else {
-                                leaf_merge_into_left(tree, leaf, l_sib, i, remove);
-                                /* delete empty leaf and flush */
-                                node_delete(tree, leaf, l_sib, r_sib);
-                                /* trace upwards */
-                                non_leaf_remove(tree, parent, i);
-                        }
-                } else {
-                        /* remove at first in case of overflow during merging with sibling */
-                        leaf_simple_remove(tree, leaf, remove);
+static int lock_byte(int fd, int type, int byte, int wait)
+{
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = type;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = byte;
+        fl.l_len = 1;
+        /* owned by the open file, not the process which may attach twice */
+        return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+}
 
-                        if (r_sib->children > (_max_entries + 1) / 2) {
-                                leaf_shift_from_right(tree, leaf, r_sib, parent, i + 1);
-                                /* flush leaves */
-                                node_flush(tree, leaf);
-                                node_flush(tree, l_sib);
-                                node_flush(tree, r_sib);
-                                node_flush(tree, parent);
-                        } else {
-                                leaf_merge_from_right(tree, leaf, r_sib);
-                                /* delete empty right sibling flush */
-                                struct bplus_node *rr_sib = node_fetch(tree, r_sib->next);
-                                node_delete(tree, r_sib, leaf, rr_sib);
-                                node_flush(tree, l_sib);
-                                /* trace upwards */
-                                non_leaf_remove(tree, parent, i + 1);
-                        }
+static void shared_pool_init(struct bplus_tree *tree, struct bplus_shared *shared, long sets)
+{
+        long i;
+        struct shared_pool *pool = shared->pool;
+
+        pool->config = boot_config();
+        pool->sets = sets;
+        pool->root = tree->root;
+        pool->file_size = tree->file_size;
+        pool->level = tree->level;
+        for (i = 0; i < sets * SHARED_POOL_WAYS; i++) {
+                shared->frames[i].offset = INVALID_OFFSET;
+        }
+
+        shared_lock_init(&pool->lock);
+        for (i = 0; i < sets; i++) {
+                shared_lock_init(&shared->set_locks[i]);
+        }
+        for (i = 0; i < SHARED_POOL_SLOTS; i++) {
+                shared_lock_init(&shared->slots[i].lock);
+        }
+        pool->magic = SHARED_POOL_MAGIC;
+}
+
+static int shared_attach(struct bplus_tree *tree, struct bplus_shared *shared, long blocks)
+{
+        struct stat st;
+        long sets = 1;
+
+        /* one segment per index file wherever it is opened from */
+        if (fstat(tree->fd, &st) != 0) {
+                return -1;
+        }
+        snprintf(shared->name, sizeof(shared->name), "/bplustree-%lx-%lx",
+                 (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+
+        /* the last process which was attached may have died, the pool is
+         * built anew when no other one is attached */
+        int fresh = lock_byte(shared->lock_fd, F_WRLCK, SHARED_LOCK_USERS, 0) == 0;
+        int fd = shm_open(shared->name, O_CREAT | O_RDWR, 0644);
+        if (fd < 0) {
+                fprintf(stderr, "Failed to open shared memory %s!\n", shared->name);
+                return -1;
+        }
+
+        if (fresh) {
+                while (sets * SHARED_POOL_WAYS < blocks) {
+                        sets *= 2;
+                }
+                shared->size = shared_layout(shared, NULL, sets);
+                if (ftruncate(fd, 0) != 0 || ftruncate(fd, shared->size) != 0) {
+                        fprintf(stderr, "Failed to allocate shared memory %s!\n", shared->name);
+                        close(fd);
+                        return -1;
                 }
         } else {
-                leaf_simple_remove(tree, leaf, remove);
-                node_flush(tree, leaf);
+                if (fstat(fd, &st) != 0) {
+                        close(fd);
+                        return -1;
+                }
+                shared->size = st.st_size;
         }
 
-        return 0;
-}
+        void *map = mmap(NULL, shared->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                fprintf(stderr, "Failed to map shared memory %s!\n", shared->name);
+                return -1;
+        }
+        shared->pool = map;
+
+        if (fresh) {
+                shared_layout(shared, map, sets);
+                shared_pool_init(tree, shared, sets);
+        } else if (shared->pool->magic != SHARED_POOL_MAGIC || shared->pool->config != boot_config()) {
+                fprintf(stderr, "Index is shared in another format!\n");
+                munmap(map, shared->size);
+                return -1;
+        } else {
+                shared_layout(shared, map, shared->pool->sets);
+        }
 
-static int bplus_tree_delete(struct bplus_tree *tree, key_t key)
-{
-        struct bplus_node *node = node_seek(tree, tree->root);
-        while (node != NULL) {
-                if (is_leaf(node)) {
-                        return leaf_remove(tree, node, key);
-                } else {
-                        int i = key_binary_search(node, key);
-                        if (i >= 0) {
-                                node = node_seek(tree, sub(node)[i + 1]);
-                        } else {
-                                i = -i - 1;
-                                node = node_seek(tree, sub(node)[i]);
-                        }
+        /* the slot of a process gone is free again */
+        struct shared_pool *pool = shared->pool;
+        for (shared->slot = 0; shared->slot < SHARED_POOL_SLOTS; shared->slot++) {
+                if (lock_byte(shared->lock_fd, F_WRLCK, SHARED_LOCK_SLOTS + shared->slot, 0) == 0) {
+                        break;
                 }
         }
-        return -1;
-}
+        if (shared->slot == SHARED_POOL_SLOTS) {
+                fprintf(stderr, "Too many processes share the index!\n");
+                munmap(map, shared->size);
+                return -1;
+        }
+        if (shared->slot >= pool->slots) {
+                __atomic_store_n(&pool->slots, shared->slot + 1, __ATOMIC_SEQ_CST);
+        }
 
-long bplus_tree_get(struct bplus_tree *tree, key_t key)
-{
-        return bplus_tree_search(tree, key);
+        lock_byte(shared->lock_fd, F_RDLCK, SHARED_LOCK_USERS, 0);
+        return 0;
 }
 
-int bplus_tree_put(struct bplus_tree *tree, key_t key, long data)
+static void shared_detach(struct bplus_tree *tree)
 {
-        if (data) {
-                return bplus_tree_insert(tree, key, data);
-        } else {
-                return bplus_tree_delete(tree, key);
+        struct bplus_shared *shared = tree->shared;
+
+        shared_commit(tree);
+        lock_byte(shared->lock_fd, F_WRLCK, SHARED_LOCK_ATTACH, 1);
+        /* the pool of blocks goes with the last process */
+        if (lock_byte(shared->lock_fd, F_WRLCK, SHARED_LOCK_USERS, 0) == 0) {
+                shm_unlink(shared->name);
         }
+        munmap(shared->pool, shared->size);
+        close(shared->lock_fd);
+        free(shared);
+        tree->shared = NULL;
 }
 
-long bplus_tree_get_range(struct bplus_tree *tree, key_t key1, key_t key2)
+/* Share a pool of blocks in memory with the other processes opening the
+ * index at filename, sized by the first one attached. One of them is the
+ * writer, the rest only read the tree through bplus_tree_get(),
+ * bplus_tree_get_batch(), bplus_tree_get_range(), bplus_tree_walk() and the
+ * rank queries, and see it as of the last operation of the writer. Changes
+ * still in its memtable are seen once merged. Blocks of 0 leaves the pool */
+int bplus_tree_shared_enable(struct bplus_tree *tree, long blocks, int writer)
 {
-        long start = -1;
-        key_t min = key1 <= key2 ? key1 : key2;
-        key_t max = min == key1 ? key2 : key1;
+        char path[1024 + 8];
 
-        struct bplus_node *node = node_seek(tree, tree->root);
-        while (node != NULL) {
-                int i = key_binary_search(node, min);
-                if (is_leaf(node)) {
-                        if (i < 0) {
-                                i = -i - 1;
-                                if (i >= node->children) {
-                                        node = node_seek(tree, node->next);
-                                }
-                        }
-                        while (node != NULL && key(node)[i] <= max) {
-                                start = data(node)[i];
-                                if (++i >= node->children) {
-                                        node = node_seek(tree, node->next);
-                                        i = 0;
-                                }
-                        }
-                        break;
-                } else {
-                        if (i >= 0) {
-                                node = node_seek(tree, sub(node)[i + 1]);
-                        } else  {
-                                i = -i - 1;
-                                node = node_seek(tree, sub(node)[i]);
-                        }
+        if (blocks <= 0) {
+                if (tree->shared != NULL) {
+                        shared_detach(tree);
                 }
+                return 0;
+        }
+        if (tree->shared != NULL) {
+                fprintf(stderr, "Index is shared already!\n");
+                return -1;
+        }
+        if (tree->wb != NULL) {
+                fprintf(stderr, "Blocks written back in background cannot be shared!\n");
+                return -1;
         }
 
-        return start;
+        struct bplus_shared *shared = calloc(1, sizeof(*shared));
+        assert(shared != NULL);
+        shared->writer = writer;
+        snprintf(path, sizeof(path), "%.*s.lock", (int) (strlen(tree->filename) - strlen(".boot")), tree->filename);
+        shared->lock_fd = open(path, O_CREAT | O_RDWR, 0644);
+        if (shared->lock_fd < 0) {
+                fprintf(stderr, "Failed to open lock file %s!\n", path);
+                free(shared);
+                return -1;
+        }
+
+        lock_byte(shared->lock_fd, F_WRLCK, SHARED_LOCK_ATTACH, 1);
+        if (writer && lock_byte(shared->lock_fd, F_WRLCK, SHARED_LOCK_WRITER, 0) != 0) {
+                fprintf(stderr, "Index has a writer already!\n");
+                close(shared->lock_fd);
+                free(shared);
+                return -1;
+        }
+        if (shared_attach(tree, shared, blocks) != 0) {
+                close(shared->lock_fd);
+                free(shared);
+                return -1;
+        }
+        lock_byte(shared->lock_fd, F_UNLCK, SHARED_LOCK_ATTACH, 0);
+        tree->shared = shared;
+
+        if (writer) {
+                /* the tree of a writer that went away is replaced */
+                shared_write_begin(tree);
+                shared_commit(tree);
+        } else {
+                /* other processes change what they would answer */
+                bplus_tree_cache_enable(tree, 0);
+                free(tree->bloom);
+                tree->bloom = NULL;
+        }
+        return 0;
 }
 
-int bplus_open(char *filename)
+void bplus_tree_shared_stats(struct bplus_tree *tree, struct bplus_shared_stats *stats)
 {
-        return open(filename, O_CREAT | O_RDWR, 0644);
+        memset(stats, 0, sizeof(*stats));
+        if (tree->shared != NULL) {
+                stats->blocks = tree->shared->pool->sets * SHARED_POOL_WAYS;
+                stats->bytes = tree->shared->size;
+                stats->hits = tree->shared->hits;
+                stats->misses = tree->shared->misses;
+        }
 }
 
-void bplus_close(int fd)
+static int split_add(key_t key, long data, void *arg)
 {
-        fsync(fd);
-        close(fd);
+        bulk_stream_add(arg, key, data);
+        return 0;
 }
 
-static off_t str_to_hex(char *c, int len)
+/* a new index at filename of the entries of tree in [min, max] */
+static int split_side(struct bplus_tree *tree, key_t min, key_t max, char *filename)
 {
-        off_t offset = 0;
-        while (len-- > 0) {
-                if (isdigit(*c)) {
-                        offset = offset * 16 + *c - '0';
-                } else if (isxdigit(*c)) {
-                        if (islower(*c)) {
-                                offset = offset * 16 + *c - 'a' + 10;
-                        } else {
-                                offset = offset * 16 + *c - 'A' + 10;
-                        }
+        char name[1024 + 16];
+        struct bulk_stream dry, bs;
+
+        if (strlen(filename) >= 1024) {
+                fprintf(stderr, "Index file name too long!\n");
+                return -1;
+        }
+        snprintf(name, sizeof(name), "%s.boot", filename);
+        if (strcmp(name, tree->filename) == 0) {
+                fprintf(stderr, "Index cannot be split onto itself!\n");
+                return -1;
+        }
+
+        /* nothing of a previous index at filename is kept */
+        unlink(filename);
+        unlink(name);
+        snprintf(name, sizeof(name), "%s.bloom", filename);
+        unlink(name);
+        snprintf(name, sizeof(name), "%s.manifest", filename);
+        unlink(name);
+        snprintf(name, sizeof(name), "%s.undo", filename);
+        unlink(name);
+        struct bplus_tree *side = bplus_tree_init_flags(filename, tree->block_size, tree->flags & ~BPLUS_TREE_READ_ONLY);
+        if (side == NULL) {
+                return -1;
+        }
+
+        if (min <= max && multi_valued()) {
+                /* values of a key go to its posting cells in order */
+                bplus_tree_walk(tree, min, max, merge_append, side);
+        } else if (min <= max) {
+                bulk_stream_begin(&dry, side, NULL);
+                bplus_tree_walk(tree, min, max, split_add, &dry);
+                bulk_stream_end(&dry);
+                if (dry.entries > 0) {
+                        bulk_stream_begin(&bs, side, &dry);
+                        bplus_tree_walk(tree, min, max, split_add, &bs);
+                        bulk_stream_end(&bs);
                 }
-                c++;
         }
-        return offset;
+        bplus_tree_deinit(side);
+        return 0;
 }
 
-static inline void hex_to_str(off_t offset, char *buf, int len)
+/* Split tree at key into a left index of the keys less than it and a right
+ * one of the rest, tree itself is left as it is. Each side is walked out of
+ * tree in key order and written with full leaves as by a bulk load, so the
+ * new indexes take no more room than the entries they hold */
+int bplus_tree_split_at(struct bplus_tree *tree, key_t key, char *out_left, char *out_right)
 {
-        const static char *hex = "0123456789ABCDEF";
-        while (len-- > 0) {
-                buf[len] = hex[offset & 0xf];
-                offset >>= 4;
+        int ret;
+
+        if (strcmp(out_left, out_right) == 0) {
+                fprintf(stderr, "Both sides of a split cannot be one index!\n");
+                return -1;
         }
-}
 
-static inline off_t offset_load(int fd)
-{
-        char buf[ADDR_STR_WIDTH];
-        ssize_t len = read(fd, buf, sizeof(buf));
-        return len > 0 ? str_to_hex(buf, sizeof(buf)) : INVALID_OFFSET;
+        /* both sides as of one operation of the writer if tree is shared */
+        shared_read_begin(tree);
+        if (key > INT_MIN) {
+                ret = split_side(tree, INT_MIN, key - 1, out_left);
+        } else {
+                /* no key is less than the least one */
+                ret = split_side(tree, 0, -1, out_left);
+        }
+        if (ret == 0) {
+                ret = split_side(tree, key, INT_MAX, out_right);
+        }
+        shared_read_end(tree);
+        return ret;
 }
 
-static inline ssize_t offset_store(int fd, off_t offset)
+/* node order and leaf entries fitting in a block of current format */
+static void node_capacity_set(void)
 {
-        char buf[ADDR_STR_WIDTH];
-        hex_to_str(offset, buf, sizeof(buf));
-        return write(fd, buf, sizeof(buf));
+        /* compact nodes link blocks with 32-bit numbers */
+        int header = compact() ? sizeof(struct bplus_block) : sizeof(struct bplus_node);
+        int link = compact() ? sizeof(uint32_t) : sizeof(off_t);
+        int space = _block_size - header;
+
+        /* augmented sub-node entries carry subtree counts */
+        int entry = sizeof(key_t) + link + (augmented() ? sizeof(long) : 0);
+        _max_order = space / entry;
+        if (blocked()) {
+                while (_max_order > 0 && (_max_order - 1) * sizeof(key_t) + _max_order * (entry - sizeof(key_t)) +
+                                         fence_size(_max_order - 1) * sizeof(key_t) > (size_t) space) {
+                        _max_order--;
+                }
+        }
+
+        _max_entries = space / (sizeof(key_t) + sizeof(long) + (slotted() ? sizeof(short) : 0));
+        if (compressed()) {
+                /* a compressed leaf of this many entries fits in a block however
+                 * wide its fields are, so both halves of a split one do */
+                int fit = (space - (int) (sizeof(struct leaf_pack) + sizeof(uint64_t))) /
+                          (int) (sizeof(key_t) + sizeof(long));
+                _max_entries = 2 * fit - 1;
+        }
+        if (slotted() && _max_entries > MAX_SLOTTED_ENTRIES) {
+                _max_entries = MAX_SLOTTED_ENTRIES;
+        }
+
+        if (buffered()) {
+                /* fan-out about the square root of the entries a block holds,
+                 * the rest of a non-leaf node buffers messages */
+                int order = 3;
+                while ((order + 1) * (order + 1) * entry <= space) {
+                        order++;
+                }
+                _max_order = order + BUFFER_SPLIT_SLACK;
+                _buffer_offset = sizeof(struct bplus_node) + (_max_order - 1) * sizeof(key_t) +
+                                 _max_order * sizeof(off_t) + non_leaf_tail_size();
+                _buffer_offset = (_buffer_offset + 7) / 8 * 8;
+                _max_messages = (_block_size - _buffer_offset - (int) sizeof(struct message_buffer)) /
+                                (int) sizeof(struct bplus_message);
+        }
+
+        _max_postings = (_block_size - (int) sizeof(struct bplus_node)) / (int) sizeof(long);
+        /* a cell block starts with the class of its cells, larger classes
+         * take two cells a block at least */
+        for (_cell_classes = 0; _cell_classes < MAX_CELL_CLASSES; _cell_classes++) {
+                int cell = 64 << _cell_classes;
+                int room = _block_size - (int) sizeof(struct bplus_node) - (int) sizeof(long);
+                int n = room * 8 / (cell * 8 + 1);
+                while (n > 0 && (n + 63) / 64 * 8 + n * cell > room) {
+                        n--;
+                }
+                if (n < (_cell_classes > 0 ? 2 : 1)) {
+                        break;
+                }
+                _max_cells[_cell_classes] = n;
+                _cell_map_size[_cell_classes] = (n + 63) / 64 * 8;
+        }
+
+        /* nodes in memory keep off_t links */
+        _node_size = _block_size;
+        if (compact() || compressed()) {
+                int leaf = _max_entries * (sizeof(key_t) + sizeof(long) + (slotted() ? sizeof(short) : 0));
+                int non_leaf = compact() ? (int) ((_max_order - 1) * sizeof(key_t) + _max_order * sizeof(off_t) +
+                                                  non_leaf_tail_size()) : space;
+                _node_size = sizeof(struct bplus_node) + (leaf > non_leaf ? leaf : non_leaf);
+                /* room to read a whole block behind the header */
+                if (_node_size < _block_size + (int) (sizeof(struct bplus_node) - sizeof(struct bplus_block))) {
+                        _node_size = _block_size + sizeof(struct bplus_node) - sizeof(struct bplus_block);
+                }
+        }
+        if (compressed()) {
+                /* and behind the arrays to unpack a leaf from */
+                _node_size = (_node_size + 7) / 8 * 8 + _block_size;
+        }
 }
 
-struct bplus_tree *bplus_tree_init(char *filename, int block_size)
+struct bplus_tree *bplus_tree_init_flags(char *filename, int block_size, int flags)
 {
         int i;
+        off_t offset, root = INVALID_OFFSET, file_size = 0;
+        char boot[1024 + 16];
         struct bplus_node node;
 
         if (strlen(filename) >= 1024) {
@@ -1070,76 +7936,342 @@ struct bplus_tree *bplus_tree_init(char *filename, int block_size)
                 return NULL;
         }
 
+        /* a crash in write-back mode leaves the index to be rolled back */
+        int read_only = flags & BPLUS_TREE_READ_ONLY;
+        if (!read_only && undo_recover(filename) != 0) {
+                return NULL;
+        }
+
+        /* load index boot file, the format of an existing index overrides
+         * the one requested */
+        snprintf(boot, sizeof(boot), "%s.boot", filename);
+        int fd = open(boot, read_only ? O_RDONLY : O_RDWR, 0644);
+        if (read_only && (fd < 0 || access(filename, R_OK) != 0)) {
+                fprintf(stderr, "No index at %s!\n", filename);
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return NULL;
+        }
+        if (fd >= 0) {
+                root = offset_load(fd);
+                off_t config = offset_load(fd);
+                block_size = config & 0xffffffff;
+                flags = (flags & ~FORMAT_FLAGS) | ((config >> 32) & FORMAT_FLAGS);
+                file_size = offset_load(fd);
+        }
+
+        /* checked before the format is set, which trees open already use */
+        if ((flags & BPLUS_TREE_BUFFERED_NODES) &&
+            (flags & (BPLUS_TREE_AUGMENTED | BPLUS_TREE_COMPACT_NODES | BPLUS_TREE_MULTI_VALUES))) {
+                fprintf(stderr, "Buffered nodes can be neither augmented, compact nor multi-valued!\n");
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return NULL;
+        }
+
+        /* in-node search strategy */
+        int search_mode = 0;
+        if (flags & BPLUS_TREE_ADAPTIVE_SEARCH) {
+                search_mode = BPLUS_TREE_ADAPTIVE_SEARCH;
+        } else if (flags & BPLUS_TREE_INTERPOLATION_SEARCH) {
+                search_mode = BPLUS_TREE_INTERPOLATION_SEARCH;
+        }
+
+        /* the format is process-wide, trees open at once share it */
+        pthread_mutex_lock(&_format_lock);
+        if (_open_trees > 0 && (block_size != _block_size || (flags & FORMAT_FLAGS) != _format_flags ||
+                                search_mode != _key_search_mode)) {
+                pthread_mutex_unlock(&_format_lock);
+                fprintf(stderr, "Trees open at once must share a format and block size!\n");
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return NULL;
+        }
+
+        /* no tree is open in another format to be changed below */
         _block_size = block_size;
-        _max_order = (block_size - sizeof(node)) / (sizeof(key_t) + sizeof(off_t));
-        _max_entries = (block_size - sizeof(node)) / (sizeof(key_t) + sizeof(long));
-        if (_max_order <= 2) {
+        _format_flags = flags & FORMAT_FLAGS;
+        _key_search_mode = search_mode;
+        node_capacity_set();
+        if (_max_order <= 2 || _max_entries < 1 || (buffered() && _max_messages < 2) ||
+            (multi_valued() && _cell_classes < 1)) {
+                pthread_mutex_unlock(&_format_lock);
                 fprintf(stderr, "block size is too small for one node!\n");
+                if (fd >= 0) {
+                        close(fd);
+                }
                 return NULL;
         }
+        _open_trees++;
+        pthread_mutex_unlock(&_format_lock);
 
         struct bplus_tree *tree = calloc(1, sizeof(*tree));
         assert(tree != NULL);
+        tree->flags = flags;
+        tree->bulk_spill = BULK_SPILL_ENTRIES;
+        for (i = 0; i < MAX_CELL_CLASSES; i++) {
+                tree->posting_cells[i] = INVALID_OFFSET;
+        }
         list_init(&tree->free_blocks);
-        strcpy(tree->filename, filename);
+        strcpy(tree->filename, boot);
+        tree->root = root;
+        tree->file_size = file_size;
 
-        /* load index boot file */
-        int fd = open(strcat(tree->filename, ".boot"), O_RDWR, 0644);
         if (fd >= 0) {
-                tree->root = offset_load(fd);
-                _block_size = offset_load(fd);
-                tree->file_size = offset_load(fd);
                 /* load free blocks */
-                while ((i = offset_load(fd)) != INVALID_OFFSET) {
+                while ((offset = offset_load(fd)) != INVALID_OFFSET) {
                         struct free_block *block = malloc(sizeof(*block));
                         assert(block != NULL);
-                        block->offset = i;
+                        block->offset = offset;
                         list_add(&block->link, &tree->free_blocks);
                 }
                 fsync(fd);
                 close(fd);
-        } else {
-                tree->root = INVALID_OFFSET;
-                _block_size = block_size;
-                tree->file_size = 0;
         }
 
         /* set order and entries */
-        _max_order = (_block_size - sizeof(node)) / (sizeof(key_t) + sizeof(off_t));
-        _max_entries = (_block_size - sizeof(node)) / (sizeof(key_t) + sizeof(long));
+        tree->block_size = _block_size;
         printf("config node order:%d and leaf entries:%d\n", _max_order, _max_entries);
 
+        /* load bloom filter if it has been enabled before */
+        bloom_load(tree);
+
         /* init free node caches */
-        tree->caches = malloc(_block_size * MIN_CACHE_NUM);
+        tree->caches = malloc(_node_size * MIN_CACHE_NUM);
 
         /* open data file */
-        tree->fd = bplus_open(filename);
+        tree->fd = read_only ? open(filename, O_RDONLY) : bplus_open(filename);
         assert(tree->fd >= 0);
+
+        /* warm up with what the last run looked up */
+        if (!read_only) {
+                warmup_start(tree);
+        }
         return tree;
 }
 
+struct bplus_tree *bplus_tree_init(char *filename, int block_size)
+{
+        return bplus_tree_init_flags(filename, block_size, 0);
+}
+
 void bplus_tree_deinit(struct bplus_tree *tree)
 {
-        int fd = open(tree->filename, O_CREAT | O_RDWR, 0644);
-        assert(fd >= 0);
-        assert(offset_store(fd, tree->root) == ADDR_STR_WIDTH);
-        assert(offset_store(fd, _block_size) == ADDR_STR_WIDTH);
-        assert(offset_store(fd, tree->file_size) == ADDR_STR_WIDTH);
+        if (tree->memtable != NULL) {
+                bplus_tree_memtable_enable(tree, 0);
+        }
+        if (tree->wb != NULL) {
+                writeback_disable(tree);
+        }
+        if (tree->backup != NULL) {
+                bplus_tree_backup_end(tree);
+        }
+        if (tree->trace != NULL) {
+                bplus_tree_trace_end(tree);
+        }
+        if (tree->replica != NULL) {
+                bplus_tree_replicate_end(tree);
+        }
+        if (tree->manifest != NULL) {
+                manifest_disable(tree);
+        }
+        bplus_tree_warmup_wait(tree);
 
-        /* store free blocks in files for future reuse */
+        /* the boot file and the bloom filter are the writer's */
+        int reader = shared_reader(tree) || (tree->flags & BPLUS_TREE_READ_ONLY);
+        if (tree->shared != NULL) {
+                shared_detach(tree);
+        }
+        if (!reader) {
+                boot_store(tree);
+        }
         struct list_head *pos, *n;
         list_for_each_safe(pos, n, &tree->free_blocks) {
                 list_del(pos);
-                struct free_block *block = list_entry(pos, struct free_block, link);
-                assert(offset_store(fd, block->offset) == ADDR_STR_WIDTH);
-                free(block);
+                free(list_entry(pos, struct free_block, link));
+        }
+        if (!reader) {
+                bloom_store(tree);
+        }
+        if (tree->map != NULL) {
+                munmap(tree->map, tree->map_size);
         }
-
-        fsync(fd);
-        close(fd);
         bplus_close(tree->fd);
+        free(tree->hot);
+        free(tree->bloom);
+        free(tree->changed);
         free(tree->caches);
         free(tree);
+
+        pthread_mutex_lock(&_format_lock);
+        _open_trees--;
+        pthread_mutex_unlock(&_format_lock);
+}
+
+/* blocks read at once by bplus_tree_analyze() */
+#define ANALYZE_CHUNK_BLOCKS 256
+
+/* what the header of a block says, whatever the node format is */
+struct block_info {
+        long parent;
+        long next;
+        int type;
+        int children;
+        int depth;
+        long messages;
+};
+
+static void block_info_read(char *buf, struct block_info *info)
+{
+        off_t parent, next;
+
+        if (compact()) {
+                struct bplus_block *block = (struct bplus_block *) buf;
+                parent = block_offset(block->parent);
+                next = block_offset(block->next);
+                info->type = block->type;
+                info->children = block->children;
+        } else {
+                struct bplus_node *node = (struct bplus_node *) buf;
+                parent = node->parent;
+                next = node->next;
+                info->type = node->type;
+                info->children = node->children;
+        }
+
+        /* buffered nodes are never compact */
+        info->messages = buffered() && info->type != BPLUS_TREE_LEAF ? buffer(buf)->count : 0;
+        info->parent = parent == INVALID_OFFSET ? -1 : parent / _block_size;
+        info->next = next == INVALID_OFFSET ? -1 : next / _block_size;
+        info->depth = -2;
+}
+
+/* depth of a block below the root by its parent links, -1 if it is not
+ * linked to the root */
+static int block_depth(struct block_info *infos, long blocks, long root, long b)
+{
+        long path[BPLUS_STATS_LEVELS];
+        int n = 0, depth;
+
+        while (infos[b].depth == -2) {
+                if (b == root) {
+                        infos[b].depth = 0;
+                        break;
+                }
+                if (n == BPLUS_STATS_LEVELS || infos[b].parent < 0 || infos[b].parent >= blocks) {
+                        infos[b].depth = -1;
+                        break;
+                }
+                path[n++] = b;
+                b = infos[b].parent;
+        }
+
+        depth = infos[b].depth;
+        while (n-- > 0) {
+                depth = depth < 0 ? -1 : depth + 1;
+                infos[path[n]].depth = depth >= BPLUS_STATS_LEVELS ? -1 : depth;
+                depth = infos[path[n]].depth;
+        }
+        return depth;
+}
+
+/* Scan the index file sequentially and gather the shape of the tree, the
+ * headers of all blocks are kept and levels are resolved by parent links
+ * afterwards so that no node is read twice */
+int bplus_tree_analyze(struct bplus_tree *tree, struct bplus_tree_stats *stats)
+{
+        long b, i;
+        long blocks = tree->file_size / _block_size;
+
+        writeback_drain(tree);
+        memset(stats, 0, sizeof(*stats));
+        stats->block_size = _block_size;
+        stats->order = _max_order;
+        stats->entries = _max_entries;
+        stats->file_size = tree->file_size;
+        stats->blocks = blocks;
+        if (blocks == 0) {
+                return 0;
+        }
+
+        struct block_info *infos = malloc(blocks * sizeof(*infos));
+        char *buf = malloc((long) ANALYZE_CHUNK_BLOCKS * _block_size);
+        if (infos == NULL || buf == NULL) {
+                fprintf(stderr, "Failed to allocate analyzer buffers!\n");
+                free(infos);
+                free(buf);
+                return -1;
+        }
+
+        posix_fadvise(tree->fd, 0, tree->file_size, POSIX_FADV_SEQUENTIAL);
+        for (b = 0; b < blocks; b += ANALYZE_CHUNK_BLOCKS) {
+                long n = blocks - b < ANALYZE_CHUNK_BLOCKS ? blocks - b : ANALYZE_CHUNK_BLOCKS;
+                long len = pread(tree->fd, buf, n * _block_size, b * _block_size);
+                assert(len == n * _block_size);
+                for (i = 0; i < n; i++) {
+                        block_info_read(buf + i * _block_size, &infos[b + i]);
+                }
+        }
+        free(buf);
+
+        /* free blocks keep stale nodes */
+        struct list_head *pos;
+        list_for_each(pos, &tree->free_blocks) {
+                struct free_block *block = list_entry(pos, struct free_block, link);
+                infos[block->offset / _block_size].depth = -1;
+                stats->free_blocks++;
+        }
+
+        long root = tree->root == INVALID_OFFSET ? -1 : tree->root / _block_size;
+        for (b = 0; b < blocks; b++) {
+                if (infos[b].depth != -1 && (infos[b].type == BPLUS_TREE_POSTING ||
+                                             infos[b].type == BPLUS_TREE_POSTING_CELLS)) {
+                        stats->posting_blocks++;
+                        continue;
+                }
+                int d = infos[b].depth == -1 ? -1 : block_depth(infos, blocks, root, b);
+                if (d < 0) {
+                        continue;
+                }
+
+                struct block_info *info = &infos[b];
+                int capacity = info->type == BPLUS_TREE_LEAF ? _max_entries : _max_order;
+                int bucket = (long) info->children * BPLUS_STATS_BUCKETS / capacity;
+                if (bucket >= BPLUS_STATS_BUCKETS) {
+                        bucket = BPLUS_STATS_BUCKETS - 1;
+                }
+                stats->nodes[d]++;
+                stats->slots[d] += info->children;
+                stats->messages += info->messages;
+                stats->fill[d][bucket]++;
+                if (d + 1 > stats->height) {
+                        stats->height = d + 1;
+                }
+                if (info->type == BPLUS_TREE_LEAF) {
+                        stats->keys += info->children;
+                        /* locality of the leaf chain */
+                        if (info->next >= 0) {
+                                stats->leaf_links++;
+                                if (info->next == b + 1) {
+                                        stats->leaf_adjacent++;
+                                } else if (info->next > b) {
+                                        stats->leaf_forward++;
+                                }
+                        }
+                }
+        }
+
+        /* neither in use nor free */
+        stats->lost_blocks = blocks - stats->free_blocks - stats->posting_blocks;
+        for (i = 0; i < stats->height; i++) {
+                stats->lost_blocks -= stats->nodes[i];
+        }
+
+        free(infos);
+        return 0;
 }
 
 #ifdef _BPLUS_TREE_DEBUG
@@ -1165,7 +8297,7 @@ static void node_key_dump(struct bplus_node *node)
         if (is_leaf(node)) {
                 printf("leaf:");
                 for (i = 0; i < node->children; i++) {
-                        printf(" %d", key(node)[i]);
+                        printf(" %d", key(node)[leaf_slot(node, i)]);
                 }
         } else {
                 printf("node:");
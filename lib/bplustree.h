@@ -9,6 +9,10 @@
  * of sibling, parent and node seeking */
 #define MIN_CACHE_NUM 5
 
+/* classes of posting cells, the values a cell holds double from one to the
+ * next */
+#define MAX_CELL_CLASSES 16
+
 #define list_entry(ptr, type, member) \
         ((type *)((char *)(ptr) - (size_t)(&((type *)0)->member)))
 
@@ -27,6 +31,43 @@
 
 typedef int key_t;
 
+/* options of bplus_tree_init_flags(), the format and the search strategy
+ * are process-wide, so trees open at once must share them and the block
+ * size, an index of another one is refused while a tree is open */
+enum {
+        /* in-node search strategy, binary search by default */
+        BPLUS_TREE_INTERPOLATION_SEARCH = 1 << 0,
+        BPLUS_TREE_ADAPTIVE_SEARCH = 1 << 1,
+        /* keep subtree entry counts in non-leaf nodes for rank queries,
+         * fixed when the index is created */
+        BPLUS_TREE_AUGMENTED = 1 << 2,
+        /* leaf entries stay unordered behind a sorted slot directory so that
+         * insertion and removal move 2-byte slots only, fixed at creation */
+        BPLUS_TREE_SLOTTED_LEAVES = 1 << 3,
+        /* non-leaf nodes carry cache-line fence keys for faster descent,
+         * fixed at creation */
+        BPLUS_TREE_BLOCKED_NODES = 1 << 4,
+        /* nodes on disk link 32-bit block numbers under a shrunken header for
+         * higher fan-out and indexes up to 2^32 blocks, fixed at creation */
+        BPLUS_TREE_COMPACT_NODES = 1 << 5,
+        /* keys and data of leaves on disk are bit-packed against the least
+         * of them so that leaves hold more entries, fixed at creation */
+        BPLUS_TREE_COMPRESSED_LEAVES = 1 << 6,
+        /* non-leaf nodes give up fan-out to buffer puts and deletes, which
+         * go down to the leaves in batches. Puts no longer look for the key
+         * and return 0 once queued. Works with neither augmented nor compact
+         * nodes, fixed at creation */
+        BPLUS_TREE_BUFFERED_NODES = 1 << 7,
+        /* a key holds a sorted set of positive values, kept in the leaf while
+         * there is one, in a cell shared with other keys while they fit a
+         * fraction of a block and in a chain of posting blocks beyond, fixed at creation */
+        BPLUS_TREE_MULTI_VALUES = 1 << 8,
+        /* open an existing index without writing to it, for inspection: no
+         * warm-up, no crash roll-back and nothing stored on deinit. The
+         * tree must not be modified */
+        BPLUS_TREE_READ_ONLY = 1 << 9,
+};
+
 struct list_head {
         struct list_head *prev, *next;
 };
@@ -108,6 +149,17 @@ struct bplus_leaf {
 };
 */
 
+struct bplus_backup;
+struct bplus_follower;
+struct bplus_manifest;
+struct bplus_memtable;
+struct bplus_replica;
+struct bplus_shared;
+struct bplus_trace;
+struct bplus_warmup;
+struct bplus_writeback;
+struct hot_entry;
+
 typedef struct free_block {
         struct list_head link;
         off_t offset;
@@ -118,17 +170,215 @@ struct bplus_tree {
         int used[MIN_CACHE_NUM];
         char filename[1024];
         int fd;
+        int flags;
+        int block_size;
         int level;
         off_t root;
         off_t file_size;
         struct list_head free_blocks;
+        /* optional bloom filter short-circuiting lookups of absent keys */
+        unsigned char *bloom;
+        long bloom_bits;
+        int bloom_hashes;
+        /* optional cache of lookup results of hot keys and its hit ratio */
+        struct hot_entry *hot;
+        long hot_mask;
+        long hot_hits;
+        long hot_lookups;
+        /* blocks written since last backup and the backup in progress */
+        unsigned char *changed;
+        long changed_blocks;
+        struct bplus_backup *backup;
+        /* modified blocks kept in memory and written in background */
+        struct bplus_writeback *wb;
+        long written_blocks;
+        /* recent changes kept in key order until merged into leaves */
+        struct bplus_memtable *memtable;
+        /* block of posting cells of each class last seen with a free one */
+        off_t posting_cells[MAX_CELL_CLASSES];
+        /* calls of the public API being recorded */
+        struct bplus_trace *trace;
+        /* follower the written blocks are streamed to */
+        struct bplus_replica *replica;
+        /* pool of blocks in memory shared with other processes */
+        struct bplus_shared *shared;
+        /* blocks looked up lately, saved to warm the next start up */
+        struct bplus_manifest *manifest;
+        /* blocks saved by the last run being read in background */
+        struct bplus_warmup *warmup;
+        /* bulk loading input sorted in memory at most */
+        long bulk_spill;
+        /* read-only mapping of the index for batched lookups */
+        char *map;
+        off_t map_size;
+};
+
+#define BPLUS_STATS_LEVELS 32
+#define BPLUS_STATS_BUCKETS 10
+
+/* shape of an index gathered by bplus_tree_analyze(), levels count from the
+ * root and fill factors are bucketed by tenths of node capacity */
+struct bplus_tree_stats {
+        int block_size;
+        int order;
+        int entries;
+        int height;
+        off_t file_size;
+        long blocks;
+        long free_blocks;
+        /* neither reachable from the root nor on the free list */
+        long lost_blocks;
+        long keys;
+        /* puts and deletes buffered in non-leaf nodes */
+        long messages;
+        /* blocks holding values of multi-valued keys */
+        long posting_blocks;
+        long nodes[BPLUS_STATS_LEVELS];
+        /* sum of entries or sub-nodes in use */
+        long slots[BPLUS_STATS_LEVELS];
+        long fill[BPLUS_STATS_LEVELS][BPLUS_STATS_BUCKETS];
+        /* leaves followed by a next leaf, the one right after it in the
+         * file and one anywhere further ahead */
+        long leaf_links;
+        long leaf_adjacent;
+        long leaf_forward;
+};
+
+#define BPLUS_TRACE_MAGIC 0x52545042  /* "BPTR" */
+#define BPLUS_TRACE_VERSION 1
+
+/* A trace file is a header followed by one record per call, in the byte
+ * order of the machine it was recorded on */
+enum {
+        BPLUS_TRACE_GET,
+        BPLUS_TRACE_PUT,
+        BPLUS_TRACE_GET_RANGE,
+};
+
+struct bplus_trace_header {
+        int magic;
+        int version;
+};
+
+struct bplus_trace_record {
+        /* nanoseconds since recording began */
+        long time;
+        /* data of put or the other key of get_range */
+        long arg;
+        /* what the call returned */
+        long ret;
+        int op;
+        key_t key;
+};
+
+#define BPLUS_REPLICA_MAGIC 0x50455242  /* "BREP" */
+#define BPLUS_REPLICA_VERSION 1
+
+/* A replication stream is a header followed by a record of every block the
+ * leader writes, each followed by the bytes of the block, and a commit
+ * record between operations which makes the blocks before it visible at
+ * the follower. The byte order is that of the leader */
+enum {
+        BPLUS_REPLICA_BLOCK,
+        BPLUS_REPLICA_COMMIT,
 };
 
+struct bplus_replica_header {
+        int magic;
+        int version;
+        /* format flags in the upper half, block size in the lower */
+        long config;
+};
+
+struct bplus_replica_record {
+        /* offset of the block or root of the tree committed */
+        long offset;
+        /* file size and wall clock time in nanoseconds of a commit */
+        long file_size;
+        long time;
+        /* commits before this one */
+        long seq;
+        int type;
+        /* height of the tree committed */
+        int level;
+};
+
+/* progress of a follower gathered by bplus_follower_stats() */
+struct bplus_follower_stats {
+        long commits;
+        long blocks;
+        long bytes;
+        /* nanoseconds from a commit at the leader until it is applied here,
+         * of the last one and the worst */
+        long lag;
+        long max_lag;
+        /* the leader has ended the stream */
+        int done;
+};
+
+/* pool shared by the processes of an index, counters are of this process */
+struct bplus_shared_stats {
+        long blocks;
+        long bytes;
+        long hits;
+        long misses;
+};
+
+/* callback of bplus_tree_walk(), returns non-zero to stop walking,
+ * the tree must not be modified inside. Every value of a multi-valued key
+ * is walked as an entry of its own, so walking from a key to itself goes
+ * through its values */
+typedef int (*bplus_tree_walk_fn)(key_t key, long data, void *arg);
+
 void bplus_tree_dump(struct bplus_tree *tree);
+int bplus_tree_analyze(struct bplus_tree *tree, struct bplus_tree_stats *stats);
 long bplus_tree_get(struct bplus_tree *tree, key_t key);
+long bplus_tree_get_batch(struct bplus_tree *tree, key_t *keys, long *data, long count, int group);
 int bplus_tree_put(struct bplus_tree *tree, key_t key, long data);
+int bplus_tree_update(struct bplus_tree *tree, key_t key, long data);
+int bplus_tree_upsert(struct bplus_tree *tree, key_t key, long data);
+int bplus_tree_append(struct bplus_tree *tree, key_t key, long value);
+int bplus_tree_remove(struct bplus_tree *tree, key_t key, long value);
+long bplus_tree_add(struct bplus_tree *tree, key_t key, long delta);
+int bplus_tree_delete_range(struct bplus_tree *tree, key_t key1, key_t key2);
 long bplus_tree_get_range(struct bplus_tree *tree, key_t key1, key_t key2);
+long bplus_tree_walk(struct bplus_tree *tree, key_t key1, key_t key2,
+                     bplus_tree_walk_fn fn, void *arg);
+long bplus_tree_count(struct bplus_tree *tree, key_t key1, key_t key2);
+long bplus_tree_rank(struct bplus_tree *tree, key_t key);
+int bplus_tree_select(struct bplus_tree *tree, long rank, key_t *key, long *data);
+int bplus_tree_bloom_enable(struct bplus_tree *tree, long keys, int bits_per_key);
+long bplus_tree_bloom_rebuild(struct bplus_tree *tree);
+int bplus_tree_cache_enable(struct bplus_tree *tree, long entries);
+int bplus_tree_cache_get(struct bplus_tree *tree, key_t key, long *data);
+int bplus_tree_bulk_load(struct bplus_tree *tree, key_t *keys, long *data, long count, int nr_threads);
+int bplus_tree_bulk_spill_enable(struct bplus_tree *tree, long entries);
+long bplus_tree_merge(struct bplus_tree *dst, struct bplus_tree *src);
+int bplus_tree_backup_begin(struct bplus_tree *tree, char *path, int incremental);
+long bplus_tree_backup_step(struct bplus_tree *tree, int max_blocks);
+int bplus_tree_backup_end(struct bplus_tree *tree);
+int bplus_tree_restore(char *backup, char *filename);
+int bplus_tree_split_at(struct bplus_tree *tree, key_t key, char *out_left, char *out_right);
+int bplus_tree_writeback_enable(struct bplus_tree *tree, long dirty_bytes, int flush_ms, int checkpoint_ms);
+int bplus_tree_checkpoint(struct bplus_tree *tree);
+int bplus_tree_memtable_enable(struct bplus_tree *tree, long entries);
+long bplus_tree_memtable_flush(struct bplus_tree *tree);
+int bplus_tree_trace_begin(struct bplus_tree *tree, char *path);
+int bplus_tree_trace_end(struct bplus_tree *tree);
+int bplus_tree_replicate_begin(struct bplus_tree *tree, int fd);
+int bplus_tree_replicate_end(struct bplus_tree *tree);
+struct bplus_follower *bplus_follower_start(char *filename, int fd);
+long bplus_follower_get(struct bplus_follower *follower, key_t key);
+long bplus_follower_walk(struct bplus_follower *follower, key_t key1, key_t key2,
+                         bplus_tree_walk_fn fn, void *arg);
+void bplus_follower_stats(struct bplus_follower *follower, struct bplus_follower_stats *stats);
+void bplus_follower_stop(struct bplus_follower *follower);
+int bplus_tree_shared_enable(struct bplus_tree *tree, long blocks, int writer);
+int bplus_tree_manifest_enable(struct bplus_tree *tree, int save_ms);
+long bplus_tree_warmup_wait(struct bplus_tree *tree);
+void bplus_tree_shared_stats(struct bplus_tree *tree, struct bplus_shared_stats *stats);
 struct bplus_tree *bplus_tree_init(char *filename, int block_size);
+struct bplus_tree *bplus_tree_init_flags(char *filename, int block_size, int flags);
 void bplus_tree_deinit(struct bplus_tree *tree);
 int bplus_open(char *filename);
 void bplus_close(int fd);
@@ -0,0 +1,497 @@
+/*
+ * Copyright (C) 2017, Leo Ma <begeekmyfriend@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bplustree_shard.h"
+
+/* a shard is hot when it serves that many times of the average requests */
+#define HOT_SHARD_RATIO 2
+/* the part of keys a hot shard hands over to its neighbour */
+#define REBALANCE_MOVE_DIV 4
+
+enum {
+        SHARD_GET,
+        SHARD_PUT,
+        SHARD_GET_RANGE,
+        SHARD_WALK,
+};
+
+struct shard_request {
+        struct list_head link;
+        int op;
+        key_t key1;
+        key_t key2;
+        long data;
+        bplus_tree_walk_fn fn;
+        void *arg;
+        long ret;
+        int done;
+};
+
+struct shard_walk {
+        bplus_tree_walk_fn fn;
+        void *arg;
+        int stop;
+};
+
+struct shard_entries {
+        key_t *keys;
+        long *data;
+        long count;
+        long target;
+};
+
+static void *shard_worker(void *arg)
+{
+        struct bplus_shard *shard = arg;
+
+        pthread_mutex_lock(&shard->lock);
+        for (; ;) {
+                while (list_empty(&shard->requests) && !shard->quit) {
+                        pthread_cond_wait(&shard->wakeup, &shard->lock);
+                }
+                if (list_empty(&shard->requests)) {
+                        break;
+                }
+
+                struct shard_request *req;
+                req = list_first_entry(&shard->requests, struct shard_request, link);
+                list_del(&req->link);
+                pthread_mutex_unlock(&shard->lock);
+
+                switch (req->op) {
+                case SHARD_GET:
+                        req->ret = bplus_tree_get(shard->tree, req->key1);
+                        break;
+                case SHARD_PUT:
+                        req->ret = bplus_tree_put(shard->tree, req->key1, req->data);
+                        break;
+                case SHARD_GET_RANGE:
+                        req->ret = bplus_tree_get_range(shard->tree, req->key1, req->key2);
+                        break;
+                case SHARD_WALK:
+                        req->ret = bplus_tree_walk(shard->tree, req->key1, req->key2, req->fn, req->arg);
+                        break;
+                default:
+                        assert(0);
+                }
+
+                pthread_mutex_lock(&shard->lock);
+                shard->ops++;
+                req->done = 1;
+                pthread_cond_broadcast(&shard->done);
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        return NULL;
+}
+
+static long shard_submit(struct bplus_shard *shard, struct shard_request *req)
+{
+        req->done = 0;
+        pthread_mutex_lock(&shard->lock);
+        list_add_tail(&req->link, &shard->requests);
+        pthread_cond_signal(&shard->wakeup);
+        while (!req->done) {
+                pthread_cond_wait(&shard->done, &shard->lock);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        return req->ret;
+}
+
+static int shard_locate(struct bplus_shard_tree *st, key_t key)
+{
+        /* the count of bounds not greater than key */
+        int low = 0;
+        int high = st->nr_shards - 1;
+        while (low < high) {
+                int mid = low + (high - low) / 2;
+                if (st->bounds[mid] <= key) {
+                        low = mid + 1;
+                } else {
+                        high = mid;
+                }
+        }
+        return low;
+}
+
+static inline key_t shard_min(struct bplus_shard_tree *st, int i)
+{
+        return i == 0 ? INT_MIN : st->bounds[i - 1];
+}
+
+static inline key_t shard_max(struct bplus_shard_tree *st, int i)
+{
+        return i == st->nr_shards - 1 ? INT_MAX : st->bounds[i] - 1;
+}
+
+static void shard_name(struct bplus_shard_tree *st, char *buf, int i)
+{
+        if (i < 0) {
+                sprintf(buf, "%s.shards", st->prefix);
+        } else {
+                sprintf(buf, "%s.%d", st->prefix, i);
+        }
+}
+
+/* returns 1 if no boundaries have been stored yet */
+static int bounds_load(struct bplus_shard_tree *st)
+{
+        char name[1024 + 16];
+        int i, n;
+
+        shard_name(st, name, -1);
+        FILE *fp = fopen(name, "r");
+        if (fp == NULL) {
+                return errno == ENOENT ? 1 : -1;
+        }
+        if (fscanf(fp, "%d", &n) != 1 || n != st->nr_shards) {
+                fclose(fp);
+                return -1;
+        }
+        for (i = 0; i < n - 1; i++) {
+                if (fscanf(fp, "%d", &st->bounds[i]) != 1) {
+                        fclose(fp);
+                        return -1;
+                }
+        }
+        fclose(fp);
+        return 0;
+}
+
+/* written aside and renamed, a crash leaves the old boundaries or the new */
+static int bounds_store(struct bplus_shard_tree *st)
+{
+        char name[1024 + 16], tmp[1024 + 32];
+        int i;
+
+        shard_name(st, name, -1);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+        FILE *fp = fopen(tmp, "w");
+        if (fp == NULL) {
+                fprintf(stderr, "Failed to store shard boundaries!\n");
+                return -1;
+        }
+        fprintf(fp, "%d\n", st->nr_shards);
+        for (i = 0; i < st->nr_shards - 1; i++) {
+                fprintf(fp, "%d\n", st->bounds[i]);
+        }
+        int failed = fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+        if (fclose(fp) != 0 || failed || rename(tmp, name) != 0) {
+                fprintf(stderr, "Failed to store shard boundaries!\n");
+                unlink(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+static void maybe_rebalance(struct bplus_shard_tree *st)
+{
+        if (st->rebalance_interval > 0) {
+                long n = __atomic_add_fetch(&st->requests, 1, __ATOMIC_RELAXED);
+                if (n % st->rebalance_interval == 0) {
+                        bplus_shard_rebalance(st);
+                }
+        }
+}
+
+long bplus_shard_get(struct bplus_shard_tree *st, key_t key)
+{
+        struct shard_request req;
+        req.op = SHARD_GET;
+        req.key1 = key;
+
+        pthread_rwlock_rdlock(&st->rebalance_lock);
+        struct bplus_shard *shard = &st->shards[shard_locate(st, key)];
+        long ret;
+        /* hot keys are served by the caller without waking the worker */
+        if (bplus_tree_cache_get(shard->tree, key, &ret) != 0) {
+                ret = shard_submit(shard, &req);
+        }
+        pthread_rwlock_unlock(&st->rebalance_lock);
+
+        maybe_rebalance(st);
+        return ret;
+}
+
+int bplus_shard_put(struct bplus_shard_tree *st, key_t key, long data)
+{
+        struct shard_request req;
+        req.op = SHARD_PUT;
+        req.key1 = key;
+        req.data = data;
+
+        pthread_rwlock_rdlock(&st->rebalance_lock);
+        int ret = shard_submit(&st->shards[shard_locate(st, key)], &req);
+        pthread_rwlock_unlock(&st->rebalance_lock);
+
+        maybe_rebalance(st);
+        return ret;
+}
+
+long bplus_shard_get_range(struct bplus_shard_tree *st, key_t key1, key_t key2)
+{
+        int i;
+        long ret = -1;
+        key_t min = key1 <= key2 ? key1 : key2;
+        key_t max = min == key1 ? key2 : key1;
+
+        /* the data of the last key in range, so search from the highest shard */
+        pthread_rwlock_rdlock(&st->rebalance_lock);
+        for (i = shard_locate(st, max); i >= 0 && shard_max(st, i) >= min; i--) {
+                struct shard_request req;
+                req.op = SHARD_GET_RANGE;
+                req.key1 = min > shard_min(st, i) ? min : shard_min(st, i);
+                req.key2 = max < shard_max(st, i) ? max : shard_max(st, i);
+                ret = shard_submit(&st->shards[i], &req);
+                if (ret != -1) {
+                        break;
+                }
+        }
+        pthread_rwlock_unlock(&st->rebalance_lock);
+
+        return ret;
+}
+
+static int walk_step(key_t key, long data, void *arg)
+{
+        struct shard_walk *w = arg;
+        w->stop = w->fn(key, data, w->arg);
+        return w->stop;
+}
+
+long bplus_shard_walk(struct bplus_shard_tree *st, key_t key1, key_t key2,
+                      bplus_tree_walk_fn fn, void *arg)
+{
+        int i;
+        long count = 0;
+        key_t min = key1 <= key2 ? key1 : key2;
+        key_t max = min == key1 ? key2 : key1;
+        struct shard_walk w = { fn, arg, 0 };
+
+        /* shards are range partitioned, so walking them in turn keeps key order */
+        pthread_rwlock_rdlock(&st->rebalance_lock);
+        for (i = shard_locate(st, min); i < st->nr_shards && shard_min(st, i) <= max && !w.stop; i++) {
+                struct shard_request req;
+                req.op = SHARD_WALK;
+                req.key1 = min > shard_min(st, i) ? min : shard_min(st, i);
+                req.key2 = max < shard_max(st, i) ? max : shard_max(st, i);
+                req.fn = walk_step;
+                req.arg = &w;
+                count += shard_submit(&st->shards[i], &req);
+        }
+        pthread_rwlock_unlock(&st->rebalance_lock);
+
+        return count;
+}
+
+static int entry_count(key_t key, long data, void *arg)
+{
+        struct shard_entries *e = arg;
+        (void) data;
+        if (e->count++ == e->target) {
+                e->keys[0] = key;
+                return 1;
+        }
+        return 0;
+}
+
+static int entry_collect(key_t key, long data, void *arg)
+{
+        struct shard_entries *e = arg;
+        e->keys[e->count] = key;
+        e->data[e->count] = data;
+        e->count++;
+        return 0;
+}
+
+static void shard_move(struct bplus_shard_tree *st, int from, int to, key_t min, key_t max, long count)
+{
+        long i;
+        struct shard_entries e;
+
+        e.keys = malloc(count * sizeof(key_t));
+        e.data = malloc(count * sizeof(long));
+        assert(e.keys != NULL && e.data != NULL);
+        e.count = 0;
+        bplus_tree_walk(st->shards[from].tree, min, max, entry_collect, &e);
+        assert(e.count == count);
+
+        for (i = 0; i < e.count; i++) {
+                bplus_tree_put(st->shards[to].tree, e.keys[i], e.data[i]);
+                bplus_tree_put(st->shards[from].tree, e.keys[i], 0);
+        }
+
+        free(e.keys);
+        free(e.data);
+}
+
+int bplus_shard_cache_enable(struct bplus_shard_tree *st, long entries)
+{
+        int i, ret = 0;
+
+        /* no request is in flight while the caches are replaced */
+        pthread_rwlock_wrlock(&st->rebalance_lock);
+        for (i = 0; i < st->nr_shards; i++) {
+                if (bplus_tree_cache_enable(st->shards[i].tree, entries) != 0) {
+                        ret = -1;
+                }
+        }
+        pthread_rwlock_unlock(&st->rebalance_lock);
+        return ret;
+}
+
+int bplus_shard_rebalance(struct bplus_shard_tree *st)
+{
+        int i, hot = 0, ret = -1;
+        long total = 0;
+
+        pthread_rwlock_wrlock(&st->rebalance_lock);
+
+        /* no request is in flight now, workers are idle */
+        for (i = 0; i < st->nr_shards; i++) {
+                total += st->shards[i].ops;
+                if (st->shards[i].ops > st->shards[hot].ops) {
+                        hot = i;
+                }
+        }
+
+        if (st->nr_shards > 1 && st->shards[hot].ops * st->nr_shards > total * HOT_SHARD_RATIO) {
+                /* hand over to the cooler neighbour */
+                int cool;
+                if (hot == 0) {
+                        cool = 1;
+                } else if (hot == st->nr_shards - 1) {
+                        cool = hot - 1;
+                } else {
+                        cool = st->shards[hot - 1].ops <= st->shards[hot + 1].ops ? hot - 1 : hot + 1;
+                }
+
+                struct shard_entries e;
+                key_t pivot;
+                e.keys = &pivot;
+                e.count = 0;
+                e.target = -1;
+                long count = bplus_tree_walk(st->shards[hot].tree, shard_min(st, hot), shard_max(st, hot),
+                                             entry_count, &e);
+                long move = count / REBALANCE_MOVE_DIV;
+
+                if (move > 0) {
+                        /* locate the key the new boundary is set on */
+                        e.count = 0;
+                        e.target = cool > hot ? count - move : move;
+                        bplus_tree_walk(st->shards[hot].tree, shard_min(st, hot), shard_max(st, hot),
+                                        entry_count, &e);
+
+                        if (cool > hot) {
+                                shard_move(st, hot, cool, pivot, shard_max(st, hot), move);
+                                st->bounds[hot] = pivot;
+                        } else {
+                                shard_move(st, hot, cool, shard_min(st, hot), pivot - 1, move);
+                                st->bounds[cool] = pivot;
+                        }
+                        ret = bounds_store(st);
+                }
+        }
+
+        for (i = 0; i < st->nr_shards; i++) {
+                st->shards[i].ops = 0;
+        }
+
+        pthread_rwlock_unlock(&st->rebalance_lock);
+        return ret;
+}
+
+struct bplus_shard_tree *bplus_shard_tree_init(char *prefix, int block_size, int nr_shards)
+{
+        int i;
+
+        if (strlen(prefix) >= 1024 - 16) {
+                fprintf(stderr, "Index file name too long!\n");
+                return NULL;
+        }
+
+        if (nr_shards <= 0 || nr_shards > MAX_SHARD_NUM) {
+                fprintf(stderr, "Shard number must be in [1, %d]!\n", MAX_SHARD_NUM);
+                return NULL;
+        }
+
+        struct bplus_shard_tree *st = calloc(1, sizeof(*st));
+        assert(st != NULL);
+        strcpy(st->prefix, prefix);
+        st->nr_shards = nr_shards;
+        pthread_rwlock_init(&st->rebalance_lock, NULL);
+
+        /* split the key space evenly unless the boundaries have been stored,
+         * those of another shard number tell where keys of the shards are */
+        int loaded = bounds_load(st);
+        if (loaded < 0) {
+                fprintf(stderr, "Shard boundaries of %s unreadable or not of %d shards!\n", prefix, nr_shards);
+                pthread_rwlock_destroy(&st->rebalance_lock);
+                free(st);
+                return NULL;
+        }
+        if (loaded > 0) {
+                for (i = 1; i < nr_shards; i++) {
+                        st->bounds[i - 1] = (key_t) ((long) INT_MIN + ((long) UINT_MAX + 1) / nr_shards * i);
+                }
+                if (bounds_store(st) != 0) {
+                        pthread_rwlock_destroy(&st->rebalance_lock);
+                        free(st);
+                        return NULL;
+                }
+        }
+
+        for (i = 0; i < nr_shards; i++) {
+                char name[1024 + 16];
+                struct bplus_shard *shard = &st->shards[i];
+
+                shard_name(st, name, i);
+                shard->tree = bplus_tree_init(name, block_size);
+                if (shard->tree == NULL) {
+                        st->nr_shards = i;
+                        bplus_shard_tree_deinit(st);
+                        return NULL;
+                }
+
+                list_init(&shard->requests);
+                pthread_mutex_init(&shard->lock, NULL);
+                pthread_cond_init(&shard->wakeup, NULL);
+                pthread_cond_init(&shard->done, NULL);
+                pthread_create(&shard->thread, NULL, shard_worker, shard);
+        }
+
+        return st;
+}
+
+void bplus_shard_tree_deinit(struct bplus_shard_tree *st)
+{
+        int i;
+
+        for (i = 0; i < st->nr_shards; i++) {
+                struct bplus_shard *shard = &st->shards[i];
+
+                pthread_mutex_lock(&shard->lock);
+                shard->quit = 1;
+                pthread_cond_signal(&shard->wakeup);
+                pthread_mutex_unlock(&shard->lock);
+                pthread_join(shard->thread, NULL);
+
+                bplus_tree_deinit(shard->tree);
+                pthread_mutex_destroy(&shard->lock);
+                pthread_cond_destroy(&shard->wakeup);
+                pthread_cond_destroy(&shard->done);
+        }
+
+        pthread_rwlock_destroy(&st->rebalance_lock);
+        free(st);
+}
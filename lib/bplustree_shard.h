@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2017, Leo Ma <begeekmyfriend@gmail.com>
+ */
+
+#ifndef _BPLUS_TREE_SHARD_H
+#define _BPLUS_TREE_SHARD_H
+
+#include <pthread.h>
+
+#include "bplustree.h"
+
+#define MAX_SHARD_NUM 256
+
+/* A shard serves the keys in [lower bound, upper bound) with its own index
+ * file and worker thread, requests are queued and executed in order */
+struct bplus_shard {
+        struct bplus_tree *tree;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t wakeup;
+        pthread_cond_t done;
+        struct list_head requests;
+        int quit;
+        /* requests served since last rebalance */
+        long ops;
+};
+
+struct bplus_shard_tree {
+        char prefix[1024];
+        int nr_shards;
+        /* shard i holds keys in [bounds[i - 1], bounds[i]) */
+        key_t bounds[MAX_SHARD_NUM - 1];
+        struct bplus_shard shards[MAX_SHARD_NUM];
+        /* taken for reading by requests and for writing by rebalancing */
+        pthread_rwlock_t rebalance_lock;
+        /* check shard load every that many requests, 0 means never */
+        long rebalance_interval;
+        long requests;
+};
+
+struct bplus_shard_tree *bplus_shard_tree_init(char *prefix, int block_size, int nr_shards);
+void bplus_shard_tree_deinit(struct bplus_shard_tree *st);
+long bplus_shard_get(struct bplus_shard_tree *st, key_t key);
+int bplus_shard_put(struct bplus_shard_tree *st, key_t key, long data);
+long bplus_shard_get_range(struct bplus_shard_tree *st, key_t key1, key_t key2);
+long bplus_shard_walk(struct bplus_shard_tree *st, key_t key1, key_t key2,
+                      bplus_tree_walk_fn fn, void *arg);
+int bplus_shard_cache_enable(struct bplus_shard_tree *st, long entries);
+int bplus_shard_rebalance(struct bplus_shard_tree *st);
+
+#endif  /* _BPLUS_TREE_SHARD_H */
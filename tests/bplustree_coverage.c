@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <string.h>
 #include <assert.h>
 #include "bplustree.h"
 
@@ -22,6 +23,28 @@ static unsigned char huge_array[INT_MAX>>3] = { 0 };
 #define has(a, k)       ((a[(k)>>3]) & (1<<((k)&7)))
 #define set(a, k)       ((a[(k)>>3]) |= (1<<((k)&7)))
 #define unset(a, k)     ((a[(k)>>3]) &= ~(1<<((k)&7)))
+
+/* clear keys in [lo, hi] and tell whether any of them has been set */
+static int range_unset(unsigned char *a, int lo, int hi)
+{
+        int exist = 0;
+        for (; lo <= hi && (lo & 7); lo++) {
+                exist |= has(a, lo);
+                unset(a, lo);
+        }
+        for (; hi >= lo && ((hi + 1) & 7); hi--) {
+                exist |= has(a, hi);
+                unset(a, hi);
+        }
+        if (lo <= hi) {
+                /* whole bytes are all zero if each equals the next one and the first is zero */
+                size_t len = (hi - lo + 1) >> 3;
+                exist |= a[lo >> 3] || memcmp(&a[lo >> 3], &a[(lo >> 3) + 1], len - 1);
+                memset(&a[lo >> 3], 0, len);
+        }
+        return exist != 0;
+}
+
 //#define DEBUG
 #ifdef DEBUG
 #define log(fmt, ...)  printf(fmt, ##__VA_ARGS__)
@@ -32,7 +55,7 @@ static unsigned char huge_array[INT_MAX>>3] = { 0 };
 void exec_file(char *file, struct bplus_tree *tree)
 {
         int got = 0, exist = 0;
-        int k;
+        int k, k2;
         int ret;
         char op;
         FILE *fp = fopen(file,"r");
@@ -107,6 +130,27 @@ void exec_file(char *file, struct bplus_tree *tree)
                         }
                         break;
                 case 'r':
+                        if (fscanf(fp, "%d", &k2) == 1) {
+                                /* range deletion as "r lo hi" */
+                                log("r %d %d ", k, k2);
+                                exist = range_unset(huge_array, k, k2);
+                                if (0 == bplus_tree_delete_range(tree, k, k2)) {
+                                        valid_del++;
+                                        if (TEST_KEY >= k && TEST_KEY <= k2) {
+                                                got = 0;
+                                        }
+                                        if (!exist) {
+                                                fprintf(stderr, "delete range %d-%d error, deleted but not found!\n", k, k2);
+                                                exit(-1);
+                                        }
+                                } else {
+                                        if (exist) {
+                                                fprintf(stderr, "delete range %d-%d error, found but not deleted!\n", k, k2);
+                                                exit(-1);
+                                        }
+                                }
+                                break;
+                        }
                         log("d %d ", k);
                         if (has(huge_array, k)) {
                                 exist = 1;
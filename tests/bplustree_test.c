@@ -0,0 +1,1561 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "bplustree.h"
+#include "bplustree_shard.h"
+
+/* each case runs in a process of its own, trees open at once share a format */
+
+#define expect(cond, ...) do { \
+        if (!(cond)) { \
+                fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+                fprintf(stderr, __VA_ARGS__); \
+                fprintf(stderr, "\n"); \
+                exit(-1); \
+        } \
+} while (0)
+
+/* index file of a case with whatever a previous run left removed */
+static char *index_file(char *buf, const char *name)
+{
+        static const char *suffixes[] = { "", ".boot", ".bloom", ".manifest", ".lock", ".undo" };
+        char path[1100];
+        unsigned int i;
+
+        sprintf(buf, "/tmp/bplustree_test_%s.index", name);
+        for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+                sprintf(path, "%s%s", buf, suffixes[i]);
+                unlink(path);
+        }
+        return buf;
+}
+
+struct walk_check {
+        long *ref;
+        int max_key;
+        key_t last;
+        long count;
+};
+
+static int walk_check_fn(key_t key, long data, void *arg)
+{
+        struct walk_check *w = arg;
+        expect(key > w->last, "walk out of order at key %d", key);
+        expect(key >= 0 && key <= w->max_key && w->ref[key] == data,
+               "walk saw key %d data %ld", key, data);
+        w->last = key;
+        w->count++;
+        return 0;
+}
+
+/* tree holds exactly the keys of ref with non-zero data */
+static void tree_check(struct bplus_tree *tree, long *ref, int max_key)
+{
+        struct walk_check w;
+        long live = 0;
+        int k;
+
+        for (k = 0; k <= max_key; k++) {
+                long data = bplus_tree_get(tree, k);
+                expect(data == (ref[k] ? ref[k] : -1), "key %d got %ld expected %ld", k, data, ref[k]);
+                live += ref[k] != 0;
+        }
+
+        w.ref = ref;
+        w.max_key = max_key;
+        w.last = INT_MIN;
+        w.count = 0;
+        bplus_tree_walk(tree, INT_MIN, INT_MAX, walk_check_fn, &w);
+        expect(w.count == live, "walk saw %ld of %ld entries", w.count, live);
+}
+
+/* one random change to tree and ref alike, puts checked to only insert
+ * an absent key and delete a present one unless buffered */
+static void model_step(struct bplus_tree *tree, long *ref, int max_key, int buffered)
+{
+        key_t k = rand() % max_key + 1;
+        long data = rand() % 1000000 + 1;
+        int ret;
+
+        switch (rand() % 8) {
+        case 0:
+        case 1:
+                ret = bplus_tree_put(tree, k, data);
+                expect(ret == (buffered || ref[k] == 0 ? 0 : -1), "put of key %d returned %d", k, ret);
+                if (ref[k] == 0) {
+                        ref[k] = data;
+                }
+                break;
+        case 2:
+        case 3:
+                expect(bplus_tree_upsert(tree, k, data) == 0, "upsert of key %d failed", k);
+                ref[k] = data;
+                break;
+        case 4:
+                ret = bplus_tree_update(tree, k, data);
+                expect(ret == (ref[k] != 0 ? 0 : -1), "update of key %d returned %d", k, ret);
+                if (ref[k] != 0) {
+                        ref[k] = data;
+                }
+                break;
+        case 5:
+        case 6:
+                ret = bplus_tree_put(tree, k, 0);
+                expect(ret == (buffered || ref[k] != 0 ? 0 : -1), "delete of key %d returned %d", k, ret);
+                ref[k] = 0;
+                break;
+        default:
+                bplus_tree_delete_range(tree, k, k + 20);
+                for (data = k; data <= k + 20 && data <= max_key; data++) {
+                        ref[data] = 0;
+                }
+                break;
+        }
+}
+
+#define BULK_KEYS 100000
+#define BULK_COUNT 250000
+
+static void bulk_load_case(int flags, long spill)
+{
+        char name[1100];
+        long i;
+        key_t *keys = malloc(BULK_COUNT * sizeof(key_t));
+        long *data = malloc(BULK_COUNT * sizeof(long));
+        long *ref = calloc(BULK_KEYS + 1, sizeof(long));
+        expect(keys != NULL && data != NULL && ref != NULL, "out of memory");
+
+        /* duplicates included, the first put of a key wins */
+        srand(flags + spill);
+        for (i = 0; i < BULK_COUNT; i++) {
+                keys[i] = rand() % BULK_KEYS + 1;
+                data[i] = rand() % 1000000 + 1;
+                if (ref[keys[i]] == 0) {
+                        ref[keys[i]] = data[i];
+                }
+        }
+
+        index_file(name, "bulk_load");
+        struct bplus_tree *tree = bplus_tree_init_flags(name, 1024, flags);
+        expect(tree != NULL, "init failed");
+        bplus_tree_bulk_spill_enable(tree, spill);
+        expect(bplus_tree_bulk_load(tree, keys, data, BULK_COUNT, 4) == 0, "bulk load failed");
+        expect(bplus_tree_bulk_load(tree, keys, data, BULK_COUNT, 4) == -1, "bulk load into a full tree");
+        tree_check(tree, ref, BULK_KEYS);
+
+        /* usable as any other tree afterwards */
+        for (i = 0; i < 2000; i++) {
+                key_t k = rand() % BULK_KEYS + 1;
+                if (rand() % 2) {
+                        ref[k] = rand() % 1000000 + 1;
+                        bplus_tree_upsert(tree, k, ref[k]);
+                } else {
+                        ref[k] = 0;
+                        bplus_tree_put(tree, k, 0);
+                }
+        }
+        bplus_tree_deinit(tree);
+
+        tree = bplus_tree_init_flags(name, 1024, flags);
+        tree_check(tree, ref, BULK_KEYS);
+        bplus_tree_deinit(tree);
+
+        free(keys);
+        free(data);
+        free(ref);
+}
+
+static void test_bulk_load(void)
+{
+        /* in memory, and in runs spilled to temp files */
+        bulk_load_case(0, 0);
+        bulk_load_case(0, 30000);
+        bulk_load_case(BPLUS_TREE_AUGMENTED | BPLUS_TREE_COMPACT_NODES, 0);
+        bulk_load_case(BPLUS_TREE_COMPRESSED_LEAVES, 0);
+        bulk_load_case(BPLUS_TREE_COMPRESSED_LEAVES, 30000);
+        bulk_load_case(BPLUS_TREE_SLOTTED_LEAVES | BPLUS_TREE_BLOCKED_NODES, 30000);
+}
+
+#define BACKUP_KEYS 20000
+
+static void backup_take(struct bplus_tree *tree, char *path, int incremental,
+                        long *ref, long *snapshot)
+{
+        int k;
+
+        expect(bplus_tree_backup_begin(tree, path, incremental) == 0, "backup begin failed");
+        memcpy(snapshot, ref, (BACKUP_KEYS + 1) * sizeof(long));
+        /* changes after the backup began are not in it */
+        while (bplus_tree_backup_step(tree, 4) > 0) {
+                k = rand() % BACKUP_KEYS + 1;
+                ref[k] = rand() % 1000000 + 1;
+                bplus_tree_upsert(tree, k, ref[k]);
+        }
+        expect(bplus_tree_backup_end(tree) == 0, "backup end failed");
+}
+
+static void test_backup(void)
+{
+        char name[1100], restored[1100], full[1200], incr[1200], incr2[1200];
+        long *ref = calloc(BACKUP_KEYS + 1, sizeof(long));
+        long *snap1 = calloc(BACKUP_KEYS + 1, sizeof(long));
+        long *snap2 = calloc(BACKUP_KEYS + 1, sizeof(long));
+        long *snap3 = calloc(BACKUP_KEYS + 1, sizeof(long));
+        key_t *keys = malloc(BACKUP_KEYS * sizeof(key_t));
+        long *data = malloc(BACKUP_KEYS * sizeof(long));
+        int k;
+        expect(ref != NULL && snap1 != NULL && snap2 != NULL && snap3 != NULL &&
+               keys != NULL && data != NULL, "out of memory");
+
+        index_file(name, "backup");
+        index_file(restored, "backup_restored");
+        sprintf(full, "%s.full", name);
+        sprintf(incr, "%s.incr", name);
+        sprintf(incr2, "%s.incr2", name);
+        srand(30);
+
+        /* an empty tree backed up starts tracking changed blocks, those of
+         * a bulk load written by several threads go to the next backup */
+        struct bplus_tree *tree = bplus_tree_init(name, 512);
+        backup_take(tree, full, 0, ref, snap1);
+        for (k = 0; k < BACKUP_KEYS; k++) {
+                keys[k] = k + 1;
+                data[k] = (k + 1) * 7L;
+                ref[k + 1] = data[k];
+        }
+        expect(bplus_tree_bulk_load(tree, keys, data, BACKUP_KEYS, 4) == 0, "bulk load failed");
+        backup_take(tree, incr, 1, ref, snap2);
+
+        for (k = 0; k < 3000; k++) {
+                int key = rand() % BACKUP_KEYS + 1;
+                ref[key] = rand() % 2 ? rand() % 1000000 + 1 : 0;
+                bplus_tree_upsert(tree, key, ref[key]);
+                if (ref[key] == 0) {
+                        bplus_tree_put(tree, key, 0);
+                }
+        }
+        backup_take(tree, incr2, 1, ref, snap3);
+        bplus_tree_deinit(tree);
+
+        /* full backup alone, with a bloom filter of it left behind */
+        expect(bplus_tree_restore(full, restored) == 0, "restore failed");
+        tree = bplus_tree_init(restored, 512);
+        tree_check(tree, snap1, BACKUP_KEYS);
+        bplus_tree_bloom_enable(tree, BACKUP_KEYS, 10);
+        bplus_tree_deinit(tree);
+
+        /* incremental ones apply upon the previous */
+        expect(bplus_tree_restore(incr, restored) == 0, "restore failed");
+        tree = bplus_tree_init(restored, 512);
+        tree_check(tree, snap2, BACKUP_KEYS);
+        bplus_tree_deinit(tree);
+
+        expect(bplus_tree_restore(incr2, restored) == 0, "restore failed");
+        tree = bplus_tree_init(restored, 512);
+        tree_check(tree, snap3, BACKUP_KEYS);
+        bplus_tree_deinit(tree);
+
+        /* a truncated backup is refused and leaves the boot file alone */
+        char boot[1200], before[4096], after[4096];
+        sprintf(boot, "%s.boot", restored);
+        FILE *fp = fopen(boot, "rb");
+        expect(fp != NULL, "no boot file");
+        size_t len = fread(before, 1, sizeof(before), fp);
+        fclose(fp);
+        expect(truncate(incr2, 200) == 0, "truncate failed");
+        expect(bplus_tree_restore(incr2, restored) == -1, "truncated backup restored");
+        fp = fopen(boot, "rb");
+        expect(fp != NULL && fread(after, 1, sizeof(after), fp) == len && memcmp(before, after, len) == 0,
+               "boot file replaced by a truncated backup");
+        fclose(fp);
+
+        unlink(full);
+        unlink(incr);
+        unlink(incr2);
+        free(ref);
+        free(snap1);
+        free(snap2);
+        free(snap3);
+        free(keys);
+        free(data);
+}
+
+#define MERGE_KEYS 30000
+
+static void merge_case(int flags, int src_keys)
+{
+        char dst_name[1100], src_name[1100];
+        long *ref = calloc(MERGE_KEYS + 1, sizeof(long));
+        long *src_ref = calloc(MERGE_KEYS + 1, sizeof(long));
+        long count = 0;
+        int i, k;
+        expect(ref != NULL && src_ref != NULL, "out of memory");
+
+        index_file(dst_name, "merge_dst");
+        index_file(src_name, "merge_src");
+        struct bplus_tree *dst = bplus_tree_init_flags(dst_name, 512, flags);
+        struct bplus_tree *src = bplus_tree_init_flags(src_name, 512, flags);
+        expect(dst != NULL && src != NULL, "init failed");
+
+        srand(flags + src_keys);
+        for (k = 2; k <= MERGE_KEYS; k += 2) {
+                ref[k] = k;
+                bplus_tree_put(dst, k, ref[k]);
+        }
+        /* src overlaps dst in some keys and adds others */
+        for (i = 0; i < src_keys; i++) {
+                k = rand() % MERGE_KEYS + 1;
+                if (src_ref[k] == 0) {
+                        src_ref[k] = rand() % 1000000 + 1;
+                        bplus_tree_put(src, k, src_ref[k]);
+                        count++;
+                }
+        }
+
+        expect(bplus_tree_merge(dst, src) == count, "merge count differs");
+        for (k = 0; k <= MERGE_KEYS; k++) {
+                if (src_ref[k] != 0) {
+                        ref[k] = src_ref[k];
+                }
+        }
+        tree_check(dst, ref, MERGE_KEYS);
+        tree_check(src, src_ref, MERGE_KEYS);
+        expect(bplus_tree_merge(dst, dst) == -1, "tree merged into itself");
+        bplus_tree_deinit(src);
+        bplus_tree_deinit(dst);
+
+        dst = bplus_tree_init_flags(dst_name, 512, flags);
+        tree_check(dst, ref, MERGE_KEYS);
+        bplus_tree_deinit(dst);
+
+        free(ref);
+        free(src_ref);
+}
+
+static void test_merge(void)
+{
+        char name1[1100], name2[1100];
+
+        /* a tree of another block size is not even opened */
+        index_file(name1, "merge_block1");
+        index_file(name2, "merge_block2");
+        struct bplus_tree *tree1 = bplus_tree_init(name1, 512);
+        expect(bplus_tree_init(name2, 1024) == NULL, "block sizes differ");
+        bplus_tree_deinit(tree1);
+
+        /* a few changes go leaf by leaf, many rebuild dst */
+        merge_case(0, 100);
+        merge_case(0, 20000);
+        merge_case(BPLUS_TREE_AUGMENTED | BPLUS_TREE_COMPRESSED_LEAVES, 100);
+        merge_case(BPLUS_TREE_AUGMENTED | BPLUS_TREE_COMPRESSED_LEAVES, 20000);
+        merge_case(BPLUS_TREE_SLOTTED_LEAVES | BPLUS_TREE_COMPACT_NODES, 20000);
+}
+
+#define SPLIT_KEYS 40000
+
+static void split_check(char *filename, int flags, long *ref, key_t min, key_t max)
+{
+        long *side = calloc(SPLIT_KEYS + 1, sizeof(long));
+        long blocks = 0;
+        struct stat st;
+        int k;
+        expect(side != NULL, "out of memory");
+
+        for (k = 0; k <= SPLIT_KEYS; k++) {
+                if (k >= min && k <= max && ref[k] != 0) {
+                        side[k] = ref[k];
+                        blocks++;
+                }
+        }
+        struct bplus_tree *tree = bplus_tree_init_flags(filename, 512, flags);
+        expect(tree != NULL, "init failed");
+        tree_check(tree, side, SPLIT_KEYS);
+        bplus_tree_deinit(tree);
+
+        /* full leaves, with 16 bytes an entry at least a block holds 20 */
+        blocks = blocks / 20 + 2;
+        expect(stat(filename, &st) == 0, "stat failed");
+        expect(st.st_size <= blocks * 512, "%s is %ld bytes for %ld blocks",
+               filename, (long) st.st_size, blocks);
+        free(side);
+}
+
+static void split_case(int flags)
+{
+        char name[1100], left[1100], right[1100];
+        long *ref = calloc(SPLIT_KEYS + 1, sizeof(long));
+        int k;
+        expect(ref != NULL, "out of memory");
+
+        index_file(name, "split");
+        index_file(left, "split_left");
+        index_file(right, "split_right");
+        struct bplus_tree *tree = bplus_tree_init_flags(name, 512, flags);
+        expect(tree != NULL, "init failed");
+        srand(flags);
+        for (k = 0; k < SPLIT_KEYS; k++) {
+                int key = rand() % SPLIT_KEYS;
+                ref[key] = rand() % 1000000 + 1;
+                bplus_tree_upsert(tree, key, ref[key]);
+        }
+
+        expect(bplus_tree_split_at(tree, SPLIT_KEYS / 3, left, right) == 0, "split failed");
+        split_check(left, flags, ref, INT_MIN, SPLIT_KEYS / 3 - 1);
+        split_check(right, flags, ref, SPLIT_KEYS / 3, INT_MAX);
+        struct stat st, st_left;
+        expect(stat(name, &st) == 0 && stat(left, &st_left) == 0, "stat failed");
+        expect(st_left.st_size < st.st_size / 2, "left side of a third of the keys is %ld of %ld bytes",
+               (long) st_left.st_size, (long) st.st_size);
+
+        /* at either end one side is empty */
+        expect(bplus_tree_split_at(tree, INT_MIN, left, right) == 0, "split failed");
+        split_check(left, flags, ref, 1, 0);
+        split_check(right, flags, ref, INT_MIN, INT_MAX);
+        expect(bplus_tree_split_at(tree, INT_MAX, left, right) == 0, "split failed");
+        split_check(left, flags, ref, INT_MIN, INT_MAX - 1);
+
+        /* tree is left as it is, and is not overwritten by a side */
+        tree_check(tree, ref, SPLIT_KEYS);
+        expect(bplus_tree_split_at(tree, 100, name, right) == -1, "split onto itself");
+        expect(bplus_tree_split_at(tree, 100, left, left) == -1, "split onto one index");
+        tree_check(tree, ref, SPLIT_KEYS);
+        bplus_tree_deinit(tree);
+        free(ref);
+}
+
+static void test_split(void)
+{
+        split_case(0);
+        split_case(BPLUS_TREE_AUGMENTED | BPLUS_TREE_COMPACT_NODES);
+        split_case(BPLUS_TREE_COMPRESSED_LEAVES);
+}
+
+#define FOLLOW_KEYS 20000
+
+static void follower_case(int flags)
+{
+        char name[1100], replica[1100];
+        long *ref = calloc(FOLLOW_KEYS + 1, sizeof(long));
+        struct bplus_follower_stats stats;
+        int fds[2], status, k;
+        expect(ref != NULL, "out of memory");
+
+        index_file(name, "follow_leader");
+        index_file(replica, "follow_replica");
+
+        /* an index left at the replica with a bloom filter not knowing
+         * the keys shipped */
+        struct bplus_tree *tree = bplus_tree_init_flags(replica, 512, flags);
+        expect(tree != NULL, "init failed");
+        bplus_tree_bloom_enable(tree, 1000, 10);
+        bplus_tree_put(tree, -5, 5);
+        bplus_tree_deinit(tree);
+
+        srand(flags);
+        for (k = 0; k < 3 * FOLLOW_KEYS; k++) {
+                int key = rand() % FOLLOW_KEYS + 1;
+                ref[key] = rand() % 3 ? rand() % 1000000 + 1 : 0;
+        }
+
+        expect(pipe(fds) == 0, "pipe failed");
+        pid_t pid = fork();
+        expect(pid >= 0, "fork failed");
+        if (pid == 0) {
+                /* leader, half of the changes come before the stream begins */
+                close(fds[0]);
+                srand(flags);
+                tree = bplus_tree_init_flags(name, 512, flags);
+                for (k = 0; k < 3 * FOLLOW_KEYS; k++) {
+                        int key = rand() % FOLLOW_KEYS + 1;
+                        long data = rand() % 3 ? rand() % 1000000 + 1 : 0;
+                        if (k == 3 * FOLLOW_KEYS / 2) {
+                                expect(bplus_tree_replicate_begin(tree, fds[1]) == 0, "replicate failed");
+                        }
+                        if (data != 0) {
+                                bplus_tree_upsert(tree, key, data);
+                        } else {
+                                bplus_tree_put(tree, key, 0);
+                        }
+                }
+                expect(bplus_tree_replicate_end(tree) == 0, "replicate end failed");
+                bplus_tree_deinit(tree);
+                _exit(0);
+        }
+
+        close(fds[1]);
+        struct bplus_follower *follower = bplus_follower_start(replica, fds[0]);
+        expect(follower != NULL, "follower start failed");
+        do {
+                usleep(10000);
+                bplus_follower_stats(follower, &stats);
+        } while (!stats.done);
+        expect(stats.commits > 1, "%ld commits", stats.commits);
+
+        for (k = -5; k <= FOLLOW_KEYS; k++) {
+                long data = bplus_follower_get(follower, k);
+                long expected = k >= 0 && ref[k] ? ref[k] : -1;
+                expect(data == expected, "replica key %d got %ld expected %ld", k, data, expected);
+        }
+        bplus_follower_stop(follower);
+        close(fds[0]);
+        expect(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+               "leader failed");
+
+        /* the replica is an index of its own afterwards */
+        tree = bplus_tree_init_flags(replica, 512, flags);
+        tree_check(tree, ref, FOLLOW_KEYS);
+        bplus_tree_deinit(tree);
+        free(ref);
+}
+
+/* a follower stopped while the leader keeps the stream open */
+static void follower_stop_case(void)
+{
+        char name[1100], replica[1100];
+        int fds[2], status, k;
+
+        index_file(name, "follow_leader");
+        index_file(replica, "follow_replica");
+        expect(pipe(fds) == 0, "pipe failed");
+        pid_t pid = fork();
+        expect(pid >= 0, "fork failed");
+        if (pid == 0) {
+                close(fds[0]);
+                struct bplus_tree *tree = bplus_tree_init(name, 512);
+                for (k = 1; k <= 1000; k++) {
+                        bplus_tree_put(tree, k, k);
+                }
+                expect(bplus_tree_replicate_begin(tree, fds[1]) == 0, "replicate failed");
+                for (k = 1001; k <= 2000; k++) {
+                        bplus_tree_put(tree, k, k);
+                }
+                pause();
+                _exit(0);
+        }
+
+        close(fds[1]);
+        alarm(60);
+        struct bplus_follower *follower = bplus_follower_start(replica, fds[0]);
+        expect(follower != NULL, "follower start failed");
+        while (bplus_follower_get(follower, 2000) != 2000) {
+                usleep(10000);
+        }
+        bplus_follower_stop(follower);
+        alarm(0);
+
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        close(fds[0]);
+
+        /* the replica is as of the last commit applied */
+        struct bplus_tree *tree = bplus_tree_init(replica, 512);
+        for (k = 1; k <= 2000; k++) {
+                expect(bplus_tree_get(tree, k) == k, "replica key %d lost", k);
+        }
+        bplus_tree_deinit(tree);
+}
+
+static void test_follower(void)
+{
+        follower_case(0);
+        follower_case(BPLUS_TREE_AUGMENTED | BPLUS_TREE_COMPRESSED_LEAVES);
+        follower_stop_case();
+}
+
+#define SHARED_KEYS 5000
+#define SHARED_ROUNDS 4
+
+static int shared_sleep(key_t key, long data, void *arg)
+{
+        (void) key;
+        (void) data;
+        (void) arg;
+        sleep(100);
+        return 0;
+}
+
+static int shared_count(key_t key, long data, void *arg)
+{
+        (void) key;
+        (void) data;
+        (void) arg;
+        return 0;
+}
+
+static pid_t shared_reader(char *name, int ready, int go)
+{
+        char c;
+        int r, k;
+
+        pid_t pid = fork();
+        expect(pid >= 0, "fork failed");
+        if (pid != 0) {
+                return pid;
+        }
+
+        struct bplus_tree *tree = bplus_tree_init(name, 4096);
+        expect(tree != NULL && bplus_tree_shared_enable(tree, 256, 0) == 0, "reader attach failed");
+        for (r = 0; r < SHARED_ROUNDS; r++) {
+                expect(write(ready, "r", 1) == 1 && read(go, &c, 1) == 1, "reader sync failed");
+                /* every change of the writer up to the round is seen */
+                for (k = 1; k <= SHARED_KEYS; k++) {
+                        long data = bplus_tree_get(tree, k);
+                        expect(data == (long) k * (r + 1), "round %d key %d got %ld", r, k, data);
+                }
+                expect(bplus_tree_walk(tree, INT_MIN, INT_MAX, shared_count, NULL) == SHARED_KEYS,
+                       "reader walk differs");
+        }
+        bplus_tree_deinit(tree);
+        _exit(0);
+}
+
+static void test_shared(void)
+{
+        char name[1100], c;
+        int ready[2], go[2], status, r, k;
+        pid_t pid;
+
+        /* a lock left by a dead process must not hang the rest */
+        alarm(60);
+        index_file(name, "shared");
+        struct bplus_tree *tree = bplus_tree_init(name, 4096);
+        expect(tree != NULL && bplus_tree_shared_enable(tree, 256, 1) == 0, "writer attach failed");
+
+        expect(pipe(ready) == 0 && pipe(go) == 0, "pipe failed");
+        pid = shared_reader(name, ready[1], go[0]);
+        close(ready[1]);
+        close(go[0]);
+        for (r = 0; r < SHARED_ROUNDS; r++) {
+                /* the reader is done with the round before */
+                expect(read(ready[0], &c, 1) == 1, "writer sync failed");
+                for (k = 1; k <= SHARED_KEYS; k++) {
+                        bplus_tree_upsert(tree, k, (long) k * (r + 1));
+                }
+                expect(write(go[1], "g", 1) == 1, "writer sync failed");
+        }
+        expect(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+               "reader failed");
+
+        close(ready[0]);
+        close(go[1]);
+
+        /* a reader killed inside a call */
+        expect(pipe(ready) == 0, "pipe failed");
+        pid = fork();
+        expect(pid >= 0, "fork failed");
+        if (pid == 0) {
+                struct bplus_tree *reader = bplus_tree_init(name, 4096);
+                expect(bplus_tree_shared_enable(reader, 256, 0) == 0, "reader attach failed");
+                expect(write(ready[1], "r", 1) == 1, "reader sync failed");
+                bplus_tree_walk(reader, 1, 1, shared_sleep, NULL);
+                _exit(0);
+        }
+        expect(read(ready[0], &c, 1) == 1, "writer sync failed");
+        usleep(100000);
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        close(ready[0]);
+        close(ready[1]);
+        for (k = 1; k <= SHARED_KEYS; k++) {
+                bplus_tree_upsert(tree, k, k);
+        }
+        bplus_tree_deinit(tree);
+
+        /* writers killed while writing, with a reader attached throughout */
+        struct bplus_tree *keep = bplus_tree_init(name, 4096);
+        expect(keep != NULL && bplus_tree_shared_enable(keep, 256, 0) == 0, "reader attach failed");
+        for (r = 0; r < 10; r++) {
+                pid = fork();
+                expect(pid >= 0, "fork failed");
+                if (pid == 0) {
+                        struct bplus_tree *writer = bplus_tree_init(name, 4096);
+                        expect(bplus_tree_shared_enable(writer, 256, 1) == 0, "writer attach failed");
+                        for (k = 0; ; k++) {
+                                bplus_tree_upsert(writer, k % SHARED_KEYS + 1, k);
+                        }
+                }
+                struct bplus_tree *reader = bplus_tree_init(name, 4096);
+                expect(reader != NULL && bplus_tree_shared_enable(reader, 256, 0) == 0, "reader attach failed");
+                usleep(20000 + r * 2000);
+                kill(pid, SIGKILL);
+                waitpid(pid, &status, 0);
+                for (k = 1; k <= 100; k++) {
+                        bplus_tree_get(reader, k);
+                }
+                bplus_tree_deinit(reader);
+                bplus_tree_get(keep, r + 1);
+        }
+        bplus_tree_deinit(keep);
+
+        /* and a writer attaches after them all */
+        tree = bplus_tree_init(name, 4096);
+        expect(tree != NULL && bplus_tree_shared_enable(tree, 256, 1) == 0, "writer attach failed");
+        bplus_tree_upsert(tree, 1, 1);
+        expect(bplus_tree_get(tree, 1) == 1, "writer after crashes failed");
+        bplus_tree_deinit(tree);
+        alarm(0);
+}
+
+#define WARMUP_KEYS 50000
+
+static void test_warmup(void)
+{
+        char name[1100], manifest[1200];
+        long *ref = calloc(WARMUP_KEYS + 1, sizeof(long));
+        struct stat st;
+        int i, k;
+        expect(ref != NULL, "out of memory");
+
+        index_file(name, "warmup");
+        sprintf(manifest, "%s.manifest", name);
+        struct bplus_tree *tree = bplus_tree_init(name, 512);
+        expect(tree != NULL, "init failed");
+        for (k = 1; k <= WARMUP_KEYS; k++) {
+                ref[k] = k * 3L;
+                bplus_tree_put(tree, k, ref[k]);
+        }
+
+        /* saved in background while the tree is in use, and of the blocks
+         * read lately as it goes away */
+        bplus_tree_manifest_enable(tree, 20);
+        for (i = 0; i < 2; i++) {
+                for (k = 1; k <= WARMUP_KEYS / 10; k++) {
+                        expect(bplus_tree_get(tree, k * 7 % WARMUP_KEYS + 1) == ref[k * 7 % WARMUP_KEYS + 1],
+                               "get failed");
+                }
+                for (k = 0; i == 0 && k < 100 && stat(manifest, &st) != 0; k++) {
+                        usleep(20000);
+                }
+                expect(stat(manifest, &st) == 0, "no manifest saved in background");
+        }
+        bplus_tree_deinit(tree);
+        expect(stat(manifest, &st) == 0, "no manifest saved");
+
+        /* the next start reads the blocks looked up before */
+        tree = bplus_tree_init(name, 512);
+        expect(tree != NULL, "init failed");
+        long blocks = bplus_tree_warmup_wait(tree);
+        expect(blocks > 0, "%ld blocks warmed up", blocks);
+        /* a block offset each after the header of two */
+        expect(blocks <= (long) (st.st_size / sizeof(long) - 2), "%ld blocks warmed up", blocks);
+        expect(bplus_tree_warmup_wait(tree) == 0, "warm up waited twice");
+        tree_check(tree, ref, WARMUP_KEYS);
+        bplus_tree_deinit(tree);
+
+        /* a manifest left of a larger index is only read within the file */
+        expect(unlink(name) == 0, "unlink failed");
+        sprintf(manifest, "%s.boot", name);
+        unlink(manifest);
+        tree = bplus_tree_init(name, 512);
+        expect(tree != NULL, "init failed");
+        bplus_tree_warmup_wait(tree);
+        memset(ref, 0, (WARMUP_KEYS + 1) * sizeof(long));
+        ref[1] = 1;
+        bplus_tree_put(tree, 1, 1);
+        tree_check(tree, ref, WARMUP_KEYS);
+        bplus_tree_deinit(tree);
+        free(ref);
+}
+
+#define FORMAT_KEYS 10000
+
+static void test_format(void)
+{
+        char name[1100], other[1100];
+        long *ref = calloc(FORMAT_KEYS + 1, sizeof(long));
+        int k;
+        expect(ref != NULL, "out of memory");
+
+        index_file(name, "format");
+        index_file(other, "format_other");
+        struct bplus_tree *tree = bplus_tree_init(name, 512);
+        expect(tree != NULL, "init failed");
+        for (k = 1; k <= FORMAT_KEYS; k++) {
+                ref[k] = k;
+                bplus_tree_put(tree, k, ref[k]);
+        }
+
+        /* a format refused leaves the tree open as it is */
+        expect(bplus_tree_init_flags(other, 512, BPLUS_TREE_BUFFERED_NODES | BPLUS_TREE_AUGMENTED) == NULL,
+               "buffered augmented tree opened");
+        expect(bplus_tree_init_flags(other, 16, 0) == NULL, "tree of tiny blocks opened");
+        tree_check(tree, ref, FORMAT_KEYS);
+
+        /* as is one of another format, block size or search while it is */
+        expect(bplus_tree_init_flags(other, 512, BPLUS_TREE_COMPRESSED_LEAVES) == NULL,
+               "compressed tree opened");
+        expect(bplus_tree_init(other, 1024) == NULL, "tree of larger blocks opened");
+        expect(bplus_tree_init_flags(other, 512, BPLUS_TREE_INTERPOLATION_SEARCH) == NULL,
+               "tree of another search opened");
+        tree_check(tree, ref, FORMAT_KEYS);
+
+        /* an index of another format opened before is too */
+        bplus_tree_deinit(tree);
+        tree = bplus_tree_init_flags(other, 512, BPLUS_TREE_COMPRESSED_LEAVES);
+        expect(tree != NULL, "init failed");
+        bplus_tree_put(tree, 1, 1);
+        bplus_tree_deinit(tree);
+        tree = bplus_tree_init(name, 512);
+        expect(bplus_tree_init(other, 512) == NULL, "compressed index opened");
+        tree_check(tree, ref, FORMAT_KEYS);
+
+        /* while one of its own format opens along */
+        char same[1100];
+        index_file(same, "format_same");
+        struct bplus_tree *tree2 = bplus_tree_init(same, 512);
+        expect(tree2 != NULL, "init failed");
+        bplus_tree_put(tree2, 1, 2);
+        expect(bplus_tree_get(tree2, 1) == 2, "second tree lost its key");
+        tree_check(tree, ref, FORMAT_KEYS);
+        bplus_tree_deinit(tree2);
+        bplus_tree_deinit(tree);
+
+        tree = bplus_tree_init(other, 512);
+        expect(tree != NULL && bplus_tree_get(tree, 1) == 1, "compressed index lost");
+        bplus_tree_deinit(tree);
+        free(ref);
+}
+
+#define SHARD_KEYS 20000
+#define SHARD_STEP 200000
+
+static key_t shard_key(int i)
+{
+        return (key_t) ((long) INT_MIN + (long) i * SHARD_STEP);
+}
+
+/* shard files of a prefix with whatever a previous run left removed */
+static char *shard_prefix(char *buf, const char *name, int nr_shards)
+{
+        char path[1200];
+        int i;
+
+        sprintf(buf, "/tmp/bplustree_test_%s", name);
+        for (i = 0; i < nr_shards; i++) {
+                sprintf(path, "%s.%d", buf, i);
+                unlink(path);
+                strcat(path, ".boot");
+                unlink(path);
+        }
+        sprintf(path, "%s.shards", buf);
+        unlink(path);
+        return buf;
+}
+
+struct shard_check {
+        long *ref;
+        long last;
+        long count;
+};
+
+static int shard_check_fn(key_t key, long data, void *arg)
+{
+        struct shard_check *c = arg;
+        long i = ((long) key - INT_MIN) / SHARD_STEP;
+        expect(key > c->last, "shard walk out of order at key %d", key);
+        expect(((long) key - INT_MIN) % SHARD_STEP == 0 && i < SHARD_KEYS && c->ref[i] == data,
+               "shard walk saw key %d data %ld", key, data);
+        c->last = key;
+        c->count++;
+        return 0;
+}
+
+static void shard_check(struct bplus_shard_tree *st, long *ref)
+{
+        struct shard_check c;
+        long live = 0;
+        int i;
+
+        for (i = 0; i < SHARD_KEYS; i++) {
+                long data = bplus_shard_get(st, shard_key(i));
+                expect(data == (ref[i] ? ref[i] : -1), "shard key %d got %ld expected %ld",
+                       shard_key(i), data, ref[i]);
+                live += ref[i] != 0;
+        }
+
+        /* across every shard in key order */
+        c.ref = ref;
+        c.last = (long) INT_MIN - 1;
+        c.count = 0;
+        expect(bplus_shard_walk(st, INT_MIN, INT_MAX, shard_check_fn, &c) == live, "shard walk count differs");
+        expect(c.count == live, "shard walk saw %ld of %ld entries", c.count, live);
+        if (live > 0) {
+                /* the last key of a range across the shards */
+                for (i = SHARD_KEYS - 1; ref[i] == 0; i--) {
+                }
+                expect(bplus_shard_get_range(st, INT_MIN, INT_MAX) == ref[i], "shard range differs");
+        }
+}
+
+static void test_shard(void)
+{
+        char prefix[1100];
+        long *ref = calloc(SHARD_KEYS, sizeof(long));
+        int i, k;
+        expect(ref != NULL, "out of memory");
+
+        shard_prefix(prefix, "shard", 4);
+        struct bplus_shard_tree *st = bplus_shard_tree_init(prefix, 512, 4);
+        expect(st != NULL, "shard init failed");
+        srand(28);
+        for (k = 0; k < 2 * SHARD_KEYS; k++) {
+                long data = rand() % 3 ? rand() % 1000000 + 1 : 0;
+                i = rand() % SHARD_KEYS;
+                /* a put keeps the data of a key there, of 0 deletes it */
+                if (data == 0 || ref[i] == 0) {
+                        ref[i] = data;
+                }
+                bplus_shard_put(st, shard_key(i), data);
+        }
+        shard_check(st, ref);
+
+        /* the second shard is hot and hands keys over to a neighbour */
+        key_t bounds[3];
+        memcpy(bounds, st->bounds, sizeof(bounds));
+        for (k = 0; k < 10; k++) {
+                for (i = SHARD_KEYS / 4; i < SHARD_KEYS / 2; i++) {
+                        bplus_shard_get(st, shard_key(i));
+                }
+        }
+        expect(bplus_shard_rebalance(st) == 0, "rebalance failed");
+        expect(memcmp(bounds, st->bounds, sizeof(bounds)) != 0, "rebalance kept the bounds");
+        expect(st->bounds[0] < st->bounds[1] && st->bounds[1] < st->bounds[2], "bounds out of order");
+        shard_check(st, ref);
+        memcpy(bounds, st->bounds, sizeof(bounds));
+        bplus_shard_tree_deinit(st);
+
+        /* reopened with the bounds stored, and refused of another number */
+        expect(bplus_shard_tree_init(prefix, 512, 2) == NULL, "shards reopened in another number");
+        st = bplus_shard_tree_init(prefix, 512, 4);
+        expect(st != NULL, "shard init failed");
+        expect(memcmp(bounds, st->bounds, sizeof(bounds)) == 0, "bounds not stored");
+        shard_check(st, ref);
+        bplus_shard_tree_deinit(st);
+        free(ref);
+}
+
+#define WRITEBACK_KEYS 20000
+
+/* a process ending without deinit after a checkpoint leaves the index to
+ * be rolled back to it, however many blocks were written since */
+static void writeback_crash_case(void)
+{
+        char name[1100], snapshot[1200];
+        long *ref = calloc(WRITEBACK_KEYS + 1, sizeof(long));
+        long i;
+        int status;
+        expect(ref != NULL, "out of memory");
+
+        index_file(name, "writeback");
+        sprintf(snapshot, "%s.ref", name);
+        pid_t pid = fork();
+        expect(pid >= 0, "fork failed");
+        if (pid == 0) {
+                struct bplus_tree *tree = bplus_tree_init(name, 1024);
+                expect(tree != NULL, "init failed");
+                expect(bplus_tree_writeback_enable(tree, 64 * 1024, 2, 0) == 0, "write-back enable failed");
+                srand(42);
+                for (i = 0; i < 50000; i++) {
+                        model_step(tree, ref, WRITEBACK_KEYS, 0);
+                }
+                expect(bplus_tree_checkpoint(tree) == 0, "checkpoint failed");
+                FILE *fp = fopen(snapshot, "wb");
+                expect(fp != NULL && fwrite(ref, sizeof(long), WRITEBACK_KEYS + 1, fp) == WRITEBACK_KEYS + 1,
+                       "snapshot not written");
+                fclose(fp);
+                for (i = 0; i < 50000; i++) {
+                        model_step(tree, ref, WRITEBACK_KEYS, 0);
+                }
+                usleep(20000);
+                _exit(0);
+        }
+        expect(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+               "writer failed");
+
+        FILE *fp = fopen(snapshot, "rb");
+        expect(fp != NULL && fread(ref, sizeof(long), WRITEBACK_KEYS + 1, fp) == WRITEBACK_KEYS + 1,
+               "snapshot not read");
+        fclose(fp);
+        unlink(snapshot);
+        struct bplus_tree *tree = bplus_tree_init(name, 1024);
+        expect(tree != NULL, "init failed");
+        tree_check(tree, ref, WRITEBACK_KEYS);
+        bplus_tree_deinit(tree);
+        free(ref);
+}
+
+static void test_writeback(void)
+{
+        char name[1100];
+        long *ref = calloc(WRITEBACK_KEYS + 1, sizeof(long));
+        long i;
+        expect(ref != NULL, "out of memory");
+
+        /* a dirty table far smaller than the tree, flushed by writers and the
+         * flusher alike, and checkpoints due while changes go on */
+        index_file(name, "writeback");
+        struct bplus_tree *tree = bplus_tree_init(name, 1024);
+        expect(tree != NULL, "init failed");
+        expect(bplus_tree_writeback_enable(tree, 64 * 1024, 2, 10) == 0, "write-back enable failed");
+        srand(41);
+        for (i = 0; i < 200000; i++) {
+                model_step(tree, ref, WRITEBACK_KEYS, 0);
+                if (i % 50000 == 0) {
+                        tree_check(tree, ref, WRITEBACK_KEYS);
+                }
+        }
+        tree_check(tree, ref, WRITEBACK_KEYS);
+
+        /* the flusher empties the table in the background */
+        usleep(50000);
+        tree_check(tree, ref, WRITEBACK_KEYS);
+        expect(bplus_tree_checkpoint(tree) == 0, "checkpoint failed");
+        for (i = 0; i < 20000; i++) {
+                model_step(tree, ref, WRITEBACK_KEYS, 0);
+        }
+        bplus_tree_deinit(tree);
+
+        /* all of it on disk, read back without the table */
+        tree = bplus_tree_init(name, 1024);
+        expect(tree != NULL, "init failed");
+        tree_check(tree, ref, WRITEBACK_KEYS);
+        expect(bplus_tree_writeback_enable(tree, 64 * 1024, 1000, 0) == 0, "write-back enable failed");
+        for (i = 0; i < 20000; i++) {
+                model_step(tree, ref, WRITEBACK_KEYS, 0);
+        }
+        /* and turned off again with the table written */
+        expect(bplus_tree_writeback_enable(tree, 0, 0, 0) == 0, "write-back disable failed");
+        tree_check(tree, ref, WRITEBACK_KEYS);
+        bplus_tree_deinit(tree);
+
+        tree = bplus_tree_init(name, 1024);
+        expect(tree != NULL, "init failed");
+        tree_check(tree, ref, WRITEBACK_KEYS);
+        bplus_tree_deinit(tree);
+        free(ref);
+        writeback_crash_case();
+}
+
+#define BUFFERED_KEYS 30000
+
+static void buffered_case(int block_size, int flags)
+{
+        char name[1100];
+        long *ref = calloc(BUFFERED_KEYS + 1, sizeof(long));
+        long i;
+        int k;
+        expect(ref != NULL, "out of memory");
+
+        index_file(name, "buffered");
+        struct bplus_tree *tree = bplus_tree_init_flags(name, block_size, BPLUS_TREE_BUFFERED_NODES | flags);
+        expect(tree != NULL, "init failed");
+        /* changes are only queued once the root is no leaf */
+        for (k = 1; k <= BUFFERED_KEYS; k += 2) {
+                ref[k] = k;
+                expect(bplus_tree_upsert(tree, k, k) == 0, "upsert of key %d failed", k);
+        }
+        tree_check(tree, ref, BUFFERED_KEYS);
+
+        /* lookups and walks see messages still in the buffers */
+        srand(block_size + flags);
+        for (i = 0; i < 200000; i++) {
+                model_step(tree, ref, BUFFERED_KEYS, 1);
+                if (i % 40000 == 0) {
+                        tree_check(tree, ref, BUFFERED_KEYS);
+                }
+        }
+        tree_check(tree, ref, BUFFERED_KEYS);
+        bplus_tree_deinit(tree);
+
+        /* and the buffers are kept in the nodes on disk */
+        tree = bplus_tree_init_flags(name, block_size, BPLUS_TREE_BUFFERED_NODES | flags);
+        expect(tree != NULL, "init failed");
+        tree_check(tree, ref, BUFFERED_KEYS);
+        for (i = 0; i < 20000; i++) {
+                model_step(tree, ref, BUFFERED_KEYS, 1);
+        }
+        tree_check(tree, ref, BUFFERED_KEYS);
+        bplus_tree_deinit(tree);
+        free(ref);
+}
+
+static void test_buffered(void)
+{
+        buffered_case(1024, 0);
+        buffered_case(4096, 0);
+        buffered_case(1024, BPLUS_TREE_SLOTTED_LEAVES);
+}
+
+#define MEMTABLE_KEYS 20000
+
+static void memtable_case(int flags)
+{
+        char name[1100];
+        long *ref = calloc(MEMTABLE_KEYS + 1, sizeof(long));
+        long i;
+        expect(ref != NULL, "out of memory");
+
+        index_file(name, "memtable");
+        struct bplus_tree *tree = bplus_tree_init_flags(name, 1024, flags);
+        expect(tree != NULL, "init failed");
+        expect(bplus_tree_memtable_enable(tree, 1000) == 0, "memtable enable failed");
+
+        /* read from the memtable before and after it is merged when full */
+        srand(flags + 44);
+        for (i = 0; i < 100000; i++) {
+                model_step(tree, ref, MEMTABLE_KEYS, 0);
+                if (i % 20000 == 10) {
+                        tree_check(tree, ref, MEMTABLE_KEYS);
+                }
+        }
+        tree_check(tree, ref, MEMTABLE_KEYS);
+        /* range deletes merge it first */
+        bplus_tree_delete_range(tree, 1, 1);
+        ref[1] = 0;
+        for (i = 1; i <= 500; i++) {
+                ref[i * 2] = i;
+                bplus_tree_upsert(tree, i * 2, i);
+        }
+        expect(bplus_tree_memtable_flush(tree) == 500, "memtable flush lost changes");
+        expect(bplus_tree_memtable_flush(tree) == 0, "memtable flushed twice");
+        tree_check(tree, ref, MEMTABLE_KEYS);
+
+        /* a smaller one, then none, with what it held merged */
+        expect(bplus_tree_memtable_enable(tree, 10) == 0, "memtable resize failed");
+        for (i = 0; i < 20000; i++) {
+                model_step(tree, ref, MEMTABLE_KEYS, 0);
+        }
+        expect(bplus_tree_memtable_enable(tree, 0) == 0, "memtable disable failed");
+        tree_check(tree, ref, MEMTABLE_KEYS);
+        expect(bplus_tree_memtable_enable(tree, 1000) == 0, "memtable enable failed");
+        for (i = 0; i < 500; i++) {
+                model_step(tree, ref, MEMTABLE_KEYS, 0);
+        }
+        /* changes still held are merged as the tree goes away */
+        bplus_tree_deinit(tree);
+
+        tree = bplus_tree_init_flags(name, 1024, flags);
+        expect(tree != NULL, "init failed");
+        tree_check(tree, ref, MEMTABLE_KEYS);
+        bplus_tree_deinit(tree);
+        free(ref);
+}
+
+static void test_memtable(void)
+{
+        char name[1100];
+
+        memtable_case(0);
+        memtable_case(BPLUS_TREE_COMPRESSED_LEAVES);
+        memtable_case(BPLUS_TREE_AUGMENTED);
+
+        /* buffered nodes batch changes already */
+        index_file(name, "memtable");
+        struct bplus_tree *tree = bplus_tree_init_flags(name, 1024, BPLUS_TREE_BUFFERED_NODES);
+        expect(tree != NULL, "init failed");
+        expect(bplus_tree_memtable_enable(tree, 1000) == -1, "memtable on buffered nodes");
+        bplus_tree_deinit(tree);
+}
+
+#define MULTI_KEYS 300
+#define MULTI_VALUES 2000
+
+struct multi_check {
+        char *ref;
+        key_t key;
+        long value;
+        long count;
+};
+
+static int multi_check_fn(key_t key, long data, void *arg)
+{
+        struct multi_check *w = arg;
+        expect(key > w->key || (key == w->key && data > w->value),
+               "walk out of order at key %d value %ld", key, data);
+        expect(key >= 0 && key <= MULTI_KEYS && data > 0 && data <= MULTI_VALUES &&
+               w->ref[key * (MULTI_VALUES + 1) + data], "walk saw key %d value %ld", key, data);
+        w->key = key;
+        w->value = data;
+        w->count++;
+        return 0;
+}
+
+/* every key has the values of its row of ref, the least of them got */
+static void multi_check(struct bplus_tree *tree, char *ref)
+{
+        struct multi_check w;
+        long count = 0;
+        int k;
+
+        for (k = 0; k <= MULTI_KEYS; k++) {
+                char *row = ref + k * (MULTI_VALUES + 1);
+                long v, first = -1, n = 0;
+                for (v = MULTI_VALUES; v > 0; v--) {
+                        if (row[v]) {
+                                first = v;
+                                n++;
+                        }
+                }
+                long data = bplus_tree_get(tree, k);
+                expect(data == first, "key %d got %ld expected %ld", k, data, first);
+                /* walking from a key to itself goes through its values */
+                w.ref = ref;
+                w.key = INT_MIN;
+                w.value = 0;
+                w.count = 0;
+                bplus_tree_walk(tree, k, k, multi_check_fn, &w);
+                expect(w.count == n, "key %d walked %ld of %ld values", k, w.count, n);
+                count += n;
+        }
+
+        w.ref = ref;
+        w.key = INT_MIN;
+        w.value = 0;
+        w.count = 0;
+        bplus_tree_walk(tree, INT_MIN, INT_MAX, multi_check_fn, &w);
+        expect(w.count == count, "walk saw %ld of %ld values", w.count, count);
+}
+
+static void multi_case(int block_size, int flags)
+{
+        char name[1100];
+        char *ref = calloc((MULTI_KEYS + 1) * (MULTI_VALUES + 1), 1);
+        long i;
+        expect(ref != NULL, "out of memory");
+
+        index_file(name, "multi");
+        flags |= BPLUS_TREE_MULTI_VALUES;
+        struct bplus_tree *tree = bplus_tree_init_flags(name, block_size, flags);
+        expect(tree != NULL, "init failed");
+        expect(bplus_tree_append(tree, 1, 0) == -1, "appended value 0");
+        expect(bplus_tree_upsert(tree, 1, -1) == -1, "upserted a negative value");
+
+        /* keys of a few values in the leaf or a cell, every tenth one of
+         * enough to need a chain of posting blocks */
+        srand(block_size + flags);
+        for (i = 0; i < 300000; i++) {
+                key_t k = rand() % MULTI_KEYS + 1;
+                long v = rand() % (k % 10 == 0 ? MULTI_VALUES : 12) + 1;
+                char *row = ref + k * (MULTI_VALUES + 1);
+                int ret, op = rand() % 100;
+
+                if (op < 60) {
+                        ret = bplus_tree_append(tree, k, v);
+                        expect(ret == (row[v] ? -1 : 0), "append of key %d value %ld returned %d", k, v, ret);
+                        row[v] = 1;
+                } else if (op < 98) {
+                        ret = bplus_tree_remove(tree, k, v);
+                        expect(ret == (row[v] ? 0 : -1), "remove of key %d value %ld returned %d", k, v, ret);
+                        row[v] = 0;
+                } else if (op < 99) {
+                        /* the values go with the key */
+                        bplus_tree_put(tree, k, 0);
+                        memset(row, 0, MULTI_VALUES + 1);
+                } else {
+                        bplus_tree_delete_range(tree, k, k + 3);
+                        memset(row, 0, (MULTI_VALUES + 1) * (k + 3 <= MULTI_KEYS ? 4 : MULTI_KEYS - k + 1));
+                }
+                if (i % 100000 == 0) {
+                        multi_check(tree, ref);
+                }
+        }
+        multi_check(tree, ref);
+        bplus_tree_deinit(tree);
+
+        tree = bplus_tree_init_flags(name, block_size, flags);
+        expect(tree != NULL, "init failed");
+        multi_check(tree, ref);
+        bplus_tree_deinit(tree);
+        free(ref);
+}
+
+static void test_multi(void)
+{
+        multi_case(1024, 0);
+        multi_case(4096, 0);
+        multi_case(1024, BPLUS_TREE_SLOTTED_LEAVES);
+}
+
+#define CACHE_KEYS 2000
+
+/* whatever the cache holds is what the tree holds */
+static void cache_check(struct bplus_tree *tree, long *ref)
+{
+        int k;
+        long data;
+
+        for (k = 0; k <= CACHE_KEYS; k++) {
+                if (bplus_tree_cache_get(tree, k, &data) == 0) {
+                        expect(data == (ref[k] ? ref[k] : -1), "key %d cached %ld expected %ld", k, data, ref[k]);
+                }
+        }
+}
+
+static void cache_case(int flags, long memtable)
+{
+        char name[1100];
+        long *ref = calloc(CACHE_KEYS + 1, sizeof(long));
+        long i, data, hits = 0;
+        int k;
+        expect(ref != NULL, "out of memory");
+
+        index_file(name, "cache");
+        struct bplus_tree *tree = bplus_tree_init_flags(name, 512, flags);
+        expect(tree != NULL, "init failed");
+        expect(bplus_tree_cache_enable(tree, 256) == 0, "cache enable failed");
+        if (memtable > 0) {
+                expect(bplus_tree_memtable_enable(tree, memtable) == 0, "memtable enable failed");
+        }
+        for (k = 1; k <= CACHE_KEYS; k += 2) {
+                ref[k] = k;
+                bplus_tree_upsert(tree, k, k);
+        }
+
+        /* lookups fill the cache, and every kind of change keeps it right */
+        srand(flags + memtable);
+        for (i = 0; i < 30000; i++) {
+                k = rand() % CACHE_KEYS + 1;
+                expect(bplus_tree_get(tree, k) == (ref[k] ? ref[k] : -1), "key %d got a stale value", k);
+                if (rand() % 4 == 0) {
+                        long delta = rand() % 3 - 1;
+                        data = bplus_tree_add(tree, k, delta);
+                        expect(data == ref[k] + delta, "add to key %d gave %ld", k, data);
+                        ref[k] = data;
+                } else {
+                        model_step(tree, ref, CACHE_KEYS, flags & BPLUS_TREE_BUFFERED_NODES);
+                }
+                cache_check(tree, ref);
+        }
+        for (k = 0; k <= CACHE_KEYS; k++) {
+                hits += bplus_tree_cache_get(tree, k, &data) == 0;
+        }
+        expect(hits > 0, "nothing cached");
+        tree_check(tree, ref, CACHE_KEYS);
+
+        /* dropped with the cache, nothing is cached */
+        expect(bplus_tree_cache_enable(tree, 0) == 0, "cache disable failed");
+        expect(bplus_tree_cache_get(tree, 1, &data) == -1, "cached without a cache");
+        bplus_tree_deinit(tree);
+        free(ref);
+}
+
+static void test_cache(void)
+{
+        cache_case(0, 0);
+        cache_case(0, 100);
+        cache_case(BPLUS_TREE_BUFFERED_NODES, 0);
+        cache_case(BPLUS_TREE_AUGMENTED, 0);
+}
+
+#define TRACE_KEYS 5000
+#define TRACE_OPS 50000
+
+static void test_trace(void)
+{
+        char name[1100], trace[1200];
+        long *ref = calloc(TRACE_KEYS + 1, sizeof(long));
+        struct bplus_trace_record *recs = calloc(TRACE_OPS, sizeof(*recs));
+        struct bplus_trace_record rec;
+        struct bplus_trace_header header;
+        long i, last = 0;
+        expect(ref != NULL && recs != NULL, "out of memory");
+
+        index_file(name, "trace");
+        sprintf(trace, "%s.trace", name);
+        struct bplus_tree *tree = bplus_tree_init(name, 1024);
+        expect(tree != NULL, "init failed");
+        expect(bplus_tree_trace_end(tree) == -1, "trace ended unrecorded");
+        expect(bplus_tree_trace_begin(tree, trace) == 0, "trace begin failed");
+        expect(bplus_tree_trace_begin(tree, trace) == -1, "trace begun twice");
+
+        /* the calls recorded are kept to be told from the trace */
+        srand(40);
+        for (i = 0; i < TRACE_OPS; i++) {
+                key_t k = rand() % TRACE_KEYS + 1;
+                recs[i].key = k;
+                switch (rand() % 4) {
+                case 0:
+                        recs[i].op = BPLUS_TRACE_GET;
+                        recs[i].ret = bplus_tree_get(tree, k);
+                        expect(recs[i].ret == (ref[k] ? ref[k] : -1), "key %d got %ld", k, recs[i].ret);
+                        break;
+                case 1:
+                        recs[i].op = BPLUS_TRACE_GET_RANGE;
+                        recs[i].arg = k + rand() % 50;
+                        recs[i].ret = bplus_tree_get_range(tree, k, recs[i].arg);
+                        break;
+                default:
+                        recs[i].op = BPLUS_TRACE_PUT;
+                        recs[i].arg = rand() % 3 ? rand() % 1000000 + 1 : 0;
+                        recs[i].ret = bplus_tree_put(tree, k, recs[i].arg);
+                        expect(recs[i].ret == ((ref[k] == 0) == (recs[i].arg != 0) ? 0 : -1),
+                               "put of key %d returned %ld", k, recs[i].ret);
+                        if (recs[i].ret == 0) {
+                                ref[k] = recs[i].arg;
+                        }
+                        break;
+                }
+        }
+        /* neither are other calls recorded, nor calls once it ends */
+        bplus_tree_upsert(tree, 1, 1);
+        expect(bplus_tree_trace_end(tree) == 0, "trace end failed");
+        bplus_tree_get(tree, 1);
+        bplus_tree_deinit(tree);
+
+        FILE *fp = fopen(trace, "rb");
+        expect(fp != NULL, "no trace file");
+        expect(fread(&header, sizeof(header), 1, fp) == 1, "trace header missing");
+        expect(header.magic == BPLUS_TRACE_MAGIC && header.version == BPLUS_TRACE_VERSION,
+               "trace header %x version %d", header.magic, header.version);
+        for (i = 0; i < TRACE_OPS; i++) {
+                expect(fread(&rec, sizeof(rec), 1, fp) == 1, "trace ends at record %ld", i);
+                expect(rec.op == recs[i].op && rec.key == recs[i].key && rec.ret == recs[i].ret &&
+                       (rec.op == BPLUS_TRACE_GET || rec.arg == recs[i].arg),
+                       "record %ld is op %d key %d arg %ld ret %ld", i, rec.op, rec.key, rec.arg, rec.ret);
+                expect(rec.time >= last, "record %ld recorded before the one ahead", i);
+                last = rec.time;
+        }
+        expect(fread(&rec, sizeof(rec), 1, fp) == 0, "trace goes on beyond the calls");
+        fclose(fp);
+
+        /* replayed against a new tree, every call returns what it did */
+        index_file(name, "trace");
+        tree = bplus_tree_init(name, 1024);
+        expect(tree != NULL, "init failed");
+        for (i = 0; i < TRACE_OPS; i++) {
+                long ret;
+                if (recs[i].op == BPLUS_TRACE_GET) {
+                        ret = bplus_tree_get(tree, recs[i].key);
+                } else if (recs[i].op == BPLUS_TRACE_GET_RANGE) {
+                        ret = bplus_tree_get_range(tree, recs[i].key, recs[i].arg);
+                } else {
+                        ret = bplus_tree_put(tree, recs[i].key, recs[i].arg);
+                }
+                expect(ret == recs[i].ret, "replayed record %ld returned %ld", i, ret);
+        }
+        tree_check(tree, ref, TRACE_KEYS);
+        bplus_tree_deinit(tree);
+        unlink(trace);
+        free(recs);
+        free(ref);
+}
+
+#define ANALYZE_KEYS 20000
+
+/* contents of a file, NULL if there is none */
+static char *file_read(const char *path, struct stat *st)
+{
+        if (stat(path, st) != 0) {
+                return NULL;
+        }
+        char *buf = malloc(st->st_size + 1);
+        FILE *fp = fopen(path, "rb");
+        expect(buf != NULL && fp != NULL, "%s unreadable", path);
+        expect(fread(buf, 1, st->st_size, fp) == (size_t) st->st_size, "%s unreadable", path);
+        fclose(fp);
+        return buf;
+}
+
+static void test_analyze(void)
+{
+        static const char *suffixes[] = { "", ".boot", ".bloom", ".manifest" };
+        char name[1100], path[1200];
+        char *before[4];
+        struct stat st[4], after_st;
+        struct bplus_tree_stats stats;
+        unsigned int i;
+        int k;
+
+        /* nothing is created of an index not there */
+        index_file(name, "analyze");
+        expect(bplus_tree_init_flags(name, 1024, BPLUS_TREE_READ_ONLY) == NULL, "read-only init created an index");
+        expect(access(name, F_OK) != 0, "read-only init created an index");
+
+        struct bplus_tree *tree = bplus_tree_init(name, 1024);
+        expect(tree != NULL, "init failed");
+        expect(bplus_tree_bloom_enable(tree, ANALYZE_KEYS, 10) == 0, "bloom enable failed");
+        expect(bplus_tree_manifest_enable(tree, 1000) == 0, "manifest enable failed");
+        for (k = 1; k <= ANALYZE_KEYS; k++) {
+                bplus_tree_put(tree, k, k);
+        }
+        for (k = 1; k <= ANALYZE_KEYS; k += 3) {
+                bplus_tree_put(tree, k, 0);
+                bplus_tree_get(tree, k + 1);
+        }
+        bplus_tree_deinit(tree);
+        for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+                sprintf(path, "%s%s", name, suffixes[i]);
+                before[i] = file_read(path, &st[i]);
+                expect(before[i] != NULL, "no %s", path);
+        }
+
+        /* read as it is, without warm-up, and left as it was */
+        tree = bplus_tree_init_flags(name, 4096, BPLUS_TREE_READ_ONLY);
+        expect(tree != NULL, "read-only init failed");
+        expect(bplus_tree_warmup_wait(tree) == 0, "read-only tree warmed up");
+        expect(bplus_tree_analyze(tree, &stats) == 0, "analyze failed");
+        expect(stats.block_size == 1024, "block size %d", stats.block_size);
+        expect(stats.keys == ANALYZE_KEYS - (ANALYZE_KEYS + 2) / 3, "%ld keys", stats.keys);
+        expect(stats.lost_blocks == 0, "%ld blocks lost", stats.lost_blocks);
+        expect(bplus_tree_get(tree, 2) == 2 && bplus_tree_get(tree, 1) == -1, "read-only get failed");
+        bplus_tree_deinit(tree);
+        for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+                sprintf(path, "%s%s", name, suffixes[i]);
+                /* neither written in place nor replaced */
+                char *after = file_read(path, &after_st);
+                expect(after != NULL && after_st.st_ino == st[i].st_ino &&
+                       after_st.st_mtim.tv_sec == st[i].st_mtim.tv_sec &&
+                       after_st.st_mtim.tv_nsec == st[i].st_mtim.tv_nsec &&
+                       after_st.st_size == st[i].st_size && memcmp(before[i], after, st[i].st_size) == 0,
+                       "%s changed", path);
+                free(after);
+                free(before[i]);
+        }
+}
+
+static struct {
+        const char *name;
+        void (*fn)(void);
+} tests[] = {
+        { "bulk_load", test_bulk_load },
+        { "backup", test_backup },
+        { "merge", test_merge },
+        { "split", test_split },
+        { "follower", test_follower },
+        { "shared", test_shared },
+        { "warmup", test_warmup },
+        { "format", test_format },
+        { "shard", test_shard },
+        { "writeback", test_writeback },
+        { "buffered", test_buffered },
+        { "memtable", test_memtable },
+        { "multi", test_multi },
+        { "cache", test_cache },
+        { "trace", test_trace },
+        { "analyze", test_analyze },
+};
+
+int main(int argc, char **argv)
+{
+        unsigned int i;
+        int found = 0;
+
+        for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+                if (argc < 2 || strcmp(argv[1], tests[i].name) == 0) {
+                        tests[i].fn();
+                        printf("### %s passed\n", tests[i].name);
+                        found = 1;
+                }
+        }
+        if (!found) {
+                fprintf(stderr, "No test case %s!\n", argv[1]);
+                return -1;
+        }
+        return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bplustree.h"
+
+static double percent(long part, long whole)
+{
+        return whole > 0 ? 100.0 * part / whole : 0.0;
+}
+
+static void stats_print(struct bplus_tree_stats *stats)
+{
+        int i, j;
+        long used = stats->blocks - stats->free_blocks - stats->lost_blocks;
+
+        printf("\n-- File\n");
+        printf("size:        %lld bytes, %ld blocks of %d bytes\n",
+               (long long) stats->file_size, stats->blocks, stats->block_size);
+        printf("in use:      %ld blocks (%.1f%%)\n", used, percent(used, stats->blocks));
+        printf("free:        %ld blocks (%.1f%%)\n", stats->free_blocks, percent(stats->free_blocks, stats->blocks));
+        printf("lost:        %ld blocks (%.1f%%)\n", stats->lost_blocks, percent(stats->lost_blocks, stats->blocks));
+        printf("live data:   %ld keys, %ld bytes (%.1f%% of file)\n", stats->keys,
+               stats->keys * (long) (sizeof(key_t) + sizeof(long)),
+               percent(stats->keys * (sizeof(key_t) + sizeof(long)), stats->file_size));
+        if (stats->messages > 0) {
+                printf("buffered:    %ld puts and deletes not in leaves yet\n", stats->messages);
+        }
+        if (stats->posting_blocks > 0) {
+                printf("postings:    %ld blocks (%.1f%%) of values of multi-valued keys\n",
+                       stats->posting_blocks, percent(stats->posting_blocks, stats->blocks));
+        }
+
+        printf("\n-- Levels (order %d, leaf entries %d)\n", stats->order, stats->entries);
+        printf("level       nodes   fill |");
+        for (j = 0; j < BPLUS_STATS_BUCKETS; j++) {
+                printf(" %3d%%", j * 100 / BPLUS_STATS_BUCKETS);
+        }
+        printf("\n");
+        for (i = 0; i < stats->height; i++) {
+                int capacity = i == stats->height - 1 ? stats->entries : stats->order;
+                printf("%5d %11ld %5.1f%% |", i, stats->nodes[i],
+                       percent(stats->slots[i], stats->nodes[i] * capacity));
+                for (j = 0; j < BPLUS_STATS_BUCKETS; j++) {
+                        printf(" %4.0f", percent(stats->fill[i][j], stats->nodes[i]));
+                }
+                printf("\n");
+        }
+
+        printf("\n-- Leaf chain\n");
+        printf("links:       %ld\n", stats->leaf_links);
+        printf("adjacent:    %.1f%%\n", percent(stats->leaf_adjacent, stats->leaf_links));
+        printf("forward:     %.1f%%\n", percent(stats->leaf_forward, stats->leaf_links));
+        printf("backward:    %.1f%%\n",
+               percent(stats->leaf_links - stats->leaf_adjacent - stats->leaf_forward, stats->leaf_links));
+}
+
+int main(int argc, char **argv)
+{
+        struct bplus_tree_stats stats;
+
+        if (argc != 2 || strlen(argv[1]) >= 1024) {
+                fprintf(stderr, "Usage: %s <index file>\n", argv[0]);
+                return 1;
+        }
+
+        /* nothing of the index is written, the block size is taken from
+         * the boot file */
+        struct bplus_tree *tree = bplus_tree_init_flags(argv[1], 4096, BPLUS_TREE_READ_ONLY);
+        if (tree == NULL) {
+                return 1;
+        }
+
+        int ret = bplus_tree_analyze(tree, &stats);
+        if (ret == 0) {
+                stats_print(&stats);
+        }
+        bplus_tree_deinit(tree);
+        return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+/* In-node key search on one full leaf of 16, 32 and 64 KiB blocks, with
+ * binary, interpolation and adaptive search over uniform, skewed and
+ * clustered keys. The searches are static, so the library source is built
+ * in here, and it is not written for -Wextra */
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wold-style-declaration"
+#include "bplustree.c"
+
+#include <math.h>
+
+enum {
+        KEYS_UNIFORM,
+        KEYS_SKEWED,
+        KEYS_CLUSTERED,
+        NR_KEY_SETS,
+};
+
+static const char *key_set_names[NR_KEY_SETS] = { "uniform", "skewed", "clustered" };
+
+static const int search_modes[] = {
+        0,
+        BPLUS_TREE_INTERPOLATION_SEARCH,
+        BPLUS_TREE_ADAPTIVE_SEARCH,
+};
+
+static long elapsed(struct timespec *from, struct timespec *to)
+{
+        return (to->tv_sec - from->tv_sec) * 1000000000L + to->tv_nsec - from->tv_nsec;
+}
+
+/* ascending keys of the set, by the gaps between them */
+static void keys_fill(key_t *keys, int n, int set)
+{
+        int i;
+        long k = 0;
+
+        for (i = 0; i < n; i++) {
+                switch (set) {
+                case KEYS_UNIFORM:
+                        k += 1 + rand() % 15;
+                        break;
+                case KEYS_SKEWED:
+                        /* gaps growing exponentially to the end of the node */
+                        k += 1 + (long) (exp(12.0 * i / n) * (rand() % 4 + 1) / 4);
+                        break;
+                default:
+                        /* eight dense runs far apart */
+                        k += i % (n / 8) == 0 ? 10000000 : 1 + rand() % 3;
+                        break;
+                }
+                keys[i] = k;
+        }
+}
+
+static void usage(char *prog)
+{
+        fprintf(stderr, "Usage: %s [-n probes]\n"
+                        "  -n  searches timed of each strategy, 2000000 by default\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+        int opt, set, mode, size;
+        long j, probes = 2000000;
+
+        while ((opt = getopt(argc, argv, "n:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        probes = atol(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind != argc || probes <= 0) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        key_t *targets = malloc(probes * sizeof(key_t));
+        assert(targets != NULL);
+        printf("ns/search   binary  interpolation  adaptive\n");
+        for (size = 16 << 10; size <= 64 << 10; size <<= 1) {
+                _block_size = size;
+                _format_flags = 0;
+                node_capacity_set();
+                struct bplus_node *leaf = calloc(1, _node_size);
+                assert(leaf != NULL);
+                leaf->type = BPLUS_TREE_LEAF;
+                leaf->children = _max_entries;
+
+                for (set = 0; set < NR_KEY_SETS; set++) {
+                        srand(set);
+                        keys_fill(key(leaf), leaf->children, set);
+                        /* half hits and half misses within the key range */
+                        key_t max = key(leaf)[leaf->children - 1];
+                        for (j = 0; j < probes; j++) {
+                                targets[j] = j % 2 ? key(leaf)[rand() % leaf->children] : rand() % max;
+                        }
+
+                        printf("%2dK %-10s", size >> 10, key_set_names[set]);
+                        for (mode = 0; mode < (int) (sizeof(search_modes) / sizeof(search_modes[0])); mode++) {
+                                struct timespec start, end;
+                                long found = 0;
+                                _key_search_mode = search_modes[mode];
+                                clock_gettime(CLOCK_MONOTONIC, &start);
+                                for (j = 0; j < probes; j++) {
+                                        found += key_search(leaf, targets[j]) >= 0;
+                                }
+                                clock_gettime(CLOCK_MONOTONIC, &end);
+                                /* hits are counted to keep the searches */
+                                if (found < probes / 2) {
+                                        fprintf(stderr, "Searches missed keys!\n");
+                                        return 1;
+                                }
+                                printf(" %*.1f", mode == 0 ? 7 : mode == 1 ? 14 : 9,
+                                       (double) elapsed(&start, &end) / probes);
+                        }
+                        printf("\n");
+                }
+                free(leaf);
+        }
+
+        free(targets);
+        return 0;
+}
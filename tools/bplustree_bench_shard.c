@@ -0,0 +1,137 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bplustree_shard.h"
+
+/* Throughput of a sharded tree by shard count, with as many client threads
+ * as shards putting and then getting random keys over the whole key space */
+
+struct bench_thread {
+        struct bplus_shard_tree *st;
+        pthread_t thread;
+        unsigned int seed;
+        long ops;
+};
+
+static long elapsed(struct timespec *from, struct timespec *to)
+{
+        return (to->tv_sec - from->tv_sec) * 1000000000L + to->tv_nsec - from->tv_nsec;
+}
+
+static key_t random_key(unsigned int *seed)
+{
+        return (key_t) ((unsigned int) rand_r(seed) << 16 ^ (unsigned int) rand_r(seed));
+}
+
+static void *bench_run(void *arg)
+{
+        long i;
+        struct bench_thread *t = arg;
+        unsigned int seed = t->seed;
+
+        for (i = 0; i < t->ops / 2; i++) {
+                bplus_shard_put(t->st, random_key(&seed), i + 1);
+        }
+        /* the same keys again */
+        seed = t->seed;
+        for (i = 0; i < t->ops / 2; i++) {
+                bplus_shard_get(t->st, random_key(&seed));
+        }
+        return NULL;
+}
+
+static void files_remove(char *prefix, int nr_shards)
+{
+        int i;
+        char name[1024 + 32];
+
+        for (i = 0; i < nr_shards; i++) {
+                snprintf(name, sizeof(name), "%s.%d", prefix, i);
+                unlink(name);
+                strcat(name, ".boot");
+                unlink(name);
+        }
+        snprintf(name, sizeof(name), "%s.shards", prefix);
+        unlink(name);
+}
+
+static void usage(char *prog)
+{
+        fprintf(stderr, "Usage: %s [-n ops] [-s max shards] [-b block size] [prefix]\n"
+                        "  -n  puts and gets in all, 800000 by default\n"
+                        "  -s  shard counts run are the powers of 2 up to it, 8 by default\n"
+                        "  -b  4096 by default\n"
+                        "  prefix of the shard files, /dev/shm/bplustree_bench by default\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+        int opt, i, nr_shards, max_shards = 8, block_size = 4096;
+        long ops = 800000;
+        char *prefix = "/dev/shm/bplustree_bench";
+        struct bench_thread threads[MAX_SHARD_NUM];
+
+        while ((opt = getopt(argc, argv, "n:s:b:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        ops = atol(optarg);
+                        break;
+                case 's':
+                        max_shards = atoi(optarg);
+                        break;
+                case 'b':
+                        block_size = atoi(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind < argc) {
+                prefix = argv[optind++];
+        }
+        if (optind != argc || ops <= 0 || max_shards <= 0 || max_shards > MAX_SHARD_NUM ||
+            strlen(prefix) >= 1024 - 16) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        printf("%ld CPUs online\n", sysconf(_SC_NPROCESSORS_ONLN));
+        printf("shards  threads    ops/s  speedup\n");
+        double base = 0;
+        for (nr_shards = 1; nr_shards <= max_shards; nr_shards *= 2) {
+                struct timespec start, end;
+
+                files_remove(prefix, nr_shards);
+                struct bplus_shard_tree *st = bplus_shard_tree_init(prefix, block_size, nr_shards);
+                if (st == NULL) {
+                        return 1;
+                }
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (i = 0; i < nr_shards; i++) {
+                        threads[i].st = st;
+                        threads[i].seed = i + 1;
+                        threads[i].ops = ops / nr_shards;
+                        pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]);
+                }
+                for (i = 0; i < nr_shards; i++) {
+                        pthread_join(threads[i].thread, NULL);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                long done = ops / nr_shards / 2 * 2 * nr_shards;
+                double rate = done * 1e9 / elapsed(&start, &end);
+                if (nr_shards == 1) {
+                        base = rate;
+                }
+                bplus_shard_tree_deinit(st);
+                files_remove(prefix, nr_shards);
+                printf("%6d %8d %8.0f %8.2f\n", nr_shards, nr_shards, rate, rate / base);
+        }
+        return 0;
+}
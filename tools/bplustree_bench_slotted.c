@@ -0,0 +1,141 @@
+/* Cost of an in-node insert and remove on a half-full leaf of plain and
+ * slotted layout by block size, and of random puts into an index of each.
+ * The leaf routines are static, so the library source is built in here,
+ * and it is not written for -Wextra */
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wold-style-declaration"
+#include "bplustree.c"
+
+static long elapsed(struct timespec *from, struct timespec *to)
+{
+        return (to->tv_sec - from->tv_sec) * 1000000000L + to->tv_nsec - from->tv_nsec;
+}
+
+/* ns of one insert and one remove of an odd key among even ones */
+static double leaf_bench(int flags, long rounds)
+{
+        int i;
+        long j, kept = 0;
+        struct timespec start, end;
+
+        _format_flags = flags;
+        node_capacity_set();
+        struct bplus_node *leaf = calloc(1, _node_size);
+        assert(leaf != NULL);
+        leaf->type = BPLUS_TREE_LEAF;
+        leaf->children = _max_entries / 2;
+        for (i = 0; i < leaf->children; i++) {
+                key(leaf)[i] = i * 2;
+                data(leaf)[i] = i;
+                if (slotted()) {
+                        slot(leaf)[i] = i;
+                }
+        }
+
+        key_t *keys = malloc(rounds * sizeof(key_t));
+        assert(keys != NULL);
+        for (j = 0; j < rounds; j++) {
+                keys[j] = rand() % leaf->children * 2 + 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (j = 0; j < rounds; j++) {
+                int insert = -key_search(leaf, keys[j]) - 1;
+                if (slotted()) {
+                        leaf_slot_insert(leaf, keys[j], j, insert);
+                        leaf_slot_remove(leaf, key_search(leaf, keys[j]));
+                } else {
+                        leaf_simple_insert(NULL, leaf, keys[j], j, insert);
+                        leaf_simple_remove(NULL, leaf, key_search(leaf, keys[j]));
+                }
+                kept += leaf->children;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (kept != rounds * (_max_entries / 2)) {
+                fprintf(stderr, "Leaf lost entries!\n");
+                exit(1);
+        }
+        free(keys);
+        free(leaf);
+        return (double) elapsed(&start, &end) / rounds;
+}
+
+/* us of a random put into a new index at path */
+static double put_bench(char *path, int block_size, int flags, long count)
+{
+        long i;
+        char name[1024 + 16];
+        struct timespec start, end;
+
+        unlink(path);
+        snprintf(name, sizeof(name), "%s.boot", path);
+        unlink(name);
+        struct bplus_tree *tree = bplus_tree_init_flags(path, block_size, flags);
+        if (tree == NULL) {
+                exit(1);
+        }
+
+        srand(block_size);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < count; i++) {
+                bplus_tree_put(tree, rand(), i + 1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        bplus_tree_deinit(tree);
+        unlink(path);
+        unlink(name);
+        return (double) elapsed(&start, &end) / count / 1000;
+}
+
+static void usage(char *prog)
+{
+        fprintf(stderr, "Usage: %s [-n rounds] [-p puts] [index]\n"
+                        "  -n  in-node inserts and removes timed, 2000000 by default\n"
+                        "  -p  random puts timed, 100000 by default, into index, by\n"
+                        "      default /dev/shm/bplustree_bench.index\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+        int opt, size;
+        long rounds = 2000000, puts = 100000;
+        char *path = "/dev/shm/bplustree_bench.index";
+
+        while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        rounds = atol(optarg);
+                        break;
+                case 'p':
+                        puts = atol(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind < argc) {
+                path = argv[optind++];
+        }
+        if (optind != argc || rounds <= 0 || puts < 0 || strlen(path) >= 1024) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        printf("block   insert+remove ns     put us\n");
+        printf("        plain  slotted    plain  slotted\n");
+        for (size = 4 << 10; size <= 64 << 10; size <<= 2) {
+                double put_plain = 0, put_slotted = 0;
+                _block_size = size;
+                double plain = leaf_bench(0, rounds);
+                double slotted = leaf_bench(BPLUS_TREE_SLOTTED_LEAVES, rounds);
+                if (puts > 0) {
+                        put_plain = put_bench(path, size, 0, puts);
+                        put_slotted = put_bench(path, size, BPLUS_TREE_SLOTTED_LEAVES, puts);
+                }
+                printf("%3dK %8.1f %8.1f %8.2f %8.2f\n", size >> 10, plain, slotted, put_plain, put_slotted);
+        }
+        return 0;
+}
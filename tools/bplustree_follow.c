@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bplustree.h"
+
+static void usage(char *prog)
+{
+        fprintf(stderr, "Usage: %s [-i interval ms] <replica index> < stream\n"
+                        "  -i  how often the progress is reported, 1000ms by default\n", prog);
+}
+
+static void stats_print(struct bplus_follower_stats *stats)
+{
+        printf("commits %ld blocks %ld bytes %ld lag %ldus max lag %ldus\n", stats->commits,
+               stats->blocks, stats->bytes, stats->lag / 1000, stats->max_lag / 1000);
+        fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+        int opt;
+        long interval = 1000;
+        struct bplus_follower_stats stats;
+
+        while ((opt = getopt(argc, argv, "i:")) != -1) {
+                switch (opt) {
+                case 'i':
+                        interval = atol(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind + 1 != argc || interval <= 0) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        /* the stream comes from a pipe or a socket the leader writes */
+        struct bplus_follower *follower = bplus_follower_start(argv[optind], STDIN_FILENO);
+        if (follower == NULL) {
+                return 1;
+        }
+
+        struct timespec pause;
+        pause.tv_sec = interval / 1000;
+        pause.tv_nsec = interval % 1000 * 1000000L;
+        do {
+                nanosleep(&pause, NULL);
+                bplus_follower_stats(follower, &stats);
+                stats_print(&stats);
+        } while (!stats.done);
+
+        bplus_follower_stop(follower);
+        return 0;
+}
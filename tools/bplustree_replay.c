@@ -0,0 +1,276 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bplustree.h"
+#include "bplustree_shard.h"
+
+struct replay_config {
+        char *index;
+        char *trace;
+        /* pipe or fifo a follower reads the changes from */
+        char *replica;
+        int block_size;
+        int nr_threads;
+        int nr_shards;
+        /* keep the inter-arrival time of recorded calls */
+        int paced;
+};
+
+struct replayer {
+        struct replay_config *config;
+        struct bplus_tree *tree;
+        struct bplus_shard_tree *shard_tree;
+        struct bplus_trace_record *records;
+        long count;
+        struct timespec start;
+};
+
+struct replay_thread {
+        struct replayer *r;
+        pthread_t thread;
+        int id;
+        long ops;
+        long mismatches;
+        /* latency of every call in nanoseconds */
+        long *latency;
+};
+
+static long elapsed(struct timespec *from, struct timespec *to)
+{
+        return (to->tv_sec - from->tv_sec) * 1000000000L + to->tv_nsec - from->tv_nsec;
+}
+
+static long replay_call(struct replayer *r, struct bplus_trace_record *rec)
+{
+        if (r->tree != NULL) {
+                switch (rec->op) {
+                case BPLUS_TRACE_GET:
+                        return bplus_tree_get(r->tree, rec->key);
+                case BPLUS_TRACE_PUT:
+                        return bplus_tree_put(r->tree, rec->key, rec->arg);
+                default:
+                        return bplus_tree_get_range(r->tree, rec->key, rec->arg);
+                }
+        } else {
+                switch (rec->op) {
+                case BPLUS_TRACE_GET:
+                        return bplus_shard_get(r->shard_tree, rec->key);
+                case BPLUS_TRACE_PUT:
+                        return bplus_shard_put(r->shard_tree, rec->key, rec->arg);
+                default:
+                        return bplus_shard_get_range(r->shard_tree, rec->key, rec->arg);
+                }
+        }
+}
+
+/* every thread replays the records at its own stride of the trace */
+static void *replay_thread_run(void *arg)
+{
+        long i;
+        struct timespec t1, t2;
+        struct replay_thread *t = arg;
+        struct replayer *r = t->r;
+        int stride = r->config->nr_threads;
+
+        for (i = t->id; i < r->count; i += stride) {
+                struct bplus_trace_record *rec = &r->records[i];
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                /* sleeping costs a system call even when the call is overdue */
+                if (r->config->paced && elapsed(&r->start, &t1) < rec->time) {
+                        struct timespec due = r->start;
+                        due.tv_sec += rec->time / 1000000000L;
+                        due.tv_nsec += rec->time % 1000000000L;
+                        if (due.tv_nsec >= 1000000000L) {
+                                due.tv_sec++;
+                                due.tv_nsec -= 1000000000L;
+                        }
+                        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) != 0) {
+                                continue;
+                        }
+                        clock_gettime(CLOCK_MONOTONIC, &t1);
+                }
+
+                long ret = replay_call(r, rec);
+                clock_gettime(CLOCK_MONOTONIC, &t2);
+
+                t->latency[t->ops++] = elapsed(&t1, &t2);
+                if (ret != rec->ret) {
+                        t->mismatches++;
+                }
+        }
+        return NULL;
+}
+
+static int long_cmp(const void *a, const void *b)
+{
+        long x = *(const long *) a, y = *(const long *) b;
+        return x < y ? -1 : x > y;
+}
+
+static int trace_load(struct replayer *r)
+{
+        struct bplus_trace_header header;
+        FILE *fp = fopen(r->config->trace, "rb");
+        if (fp == NULL) {
+                fprintf(stderr, "Failed to open trace file %s!\n", r->config->trace);
+                return -1;
+        }
+
+        if (fread(&header, sizeof(header), 1, fp) != 1 ||
+            header.magic != BPLUS_TRACE_MAGIC || header.version != BPLUS_TRACE_VERSION) {
+                fprintf(stderr, "%s is not a trace file!\n", r->config->trace);
+                fclose(fp);
+                return -1;
+        }
+
+        /* load the whole trace so that reading it is not replayed */
+        fseek(fp, 0, SEEK_END);
+        r->count = (ftell(fp) - sizeof(header)) / sizeof(struct bplus_trace_record);
+        fseek(fp, sizeof(header), SEEK_SET);
+        r->records = malloc(r->count * sizeof(struct bplus_trace_record));
+        if (r->records == NULL ||
+            (long) fread(r->records, sizeof(struct bplus_trace_record), r->count, fp) != r->count) {
+                fprintf(stderr, "Failed to load trace file %s!\n", r->config->trace);
+                fclose(fp);
+                return -1;
+        }
+        fclose(fp);
+        return 0;
+}
+
+static void usage(char *prog)
+{
+        fprintf(stderr, "Usage: %s [-b block size] [-t threads] [-s shards] [-p] [-r fifo] <index file> <trace file>\n"
+                        "  -p  keep the recorded inter-arrival time instead of full speed\n"
+                        "  -s  replay against a sharded tree, required by more than one thread\n"
+                        "  -r  stream the changes to a follower reading from fifo\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+        int i, opt;
+        struct replay_config config;
+        struct replayer r;
+
+        memset(&config, 0, sizeof(config));
+        config.block_size = 4096;
+        config.nr_threads = 1;
+        while ((opt = getopt(argc, argv, "b:t:s:pr:")) != -1) {
+                switch (opt) {
+                case 'b':
+                        config.block_size = atoi(optarg);
+                        break;
+                case 't':
+                        config.nr_threads = atoi(optarg);
+                        break;
+                case 's':
+                        config.nr_shards = atoi(optarg);
+                        break;
+                case 'p':
+                        config.paced = 1;
+                        break;
+                case 'r':
+                        config.replica = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind + 2 != argc || config.nr_threads < 1 || (config.nr_threads > 1 && config.nr_shards < 1) ||
+            (config.replica != NULL && config.nr_shards > 0)) {
+                usage(argv[0]);
+                return 1;
+        }
+        config.index = argv[optind];
+        config.trace = argv[optind + 1];
+
+        memset(&r, 0, sizeof(r));
+        r.config = &config;
+        if (trace_load(&r) != 0) {
+                return 1;
+        }
+
+        if (config.nr_shards > 0) {
+                r.shard_tree = bplus_shard_tree_init(config.index, config.block_size, config.nr_shards);
+        } else {
+                r.tree = bplus_tree_init(config.index, config.block_size);
+        }
+        if (r.tree == NULL && r.shard_tree == NULL) {
+                free(r.records);
+                return 1;
+        }
+
+        if (config.replica != NULL) {
+                /* a follower going away must not kill the replay */
+                signal(SIGPIPE, SIG_IGN);
+                int fd = open(config.replica, O_WRONLY);
+                if (fd < 0 || bplus_tree_replicate_begin(r.tree, fd) != 0) {
+                        fprintf(stderr, "Failed to replicate to %s!\n", config.replica);
+                        if (fd >= 0) {
+                                close(fd);
+                        }
+                        bplus_tree_deinit(r.tree);
+                        free(r.records);
+                        return 1;
+                }
+                close(fd);
+        }
+
+        struct replay_thread *threads = calloc(config.nr_threads, sizeof(*threads));
+        for (i = 0; i < config.nr_threads; i++) {
+                threads[i].r = &r;
+                threads[i].id = i;
+                threads[i].latency = malloc((r.count / config.nr_threads + 1) * sizeof(long));
+        }
+
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &r.start);
+        for (i = 0; i < config.nr_threads; i++) {
+                pthread_create(&threads[i].thread, NULL, replay_thread_run, &threads[i]);
+        }
+        for (i = 0; i < config.nr_threads; i++) {
+                pthread_join(threads[i].thread, NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        /* gather latency of all threads */
+        long ops = 0, mismatches = 0;
+        long *latency = malloc((r.count + 1) * sizeof(long));
+        for (i = 0; i < config.nr_threads; i++) {
+                memcpy(latency + ops, threads[i].latency, threads[i].ops * sizeof(long));
+                ops += threads[i].ops;
+                mismatches += threads[i].mismatches;
+                free(threads[i].latency);
+        }
+        qsort(latency, ops, sizeof(long), long_cmp);
+
+        double seconds = elapsed(&r.start, &end) / 1e9;
+        printf("replayed %ld calls in %.3fs, %.0f calls/s\n", ops, seconds, seconds > 0 ? ops / seconds : 0.0);
+        if (ops > 0) {
+                printf("latency p50 %ldns p99 %ldns p99.9 %ldns max %ldns\n", latency[ops / 2],
+                       latency[ops * 99 / 100], latency[ops * 999 / 1000], latency[ops - 1]);
+        }
+        /* results only reproduce when calls run in recorded order */
+        if (config.nr_threads == 1) {
+                printf("results differing from trace: %ld\n", mismatches);
+        }
+
+        free(latency);
+        free(threads);
+        free(r.records);
+        if (r.tree != NULL) {
+                if (config.replica != NULL) {
+                        bplus_tree_replicate_end(r.tree);
+                }
+                bplus_tree_deinit(r.tree);
+        } else {
+                bplus_shard_tree_deinit(r.shard_tree);
+        }
+        return 0;
+}